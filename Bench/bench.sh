@@ -0,0 +1,207 @@
+#!/usr/bin/env bash
+#
+# Cross-transport benchmark: start every server of a build, drive it with
+# LoadGen over loopback or a Unix socket, sweep message size and connection
+# count, and write one CSV row per run.
+#
+# usage: bench.sh build_dir [output.csv]
+#
+# Environment:
+#	BENCH_TRANSPORTS	servers to run, default "block select poll epoll iouring udp local"
+#	BENCH_SIZES			payload bytes, default "64 1024 16384"
+#	BENCH_CONNS			connections, default "1 16 64" (block always uses 1)
+#	BENCH_SECONDS		measured seconds per run, default 3
+#	BENCH_WARMUP		seconds not measured, default 1
+#	BENCH_MODE			server mode (-m), default "echo": round trips; "sink" is
+#						one-way, "source" streams BENCH_SIZES frames to LoadGen -R.
+#						The block and io_uring servers have no modes, they always
+#						run one-way
+#	BENCH_LOADGEN		extra LoadGen options, e.g. "-p 8" or "-r 100000"
+#	BENCH_STRACE		1 to count the server's system calls with strace -c,
+#						which slows it down: compare those rows with each other only
+#
+# The block and io_uring servers log every message at the info level,
+# configure the build with -DSOCKET_LOG_LEVEL=1 to measure their I/O path
+# alone.
+
+set -u
+
+build=${1:?usage: bench.sh build_dir [output.csv]}
+out=${2:-bench.csv}
+transports=${BENCH_TRANSPORTS:-block select poll epoll iouring udp local}
+sizes=${BENCH_SIZES:-64 1024 16384}
+conns_list=${BENCH_CONNS:-1 16 64}
+seconds=${BENCH_SECONDS:-3}
+warmup=${BENCH_WARMUP:-1}
+mode=${BENCH_MODE:-echo}
+lg_opts=${BENCH_LOADGEN:-}
+use_strace=${BENCH_STRACE:-0}
+
+loadgen="$build/Bench/LoadGen"
+ticks=$(getconf CLK_TCK)
+port=$((20000 + RANDOM % 20000))
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# server binary of a transport
+server_bin() {
+	case $1 in
+	block)		echo "$build/BlockTCP/BlockTCPServer" ;;
+	select)		echo "$build/SelectTCP/SelectTCPServer" ;;
+	poll)		echo "$build/PollTCP/PollTCPServer" ;;
+	epoll)		echo "$build/EpollTCP/EpollTCPServer" ;;
+	iouring)	echo "$build/IoUringTCP/IoUringTCPServer" ;;
+	udp)		echo "$build/UDP/UDPServer" ;;
+	local)		echo "$build/Local/LocalServer" ;;
+	esac
+}
+
+# LoadGen options matching a server mode
+mode_loadgen() {
+	case $1 in
+	echo)		echo "" ;;
+	source)		echo "-R" ;;
+	*)			echo "-o" ;;	# sink, console
+	esac
+}
+
+# user + system CPU seconds of a process, all its threads included
+cpu_seconds() {
+	# the command name may contain spaces, skip past it; fails once the
+	# process is gone or a zombie, whose counters read 0
+	awk -v hz="$ticks" '{ sub(/.*\) /, ""); if ($1 == "Z") exit 1; printf "%.3f", ($12 + $13) / hz }' \
+		"/proc/$1/stat" 2>/dev/null
+}
+
+# keep the last CPU time of a process in a file, the block server exits
+# with its client before it could be read afterwards
+cpu_sampler() {
+	while kill -0 "$1" 2>/dev/null; do
+		cpu_seconds "$1" > "$2.new" && mv "$2.new" "$2"
+		sleep 0.05
+	done
+}
+
+# floating point arithmetic
+calc() {
+	awk "BEGIN { printf \"%.3f\", $1 }"
+}
+
+# wait until the server listens
+wait_ready() {
+	local i
+	for i in $(seq 50); do
+		case $1 in
+		local)	[ -S "$2" ] && return 0 ;;
+		udp)	ss -Hlun "sport = :$2" 2>/dev/null | grep -q . && return 0 ;;
+		*)		ss -Hltn "sport = :$2" 2>/dev/null | grep -q . && return 0 ;;
+		esac
+		sleep 0.1
+	done
+	return 1
+}
+
+# value of 'key' in a LoadGen result line
+field() {
+	echo "$2" | tr ' ' '\n' | sed -n "s/^$1=//p"
+}
+
+echo "transport,mode,size,conns,seconds,sent,recv,msgs_per_sec,mbytes_per_sec,p50_us,p99_us,p999_us,max_us,server_cpu_sec,cpu_us_per_msg,syscalls_per_msg" > "$out"
+
+for t in $transports; do
+	bin=$(server_bin "$t")
+	if [ ! -x "$bin" ]; then
+		echo "$t: $bin not built, skipped" >&2
+		continue
+	fi
+
+	for size in $sizes; do
+		for conns in $conns_list; do
+			if [ "$t" = block ] && [ "$conns" != 1 ]; then
+				continue	# one client at a time
+			fi
+			if [ "$t" = udp ] && [ "$size" -gt 65507 ]; then
+				continue
+			fi
+
+			case $t in
+			block|iouring)	srv_mode=console ;;
+			*)				srv_mode=$mode ;;
+			esac
+			srv_opts=
+			if [ "$srv_mode" = source ]; then
+				srv_opts="-m source -S $size"
+			elif [ "$srv_mode" != console ]; then
+				srv_opts="-m $srv_mode"
+			fi
+
+			port=$((port + 1))
+			case $t in
+			local)	target="-l $tmp/bench.sock"; addr="$tmp/bench.sock"; rm -f "$addr" ;;
+			udp)	target="-u 127.0.0.1 $port"; addr=$port ;;
+			*)		target="127.0.0.1 $port"; addr=$port ;;
+			esac
+
+			# the console reads /dev/null, the control threads just end
+			if [ "$use_strace" = 1 ]; then
+				strace -f -c -q -o "$tmp/strace.txt" "$bin" $srv_opts "$addr" < /dev/null > "$tmp/server.log" 2>&1 &
+				tracer=$!
+				sleep 0.2
+				spid=$(pgrep -P "$tracer" | head -1)
+			else
+				"$bin" $srv_opts "$addr" < /dev/null > "$tmp/server.log" 2>&1 &
+				tracer=
+				spid=$!
+			fi
+			if [ -z "$spid" ] || ! wait_ready "$t" "$addr"; then
+				echo "$t: server did not start, see below" >&2
+				tail -5 "$tmp/server.log" >&2
+				kill "$spid" $tracer 2>/dev/null
+				wait 2>/dev/null
+				continue
+			fi
+
+			cpu0=$(cpu_seconds "$spid") || cpu0=0
+			echo "$cpu0" > "$tmp/cpu"
+			cpu_sampler "$spid" "$tmp/cpu" &
+			result=$("$loadgen" $(mode_loadgen "$srv_mode") $lg_opts -c "$conns" -s "$size" -d "$seconds" -w "$warmup" $target | grep '^result ')
+			# the sampler may still be running, do not share its file
+			cpu_seconds "$spid" > "$tmp/cpu.last" && mv "$tmp/cpu.last" "$tmp/cpu"
+			cpu1=$(cat "$tmp/cpu")
+
+			kill -INT "$spid" 2>/dev/null
+			sleep 0.2
+			kill "$spid" 2>/dev/null
+			wait 2>/dev/null
+
+			if [ -z "$result" ]; then
+				echo "$t size $size conns $conns: no result" >&2
+				continue
+			fi
+
+			sent=$(field sent "$result")
+			recv=$(field recv "$result")
+			msgs=$recv
+			if [ "$msgs" = 0 ]; then
+				msgs=$sent	# one-way
+			fi
+			cpu=$(calc "$cpu1 - $cpu0")
+			per_msg=
+			if [ "$msgs" -gt 0 ]; then
+				# warmup included in the CPU time, scale it to the measured window
+				per_msg=$(calc "$cpu * 1000000 * $seconds / ($seconds + $warmup) / $msgs")
+			fi
+			syscalls=
+			if [ -n "$tracer" ] && [ -s "$tmp/strace.txt" ] && [ "$msgs" -gt 0 ]; then
+				calls=$(awk '$NF == "total" { print $4 }' "$tmp/strace.txt")
+				# counted over the warmup too
+				syscalls=$(calc "$calls * $seconds / ($seconds + $warmup) / $msgs")
+			fi
+
+			echo "$t,$srv_mode,$size,$conns,$(field seconds "$result"),$sent,$recv,$(field msgs_per_sec "$result"),$(field mbytes_per_sec "$result"),$(field p50_us "$result"),$(field p99_us "$result"),$(field p999_us "$result"),$(field max_us "$result"),$cpu,$per_msg,$syscalls" >> "$out"
+			echo "$t $srv_mode size $size conns $conns: $(field msgs_per_sec "$result") msg/s, server cpu ${cpu}s" >&2
+		done
+	done
+done
+
+echo "results in $out" >&2
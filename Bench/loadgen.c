@@ -0,0 +1,790 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "frame.h"
+#include "config.h"
+#include "metrics.h"
+#include "log.h"
+
+#define CLIENT_ERRNO				__LINE__
+#define CLIENT_PRINT(_fmt, ...)		LOG_INFO("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
+
+#define LOADGEN_TX_BUF				(64 * 1024)		/* per-connection queued output, at least */
+#define LOADGEN_RX_BUF				(64 * 1024)		/* per-connection receive buffer */
+#define LOADGEN_MAX_SIZE			(256 * 1024)	/* RECV_HIGH_WATER of the servers */
+#define LOADGEN_UDP_MAX_SIZE		65507
+#define LOADGEN_EVENTS				256
+#define LOADGEN_BURST				64				/* one-way messages per writable event */
+#define LOADGEN_TICK_MS				100				/* longest epoll_wait(), to notice the end */
+
+enum loadgen_transport {
+	LOADGEN_TCP,
+	LOADGEN_LOCAL,
+	LOADGEN_UDP,
+	LOADGEN_SEQPACKET,		/* local, one message per packet */
+	LOADGEN_DGRAM,			/* local datagrams */
+};
+
+static const char *loadgen_transport_name[] = { "tcp", "local", "udp", "seqpacket", "dgram" };
+
+/* transports that keep message boundaries carry bare payloads */
+#define LOADGEN_MSGS(_t)			(((_t) == LOADGEN_UDP) || ((_t) == LOADGEN_SEQPACKET) || ((_t) == LOADGEN_DGRAM))
+
+/*
+ * Leading bytes of every payload, the server sends them back untouched.
+ * 'due_ns' is when the message should have left, not when it did, so an
+ * open-loop run also counts the time a message waited behind a slow
+ * server (no coordinated omission).
+ */
+struct loadgen_stamp {
+	uint64_t due_ns;
+	uint32_t conn;
+	uint32_t seq;
+};
+
+struct loadgen;
+
+struct loadgen_conn {
+	int fd;
+	uint32_t id;
+	struct loadgen *lg;
+	struct frame_decoder dec;	/* stream transports */
+	uint8_t *tx;				/* frames the socket did not take yet */
+	uint32_t tx_size;
+	uint32_t tx_head;			/* first byte not sent */
+	uint32_t tx_tail;			/* first free byte */
+	int want_out;				/* registered for EPOLLOUT */
+	uint32_t inflight;			/* sent, reply not seen yet */
+	uint32_t seq;
+	uint64_t next_ns;			/* open loop: when the next message is due */
+};
+
+struct loadgen {
+	enum loadgen_transport transport;
+	uint32_t conns;
+	uint32_t size;				/* payload bytes, the stamp included */
+	uint32_t pipeline;			/* closed loop: messages in flight per connection */
+	uint64_t rate;				/* messages per second over all connections, 0 is closed loop */
+	int oneway;					/* expect no replies, measure throughput only */
+	int recvonly;				/* send one message, then count what a source server streams */
+	uint32_t seconds;
+	uint32_t warmup;			/* seconds not measured */
+
+	uint64_t interval_ns;		/* open loop, per connection */
+	uint64_t measure_ns;		/* end of the warmup */
+	uint64_t end_ns;
+
+	/* measured window only */
+	uint64_t sent;
+	uint64_t recv;
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	struct metrics_hist rtt_ns;
+
+	uint32_t open;				/* connections still open */
+	uint8_t *payload;			/* message template */
+	struct loadgen_conn *conn;
+	int epfd;
+	int timerfd;				/* open loop: fires when the next message is due */
+};
+
+/**
+ * Connect one socket to the server
+ *
+ * @param[in] lg		load generator
+ * @param[in] addr		server address
+ * @param[in] addr_len	address length
+ *
+ * @return On success, a non-blocking file descriptor is returned.
+ *		   On error, negative number of the error line number
+ */
+static int loadgen_connect(struct loadgen *lg, const struct sockaddr *addr, socklen_t addr_len)
+{
+	struct sockaddr_un un;
+	int sockfd, type, flags, one;
+
+	if (lg->transport == LOADGEN_SEQPACKET) {
+		type = SOCK_SEQPACKET;
+	} else if ((lg->transport == LOADGEN_UDP) || (lg->transport == LOADGEN_DGRAM)) {
+		type = SOCK_DGRAM;
+	} else {
+		type = SOCK_STREAM;
+	}
+	sockfd = socket(addr->sa_family, type, 0);
+	if (sockfd < 0) {
+		CLIENT_PRINT("create socket failed, %s", strerror(errno));
+		return -CLIENT_ERRNO;
+	}
+
+	if (lg->transport == LOADGEN_DGRAM) {
+		/* autobind an abstract address, the replies need one */
+		memset(&un, 0x00, sizeof(struct sockaddr_un));
+		un.sun_family = AF_LOCAL;
+		if (bind(sockfd, (struct sockaddr *)&un, sizeof(sa_family_t)) < 0) {
+			CLIENT_PRINT("bind failed, %s", strerror(errno));
+			close(sockfd);
+			return -CLIENT_ERRNO;
+		}
+	}
+
+	if (connect(sockfd, addr, addr_len) < 0) {
+		CLIENT_PRINT("connect failed, %s", strerror(errno));
+		close(sockfd);
+		return -CLIENT_ERRNO;
+	}
+
+	if (lg->transport == LOADGEN_TCP) {
+		/* small messages must not wait for the previous reply */
+		one = 1;
+		setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	flags = fcntl(sockfd, F_GETFL, 0);
+	/* set non-blocking mode */
+	fcntl(sockfd, F_SETFL, flags|O_NONBLOCK);
+
+	return sockfd;
+}
+
+/**
+ * Register the epoll events the connection currently needs
+ *
+ * @param[in] c		connection
+ * @param[in] op	EPOLL_CTL_ADD or EPOLL_CTL_MOD
+ */
+static void loadgen_conn_events(struct loadgen_conn *c, int op)
+{
+	struct epoll_event epev;
+
+	memset(&epev, 0x00, sizeof(struct epoll_event));
+	epev.events = EPOLLIN;
+	if (c->want_out || (c->lg->oneway && !c->lg->rate)) {
+		/* one-way closed loop sends whenever the socket has room */
+		epev.events |= EPOLLOUT;
+	}
+	epev.data.ptr = c;
+	epoll_ctl(c->lg->epfd, op, c->fd, &epev);
+}
+
+/**
+ * Close a connection, the others keep running
+ *
+ * @param[in] c	connection
+ */
+static void loadgen_conn_close(struct loadgen_conn *c)
+{
+	if (c->fd < 0) {
+		return;
+	}
+	epoll_ctl(c->lg->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	c->lg->open--;
+}
+
+/**
+ * Send the queued frames until the socket is full
+ *
+ * @param[in] c	connection
+ *
+ * @return On success, return 0.
+ *		   On error, negative number of the error line number
+ */
+static int loadgen_flush(struct loadgen_conn *c)
+{
+	ssize_t ret;
+	int blocked;
+
+	blocked = 0;
+	while (c->tx_head < c->tx_tail) {
+		ret = send(c->fd, &c->tx[c->tx_head], c->tx_tail - c->tx_head, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				blocked = 1;
+				break;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			CLIENT_PRINT("send failed, %s", strerror(errno));
+			return -CLIENT_ERRNO;
+		}
+		c->tx_head += ret;
+	}
+	if (c->tx_head == c->tx_tail) {
+		c->tx_head = c->tx_tail = 0;
+	}
+
+	if (c->want_out != blocked) {
+		c->want_out = blocked;
+		if (!c->lg->oneway || c->lg->rate) {
+			loadgen_conn_events(c, EPOLL_CTL_MOD);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Stamp and queue one message
+ *
+ * @param[in] c			connection
+ * @param[in] due_ns	when the message is due
+ * @param[in] now		current time
+ *
+ * @return 1 if the message was queued, 0 if the connection is full,
+ *		   negative number of the error line number on error
+ */
+static int loadgen_queue(struct loadgen_conn *c, uint64_t due_ns, uint64_t now)
+{
+	struct loadgen *lg = c->lg;
+	struct loadgen_stamp stamp;
+	uint32_t len;
+	ssize_t ret;
+
+	stamp.due_ns = due_ns;
+	stamp.conn = c->id;
+	stamp.seq = c->seq;
+	memcpy(lg->payload, &stamp, sizeof(struct loadgen_stamp));
+
+	if (LOADGEN_MSGS(lg->transport)) {
+		/* a datagram or packet is the message, no frame header */
+		ret = send(c->fd, lg->payload, lg->size, 0);
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS)) {
+				return 0;
+			}
+			CLIENT_PRINT("send failed, %s", strerror(errno));
+			return -CLIENT_ERRNO;
+		}
+		len = lg->size;
+	} else {
+		if (c->want_out) {
+			return 0;	/* EPOLLOUT flushes the queue first */
+		}
+		len = FRAME_HDR_LEN + lg->size;
+		if (c->tx_size - c->tx_tail < len) {
+			if (c->tx_size - (c->tx_tail - c->tx_head) < len) {
+				return 0;
+			}
+			memmove(c->tx, &c->tx[c->tx_head], c->tx_tail - c->tx_head);
+			c->tx_tail -= c->tx_head;
+			c->tx_head = 0;
+		}
+		frame_encode(&c->tx[c->tx_tail], lg->size);
+		memcpy(&c->tx[c->tx_tail + FRAME_HDR_LEN], lg->payload, lg->size);
+		c->tx_tail += len;
+	}
+
+	c->seq++;
+	if (!lg->oneway) {
+		c->inflight++;
+	}
+	if (now >= lg->measure_ns) {
+		lg->sent++;
+		lg->bytes_out += len;
+	}
+
+	return 1;
+}
+
+/**
+ * Queue what the connection owes the server and send it
+ *
+ * Closed loop keeps 'pipeline' messages in flight, or sends a burst when
+ * no reply is expected; open loop sends every message that is due.
+ * Receive-only sends the first message alone, it introduces the
+ * connection (a UDP server learns the address from it).
+ *
+ * @param[in] c		connection
+ * @param[in] now	current time
+ *
+ * @return On success, return 0.
+ *		   On error, negative number of the error line number
+ */
+static int loadgen_pump(struct loadgen_conn *c, uint64_t now)
+{
+	struct loadgen *lg = c->lg;
+	uint32_t n;
+	int ret;
+
+	if (now >= lg->end_ns) {
+		return 0;
+	}
+
+	ret = 0;
+	if (lg->rate) {
+		while (c->next_ns <= now) {
+			ret = loadgen_queue(c, c->next_ns, now);
+			if (ret <= 0) {
+				break;	/* stays due, the latency grows */
+			}
+			c->next_ns += lg->interval_ns;
+		}
+	} else if (lg->recvonly) {
+		if (c->seq == 0) {
+			ret = loadgen_queue(c, now, now);
+		}
+	} else if (lg->oneway) {
+		for (n=0; n<LOADGEN_BURST; n++) {
+			ret = loadgen_queue(c, now, now);
+			if (ret <= 0) {
+				break;
+			}
+		}
+	} else {
+		while (c->inflight < lg->pipeline) {
+			ret = loadgen_queue(c, now, now);
+			if (ret <= 0) {
+				break;
+			}
+		}
+	}
+	if (ret < 0) {
+		return -CLIENT_ERRNO;
+	}
+
+	if (!LOADGEN_MSGS(lg->transport) && (loadgen_flush(c) < 0)) {
+		return -CLIENT_ERRNO;
+	}
+
+	return 0;
+}
+
+/**
+ * Account for a reply, it carries the stamp of its request
+ *
+ * @param[in] arg	connection
+ * @param[in] data	message payload
+ * @param[in] len	message payload length
+ *
+ * @return always 0
+ */
+static int loadgen_recv_frame(void *arg, uint8_t *data, uint32_t len)
+{
+	struct loadgen_conn *c = (struct loadgen_conn *)arg;
+	struct loadgen *lg = c->lg;
+	struct loadgen_stamp stamp;
+	uint64_t now;
+
+	now = metrics_now();
+	if (c->inflight > 0) {
+		c->inflight--;
+	}
+	if (now < lg->measure_ns) {
+		return 0;
+	}
+
+	lg->recv++;
+	lg->bytes_in += len + (LOADGEN_MSGS(lg->transport) ? 0 : FRAME_HDR_LEN);
+	if (!lg->recvonly && (len >= sizeof(struct loadgen_stamp))) {
+		memcpy(&stamp, data, sizeof(struct loadgen_stamp));
+		if ((stamp.conn == c->id) && (stamp.due_ns <= now)) {
+			metrics_hist_add(&lg->rtt_ns, now - stamp.due_ns);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Read the replies until the socket is empty
+ *
+ * @param[in] c	connection
+ *
+ * @return On success, return the number of bytes read, 0 if the server
+ *		   closed the connection.
+ *		   On error, negative number of the error line number
+ */
+static int loadgen_recv(struct loadgen_conn *c)
+{
+	static uint8_t dgram[LOADGEN_UDP_MAX_SIZE];
+	ssize_t ret;
+	uint32_t rlen;
+
+	rlen = 0;
+	while (1) {
+		if (LOADGEN_MSGS(c->lg->transport)) {
+			ret = recv(c->fd, dgram, sizeof(dgram), 0);
+			if ((ret == 0) && (c->lg->transport == LOADGEN_SEQPACKET)) {
+				CLIENT_PRINT("connection %u closed by the server", c->id);
+				return 0;
+			} else if (ret >= 0) {
+				loadgen_recv_frame(c, dgram, ret);
+				rlen += ret;
+				continue;
+			}
+		} else {
+			ret = frame_decoder_readv(&c->dec, c->fd, loadgen_recv_frame, c);
+			if (ret > 0) {
+				rlen += ret;
+				continue;
+			} else if (ret == 0) {
+				CLIENT_PRINT("connection %u closed by the server", c->id);
+				return 0;
+			}
+		}
+
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+			break;
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EBADMSG) {
+			CLIENT_PRINT("data error!!!");
+			return -CLIENT_ERRNO;
+		}
+		CLIENT_PRINT("read failed, %s", strerror(errno));
+		return -CLIENT_ERRNO;
+	}
+
+	/* a live connection, 0 is only returned on close */
+	return rlen ? rlen : 1;
+}
+
+/**
+ * Arm the timer for the next open-loop message, epoll_wait() alone only
+ * has a millisecond resolution
+ *
+ * @param[in] lg	load generator
+ */
+static void loadgen_arm(struct loadgen *lg)
+{
+	struct itimerspec its;
+	uint64_t next;
+	uint32_t i;
+
+	next = lg->end_ns;
+	for (i=0; i<lg->conns; i++) {
+		/* a full connection waits for EPOLLOUT, not for its deadline */
+		if ((lg->conn[i].fd >= 0) && !lg->conn[i].want_out && (lg->conn[i].next_ns < next)) {
+			next = lg->conn[i].next_ns;
+		}
+	}
+
+	memset(&its, 0x00, sizeof(struct itimerspec));
+	its.it_value.tv_sec = next / 1000000000ULL;
+	its.it_value.tv_nsec = next % 1000000000ULL;
+	if ((its.it_value.tv_sec == 0) && (its.it_value.tv_nsec == 0)) {
+		its.it_value.tv_nsec = 1;	/* 0 would disarm it */
+	}
+	timerfd_settime(lg->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/**
+ * Print the results, human readable and then as one "key=value" line
+ *
+ * @param[in] lg	load generator
+ * @param[in] secs	measured seconds
+ */
+static void loadgen_report(struct loadgen *lg, double secs)
+{
+	uint64_t msgs = lg->oneway ? lg->sent : lg->recv;
+	uint64_t bytes = lg->oneway ? lg->bytes_out : lg->bytes_in;
+
+	CLIENT_PRINT("%s, %u connection(s), %u bytes messages, %s, %.1f s",
+				 loadgen_transport_name[lg->transport], lg->conns, lg->size,
+				 lg->recvonly ? "receive only" : (lg->rate ? "open loop" : "closed loop"), secs);
+	CLIENT_PRINT("sent %llu, received %llu, %.0f msg/s, %.2f MB/s",
+				 (unsigned long long)lg->sent, (unsigned long long)lg->recv,
+				 msgs / secs, bytes / secs / (1024 * 1024));
+	if (!lg->oneway && !lg->recvonly) {
+		CLIENT_PRINT("rtt us: p50 %.1f, p99 %.1f, p999 %.1f, max %.1f",
+					 metrics_hist_quantile(&lg->rtt_ns, 0.5) / 1000.0,
+					 metrics_hist_quantile(&lg->rtt_ns, 0.99) / 1000.0,
+					 metrics_hist_quantile(&lg->rtt_ns, 0.999) / 1000.0,
+					 lg->rtt_ns.max / 1000.0);
+	}
+
+	LOG_INFO("result transport=%s conns=%u size=%u rate=%llu pipeline=%u oneway=%d recvonly=%d seconds=%.3f "
+			 "sent=%llu recv=%llu msgs_per_sec=%.0f mbytes_per_sec=%.3f "
+			 "p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f",
+			 loadgen_transport_name[lg->transport], lg->conns, lg->size,
+			 (unsigned long long)lg->rate, lg->pipeline, lg->oneway, lg->recvonly, secs,
+			 (unsigned long long)lg->sent, (unsigned long long)lg->recv,
+			 msgs / secs, bytes / secs / (1024 * 1024),
+			 metrics_hist_quantile(&lg->rtt_ns, 0.5) / 1000.0,
+			 metrics_hist_quantile(&lg->rtt_ns, 0.99) / 1000.0,
+			 metrics_hist_quantile(&lg->rtt_ns, 0.999) / 1000.0,
+			 lg->rtt_ns.max / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event events[LOADGEN_EVENTS];
+	struct epoll_event epev;
+	struct sockaddr_storage addr;
+	struct sockaddr_in *in;
+	struct sockaddr_un *un;
+	struct loadgen_conn *c;
+	struct loadgen lg;
+	socklen_t addr_len;
+	uint64_t now, start, last, last_recv, expired;
+	uint32_t i, max_size;
+	int nevents, ret, type;
+
+	log_init();
+
+	memset(&lg, 0x00, sizeof(struct loadgen));
+	lg.transport = LOADGEN_TCP;
+	lg.conns = 1;
+	lg.size = 64;
+	lg.pipeline = 1;
+	lg.seconds = 10;
+	lg.epfd = -1;
+	lg.timerfd = -1;
+	type = SOCK_STREAM;
+	while ((ret = getopt(argc, argv, "c:s:p:r:d:w:oRulT:")) != -1) {
+		switch (ret) {
+		case 'c':
+			lg.conns = atoi(optarg);
+			break;
+		case 's':
+			lg.size = atoi(optarg);
+			break;
+		case 'p':
+			lg.pipeline = atoi(optarg);
+			break;
+		case 'r':
+			lg.rate = strtoull(optarg, NULL, 0);
+			break;
+		case 'd':
+			lg.seconds = atoi(optarg);
+			break;
+		case 'w':
+			lg.warmup = atoi(optarg);
+			break;
+		case 'o':
+			lg.oneway = 1;
+			break;
+		case 'R':
+			lg.recvonly = 1;
+			break;
+		case 'u':
+			lg.transport = LOADGEN_UDP;
+			break;
+		case 'l':
+			lg.transport = LOADGEN_LOCAL;
+			break;
+		case 'T':
+			type = sock_type_parse(optarg);
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+	if ((lg.transport == LOADGEN_LOCAL) && (type == SOCK_SEQPACKET)) {
+		lg.transport = LOADGEN_SEQPACKET;
+	} else if ((lg.transport == LOADGEN_LOCAL) && (type == SOCK_DGRAM)) {
+		lg.transport = LOADGEN_DGRAM;
+	} else if ((type < 0) || ((lg.transport != LOADGEN_LOCAL) && (type != SOCK_STREAM))) {
+		argc = 0;	/* -T is a Local socket type */
+	}
+	max_size = LOADGEN_MSGS(lg.transport) ? LOADGEN_UDP_MAX_SIZE : LOADGEN_MAX_SIZE;
+	if (((argc - optind) < (((lg.transport == LOADGEN_TCP) || (lg.transport == LOADGEN_UDP)) ? 2 : 1)) ||
+		(lg.conns == 0) ||
+		(lg.size < sizeof(struct loadgen_stamp)) || (lg.size > max_size) ||
+		(lg.pipeline == 0) || (lg.seconds == 0) || (lg.recvonly && (lg.oneway || lg.rate))) {
+		CLIENT_PRINT("usage: ./loadgen [-c conns] [-s size] [-p pipeline] [-r rate] [-d seconds] [-w warmup] [-o | -R] "
+					 "{[-u] ip port | -l [-T stream|seqpacket|dgram] local_path}");
+		return -CLIENT_ERRNO;
+	}
+	argv += optind - 1;
+
+	memset(&addr, 0x00, sizeof(addr));
+	if ((lg.transport != LOADGEN_TCP) && (lg.transport != LOADGEN_UDP)) {
+		un = (struct sockaddr_un *)&addr;
+		un->sun_family = AF_LOCAL;
+		strncpy(un->sun_path, argv[1], sizeof(un->sun_path) - 1);
+		addr_len = sizeof(struct sockaddr_un);
+	} else {
+		in = (struct sockaddr_in *)&addr;
+		in->sin_family = AF_INET;
+		in->sin_port = htons(atoi(argv[2]));
+		if (inet_pton(AF_INET, argv[1], &in->sin_addr) <= 0) {
+			CLIENT_PRINT("IP %s conversion failed, %s", argv[1], strerror(errno));
+			return -CLIENT_ERRNO;
+		}
+		addr_len = sizeof(struct sockaddr_in);
+	}
+
+	if (server_raise_nofile() < lg.conns + CONFIG_RESERVED_FDS) {
+		CLIENT_PRINT("%u connections exceed the open files limit", lg.conns);
+		return -CLIENT_ERRNO;
+	}
+
+	lg.payload = (uint8_t *)malloc(lg.size);
+	lg.conn = (struct loadgen_conn *)calloc(lg.conns, sizeof(struct loadgen_conn));
+	if (!lg.payload || !lg.conn) {
+		CLIENT_PRINT("get %u connections memory failed", lg.conns);
+		ret = -CLIENT_ERRNO;
+		goto label_main_exit;
+	}
+	for (i=0; i<lg.size; i++) {
+		lg.payload[i] = 'a' + (i % 26);
+	}
+	for (i=0; i<lg.conns; i++) {
+		lg.conn[i].fd = -1;
+	}
+
+	lg.epfd = epoll_create(2);
+	if (lg.epfd < 0) {
+		CLIENT_PRINT("epoll failed, %s", strerror(errno));
+		ret = -CLIENT_ERRNO;
+		goto label_main_exit;
+	}
+
+	for (i=0; i<lg.conns; i++) {
+		c = &lg.conn[i];
+		c->id = i;
+		c->lg = &lg;
+		c->fd = loadgen_connect(&lg, (struct sockaddr *)&addr, addr_len);
+		if (c->fd < 0) {
+			CLIENT_PRINT("connection %u failed", i);
+			ret = -CLIENT_ERRNO;
+			goto label_main_exit;
+		}
+		lg.open++;
+		if (!LOADGEN_MSGS(lg.transport)) {
+			c->tx_size = (LOADGEN_TX_BUF > 2 * (FRAME_HDR_LEN + lg.size)) ?
+						 LOADGEN_TX_BUF : 2 * (FRAME_HDR_LEN + lg.size);
+			c->tx = (uint8_t *)malloc(c->tx_size);
+			if (!c->tx || (frame_decoder_init(&c->dec, LOADGEN_RX_BUF, LOADGEN_MAX_SIZE, NULL) < 0)) {
+				CLIENT_PRINT("get connection %u buff memory failed", i);
+				ret = -CLIENT_ERRNO;
+				goto label_main_exit;
+			}
+		}
+		loadgen_conn_events(c, EPOLL_CTL_ADD);
+	}
+	CLIENT_PRINT("%u connection(s) to %s open", lg.conns, argv[1]);
+
+	start = metrics_now();
+	lg.measure_ns = start + lg.warmup * 1000000000ULL;
+	lg.end_ns = lg.measure_ns + lg.seconds * 1000000000ULL;
+	if (lg.rate) {
+		lg.interval_ns = lg.conns * 1000000000ULL / lg.rate;
+		for (i=0; i<lg.conns; i++) {
+			/* spread the connections over one interval */
+			lg.conn[i].next_ns = start + lg.interval_ns * i / lg.conns;
+		}
+	}
+	for (i=0; i<lg.conns; i++) {
+		if (loadgen_pump(&lg.conn[i], start) < 0) {
+			loadgen_conn_close(&lg.conn[i]);
+		}
+	}
+	if (lg.rate) {
+		/* same clock as metrics_now() */
+		lg.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if (lg.timerfd < 0) {
+			CLIENT_PRINT("timerfd failed, %s", strerror(errno));
+			ret = -CLIENT_ERRNO;
+			goto label_main_exit;
+		}
+		epev.events = EPOLLIN;
+		epev.data.ptr = NULL;
+		epoll_ctl(lg.epfd, EPOLL_CTL_ADD, lg.timerfd, &epev);
+		loadgen_arm(&lg);
+	}
+
+	ret = 0;
+	last = start;
+	last_recv = 0;
+	while ((lg.open > 0) && ((now = metrics_now()) < lg.end_ns)) {
+		nevents = epoll_wait(lg.epfd, events, LOADGEN_EVENTS, LOADGEN_TICK_MS);
+		if (nevents < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			CLIENT_PRINT("epoll failed, %s", strerror(errno));
+			ret = -CLIENT_ERRNO;
+			break;
+		}
+
+		now = metrics_now();
+		for (i=0; i<nevents; i++) {
+			c = (struct loadgen_conn *)events[i].data.ptr;
+			if (!c) {
+				/* the timer, the due connections are pumped below */
+				if (read(lg.timerfd, &expired, sizeof(uint64_t)) < 0) {
+					expired = 0;
+				}
+				continue;
+			} else if (c->fd < 0) {
+				continue;
+			}
+			if ((events[i].events & EPOLLOUT) && (loadgen_flush(c) < 0)) {
+				loadgen_conn_close(c);
+				continue;
+			}
+			if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && (loadgen_recv(c) <= 0)) {
+				loadgen_conn_close(c);
+				continue;
+			}
+			if (!lg.rate && (loadgen_pump(c, now) < 0)) {
+				loadgen_conn_close(c);
+			}
+		}
+		if (lg.rate) {
+			for (i=0; i<lg.conns; i++) {
+				c = &lg.conn[i];
+				if ((c->fd >= 0) && (c->next_ns <= now) && (loadgen_pump(c, now) < 0)) {
+					loadgen_conn_close(c);
+				}
+			}
+			loadgen_arm(&lg);
+		}
+
+		if (now - last >= 1000000000ULL) {
+			CLIENT_PRINT("%3.0f s: sent %llu, received %llu (+%llu)", (now - start) / 1e9,
+						 (unsigned long long)lg.sent, (unsigned long long)lg.recv,
+						 (unsigned long long)(lg.recv - last_recv));
+			last = now;
+			last_recv = lg.recv;
+		}
+	}
+
+	now = metrics_now();
+	if (now > lg.measure_ns) {
+		loadgen_report(&lg, (((now < lg.end_ns) ? now : lg.end_ns) - lg.measure_ns) / 1e9);
+	} else {
+		CLIENT_PRINT("stopped during the warmup, nothing measured");
+	}
+
+label_main_exit:
+	if (lg.conn) {
+		for (i=0; i<lg.conns; i++) {
+			c = &lg.conn[i];
+			if (c->fd >= 0) {
+				loadgen_conn_close(c);
+			}
+			if (c->tx) {
+				free(c->tx);
+				frame_decoder_exit(&c->dec);
+			}
+		}
+		free(lg.conn);
+	}
+	if (lg.timerfd >= 0) {
+		close(lg.timerfd);
+	}
+	if (lg.epfd >= 0) {
+		close(lg.epfd);
+	}
+	free(lg.payload);
+
+	return ret;
+}
@@ -9,9 +9,11 @@
 #include <arpa/inet.h>
 
 #include "common.h"
+#include "frame.h"
+#include "log.h"
 
 #define CLIENT_ERRNO				__LINE__
-#define CLIENT_PRINT(_fmt, ...)		printf("[%04d] "_fmt"\n", __LINE__, ##__VA_ARGS__);
+#define CLIENT_PRINT(_fmt, ...)		LOG_INFO("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
 
 /**
  * Connect to the server
@@ -75,7 +77,6 @@ label_client_connect_server:
  */
 static int client_send_message(int sockfd, struct common_buff *sbuf)
 {
-	uint32_t slen;
 	int ret;
 
 	/* clear send buff */
@@ -92,11 +93,8 @@ static int client_send_message(int sockfd, struct common_buff *sbuf)
 	sbuf->len -= 1;
 	sbuf->data[sbuf->len] = '\0'; /* delete \n */
 
-	slen = sizeof(struct common_buff) + sbuf->len;
-
-	sbuf->len = htonl(sbuf->len);
 	/* send to server */
-	ret = write(sockfd, sbuf, slen);
+	ret = frame_write_all(sockfd, sbuf->data, sbuf->len);
 	if (ret < 0) {
 		/* we failed */
 		CLIENT_PRINT("write failed, %s", strerror(errno));
@@ -108,25 +106,48 @@ static int client_send_message(int sockfd, struct common_buff *sbuf)
 	return ret;
 }
 
+/**
+ * Print a complete frame received from the server
+ *
+ * @param[in] arg	unused
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return always 0
+ */
+static int client_recv_frame(void *arg, uint8_t *data, uint32_t len)
+{
+	CLIENT_PRINT("RX[%04d]> %.*s", len, (int)len, data);
+
+	return 0;
+}
+
 /**
  * Receive a message from the server
  *
+ * Blocks until at least one whole frame has arrived; one read() may
+ * bring in the header and the payload together.
+ *
  * @param[in] sockfd	socket file descriptor
- * @param[in] rbuf		recv buff pointer
+ * @param[in] dec		frame decoder of the connection
  *
- * @return On success, return the length of the sent.
+ * @return On success, return the number of bytes read.
  */
-static int client_recv_message(int sockfd, struct common_buff *rbuf)
+static int client_recv_message(int sockfd, struct frame_decoder *dec)
 {
-	void *rptr;
+	uint8_t *rptr;
+	uint32_t space;
 	uint32_t rlen;
-	int count = 2;
 	int ret;
 
-	rptr = &rbuf->len;
-	rlen = sizeof(rbuf->len);
+	rlen = 0;
 	do {
-		ret = read(sockfd, rptr, rlen);
+		rptr = frame_decoder_space(dec, &space);
+		if (!rptr) {
+			CLIENT_PRINT("get recv buff memory failed");
+			return -CLIENT_ERRNO;
+		}
+		ret = read(sockfd, rptr, space);
 		if (ret < 0) {
 			CLIENT_PRINT("read failed, %s", strerror(errno));
 			return -CLIENT_ERRNO;
@@ -134,24 +155,14 @@ static int client_recv_message(int sockfd, struct common_buff *rbuf)
 			CLIENT_PRINT("server closed connection");
 			return 0;
 		}
+		rlen += ret;
 
-		if (count == 2) {
-			rbuf->len = ntohl(rbuf->len);
-			if (rbuf->len == 0) {
-				/* data illegal */
-				CLIENT_PRINT("no data read from the server");
-				break;
-			} else if (rbuf->len > DATA_MAX_LEN) {
-				CLIENT_PRINT("data error!!!");
-				return -CLIENT_ERRNO;
-			}
+		ret = frame_decoder_commit(dec, ret, client_recv_frame, NULL);
+		if (ret < 0) {
+			CLIENT_PRINT("data error!!!");
+			return -CLIENT_ERRNO;
 		}
-
-		rptr = &rbuf->data;
-		rlen = rbuf->len;
-	} while ((--count) > 0);
-
-	CLIENT_PRINT("RX[%04d]> %s", rlen, rbuf->data);
+	} while (ret == 0);
 
 	return rlen;
 }
@@ -161,9 +172,12 @@ int main(int argc, char *argv[])
 	const char *ip_str;
 	const char *port_str;
 	struct common_buff *buff;
+	struct frame_decoder dec;
 	uint16_t blen;
 	int sockfd;
 
+	log_init();
+
 	if (argc < 3) {
 		CLIENT_PRINT("usage: ./client ip port");
 		return -CLIENT_ERRNO;
@@ -176,6 +190,12 @@ int main(int argc, char *argv[])
 		return -CLIENT_ERRNO;
 	}
 
+	if (frame_decoder_init(&dec, RECV_BUFF_LEN, RECV_HIGH_WATER, NULL) < 0) {
+		CLIENT_PRINT("get decoder memory failed");
+		free(buff);
+		return -CLIENT_ERRNO;
+	}
+
 	ip_str   = argv[1];
 	port_str = argv[2];
 	CLIENT_PRINT("addr: %s:%s", ip_str, port_str);
@@ -183,6 +203,7 @@ int main(int argc, char *argv[])
 	sockfd = client_connect_server(ip_str, port_str);
 	if (sockfd < 0) {
 		CLIENT_PRINT("connect server failed, %d", sockfd);
+		frame_decoder_exit(&dec);
 		free(buff);
 		return -CLIENT_ERRNO;
 	}
@@ -193,7 +214,7 @@ int main(int argc, char *argv[])
 			break;
 		}
 
-		if (client_recv_message(sockfd, buff) <= 0) {
+		if (client_recv_message(sockfd, &dec) <= 0) {
 			break;
 		}
 	}
@@ -202,6 +223,7 @@ int main(int argc, char *argv[])
 		close(sockfd);
 		sockfd = -1;
 	}
+	frame_decoder_exit(&dec);
 	if (buff) {
 		free(buff);
 		buff = NULL;
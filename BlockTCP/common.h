@@ -3,7 +3,9 @@
 
 #include <stdint.h>
 
-#define DATA_MAX_LEN	1024
+#define DATA_MAX_LEN	1024			/* largest payload typed on stdin */
+#define RECV_BUFF_LEN	(16 * 1024)		/* per-connection receive buffer */
+#define RECV_HIGH_WATER	(256 * 1024)	/* largest payload accepted from the peer */
 struct common_buff {
 	uint32_t len;
 	uint8_t data[0];
@@ -9,10 +9,12 @@
 #include <arpa/inet.h>
 
 #include "common.h"
+#include "frame.h"
+#include "log.h"
 
 #define LISTENQ						20
 #define SERVER_ERRNO				__LINE__
-#define SERVER_PRINT(_fmt, ...)		printf("[%04d] "_fmt"\n", __LINE__, ##__VA_ARGS__);
+#define SERVER_PRINT(_fmt, ...)		LOG_INFO("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
 
 /**
  * Accept a client connection
@@ -83,25 +85,48 @@ label_server_accept_client:
 	return ret;
 }
 
+/**
+ * Print a complete frame received from the client
+ *
+ * @param[in] arg	unused
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return always 0
+ */
+static int server_recv_frame(void *arg, uint8_t *data, uint32_t len)
+{
+	SERVER_PRINT("RX[%04d]> %.*s", len, (int)len, data);
+
+	return 0;
+}
+
 /**
  * Receive a message from the client
  *
- * @param[in] confd		client connection file descriptor
- * @param[in] rbuf		recv buff pointer
+ * Blocks until at least one whole frame has arrived; one read() may
+ * bring in the header and the payload together.
  *
- * @return On success, return the length of the sent.
+ * @param[in] connfd	client connection file descriptor
+ * @param[in] dec		frame decoder of the connection
+ *
+ * @return On success, return the number of bytes read.
  */
-static int server_recv_message(int connfd, struct common_buff *rbuf)
+static int server_recv_message(int connfd, struct frame_decoder *dec)
 {
-	void *rptr;
+	uint8_t *rptr;
+	uint32_t space;
 	uint32_t rlen;
-	int count = 2;
 	int ret;
 
-	rptr = &rbuf->len;
-	rlen = sizeof(rbuf->len);
+	rlen = 0;
 	do {
-		ret = read(connfd, rptr, rlen);
+		rptr = frame_decoder_space(dec, &space);
+		if (!rptr) {
+			SERVER_PRINT("get recv buff memory failed");
+			return -SERVER_ERRNO;
+		}
+		ret = read(connfd, rptr, space);
 		if (ret < 0) {
 			SERVER_PRINT("read failed, %s", strerror(errno));
 			return -SERVER_ERRNO;
@@ -109,27 +134,16 @@ static int server_recv_message(int connfd, struct common_buff *rbuf)
 			SERVER_PRINT("client closed connection");
 			return 0;
 		}
+		rlen += ret;
 
-		if (count == 2) {
-			rbuf->len = ntohl(rbuf->len);
-			if (rbuf->len == 0) {
-				/* data illegal */
-				SERVER_PRINT("no data read from the client");
-				break;
-			} else if (rbuf->len > DATA_MAX_LEN) {
-				SERVER_PRINT("data error!!!");
-				return -SERVER_ERRNO;
-			}
+		ret = frame_decoder_commit(dec, ret, server_recv_frame, NULL);
+		if (ret < 0) {
+			SERVER_PRINT("data error!!!");
+			return -SERVER_ERRNO;
 		}
-
-		rptr = &rbuf->data;
-		rlen = rbuf->len;
-	} while ((--count) > 0);
-
-	SERVER_PRINT("RX[%04d]> %s", rlen, rbuf->data);
+	} while (ret == 0);
 
 	return rlen;
-
 }
 
 /**
@@ -142,7 +156,6 @@ static int server_recv_message(int connfd, struct common_buff *rbuf)
  */
 static int server_send_message(int connfd, struct common_buff *sbuf)
 {
-	uint32_t slen;
 	int ret;
 
 	/* clear send buff */
@@ -159,11 +172,8 @@ static int server_send_message(int connfd, struct common_buff *sbuf)
 	sbuf->len -= 1;
 	sbuf->data[sbuf->len] = '\0'; /* delete \n */
 
-	slen = sizeof(struct common_buff) + sbuf->len;
-
-	sbuf->len = htonl(sbuf->len);
 	/* send to server */
-	ret = write(connfd, sbuf, slen);
+	ret = frame_write_all(connfd, sbuf->data, sbuf->len);
 	if (ret < 0) {
 		/* we failed */
 		SERVER_PRINT("write failed, %s", strerror(errno));
@@ -178,9 +188,12 @@ int main(int argc, char *argv[])
 {
 	const char *port_str;
 	struct common_buff *buff;
+	struct frame_decoder dec;
 	uint16_t blen;
 	int connfd;
 
+	log_init();
+
 	if (argc < 2) {
 		SERVER_PRINT("usage: ./server port");
 		return -SERVER_ERRNO;
@@ -193,18 +206,25 @@ int main(int argc, char *argv[])
 		return -SERVER_ERRNO;
 	}
 
+	if (frame_decoder_init(&dec, RECV_BUFF_LEN, RECV_HIGH_WATER, NULL) < 0) {
+		SERVER_PRINT("get decoder memory failed");
+		free(buff);
+		return -SERVER_ERRNO;
+	}
+
 	port_str = argv[1];
 	SERVER_PRINT("port: %s", port_str);
 
 	connfd = server_accept_client(port_str);
 	if (connfd < 0) {
 		SERVER_PRINT("accept client connection failed");
+		frame_decoder_exit(&dec);
 		free(buff);
 		return -SERVER_ERRNO;
 	}
 
 	while (1) {
-		if (server_recv_message(connfd, buff) <= 0) {
+		if (server_recv_message(connfd, &dec) <= 0) {
 			break;
 		}
 
@@ -218,6 +238,7 @@ int main(int argc, char *argv[])
 		close(connfd);
 		connfd = -1;
 	}
+	frame_decoder_exit(&dec);
 	if (buff) {
 		free(buff);
 		buff = NULL;
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "config.h"
+#include "mode.h"
+
+#define CONFIG_MAX_EVENTS			1024
+#define CONFIG_SEND_HIGH_WATER		(1024 * 1024)
+#define CONFIG_SOURCE_MAX			(256 * 1024)	/* RECV_HIGH_WATER of the clients */
+
+/**
+ * Raise the soft RLIMIT_NOFILE up to the hard limit
+ *
+ * @return the resulting soft limit
+ */
+uint32_t server_raise_nofile(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+		return 1024;
+	}
+
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+			getrlimit(RLIMIT_NOFILE, &rl);
+		}
+	}
+
+	/* RLIM_INFINITY or absurdly large values */
+	if (rl.rlim_cur > UINT32_MAX) {
+		return UINT32_MAX;
+	}
+
+	return (uint32_t)rl.rlim_cur;
+}
+
+/**
+ * Read the kernel accept queue limit
+ *
+ * @return net.core.somaxconn, SOMAXCONN if it cannot be read
+ */
+int server_somaxconn(void)
+{
+	FILE *fp;
+	int val;
+
+	fp = fopen("/proc/sys/net/core/somaxconn", "r");
+	if (!fp) {
+		return SOMAXCONN;
+	}
+	if ((fscanf(fp, "%d", &val) != 1) || (val <= 0)) {
+		val = SOMAXCONN;
+	}
+	fclose(fp);
+
+	return val;
+}
+
+/**
+ * Look up a Local socket type by name
+ *
+ * @param[in] name	"stream", "seqpacket" or "dgram"
+ *
+ * @return On success, return SOCK_STREAM, SOCK_SEQPACKET or SOCK_DGRAM.
+ *		   On error (unknown name), return -1
+ */
+int sock_type_parse(const char *name)
+{
+	if (strcmp(name, "stream") == 0) {
+		return SOCK_STREAM;
+	} else if (strcmp(name, "seqpacket") == 0) {
+		return SOCK_SEQPACKET;
+	} else if (strcmp(name, "dgram") == 0) {
+		return SOCK_DGRAM;
+	}
+
+	return -1;
+}
+
+/**
+ * Get the name of a Local socket type
+ *
+ * @param[in] type	SOCK_STREAM, SOCK_SEQPACKET or SOCK_DGRAM
+ *
+ * @return the name
+ */
+const char *sock_type_name(int type)
+{
+	switch (type) {
+	case SOCK_STREAM:
+		return "stream";
+	case SOCK_SEQPACKET:
+		return "seqpacket";
+	case SOCK_DGRAM:
+		return "dgram";
+	default:
+		return "unknown";
+	}
+}
+
+/**
+ * Read an unsigned value from the environment
+ *
+ * @param[in] name	variable name
+ * @param[in] def	value when unset or invalid
+ *
+ * @return the value
+ */
+static unsigned long server_config_env(const char *name, unsigned long def)
+{
+	const char *str;
+	unsigned long val;
+	char *end;
+
+	str = getenv(name);
+	if (!str || !*str) {
+		return def;
+	}
+
+	val = strtoul(str, &end, 0);
+	return (*end || (val == 0)) ? def : val;
+}
+
+/**
+ * Fill in the server limits and raise RLIMIT_NOFILE to match
+ *
+ * @param[out] cfg	configuration
+ * @param[in]  opts	getopt() string of the options the server implements,
+ *					any other option is an error
+ * @param[in]  argc	argument count
+ * @param[in]  argv	arguments, options come before the positional ones
+ *
+ * @return On success, return the index of the first positional argument.
+ *		   On error (unknown option or mode), return -1
+ */
+int server_config_parse(struct server_config *cfg, const char *opts, int argc, char *argv[])
+{
+	uint32_t nofile;
+	long online;
+	int opt;
+
+	nofile = server_raise_nofile();
+
+	cfg->max_clients = server_config_env("SOCKET_MAX_CLIENTS", 0);
+	cfg->backlog = server_config_env("SOCKET_BACKLOG", 0);
+	cfg->max_events = server_config_env("SOCKET_MAX_EVENTS", CONFIG_MAX_EVENTS);
+	cfg->edge_triggered = server_config_env("SOCKET_EDGE_TRIGGERED", 0) ? 1 : 0;
+	cfg->threads = server_config_env("SOCKET_THREADS", 1);
+	cfg->udp_gro = server_config_env("SOCKET_UDP_GRO", 0) ? 1 : 0;
+	cfg->zerocopy = server_config_env("SOCKET_ZEROCOPY", 0) ? 1 : 0;
+	cfg->send_high = server_config_env("SOCKET_SEND_HIGH_WATER", CONFIG_SEND_HIGH_WATER);
+	cfg->send_low = server_config_env("SOCKET_SEND_LOW_WATER", 0);
+	cfg->mode = getenv("SOCKET_MODE") ? mode_parse(getenv("SOCKET_MODE")) : SERVER_MODE_CONSOLE;
+	cfg->source_size = server_config_env("SOCKET_SOURCE_SIZE", MODE_SOURCE_SIZE);
+	cfg->idle_timeout = server_config_env("SOCKET_IDLE_TIMEOUT", 0);
+	cfg->hb.interval = server_config_env("SOCKET_PING_INTERVAL", 0);
+	cfg->hb.misses = server_config_env("SOCKET_PING_MISSES", HB_MISSES);
+	cfg->hb.keepalive = server_config_env("SOCKET_TCP_KEEPALIVE", 0);
+	cfg->hb.user_timeout = server_config_env("SOCKET_TCP_USER_TIMEOUT", 0);
+	cfg->accept_port = server_config_env("SOCKET_ACCEPT_PORT", 0);
+	cfg->worker = server_config_env("SOCKET_WORKER", 0) ? 1 : 0;
+	cfg->sock_type = getenv("SOCKET_LOCAL_TYPE") ? sock_type_parse(getenv("SOCKET_LOCAL_TYPE")) : SOCK_STREAM;
+	cfg->file_root = getenv("SOCKET_FILE_ROOT");
+
+	while ((opt = getopt(argc, argv, opts)) != -1) {
+		switch (opt) {
+		case 'c':
+			cfg->max_clients = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			cfg->backlog = atoi(optarg);
+			break;
+		case 'e':
+			cfg->max_events = strtoul(optarg, NULL, 0);
+			break;
+		case 'E':
+			cfg->edge_triggered = 1;
+			break;
+		case 't':
+			cfg->threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'G':
+			cfg->udp_gro = 1;
+			break;
+		case 'Z':
+			cfg->zerocopy = 1;
+			break;
+		case 'H':
+			cfg->send_high = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			cfg->send_low = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			cfg->mode = mode_parse(optarg);
+			break;
+		case 'S':
+			cfg->source_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'I':
+			cfg->idle_timeout = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			cfg->hb.interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			cfg->hb.misses = strtoul(optarg, NULL, 0);
+			break;
+		case 'K':
+			cfg->hb.keepalive = strtoul(optarg, NULL, 0);
+			break;
+		case 'U':
+			cfg->hb.user_timeout = strtoul(optarg, NULL, 0);
+			break;
+		case 'A':
+			cfg->accept_port = strtoul(optarg, NULL, 0);
+			break;
+		case 'W':
+			cfg->worker = 1;
+			break;
+		case 'T':
+			cfg->sock_type = sock_type_parse(optarg);
+			break;
+		case 'F':
+			cfg->file_root = optarg;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if ((cfg->max_clients == 0) || (cfg->max_clients > nofile - CONFIG_RESERVED_FDS)) {
+		cfg->max_clients = (nofile > CONFIG_RESERVED_FDS * 2) ? (nofile - CONFIG_RESERVED_FDS) : CONFIG_RESERVED_FDS;
+	}
+	if (cfg->backlog <= 0) {
+		cfg->backlog = server_somaxconn();
+	}
+	if (cfg->max_events == 0) {
+		cfg->max_events = CONFIG_MAX_EVENTS;
+	}
+	if (cfg->send_high == 0) {
+		cfg->send_high = CONFIG_SEND_HIGH_WATER;
+	}
+	if ((cfg->send_low == 0) || (cfg->send_low >= cfg->send_high)) {
+		cfg->send_low = cfg->send_high / 4;
+	}
+	if (cfg->mode < 0) {
+		return -1;	/* unknown mode name */
+	}
+	if ((cfg->source_size == 0) || (cfg->source_size > CONFIG_SOURCE_MAX)) {
+		cfg->source_size = MODE_SOURCE_SIZE;
+	}
+	if ((cfg->accept_port > UINT16_MAX) || (cfg->accept_port && cfg->worker)) {
+		return -1;	/* a worker does not accept */
+	}
+	if (cfg->sock_type < 0) {
+		return -1;	/* unknown socket type name */
+	} else if ((cfg->sock_type != SOCK_STREAM) && (cfg->accept_port || cfg->worker)) {
+		return -1;	/* descriptors are passed along a framed stream */
+	}
+	if (cfg->hb.misses == 0) {
+		cfg->hb.misses = HB_MISSES;
+	}
+	if (cfg->threads == 0) {
+		online = sysconf(_SC_NPROCESSORS_ONLN);
+		cfg->threads = (online > 0) ? online : 1;
+	}
+
+	return optind;
+}
@@ -0,0 +1,67 @@
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include <stdint.h>
+
+#include "heartbeat.h"
+
+#define CONFIG_RESERVED_FDS			16		/* stdin/out/err, listener, epoll... */
+
+/*
+ * Runtime server limits, taken from (highest priority first) the command
+ * line, the environment and the system. Each server only accepts the
+ * options it implements (SERVER_OPTIONS in its server.c):
+ *	-c / SOCKET_MAX_CLIENTS	max connections, default RLIMIT_NOFILE - reserved
+ *	-b / SOCKET_BACKLOG		listen() backlog, default net.core.somaxconn
+ *	-e / SOCKET_MAX_EVENTS	events fetched per epoll_wait()
+ *	-E / SOCKET_EDGE_TRIGGERED	register sockets with EPOLLET
+ *	-t / SOCKET_THREADS		worker threads, 0 is one per online CPU
+ *	-G / SOCKET_UDP_GRO		receive coalesced UDP segments (UDP_GRO)
+ *	-Z / SOCKET_ZEROCOPY	send large messages with MSG_ZEROCOPY
+ *	-H / SOCKET_SEND_HIGH_WATER	queued output bytes that pause reading a client
+ *	-L / SOCKET_SEND_LOW_WATER	queued output bytes that resume it
+ *	-m / SOCKET_MODE		console, echo, sink or source, see mode.h
+ *	-S / SOCKET_SOURCE_SIZE	payload of the frames a source server streams
+ *	-I / SOCKET_IDLE_TIMEOUT	seconds without a complete frame in or bytes out
+ *							before a connection is closed, 0 never
+ *	-P / SOCKET_PING_INTERVAL	seconds of silence before a client is pinged, 0 off
+ *	-M / SOCKET_PING_MISSES	silent intervals before a client is dead
+ *	-K / SOCKET_TCP_KEEPALIVE	TCP keepalive idle and probe interval seconds
+ *	-U / SOCKET_TCP_USER_TIMEOUT	TCP_USER_TIMEOUT of the clients in ms
+ *	-A / SOCKET_ACCEPT_PORT	Local server: also accept TCP on this port and
+ *							hand the connections to its workers
+ *	-W / SOCKET_WORKER		Local server: take connections from the acceptor
+ *							listening at the path instead of listening
+ *	-T / SOCKET_LOCAL_TYPE	Local server: stream, seqpacket or dgram socket;
+ *							seqpacket and dgram carry bare messages, no frame
+ *							header, and take neither -A nor -W
+ *	-F / SOCKET_FILE_ROOT	epoll server: directory "get" requests are served
+ *							from, file serving is off without it
+ */
+struct server_config {
+	uint32_t max_clients;
+	int backlog;
+	uint32_t max_events;
+	int edge_triggered;
+	uint32_t threads;
+	int udp_gro;
+	int zerocopy;
+	uint32_t send_high;
+	uint32_t send_low;
+	int mode;
+	uint32_t source_size;
+	uint32_t idle_timeout;
+	struct hb_config hb;
+	uint32_t accept_port;
+	int worker;
+	int sock_type;			/* SOCK_STREAM, SOCK_SEQPACKET or SOCK_DGRAM */
+	const char *file_root;	/* NULL when files are not served */
+};
+
+int server_config_parse(struct server_config *cfg, const char *opts, int argc, char *argv[]);
+uint32_t server_raise_nofile(void);
+int server_somaxconn(void);
+int sock_type_parse(const char *name);
+const char *sock_type_name(int type);
+
+#endif	/* #ifndef __CONFIG_H__ */
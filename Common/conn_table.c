@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "conn_table.h"
+
+/**
+ * Grow the table, new slots are pushed so that the lowest index is
+ * handed out first
+ *
+ * @param[in] tbl	table
+ * @param[in] size	new number of slots
+ *
+ * @return On success, return 0.
+ *		   On error, return -1 and leave the table unchanged
+ */
+static int conn_table_resize(struct conn_table *tbl, uint32_t size)
+{
+	uint32_t *stack;
+	void **slots;
+	uint32_t i;
+
+	slots = (void **)realloc(tbl->slots, size * sizeof(void *));
+	if (!slots) {
+		return -1;
+	}
+	tbl->slots = slots;
+
+	stack = (uint32_t *)realloc(tbl->free_stack, size * sizeof(uint32_t));
+	if (!stack) {
+		return -1;
+	}
+	tbl->free_stack = stack;
+
+	memset(&tbl->slots[tbl->size], 0x00, (size - tbl->size) * sizeof(void *));
+	for (i=size; i>tbl->size; i--) {
+		tbl->free_stack[tbl->free_top++] = i - 1;
+	}
+	tbl->size = size;
+
+	return 0;
+}
+
+/**
+ * Initialize a connection table
+ *
+ * @param[in] tbl		table
+ * @param[in] size		initial number of slots
+ * @param[in] max_size	upper bound for growth
+ *
+ * @return On success, return 0.
+ *		   On error, return -1
+ */
+int conn_table_init(struct conn_table *tbl, uint32_t size, uint32_t max_size)
+{
+	memset(tbl, 0x00, sizeof(struct conn_table));
+
+	if (size > max_size) {
+		size = max_size;
+	}
+	tbl->max_size = max_size;
+	if ((size == 0) || (conn_table_resize(tbl, size) < 0)) {
+		conn_table_exit(tbl);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Release the table, the connections themselves are not touched
+ *
+ * @param[in] tbl	table
+ */
+void conn_table_exit(struct conn_table *tbl)
+{
+	if (tbl->slots) {
+		free(tbl->slots);
+		tbl->slots = NULL;
+	}
+	if (tbl->free_stack) {
+		free(tbl->free_stack);
+		tbl->free_stack = NULL;
+	}
+	tbl->size = tbl->max_size = tbl->count = tbl->free_top = 0;
+}
+
+/**
+ * Put a connection into a free slot
+ *
+ * @param[in] tbl	table
+ * @param[in] conn	connection, must not be NULL
+ *
+ * @return On success, return the slot index.
+ *		   On error (max_size reached or out of memory), return -1
+ */
+int conn_table_insert(struct conn_table *tbl, void *conn)
+{
+	uint32_t slot;
+	uint32_t size;
+
+	if (tbl->free_top == 0) {
+		if (tbl->size >= tbl->max_size) {
+			return -1;
+		}
+		size = (tbl->size > (tbl->max_size / 2)) ? tbl->max_size : (tbl->size * 2);
+		if (conn_table_resize(tbl, size) < 0) {
+			return -1;
+		}
+	}
+
+	slot = tbl->free_stack[--tbl->free_top];
+	tbl->slots[slot] = conn;
+	tbl->count++;
+
+	return slot;
+}
+
+/**
+ * Free a slot
+ *
+ * @param[in] tbl	table
+ * @param[in] slot	slot returned by conn_table_insert()
+ */
+void conn_table_remove(struct conn_table *tbl, uint32_t slot)
+{
+	if ((slot >= tbl->size) || !tbl->slots[slot]) {
+		return;
+	}
+
+	tbl->slots[slot] = NULL;
+	tbl->free_stack[tbl->free_top++] = slot;
+	tbl->count--;
+}
@@ -0,0 +1,40 @@
+#ifndef __CONN_TABLE_H__
+#define __CONN_TABLE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Dense connection table: a slot array plus a stack of free slot indexes,
+ * so insert, lookup and remove are all O(1). The slot index is what the
+ * operator types to pick a client. The table doubles when it runs out of
+ * slots, up to 'max_size'.
+ */
+struct conn_table {
+	void **slots;			/* NULL when the slot is free */
+	uint32_t *free_stack;
+	uint32_t free_top;		/* number of free slots on the stack */
+	uint32_t size;
+	uint32_t max_size;
+	uint32_t count;			/* slots in use */
+};
+
+int conn_table_init(struct conn_table *tbl, uint32_t size, uint32_t max_size);
+void conn_table_exit(struct conn_table *tbl);
+int conn_table_insert(struct conn_table *tbl, void *conn);
+void conn_table_remove(struct conn_table *tbl, uint32_t slot);
+
+/**
+ * Look up a slot
+ *
+ * @param[in] tbl	table
+ * @param[in] slot	slot index, may be out of range
+ *
+ * @return the connection, NULL when the slot is free or out of range
+ */
+static inline void *conn_table_get(struct conn_table *tbl, uint32_t slot)
+{
+	return (slot < tbl->size) ? tbl->slots[slot] : NULL;
+}
+
+#endif	/* #ifndef __CONN_TABLE_H__ */
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+
+#include "ctrl.h"
+
+/**
+ * Sleep until a descriptor is readable or the channel is stopped
+ *
+ * @param[in] ch	control channel
+ * @param[in] fd	descriptor to wait for
+ *
+ * @return 0 once fd is readable, -1 when stopped
+ */
+static int ctrl_wait(struct ctrl_chan *ch, int fd)
+{
+	struct pollfd pfds[2];
+
+	pfds[0].fd = ch->stop_efd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = fd;
+	pfds[1].events = POLLIN;
+	while (1) {
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (pfds[0].revents) {
+			return -1;
+		} else if (pfds[1].revents) {
+			return 0;
+		}
+	}
+}
+
+/**
+ * Read one console line without its '\n', a longer line than 'size' comes
+ * in pieces like with fgets()
+ *
+ * The console is read with read() rather than stdio, so poll() sees every
+ * byte that has not been taken yet.
+ *
+ * @param[in]  ch	control channel
+ * @param[out] buf	line
+ * @param[in]  size	buf size, at most CTRL_MSG_LEN
+ *
+ * @return 0 on success, -1 at end of file or when stopped
+ */
+static int ctrl_read_line(struct ctrl_chan *ch, char *buf, int size)
+{
+	char *nl;
+	uint32_t len;
+	ssize_t ret;
+
+	while (1) {
+		nl = memchr(ch->line, '\n', ch->line_len);
+		if (nl || (ch->line_len >= (uint32_t)size - 1)) {
+			break;
+		}
+		if (ctrl_wait(ch, ch->in) < 0) {
+			return -1;
+		}
+		ret = read(ch->in, &ch->line[ch->line_len], sizeof(ch->line) - ch->line_len);
+		if (ret < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN)) {
+				continue;
+			}
+			return -1;
+		} else if (ret == 0) {
+			if (ch->line_len == 0) {
+				return -1;
+			}
+			nl = &ch->line[ch->line_len];	/* last line without '\n' */
+			break;
+		}
+		ch->line_len += ret;
+	}
+
+	len = nl ? (uint32_t)(nl - ch->line) : (uint32_t)size - 1;
+	if (len > (uint32_t)size - 1) {
+		len = size - 1;
+		nl = NULL;
+	}
+	memcpy(buf, ch->line, len);
+	buf[len] = '\0';
+
+	/* drop the line and its '\n' */
+	if (nl && (len < ch->line_len)) {
+		len++;
+	}
+	ch->line_len -= len;
+	memmove(ch->line, &ch->line[len], ch->line_len);
+
+	return 0;
+}
+
+/**
+ * Whether a selector line is followed by a message line
+ *
+ * @param[in] ch	control channel
+ * @param[in] sel	selector line
+ *
+ * @return 1 if it is, 0 for an empty line or a solo command
+ */
+static int ctrl_takes_msg(struct ctrl_chan *ch, const char *sel)
+{
+	if (sel[0] == '\0') {
+		return 0;
+	}
+	if ((sel[1] == '\0') && strchr(ch->solo, sel[0])) {
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Control thread: read commands and post them to the I/O loop
+ *
+ * @param[in] arg	control channel
+ *
+ * @return NULL
+ */
+static void *ctrl_run(void *arg)
+{
+	struct ctrl_chan *ch = (struct ctrl_chan *)arg;
+	struct ctrl_cmd *cmd;
+	uint64_t val = 1;
+	uint64_t room;
+	uint32_t head;
+
+	while (1) {
+		head = ch->head;
+		while ((head - __atomic_load_n(&ch->tail, __ATOMIC_SEQ_CST)) >= CTRL_RING_LEN) {
+			/* the loop is behind, the operator can wait */
+			if (ctrl_wait(ch, ch->room_efd) < 0) {
+				return NULL;
+			}
+			if (read(ch->room_efd, &room, sizeof(uint64_t)) < 0) {
+				room = 0;
+			}
+		}
+
+		cmd = &ch->ring[head % CTRL_RING_LEN];
+		if (!ch->solo) {
+			cmd->sel[0] = '\0';
+			if (ctrl_read_line(ch, cmd->msg, sizeof(cmd->msg)) < 0) {
+				break;
+			}
+		} else {
+			if (ctrl_read_line(ch, cmd->sel, sizeof(cmd->sel)) < 0) {
+				break;
+			}
+			cmd->msg[0] = '\0';
+			if (ctrl_takes_msg(ch, cmd->sel) &&
+				(ctrl_read_line(ch, cmd->msg, sizeof(cmd->msg)) < 0)) {
+				break;
+			}
+		}
+
+		__atomic_store_n(&ch->head, head + 1, __ATOMIC_SEQ_CST);
+		if (write(ch->efd, &val, sizeof(uint64_t)) < 0) {
+			break;
+		}
+	}
+
+	/* end of the console or stopped, the servers keep running without it */
+	return NULL;
+}
+
+/**
+ * Start the control thread
+ *
+ * @param[in] ch	control channel
+ * @param[in] in	console to read
+ * @param[in] solo	letters of the commands that take no message line, NULL
+ *					if every line is a command of its own
+ *
+ * @return On success, return 0, ch->efd is ready to be polled.
+ *		   On error, return -1
+ */
+int ctrl_start(struct ctrl_chan *ch, FILE *in, const char *solo)
+{
+	sigset_t all, old;
+	int ret;
+
+	memset(ch, 0x00, sizeof(struct ctrl_chan));
+	ch->in = fileno(in);
+	ch->solo = solo;
+
+	ch->efd = eventfd(0, EFD_NONBLOCK);
+	ch->room_efd = eventfd(0, EFD_NONBLOCK);
+	ch->stop_efd = eventfd(0, EFD_NONBLOCK);
+	if ((ch->efd < 0) || (ch->room_efd < 0) || (ch->stop_efd < 0)) {
+		goto label_ctrl_start;
+	}
+
+	/* signals are for the threads that asked for them, not this one */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&ch->tid, NULL, ctrl_run, ch);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		goto label_ctrl_start;
+	}
+	ch->running = 1;
+
+	return 0;
+
+label_ctrl_start:
+	if (ch->efd >= 0) {
+		close(ch->efd);
+	}
+	if (ch->room_efd >= 0) {
+		close(ch->room_efd);
+	}
+	if (ch->stop_efd >= 0) {
+		close(ch->stop_efd);
+	}
+	ch->efd = -1;
+
+	return -1;
+}
+
+/**
+ * Stop the control thread, it may be waiting on the console
+ *
+ * @param[in] ch	control channel
+ */
+void ctrl_stop(struct ctrl_chan *ch)
+{
+	uint64_t val = 1;
+
+	if (ch->running) {
+		if (write(ch->stop_efd, &val, sizeof(uint64_t)) < 0) {
+			val = 0;	/* a counter overflow, it is readable anyway */
+		}
+		pthread_join(ch->tid, NULL);
+		close(ch->room_efd);
+		close(ch->stop_efd);
+		ch->running = 0;
+	}
+	if (ch->efd >= 0) {
+		close(ch->efd);
+		ch->efd = -1;
+	}
+}
+
+/**
+ * Take the next queued command, call it until it returns 0 every time
+ * ch->efd is readable
+ *
+ * @param[in]  ch	control channel
+ * @param[out] cmd	command
+ *
+ * @return 1 if a command was taken, 0 if the queue is empty
+ */
+int ctrl_next(struct ctrl_chan *ch, struct ctrl_cmd *cmd)
+{
+	uint64_t val;
+	uint32_t tail;
+	int full;
+
+	tail = ch->tail;
+	if (tail == __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE)) {
+		/* reset the eventfd, anything posted later sets it again */
+		if (read(ch->efd, &val, sizeof(uint64_t)) < 0) {
+			val = 0;
+		}
+		if (tail == __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE)) {
+			return 0;
+		}
+	}
+
+	memcpy(cmd, &ch->ring[tail % CTRL_RING_LEN], sizeof(struct ctrl_cmd));
+	/*
+	 * seq_cst pairs with the thread's head store and tail load: either it
+	 * sees this slot free or this sees that the ring was full
+	 */
+	__atomic_store_n(&ch->tail, tail + 1, __ATOMIC_SEQ_CST);
+	full = (__atomic_load_n(&ch->head, __ATOMIC_SEQ_CST) - tail) >= CTRL_RING_LEN;
+	if (full) {
+		/* the control thread may be waiting for this slot */
+		val = 1;
+		if (write(ch->room_efd, &val, sizeof(uint64_t)) < 0) {
+			val = 0;
+		}
+	}
+
+	return 1;
+}
@@ -0,0 +1,50 @@
+#ifndef __CTRL_H__
+#define __CTRL_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Operator console on its own thread.
+ *
+ * The control thread is the only one waiting on the console. Once a whole
+ * command has been typed it is posted to the I/O loop through a single
+ * producer, single consumer ring and an eventfd, which the loop watches
+ * like any other descriptor. A command is a selector line (client index
+ * or command letter) followed by a message line, except for the letters
+ * listed as 'solo' that take no message.
+ *
+ * The thread sleeps in poll() on the console and a stop eventfd, and on
+ * a room eventfd while the ring is full, so ctrl_stop() only has to post
+ * the stop eventfd.
+ */
+#define CTRL_RING_LEN				64
+#define CTRL_SEL_LEN				16
+#define CTRL_MSG_LEN				1024
+
+struct ctrl_cmd {
+	char sel[CTRL_SEL_LEN];	/* selector line, "" in single line mode */
+	char msg[CTRL_MSG_LEN];	/* message line, "" for solo commands */
+};
+
+struct ctrl_chan {
+	int efd;				/* eventfd, readable while commands are queued */
+	int room_efd;			/* eventfd, posted when a full ring got a free slot */
+	int stop_efd;			/* eventfd, posted by ctrl_stop() */
+	int in;					/* console descriptor */
+	const char *solo;		/* commands without message, NULL: one line each */
+	pthread_t tid;
+	int running;
+	uint32_t head;			/* next slot to fill, written by the thread */
+	uint32_t tail;			/* next slot to read, written by the I/O loop */
+	struct ctrl_cmd ring[CTRL_RING_LEN];
+	char line[CTRL_MSG_LEN];	/* console bytes not split into lines yet */
+	uint32_t line_len;
+};
+
+int ctrl_start(struct ctrl_chan *ch, FILE *in, const char *solo);
+void ctrl_stop(struct ctrl_chan *ch);
+int ctrl_next(struct ctrl_chan *ch, struct ctrl_cmd *cmd);
+
+#endif	/* #ifndef __CTRL_H__ */
@@ -0,0 +1,408 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "frame.h"
+#include "fanout.h"
+
+/**
+ * Initialize an empty topic set
+ *
+ * @param[in] fo	fan-out
+ * @param[in] pool	pool the published frames come from
+ */
+void fanout_init(struct fanout *fo, struct buff_pool *pool)
+{
+	memset(fo, 0x00, sizeof(struct fanout));
+	fo->pool = pool;
+}
+
+/**
+ * Drop every topic and subscription
+ *
+ * @param[in] fo	fan-out
+ */
+void fanout_exit(struct fanout *fo)
+{
+	uint32_t i;
+
+	for (i=0; i<fo->count; i++) {
+		free(fo->topics[i].subs);
+	}
+	free(fo->topics);
+	fo->topics = NULL;
+	fo->count = fo->size = 0;
+}
+
+/**
+ * Look a topic up by name
+ *
+ * @param[in] fo	fan-out
+ * @param[in] name	topic name
+ *
+ * @return the topic, NULL if nobody subscribed to it
+ */
+static struct fanout_topic *fanout_find(struct fanout *fo, const char *name)
+{
+	uint32_t i;
+
+	for (i=0; i<fo->count; i++) {
+		if (strncmp(fo->topics[i].name, name, FANOUT_TOPIC_LEN - 1) == 0) {
+			return &fo->topics[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Remove 'sub' from a topic, the topic goes away with its last subscriber
+ *
+ * @param[in] fo	fan-out
+ * @param[in] t		topic
+ * @param[in] sub	subscriber handle
+ *
+ * @return 0 if it was subscribed, -1 otherwise
+ */
+static int fanout_topic_remove(struct fanout *fo, struct fanout_topic *t, void *sub)
+{
+	uint32_t i;
+
+	for (i=0; i<t->count; i++) {
+		if (t->subs[i] == sub) {
+			break;
+		}
+	}
+	if (i == t->count) {
+		return -1;
+	}
+	t->subs[i] = t->subs[--t->count];
+
+	if (t->count == 0) {
+		free(t->subs);
+		*t = fo->topics[--fo->count];
+	}
+
+	return 0;
+}
+
+/**
+ * Subscribe 'sub' to a topic, creating the topic if needed
+ *
+ * @param[in] fo	fan-out
+ * @param[in] name	topic name, truncated to FANOUT_TOPIC_LEN - 1
+ * @param[in] sub	subscriber handle
+ *
+ * @return On success, return 0 (also when already subscribed).
+ *		   On error, return -1
+ */
+int fanout_subscribe(struct fanout *fo, const char *name, void *sub)
+{
+	struct fanout_topic *t;
+	uint32_t i, size;
+	void *ptr;
+
+	t = fanout_find(fo, name);
+	if (!t) {
+		if (fo->count == fo->size) {
+			size = fo->size ? (fo->size * 2) : 8;
+			ptr = realloc(fo->topics, size * sizeof(struct fanout_topic));
+			if (!ptr) {
+				return -1;
+			}
+			fo->topics = (struct fanout_topic *)ptr;
+			fo->size = size;
+		}
+		t = &fo->topics[fo->count++];
+		memset(t, 0x00, sizeof(struct fanout_topic));
+		strncpy(t->name, name, FANOUT_TOPIC_LEN - 1);
+	}
+
+	for (i=0; i<t->count; i++) {
+		if (t->subs[i] == sub) {
+			return 0;
+		}
+	}
+
+	if (t->count == t->size) {
+		size = t->size ? (t->size * 2) : 16;
+		ptr = realloc(t->subs, size * sizeof(void *));
+		if (!ptr) {
+			if (t->count == 0) {
+				*t = fo->topics[--fo->count];
+			}
+			return -1;
+		}
+		t->subs = (void **)ptr;
+		t->size = size;
+	}
+	t->subs[t->count++] = sub;
+
+	return 0;
+}
+
+/**
+ * Unsubscribe 'sub' from a topic
+ *
+ * @param[in] fo	fan-out
+ * @param[in] name	topic name
+ * @param[in] sub	subscriber handle
+ *
+ * @return 0 if it was subscribed, -1 otherwise
+ */
+int fanout_unsubscribe(struct fanout *fo, const char *name, void *sub)
+{
+	struct fanout_topic *t;
+
+	t = fanout_find(fo, name);
+	if (!t) {
+		return -1;
+	}
+
+	return fanout_topic_remove(fo, t, sub);
+}
+
+/**
+ * Drop every subscription of a connection that is going away
+ *
+ * @param[in] fo	fan-out
+ * @param[in] sub	subscriber handle
+ */
+void fanout_unsubscribe_all(struct fanout *fo, void *sub)
+{
+	uint32_t i, count;
+
+	for (i=0; i<fo->count; ) {
+		count = fo->count;
+		if ((fanout_topic_remove(fo, &fo->topics[i], sub) == 0) && (fo->count < count)) {
+			continue;	/* the topic went away, the last one moved into slot i */
+		}
+		i++;
+	}
+}
+
+/**
+ * Handle a "sub <topic>" or "unsub <topic>" frame
+ *
+ * @param[in] fo	fan-out
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ * @param[in] sub	subscriber handle of the sender
+ *
+ * @return 1 if the frame was a command and succeeded, -1 if it failed,
+ *		   0 if it was not a command
+ */
+int fanout_command(struct fanout *fo, const uint8_t *data, uint32_t len, void *sub)
+{
+	char name[FANOUT_TOPIC_LEN];
+	uint32_t cmd_len;
+	int sub_cmd;
+
+	if ((len > strlen(FANOUT_SUB_CMD)) && (memcmp(data, FANOUT_SUB_CMD, strlen(FANOUT_SUB_CMD)) == 0)) {
+		sub_cmd = 1;
+		cmd_len = strlen(FANOUT_SUB_CMD);
+	} else if ((len > strlen(FANOUT_UNSUB_CMD)) &&
+			   (memcmp(data, FANOUT_UNSUB_CMD, strlen(FANOUT_UNSUB_CMD)) == 0)) {
+		sub_cmd = 0;
+		cmd_len = strlen(FANOUT_UNSUB_CMD);
+	} else {
+		return 0;
+	}
+
+	len -= cmd_len;
+	if (len >= sizeof(name)) {
+		len = sizeof(name) - 1;
+	}
+	memcpy(name, &data[cmd_len], len);
+	name[len] = '\0';
+
+	if (sub_cmd) {
+		return (fanout_subscribe(fo, name, sub) < 0) ? -1 : 1;
+	}
+	return (fanout_unsubscribe(fo, name, sub) < 0) ? -1 : 1;
+}
+
+/**
+ * Encode a message once for any number of recipients
+ *
+ * @param[in] fo		fan-out
+ * @param[in] payload	message
+ * @param[in] len		message length
+ *
+ * @return On success, return the frame with the caller's reference.
+ *		   On error, NULL
+ */
+struct outq_buf *fanout_encode(struct fanout *fo, const void *payload, uint32_t len)
+{
+	struct outq_buf *frame;
+
+	frame = outq_buf_new(fo->pool, len);
+	if (!frame) {
+		return NULL;
+	}
+	memcpy(&frame->data[FRAME_HDR_LEN], payload, len);
+	fo->stats.published++;
+
+	return frame;
+}
+
+/**
+ * Hand an encoded frame to one recipient and count the outcome
+ *
+ * @param[in] fo		fan-out
+ * @param[in] sub		subscriber handle
+ * @param[in] frame		frame from fanout_encode()
+ * @param[in] deliver	delivery callback
+ * @param[in] arg		callback user pointer
+ *
+ * @return what 'deliver' returns
+ */
+int fanout_deliver(struct fanout *fo, void *sub, struct outq_buf *frame,
+				   fanout_deliver_t deliver, void *arg)
+{
+	int ret;
+
+	ret = deliver(arg, sub, frame);
+	if (ret < 0) {
+		fo->stats.dropped++;
+	} else {
+		fo->stats.delivered++;
+	}
+
+	return ret;
+}
+
+/**
+ * Send a message to every subscriber of a topic
+ *
+ * @param[in] fo		fan-out
+ * @param[in] name		topic name
+ * @param[in] payload	message
+ * @param[in] len		message length
+ * @param[in] deliver	delivery callback
+ * @param[in] arg		callback user pointer
+ *
+ * @return On success, return the number of subscribers reached.
+ *		   On error, return -1 (out of memory)
+ */
+int fanout_publish(struct fanout *fo, const char *name, const void *payload, uint32_t len,
+				   fanout_deliver_t deliver, void *arg)
+{
+	struct fanout_topic *t;
+	struct outq_buf *frame;
+	uint32_t i;
+	int cnt;
+
+	t = fanout_find(fo, name);
+	if (!t) {
+		return 0;
+	}
+
+	frame = fanout_encode(fo, payload, len);
+	if (!frame) {
+		return -1;
+	}
+
+	cnt = 0;
+	for (i=0; i<t->count; i++) {
+		if (fanout_deliver(fo, t->subs[i], frame, deliver, arg) >= 0) {
+			cnt++;
+		}
+	}
+	outq_buf_put(fo->pool, frame);
+
+	return cnt;
+}
+
+/**
+ * Write a shared frame to a stream socket behind the connection's queued
+ * output, for the deliver callbacks of the servers
+ *
+ * The frame goes out directly only while nothing is queued; whatever the
+ * socket does not take is queued as a reference to it, so a published
+ * frame never lands in the middle of another one. A subscriber whose queue
+ * reached 'high' misses the message. One that failed, or whose queue could
+ * not take the rest of a frame already started, is shut down: the caller's
+ * event loop sees it and closes it, the subscriber lists are left alone
+ * meanwhile.
+ *
+ * @param[in] fd	connected stream socket
+ * @param[in] q		its output queue
+ * @param[in] frame	shared frame
+ * @param[in] high	queued bytes at which the subscriber misses messages
+ *
+ * @return On success, return the number of bytes written directly, the
+ *		   rest waits in the queue for the socket to be writable.
+ *		   On error, return -1, the subscriber missed the message
+ */
+ssize_t fanout_send(int fd, struct outq *q, struct outq_buf *frame, uint64_t high)
+{
+	ssize_t ret;
+
+	if (q->bytes >= high) {
+		return -1;
+	}
+
+	ret = 0;
+	if (outq_empty(q)) {
+		do {
+			ret = send(fd, frame->data, frame->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		} while ((ret < 0) && (errno == EINTR));
+		if (ret < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				shutdown(fd, SHUT_RDWR);
+				return -1;
+			}
+			ret = 0;
+		}
+	}
+	if (outq_push_ref(q, frame, ret) < 0) {
+		if (ret > 0) {
+			/* part of the frame is out, the stream is broken */
+			shutdown(fd, SHUT_RDWR);
+		}
+		return -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Like fanout_send() for sockets that keep message boundaries: only the
+ * payload goes out, as one message, and a queued frame is sent the same
+ * way by mode_flush_msgs()
+ *
+ * @param[in] fd	connected seqpacket socket
+ * @param[in] q		its output queue
+ * @param[in] frame	shared frame
+ * @param[in] high	queued bytes at which the subscriber misses messages
+ *
+ * @return On success, return the number of bytes written directly, 0
+ *		   when the message was queued.
+ *		   On error, return -1, the subscriber missed the message
+ */
+ssize_t fanout_send_msg(int fd, struct outq *q, struct outq_buf *frame, uint64_t high)
+{
+	ssize_t ret;
+
+	if (q->bytes >= high) {
+		return -1;
+	}
+
+	if (outq_empty(q)) {
+		do {
+			ret = send(fd, &frame->data[FRAME_HDR_LEN], frame->len - FRAME_HDR_LEN,
+					   MSG_NOSIGNAL | MSG_DONTWAIT);
+		} while ((ret < 0) && (errno == EINTR));
+		if (ret >= 0) {
+			return ret;
+		}
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+			shutdown(fd, SHUT_RDWR);
+			return -1;
+		}
+	}
+
+	return (outq_push_ref(q, frame, 0) < 0) ? -1 : 0;
+}
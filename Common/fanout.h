@@ -0,0 +1,70 @@
+#ifndef __FANOUT_H__
+#define __FANOUT_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pool.h"
+#include "outq.h"
+
+/*
+ * Topic based fan-out.
+ *
+ * Connections subscribe to named topics. A published message is encoded
+ * once into a reference counted frame (see outq.h) that is handed to every
+ * subscriber's deliver callback, which writes it out directly or queues
+ * a reference to it, always behind the connection's queued output (see
+ * fanout_send()); nothing is copied per recipient. The callback must not
+ * unsubscribe anyone, a failing connection is only marked for closing.
+ */
+#define FANOUT_TOPIC_LEN			32
+#define FANOUT_SUB_CMD				"sub "
+#define FANOUT_UNSUB_CMD			"unsub "
+
+struct fanout_topic {
+	char name[FANOUT_TOPIC_LEN];
+	void **subs;			/* subscriber handles, unordered */
+	uint32_t count;
+	uint32_t size;
+};
+
+struct fanout_stats {
+	uint64_t published;		/* messages encoded */
+	uint64_t delivered;		/* references handed to subscribers */
+	uint64_t dropped;		/* subscribers the deliver callback refused */
+};
+
+struct fanout {
+	struct fanout_topic *topics;
+	uint32_t count;
+	uint32_t size;
+	struct buff_pool *pool;	/* frames are drawn from it */
+	struct fanout_stats stats;
+};
+
+/**
+ * Hand a published frame to one subscriber
+ *
+ * @param[in] arg	user pointer passed to fanout_publish()
+ * @param[in] sub	subscriber handle
+ * @param[in] frame	encoded frame, take a reference to keep it
+ *
+ * @return 0 on success, negative number if the subscriber missed it
+ */
+typedef int (*fanout_deliver_t)(void *arg, void *sub, struct outq_buf *frame);
+
+void fanout_init(struct fanout *fo, struct buff_pool *pool);
+void fanout_exit(struct fanout *fo);
+int fanout_subscribe(struct fanout *fo, const char *name, void *sub);
+int fanout_unsubscribe(struct fanout *fo, const char *name, void *sub);
+void fanout_unsubscribe_all(struct fanout *fo, void *sub);
+int fanout_command(struct fanout *fo, const uint8_t *data, uint32_t len, void *sub);
+struct outq_buf *fanout_encode(struct fanout *fo, const void *payload, uint32_t len);
+int fanout_deliver(struct fanout *fo, void *sub, struct outq_buf *frame,
+				   fanout_deliver_t deliver, void *arg);
+int fanout_publish(struct fanout *fo, const char *name, const void *payload, uint32_t len,
+				   fanout_deliver_t deliver, void *arg);
+ssize_t fanout_send(int fd, struct outq *q, struct outq_buf *frame, uint64_t high);
+ssize_t fanout_send_msg(int fd, struct outq *q, struct outq_buf *frame, uint64_t high);
+
+#endif	/* #ifndef __FANOUT_H__ */
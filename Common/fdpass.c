@@ -0,0 +1,160 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "fdpass.h"
+
+#define FDPASS_RECV_FDS				8		/* descriptors taken per recvmsg() */
+
+/**
+ * Initialize an empty descriptor queue
+ *
+ * @param[in] q	queue
+ */
+void fdpass_queue_init(struct fdpass_queue *q)
+{
+	memset(q, 0x00, sizeof(struct fdpass_queue));
+}
+
+/**
+ * Close the descriptors nobody took
+ *
+ * @param[in] q	queue
+ */
+void fdpass_queue_exit(struct fdpass_queue *q)
+{
+	int fd;
+
+	while ((fd = fdpass_pop(q)) >= 0) {
+		close(fd);
+	}
+}
+
+/**
+ * Take the oldest received descriptor
+ *
+ * @param[in] q	queue
+ *
+ * @return the descriptor, -1 if none is queued
+ */
+int fdpass_pop(struct fdpass_queue *q)
+{
+	int fd;
+
+	if (q->count == 0) {
+		return -1;
+	}
+	fd = q->fds[q->head];
+	q->head = (q->head + 1) % FDPASS_QUEUE_LEN;
+	q->count--;
+
+	return fd;
+}
+
+/**
+ * Send bytes with a descriptor attached to the first of them
+ *
+ * The descriptor goes along only if at least one byte is sent; the
+ * caller still owns it and closes its copy once it is handed over.
+ *
+ * @param[in] sock	Unix stream socket
+ * @param[in] data	bytes, usually a whole "conn" frame
+ * @param[in] len	number of bytes, not 0
+ * @param[in] fd	descriptor to pass
+ *
+ * @return On success, return the number of bytes sent.
+ *		   On error, return -1 with errno set, nothing was passed
+ */
+ssize_t fdpass_send(int sock, const void *data, uint32_t len, int fd)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t ret;
+
+	iov.iov_base = (void *)data;
+	iov.iov_len = len;
+	memset(&msg, 0x00, sizeof(struct msghdr));
+	memset(&ctl, 0x00, sizeof(ctl));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	do {
+		ret = sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	} while ((ret < 0) && (errno == EINTR));
+
+	return ret;
+}
+
+/**
+ * Read bytes and queue the descriptors that came with them
+ *
+ * Descriptors that do not fit the queue are closed.
+ *
+ * @param[in] sock	Unix stream socket
+ * @param[in] buf	where the bytes go
+ * @param[in] len	room at buf
+ * @param[in] q		descriptor queue
+ *
+ * @return On success, return the number of bytes read, 0 at end of stream.
+ *		   On error, return -1 with errno set
+ */
+ssize_t fdpass_recv(int sock, void *buf, uint32_t len, struct fdpass_queue *q)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int) * FDPASS_RECV_FDS)];
+	} ctl;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t ret;
+	int i, n, fd;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	memset(&msg, 0x00, sizeof(struct msghdr));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	do {
+		ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+	} while ((ret < 0) && (errno == EINTR));
+	if (ret < 0) {
+		return -1;
+	}
+
+	for (cmsg=CMSG_FIRSTHDR(&msg); cmsg; cmsg=CMSG_NXTHDR(&msg, cmsg)) {
+		if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)) {
+			continue;
+		}
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i=0; i<n; i++) {
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if (q->count == FDPASS_QUEUE_LEN) {
+				close(fd);
+				continue;
+			}
+			q->fds[(q->head + q->count) % FDPASS_QUEUE_LEN] = fd;
+			q->count++;
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,34 @@
+#ifndef __FDPASS_H__
+#define __FDPASS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Handing connected sockets to another process over a Unix stream socket
+ * (SCM_RIGHTS), for an acceptor/worker split without a proxy hop.
+ *
+ * A worker connects to the acceptor and sends the text frame "worker".
+ * For every connection it takes over it then gets a "conn <peer>" frame
+ * with the descriptor attached to its first byte, so the descriptor is
+ * always received before the frame announcing it is complete. A recvmsg()
+ * never returns the descriptors of two sends, the receiver queues them in
+ * arrival order and takes one per "conn" frame.
+ */
+#define FDPASS_WORKER_CMD			"worker"
+#define FDPASS_CONN_CMD				"conn "
+#define FDPASS_QUEUE_LEN			64		/* received, not announced yet */
+
+struct fdpass_queue {
+	int fds[FDPASS_QUEUE_LEN];
+	uint32_t head;
+	uint32_t count;
+};
+
+void fdpass_queue_init(struct fdpass_queue *q);
+void fdpass_queue_exit(struct fdpass_queue *q);
+int fdpass_pop(struct fdpass_queue *q);
+ssize_t fdpass_send(int sock, const void *data, uint32_t len, int fd);
+ssize_t fdpass_recv(int sock, void *buf, uint32_t len, struct fdpass_queue *q);
+
+#endif	/* #ifndef __FDPASS_H__ */
@@ -0,0 +1,472 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "frame.h"
+
+/**
+ * Swap the decoder buffer for one of 'size' bytes, keeping the pending
+ * bytes (which must already start at offset 0)
+ *
+ * @param[in] dec	decoder
+ * @param[in] size	new buffer size
+ *
+ * @return On success, return 0.
+ *		   On error, return -1 and leave the old buffer in place
+ */
+static int frame_decoder_resize(struct frame_decoder *dec, uint32_t size)
+{
+	uint32_t real_size;
+	uint8_t *nbuf;
+
+	if (!dec->pool) {
+		nbuf = (uint8_t *)realloc(dec->buf, size);
+		if (!nbuf) {
+			return -1;
+		}
+		dec->buf = nbuf;
+		dec->size = size;
+		return 0;
+	}
+
+	nbuf = (uint8_t *)buff_pool_get(dec->pool, size, &real_size);
+	if (!nbuf) {
+		return -1;
+	}
+	if (dec->buf) {
+		memcpy(nbuf, dec->buf, dec->tail);
+		buff_pool_put(dec->pool, dec->buf, dec->size);
+	}
+	dec->buf = nbuf;
+	dec->size = real_size;
+
+	return 0;
+}
+
+/**
+ * Initialize a frame decoder
+ *
+ * The buffer starts at 'size' bytes so that one read() can pick up many
+ * small frames, and only grows while a frame larger than that is pending.
+ *
+ * @param[in] dec		decoder
+ * @param[in] size		initial buffer size
+ * @param[in] max_len	largest payload the peer is allowed to send
+ * @param[in] pool		buffer pool to draw from, NULL to use malloc()
+ *
+ * @return On success, return 0.
+ *		   On error, return -1
+ */
+int frame_decoder_init(struct frame_decoder *dec, uint32_t size, uint32_t max_len,
+					   struct buff_pool *pool)
+{
+	memset(dec, 0x00, sizeof(struct frame_decoder));
+
+	if (size < FRAME_HDR_LEN) {
+		size = FRAME_HDR_LEN;
+	}
+	dec->pool = pool;
+	if (frame_decoder_resize(dec, size) < 0) {
+		return -1;
+	}
+	dec->init_size = dec->size;
+	dec->max_len = max_len;
+
+	return 0;
+}
+
+/**
+ * Release the decoder buffer
+ *
+ * @param[in] dec	decoder
+ */
+void frame_decoder_exit(struct frame_decoder *dec)
+{
+	if (dec->buf) {
+		if (dec->pool) {
+			buff_pool_put(dec->pool, dec->buf, dec->size);
+		} else {
+			free(dec->buf);
+		}
+		dec->buf = NULL;
+	}
+	dec->size = dec->head = dec->tail = 0;
+}
+
+/**
+ * Take the control frames out of the application stream
+ *
+ * @param[in] dec	decoder
+ * @param[in] ctrl	called with the same user pointer as the frame
+ *					handler, NULL to drop them
+ */
+void frame_decoder_ctrl(struct frame_decoder *dec, frame_handler_t ctrl)
+{
+	dec->ctrl = ctrl;
+}
+
+/**
+ * Hand a complete frame to the handler its header asks for
+ *
+ * @param[in] dec		decoder
+ * @param[in] hdr		length header, host byte order
+ * @param[in] data		frame payload
+ * @param[in] handler	application frame callback
+ * @param[in] arg		callback user pointer
+ *
+ * @return the handler's result, 0 for a dropped control frame
+ */
+static int frame_deliver(struct frame_decoder *dec, uint32_t hdr, uint8_t *data,
+						 frame_handler_t handler, void *arg)
+{
+	if (!(hdr & FRAME_CTRL)) {
+		return handler(arg, data, hdr);
+	} else if (!dec->ctrl) {
+		return 0;
+	}
+
+	return dec->ctrl(arg, data, hdr & ~FRAME_CTRL);
+}
+
+/**
+ * Get the free region the next read() should land in
+ *
+ * @param[in]  dec		decoder
+ * @param[out] space	free bytes at the returned pointer
+ *
+ * @return On success, pointer to the free region.
+ *		   On error (out of memory), NULL
+ */
+uint8_t *frame_decoder_space(struct frame_decoder *dec, uint32_t *space)
+{
+	uint32_t need;
+	uint32_t plen;
+
+	/* bytes the pending frame needs, a header is always decodable */
+	need = FRAME_HDR_LEN;
+	if ((dec->tail - dec->head) >= FRAME_HDR_LEN) {
+		memcpy(&plen, &dec->buf[dec->head], FRAME_HDR_LEN);
+		plen = ntohl(plen) & ~FRAME_CTRL;
+		if (plen <= dec->max_len) {	/* otherwise commit reports the error */
+			need += plen;
+		}
+	}
+
+	if ((dec->head > 0) && ((dec->tail == dec->size) || (need > (dec->size - dec->head)))) {
+		/* only a partial frame is left, move it to the front */
+		memmove(dec->buf, &dec->buf[dec->head], dec->tail - dec->head);
+		dec->tail -= dec->head;
+		dec->head = 0;
+	}
+
+	if ((need > dec->size) && (frame_decoder_resize(dec, need) < 0)) {
+		return NULL;
+	}
+
+	*space = dec->size - dec->tail;
+	return &dec->buf[dec->tail];
+}
+
+/**
+ * Account for 'len' bytes written into the free region and hand every
+ * complete frame to 'handler'
+ *
+ * @param[in] dec		decoder
+ * @param[in] len		bytes written after frame_decoder_space()
+ * @param[in] handler	frame callback
+ * @param[in] arg		callback user pointer
+ *
+ * @return On success, return the number of frames decoded.
+ *		   On error, return -1 (oversized frame) or the handler's error
+ */
+int frame_decoder_commit(struct frame_decoder *dec, uint32_t len,
+						 frame_handler_t handler, void *arg)
+{
+	uint32_t hdr, plen;
+	int count;
+	int ret;
+
+	dec->tail += len;
+	count = 0;
+	while ((dec->tail - dec->head) >= FRAME_HDR_LEN) {
+		memcpy(&hdr, &dec->buf[dec->head], FRAME_HDR_LEN);
+		hdr = ntohl(hdr);
+		plen = hdr & ~FRAME_CTRL;
+		if (plen > dec->max_len) {
+			return -1;
+		}
+		if ((dec->tail - dec->head) < (FRAME_HDR_LEN + plen)) {
+			break;
+		}
+
+		ret = frame_deliver(dec, hdr, &dec->buf[dec->head + FRAME_HDR_LEN], handler, arg);
+		dec->head += FRAME_HDR_LEN + plen;
+		count++;
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	if (dec->head == dec->tail) {
+		dec->head = dec->tail = 0;
+		if (dec->size > dec->init_size) {
+			/* give back the memory of an oversized frame */
+			frame_decoder_resize(dec, dec->init_size);
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Decode 'len' bytes that were received outside of the decoder, e.g. in a
+ * buffer handed out by the kernel
+ *
+ * While nothing is pending, complete frames are handed to 'handler'
+ * straight from 'data'; only partial frames are copied into the decoder.
+ *
+ * @param[in] dec		decoder
+ * @param[in] data		received bytes
+ * @param[in] len		number of received bytes
+ * @param[in] handler	frame callback
+ * @param[in] arg		callback user pointer
+ *
+ * @return On success, return the number of frames decoded.
+ *		   On error, return -1 (oversized frame, out of memory) or the
+ *		   handler's error
+ */
+int frame_decoder_feed(struct frame_decoder *dec, uint8_t *data, uint32_t len,
+					   frame_handler_t handler, void *arg)
+{
+	uint8_t *ptr;
+	uint32_t space;
+	uint32_t hdr, plen;
+	int count;
+	int ret;
+
+	count = 0;
+	while (len > 0) {
+		if ((dec->head == dec->tail) && (len >= FRAME_HDR_LEN)) {
+			memcpy(&hdr, data, FRAME_HDR_LEN);
+			hdr = ntohl(hdr);
+			plen = hdr & ~FRAME_CTRL;
+			if (plen > dec->max_len) {
+				return -1;
+			}
+			if (len >= (FRAME_HDR_LEN + plen)) {
+				ret = frame_deliver(dec, hdr, data + FRAME_HDR_LEN, handler, arg);
+				data += FRAME_HDR_LEN + plen;
+				len -= FRAME_HDR_LEN + plen;
+				count++;
+				if (ret < 0) {
+					return ret;
+				}
+				continue;
+			}
+		}
+
+		ptr = frame_decoder_space(dec, &space);
+		if (!ptr) {
+			return -1;
+		}
+		if (space > len) {
+			space = len;
+		}
+		memcpy(ptr, data, space);
+		data += space;
+		len -= space;
+
+		ret = frame_decoder_commit(dec, space, handler, arg);
+		if (ret < 0) {
+			return ret;
+		}
+		count += ret;
+	}
+
+	return count;
+}
+
+/**
+ * Read once from 'fd' and hand every complete frame to 'handler'
+ *
+ * The read is scattered over the decoder's free region and a spill buffer
+ * on the stack, so whatever does not fit (the body of a frame larger than
+ * the decoder, or the frames queued behind it) still arrives in the same
+ * readv() and is decoded in place by frame_decoder_feed().
+ *
+ * @param[in] dec		decoder
+ * @param[in] fd		socket to read from
+ * @param[in] handler	frame callback
+ * @param[in] arg		callback user pointer
+ *
+ * @return On success, return the number of bytes read, 0 at end of file.
+ *		   On error, return -1 with errno set, EBADMSG when the data could
+ *		   not be decoded (oversized frame, out of memory, handler error)
+ */
+ssize_t frame_decoder_readv(struct frame_decoder *dec, int fd,
+							frame_handler_t handler, void *arg)
+{
+	uint8_t spill[FRAME_SPILL_LEN];
+	struct iovec iov[2];
+	uint32_t space;
+	ssize_t ret;
+
+	iov[0].iov_base = frame_decoder_space(dec, &space);
+	if (!iov[0].iov_base) {
+		errno = EBADMSG;
+		return -1;
+	}
+	iov[0].iov_len = space;
+	iov[1].iov_base = spill;
+	iov[1].iov_len = sizeof(spill);
+
+	ret = readv(fd, iov, 2);
+	if (ret <= 0) {
+		return ret;
+	}
+
+	if ((ret <= space) && (frame_decoder_commit(dec, ret, handler, arg) < 0)) {
+		errno = EBADMSG;
+		return -1;
+	}
+	if ((ret > space) && ((frame_decoder_commit(dec, space, handler, arg) < 0) ||
+		(frame_decoder_feed(dec, spill, ret - space, handler, arg) < 0))) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Fill in the length header of a frame whose payload is already in place
+ *
+ * @param[in] frame			frame start, payload follows the header
+ * @param[in] payload_len	payload length
+ *
+ * @return the number of bytes to put on the wire
+ */
+uint32_t frame_encode(void *frame, uint32_t payload_len)
+{
+	uint32_t hdr;
+
+	hdr = htonl(payload_len);
+	memcpy(frame, &hdr, FRAME_HDR_LEN);
+
+	return FRAME_HDR_LEN + payload_len;
+}
+
+/**
+ * Fill in the length header of a control frame whose payload is already
+ * in place
+ *
+ * @param[in] frame			frame start, payload follows the header
+ * @param[in] payload_len	payload length
+ *
+ * @return the number of bytes to put on the wire
+ */
+uint32_t frame_encode_ctrl(void *frame, uint32_t payload_len)
+{
+	uint32_t hdr;
+
+	hdr = htonl(FRAME_CTRL | payload_len);
+	memcpy(frame, &hdr, FRAME_HDR_LEN);
+
+	return FRAME_HDR_LEN + payload_len;
+}
+
+/**
+ * Send a frame whose payload lives in its own buffer, or the rest of one
+ * that went out in part
+ *
+ * The header and the payload are gathered by one writev() instead of being
+ * copied together first. Short writes are resumed; once a non-blocking
+ * socket is full the bytes sent so far are returned, the caller owes the
+ * peer the rest of the frame before anything else (see outq_push_frame()).
+ *
+ * @param[in] fd		socket to write to
+ * @param[in] payload	frame payload
+ * @param[in] len		payload length
+ * @param[in] sent		leading frame bytes already on the wire
+ *
+ * @return On success, return the number of frame bytes on the wire, short
+ *		   of FRAME_HDR_LEN + len when the socket filled up.
+ *		   On error, return -1 with errno set
+ */
+ssize_t frame_writev(int fd, const void *payload, uint32_t len, uint32_t sent)
+{
+	struct iovec iov[2];
+	uint32_t hdr;
+	ssize_t total;
+	ssize_t ret;
+	int i;
+
+	hdr = htonl(len);
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = FRAME_HDR_LEN;
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = len;
+
+	i = 0;
+	total = sent;
+	ret = sent;
+	while (1) {
+		/* skip what went out */
+		while ((i < 2) && ((size_t)ret >= iov[i].iov_len)) {
+			ret -= iov[i].iov_len;
+			i++;
+		}
+		if (i == 2) {
+			break;
+		}
+		iov[i].iov_base = (uint8_t *)iov[i].iov_base + ret;
+		iov[i].iov_len -= ret;
+
+		ret = writev(fd, &iov[i], 2 - i);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
+			} else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				break;
+			}
+			return -1;
+		}
+		total += ret;
+	}
+
+	return total;
+}
+
+/**
+ * Send a whole frame, waiting for room whenever the socket is full
+ *
+ * For the interactive clients, which have nothing else to do meanwhile.
+ *
+ * @param[in] fd		socket to write to
+ * @param[in] payload	frame payload
+ * @param[in] len		payload length
+ *
+ * @return On success, return FRAME_HDR_LEN + len.
+ *		   On error, return -1 with errno set
+ */
+ssize_t frame_write_all(int fd, const void *payload, uint32_t len)
+{
+	struct pollfd pfd;
+	ssize_t ret;
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	ret = frame_writev(fd, payload, len, 0);
+	while ((ret >= 0) && ((size_t)ret < FRAME_HDR_LEN + len)) {
+		if ((poll(&pfd, 1, -1) < 0) && (errno != EINTR)) {
+			return -1;
+		}
+		ret = frame_writev(fd, payload, len, ret);
+	}
+
+	return ret;
+}
@@ -0,0 +1,59 @@
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pool.h"
+
+/*
+ * Wire format: every message is a 'struct common_buff', i.e. a 4 bytes
+ * payload length in network byte order followed by the payload itself.
+ * The top bit of the length marks a control frame (e.g. a heartbeat), so
+ * no application payload can be taken for one.
+ */
+#define FRAME_HDR_LEN				sizeof(uint32_t)
+#define FRAME_CTRL					0x80000000U	/* length flag of a control frame */
+#define FRAME_SPILL_LEN				(64*1024)	/* frame_decoder_readv() overflow */
+
+/**
+ * Called once for every complete frame found by the decoder
+ *
+ * @param[in] arg	user pointer passed to frame_decoder_commit()
+ * @param[in] data	frame payload, only valid during the call
+ * @param[in] len	frame payload length
+ *
+ * @return 0 to continue decoding, negative number to stop
+ */
+typedef int (*frame_handler_t)(void *arg, uint8_t *data, uint32_t len);
+
+struct frame_decoder {
+	uint8_t *buf;
+	uint32_t size;			/* buf capacity */
+	uint32_t init_size;		/* capacity to shrink back to once drained */
+	uint32_t head;			/* first byte not yet decoded */
+	uint32_t tail;			/* first free byte */
+	uint32_t max_len;		/* largest payload accepted */
+	struct buff_pool *pool;	/* NULL: plain malloc() */
+	frame_handler_t ctrl;	/* control frames, NULL: dropped */
+};
+
+int frame_decoder_init(struct frame_decoder *dec, uint32_t size, uint32_t max_len,
+					   struct buff_pool *pool);
+void frame_decoder_exit(struct frame_decoder *dec);
+void frame_decoder_ctrl(struct frame_decoder *dec, frame_handler_t ctrl);
+uint8_t *frame_decoder_space(struct frame_decoder *dec, uint32_t *space);
+int frame_decoder_commit(struct frame_decoder *dec, uint32_t len,
+						 frame_handler_t handler, void *arg);
+int frame_decoder_feed(struct frame_decoder *dec, uint8_t *data, uint32_t len,
+					   frame_handler_t handler, void *arg);
+
+ssize_t frame_decoder_readv(struct frame_decoder *dec, int fd,
+							frame_handler_t handler, void *arg);
+
+uint32_t frame_encode(void *frame, uint32_t payload_len);
+uint32_t frame_encode_ctrl(void *frame, uint32_t payload_len);
+ssize_t frame_writev(int fd, const void *payload, uint32_t len, uint32_t sent);
+ssize_t frame_write_all(int fd, const void *payload, uint32_t len);
+
+#endif	/* #ifndef __FRAME_H__ */
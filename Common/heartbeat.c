@@ -0,0 +1,139 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "frame.h"
+#include "heartbeat.h"
+
+#define HB_MSG_LEN					4
+
+/**
+ * Tell which heartbeat a control frame is
+ *
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return HB_FRAME_PING, HB_FRAME_PONG or HB_FRAME_NONE for another
+ *		   control frame
+ */
+int hb_frame_type(const uint8_t *data, uint32_t len)
+{
+	if (len != HB_MSG_LEN) {
+		return HB_FRAME_NONE;
+	}
+	if (memcmp(data, HB_PING_MSG, HB_MSG_LEN) == 0) {
+		return HB_FRAME_PING;
+	} else if (memcmp(data, HB_PONG_MSG, HB_MSG_LEN) == 0) {
+		return HB_FRAME_PONG;
+	}
+
+	return HB_FRAME_NONE;
+}
+
+/**
+ * Decide what a heartbeat timer does with a peer
+ *
+ * Pings repeat every interval while the peer stays silent.
+ *
+ * @param[in]  hb		heartbeat settings, interval not 0
+ * @param[in]  now		current tick (ms)
+ * @param[in]  heard	tick the peer was last heard from
+ * @param[out] next		tick to check again, unset for HB_DEAD
+ *
+ * @return HB_ALIVE, HB_PING or HB_DEAD
+ */
+int hb_check(const struct hb_config *hb, uint64_t now, uint64_t heard, uint64_t *next)
+{
+	uint64_t interval = hb->interval * 1000ULL;
+	uint64_t silent = (now > heard) ? (now - heard) : 0;
+
+	if (silent >= interval * hb->misses) {
+		return HB_DEAD;
+	} else if (silent < interval) {
+		*next = heard + interval;
+		return HB_ALIVE;
+	}
+
+	*next = now + interval;
+	if (*next > heard + interval * hb->misses) {
+		*next = heard + interval * hb->misses;
+	}
+
+	return HB_PING;
+}
+
+/**
+ * Send a ping or a pong
+ *
+ * It goes out right away when nothing is queued, only the part the
+ * socket did not take is queued. Behind queued output it waits its turn.
+ *
+ * @param[in] fd	socket
+ * @param[in] type	HB_FRAME_PING or HB_FRAME_PONG
+ * @param[in] q		connection output queue
+ *
+ * @return 1 once sent, 0 if (part of) it was queued, -1 on error
+ */
+int hb_send(int fd, int type, struct outq *q)
+{
+	uint8_t frame[FRAME_HDR_LEN + HB_MSG_LEN];
+	ssize_t ret;
+	uint32_t len;
+
+	memcpy(&frame[FRAME_HDR_LEN], (type == HB_FRAME_PING) ? HB_PING_MSG : HB_PONG_MSG, HB_MSG_LEN);
+	len = frame_encode_ctrl(frame, HB_MSG_LEN);
+
+	ret = 0;
+	if (outq_empty(q)) {
+		do {
+			ret = send(fd, frame, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		} while ((ret < 0) && (errno == EINTR));
+		if (ret < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				return -1;
+			}
+			ret = 0;
+		} else if (ret == len) {
+			return 1;
+		}
+	}
+
+	return (outq_push_bytes(q, &frame[ret], len - ret) < 0) ? -1 : 0;
+}
+
+/**
+ * Apply the TCP keepalive and user timeout settings to a connection
+ *
+ * @param[in] fd	TCP socket
+ * @param[in] hb	heartbeat settings
+ *
+ * @return On success, return 0.
+ *		   On error, return -1 with errno set
+ */
+int hb_tcp_tune(int fd, const struct hb_config *hb)
+{
+	int on = 1;
+	int idle, probes;
+	unsigned int timeout;
+
+	if (hb->keepalive) {
+		idle = hb->keepalive;
+		probes = HB_KEEPALIVE_PROBES;
+		if ((setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(int)) < 0) ||
+			(setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(int)) < 0) ||
+			(setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(int)) < 0) ||
+			(setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(int)) < 0)) {
+			return -1;
+		}
+	}
+	if (hb->user_timeout) {
+		timeout = hb->user_timeout;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(unsigned int)) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
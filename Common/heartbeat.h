@@ -0,0 +1,55 @@
+#ifndef __HEARTBEAT_H__
+#define __HEARTBEAT_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "outq.h"
+
+/*
+ * Dead peer detection for long-lived connections.
+ *
+ * Each side keeps the tick it last heard from its peer: any complete
+ * frame, or output the peer acknowledged by reading it. After one
+ * interval of silence it sends a "ping" frame, which the peer answers
+ * with "pong"; after 'misses' intervals the peer is taken for dead and
+ * the connection is shut down. Both are control frames (FRAME_CTRL in the
+ * length header) with exact 4 byte payloads, taken out of the stream by
+ * the decoder's control handler, so an application frame saying "ping" is
+ * just data. They bypass the output queue whenever it is empty, so they
+ * do not count as activity for the idle timeout.
+ *
+ * The kernel side can be tuned as well: TCP keepalive probes the link of
+ * a connection with nothing in flight, TCP_USER_TIMEOUT bounds how long
+ * sent data may stay unacknowledged.
+ */
+#define HB_PING_MSG					"ping"
+#define HB_PONG_MSG					"pong"
+#define HB_MISSES					3		/* silent intervals, default */
+#define HB_KEEPALIVE_PROBES			3		/* unanswered probes before the reset */
+
+enum hb_frame {
+	HB_FRAME_NONE,		/* not a heartbeat */
+	HB_FRAME_PING,
+	HB_FRAME_PONG,
+};
+
+enum hb_action {
+	HB_ALIVE,			/* heard from recently */
+	HB_PING,			/* silent for an interval, ping it */
+	HB_DEAD,			/* silent for 'misses' intervals */
+};
+
+struct hb_config {
+	uint32_t interval;		/* seconds of silence before a ping, 0 off */
+	uint32_t misses;		/* silent intervals before the peer is dead */
+	uint32_t keepalive;		/* TCP keepalive idle and probe seconds, 0 off */
+	uint32_t user_timeout;	/* TCP_USER_TIMEOUT ms, 0 kernel default */
+};
+
+int hb_frame_type(const uint8_t *data, uint32_t len);
+int hb_check(const struct hb_config *hb, uint64_t now, uint64_t heard, uint64_t *next);
+int hb_send(int fd, int type, struct outq *q);
+int hb_tcp_tune(int fd, const struct hb_config *hb);
+
+#endif	/* #ifndef __HEARTBEAT_H__ */
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "log.h"
+
+#define LOG_REC_HDR					sizeof(uint16_t)	/* line length */
+
+/*
+ * Single producer (the owning thread), single consumer (the log thread)
+ * byte ring. 'head' and 'tail' count bytes and only ever grow, a record is
+ * a 16 bits length followed by the line and may wrap around the end.
+ */
+struct log_ring {
+	struct log_ring *next;		/* every ring, newest first */
+	uint32_t head;				/* written by the owner */
+	uint32_t tail;				/* written by the log thread */
+	uint64_t dropped;
+	uint8_t data[LOG_RING_SIZE];
+};
+
+static struct log_ring *log_rings;
+static __thread struct log_ring *log_self;
+static pthread_t log_tid;
+static int log_running;
+static int log_stopping;
+
+/**
+ * Copy into the ring at byte position 'pos', wrapping around its end
+ *
+ * @param[in] r		ring
+ * @param[in] pos	byte position
+ * @param[in] src	bytes
+ * @param[in] len	number of bytes
+ */
+static void log_ring_put(struct log_ring *r, uint32_t pos, const void *src, uint32_t len)
+{
+	uint32_t off = pos & (LOG_RING_SIZE - 1);
+	uint32_t first = (len < LOG_RING_SIZE - off) ? len : (LOG_RING_SIZE - off);
+
+	memcpy(&r->data[off], src, first);
+	memcpy(r->data, (const uint8_t *)src + first, len - first);
+}
+
+/**
+ * Copy out of the ring from byte position 'pos', wrapping around its end
+ *
+ * @param[in]  r	ring
+ * @param[in]  pos	byte position
+ * @param[out] dst	bytes
+ * @param[in]  len	number of bytes
+ */
+static void log_ring_get(struct log_ring *r, uint32_t pos, void *dst, uint32_t len)
+{
+	uint32_t off = pos & (LOG_RING_SIZE - 1);
+	uint32_t first = (len < LOG_RING_SIZE - off) ? len : (LOG_RING_SIZE - off);
+
+	memcpy(dst, &r->data[off], first);
+	memcpy((uint8_t *)dst + first, r->data, len - first);
+}
+
+/**
+ * Get the calling thread's ring, creating it on first use
+ *
+ * @return On success, return the ring.
+ *		   On error, NULL
+ */
+static struct log_ring *log_ring_self(void)
+{
+	struct log_ring *r;
+
+	if (log_self) {
+		return log_self;
+	}
+
+	r = (struct log_ring *)calloc(1, sizeof(struct log_ring));
+	if (!r) {
+		return NULL;
+	}
+	r->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&log_rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		;	/* r->next was reloaded */
+	}
+	log_self = r;
+
+	return r;
+}
+
+/**
+ * Write every queued line to stdout
+ *
+ * @return the number of bytes written
+ */
+static uint32_t log_drain(void)
+{
+	char line[LOG_LINE_MAX];
+	struct log_ring *r;
+	uint32_t head, tail, total;
+	uint16_t len;
+
+	total = 0;
+	for (r=__atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r; r=r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (tail=r->tail; tail!=head; tail+=LOG_REC_HDR+len) {
+			log_ring_get(r, tail, &len, LOG_REC_HDR);
+			log_ring_get(r, tail + LOG_REC_HDR, line, len);
+			fwrite(line, 1, len, stdout);
+			total += len;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+	if (total > 0) {
+		fflush(stdout);
+	}
+
+	return total;
+}
+
+/**
+ * Log thread: drain the rings, sleep longer and longer while they are empty
+ *
+ * @param[in] arg	unused
+ *
+ * @return NULL
+ */
+static void *log_run(void *arg)
+{
+	uint32_t idle_us = LOG_IDLE_US;
+
+	while (!__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE)) {
+		if (log_drain() > 0) {
+			idle_us = LOG_IDLE_US;
+			continue;
+		}
+		usleep(idle_us);
+		if (idle_us < LOG_IDLE_MAX_US) {
+			idle_us *= 2;	/* back off while nothing is logged */
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Stop the log thread and write out what is left, run at exit
+ */
+static void log_exit(void)
+{
+	struct log_ring *r;
+	uint64_t dropped;
+
+	if (!log_running) {
+		return;
+	}
+	__atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(log_tid, NULL);
+	log_drain();
+	log_running = 0;
+
+	dropped = 0;
+	while (log_rings) {
+		r = log_rings;
+		log_rings = r->next;
+		dropped += r->dropped;
+		free(r);
+	}
+	if (dropped > 0) {
+		printf("log: %llu lines dropped\n", (unsigned long long)dropped);
+	}
+}
+
+/**
+ * Start the log thread, the rest of the lines go through the rings and
+ * the last ones are written out at exit
+ *
+ * @return On success, return 0.
+ *		   On error, return -1, lines keep going to stdout directly
+ */
+int log_init(void)
+{
+	sigset_t all, old;
+	int ret;
+
+	if (log_running) {
+		return 0;
+	}
+
+	/* signals are for the threads that asked for them, not this one */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&log_tid, NULL, log_run, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		return -1;
+	}
+	log_running = 1;
+	atexit(log_exit);
+
+	return 0;
+}
+
+/**
+ * Format a line and queue it, use the LOG_*() macros instead
+ *
+ * @param[in] level	LOG_LEVEL_*
+ * @param[in] fmt	printf() format, without the trailing '\n'
+ */
+void log_write(int level, const char *fmt, ...)
+{
+	char line[LOG_LINE_MAX];
+	struct log_ring *r;
+	uint32_t head;
+	uint16_t len;
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+	va_end(ap);
+	if (ret < 0) {
+		return;
+	}
+	len = (ret < sizeof(line) - 1) ? ret : (sizeof(line) - 2);
+	line[len++] = '\n';
+
+	r = log_running ? log_ring_self() : NULL;
+	if (!r) {
+		fwrite(line, 1, len, stdout);
+		return;
+	}
+
+	head = r->head;
+	if (LOG_RING_SIZE - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) < LOG_REC_HDR + len) {
+		if (level <= LOG_LEVEL_WARN) {
+			fwrite(line, 1, len, stdout);
+		} else {
+			__atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+		}
+		return;
+	}
+	log_ring_put(r, head, &len, LOG_REC_HDR);
+	log_ring_put(r, head + LOG_REC_HDR, line, len);
+	__atomic_store_n(&r->head, head + LOG_REC_HDR + len, __ATOMIC_RELEASE);
+}
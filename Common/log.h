@@ -0,0 +1,41 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdint.h>
+
+/*
+ * Leveled logging off the hot path.
+ *
+ * A log line is formatted into a ring owned by the calling thread and
+ * written to stdout later by the log thread, so the caller never makes a
+ * system call. Lines above LOG_LEVEL are compiled out. When a ring is full
+ * informational lines are dropped and counted, errors and warnings are
+ * written directly instead. Before log_init() everything goes to stdout
+ * directly.
+ */
+#define LOG_LEVEL_ERROR				0
+#define LOG_LEVEL_WARN				1
+#define LOG_LEVEL_INFO				2
+#define LOG_LEVEL_DEBUG				3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL					LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SIZE				(256 * 1024)	/* per thread, a power of 2 */
+#define LOG_LINE_MAX				2048			/* longer lines are truncated */
+#define LOG_IDLE_US					1000			/* log thread sleep once idle */
+#define LOG_IDLE_MAX_US				(64 * 1000)		/* and after a long idle time */
+
+#define LOG_AT(_level, _fmt, ...)	\
+	do { if ((_level) <= LOG_LEVEL) log_write(_level, _fmt, ##__VA_ARGS__); } while (0)
+
+#define LOG_ERROR(_fmt, ...)		LOG_AT(LOG_LEVEL_ERROR, _fmt, ##__VA_ARGS__)
+#define LOG_WARN(_fmt, ...)			LOG_AT(LOG_LEVEL_WARN, _fmt, ##__VA_ARGS__)
+#define LOG_INFO(_fmt, ...)			LOG_AT(LOG_LEVEL_INFO, _fmt, ##__VA_ARGS__)
+#define LOG_DEBUG(_fmt, ...)		LOG_AT(LOG_LEVEL_DEBUG, _fmt, ##__VA_ARGS__)
+
+int log_init(void);
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif	/* #ifndef __LOG_H__ */
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+static struct metrics *metrics_sets[METRICS_MAX_SETS];
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static sigset_t metrics_sigset;
+static pthread_t metrics_tid;
+
+/**
+ * Reset a set and make metrics_dump() report it
+ *
+ * @param[in] m		metrics set, owned by the calling thread's event loop
+ * @param[in] name	prefix of its lines, e.g. "epoll_w0"
+ */
+void metrics_init(struct metrics *m, const char *name)
+{
+	int i;
+
+	memset(m, 0x00, sizeof(struct metrics));
+	strncpy(m->name, name, METRICS_NAME_LEN - 1);
+
+	pthread_mutex_lock(&metrics_lock);
+	for (i=0; i<METRICS_MAX_SETS; i++) {
+		if (!metrics_sets[i]) {
+			metrics_sets[i] = m;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+/**
+ * Stop reporting a set, before its memory goes away
+ *
+ * @param[in] m	metrics set
+ */
+void metrics_exit(struct metrics *m)
+{
+	int i;
+
+	pthread_mutex_lock(&metrics_lock);
+	for (i=0; i<METRICS_MAX_SETS; i++) {
+		if (metrics_sets[i] == m) {
+			metrics_sets[i] = NULL;
+		}
+	}
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+/**
+ * Bucket of a value: values below METRICS_HIST_SUB have one each, above
+ * that every power of 2 is split in METRICS_HIST_SUB linear buckets
+ *
+ * @param[in] v	value
+ *
+ * @return the bucket index
+ */
+uint32_t metrics_hist_index(uint64_t v)
+{
+	uint32_t shift;
+
+	if (v < METRICS_HIST_SUB) {
+		return v;
+	}
+	shift = (63 - __builtin_clzll(v)) - METRICS_HIST_SUB_BITS;
+
+	return ((shift + 1) << METRICS_HIST_SUB_BITS) + ((v >> shift) & (METRICS_HIST_SUB - 1));
+}
+
+/**
+ * Highest value that falls in a bucket
+ *
+ * @param[in] idx	bucket index
+ *
+ * @return the value
+ */
+uint64_t metrics_hist_value(uint32_t idx)
+{
+	uint32_t group = idx >> METRICS_HIST_SUB_BITS;
+	uint64_t low;
+
+	if (group == 0) {
+		return idx;
+	}
+	low = (uint64_t)(METRICS_HIST_SUB | (idx & (METRICS_HIST_SUB - 1))) << (group - 1);
+
+	return low + (1ULL << (group - 1)) - 1;
+}
+
+/**
+ * Record a value
+ *
+ * @param[in] h	histogram, owned by the calling thread
+ * @param[in] v	value
+ */
+void metrics_hist_add(struct metrics_hist *h, uint64_t v)
+{
+	metrics_add(&h->buckets[metrics_hist_index(v)], 1);
+	metrics_add(&h->count, 1);
+	metrics_add(&h->sum, v);
+	if (v > h->max) {
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Account for a wait that returned, call it after every
+ * epoll_wait()/poll()/select()
+ *
+ * @param[in] m			metrics set
+ * @param[in] nevents	what the wait returned
+ */
+void metrics_wakeup(struct metrics *m, int nevents)
+{
+	metrics_add(&m->waits, 1);
+	if (nevents > 0) {
+		metrics_add(&m->events, nevents);
+		m->wake_ns = metrics_now();
+	}
+}
+
+/**
+ * Record how long handling the last wakeup took
+ *
+ * @param[in] m	metrics set
+ */
+void metrics_handled(struct metrics *m)
+{
+	if (m->wake_ns) {
+		metrics_hist_add(&m->handle_ns, metrics_now() - m->wake_ns);
+		m->wake_ns = 0;
+	}
+}
+
+/**
+ * Estimate a quantile of a histogram
+ *
+ * @param[in] h	histogram
+ * @param[in] q	quantile, e.g. 0.99
+ *
+ * @return the highest value of the bucket holding it, at most the
+ *		   largest value recorded; 0 if the histogram is empty
+ */
+uint64_t metrics_hist_quantile(struct metrics_hist *h, double q)
+{
+	uint64_t count, seen, rank, max, v;
+	uint32_t i;
+
+	count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	if (count == 0) {
+		return 0;
+	}
+
+	rank = (uint64_t)(q * count);
+	for (i=0,seen=0; i<METRICS_HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		if (seen > rank) {
+			v = metrics_hist_value(i);
+			return (v < max) ? v : max;
+		}
+	}
+
+	return max;
+}
+
+/**
+ * Print a histogram's quantiles
+ *
+ * @param[in] fp	output
+ * @param[in] name	set name
+ * @param[in] hname	histogram name
+ * @param[in] h		histogram
+ */
+static void metrics_hist_dump(FILE *fp, const char *name, const char *hname, struct metrics_hist *h)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint32_t q;
+
+	for (q=0; q<sizeof(quantiles)/sizeof(quantiles[0]); q++) {
+		fprintf(fp, "%s_%s{quantile=\"%g\"} %llu\n", name, hname, quantiles[q],
+				(unsigned long long)metrics_hist_quantile(h, quantiles[q]));
+	}
+	fprintf(fp, "%s_%s_max %llu\n", name, hname, (unsigned long long)__atomic_load_n(&h->max, __ATOMIC_RELAXED));
+	fprintf(fp, "%s_%s_sum %llu\n", name, hname, (unsigned long long)__atomic_load_n(&h->sum, __ATOMIC_RELAXED));
+	fprintf(fp, "%s_%s_count %llu\n", name, hname, (unsigned long long)__atomic_load_n(&h->count, __ATOMIC_RELAXED));
+}
+
+/**
+ * Print every registered set, one "<set>_<metric> <value>" per line
+ *
+ * @param[in] fp	output
+ */
+void metrics_dump(FILE *fp)
+{
+	struct metrics *m;
+	int i;
+
+#define METRICS_DUMP(_field)	\
+	fprintf(fp, "%s_" #_field " %llu\n", m->name, (unsigned long long)__atomic_load_n(&m->_field, __ATOMIC_RELAXED))
+
+	flockfile(fp);
+	pthread_mutex_lock(&metrics_lock);
+	for (i=0; i<METRICS_MAX_SETS; i++) {
+		m = metrics_sets[i];
+		if (!m) {
+			continue;
+		}
+		METRICS_DUMP(accepts);
+		METRICS_DUMP(closes);
+		METRICS_DUMP(idle_closes);
+		METRICS_DUMP(dead_closes);
+		METRICS_DUMP(pings);
+		METRICS_DUMP(handoffs);
+		METRICS_DUMP(bytes_in);
+		METRICS_DUMP(bytes_out);
+		METRICS_DUMP(msgs_in);
+		METRICS_DUMP(msgs_out);
+		METRICS_DUMP(eagain);
+		METRICS_DUMP(send_errors);
+		METRICS_DUMP(waits);
+		METRICS_DUMP(events);
+		metrics_hist_dump(fp, m->name, "handle_ns", &m->handle_ns);
+	}
+	pthread_mutex_unlock(&metrics_lock);
+	fflush(fp);
+	funlockfile(fp);
+
+#undef METRICS_DUMP
+}
+
+/**
+ * Dump thread: print the metrics every time the signal arrives
+ *
+ * @param[in] arg	unused
+ *
+ * @return NULL
+ */
+static void *metrics_run(void *arg)
+{
+	int signo;
+
+	while (sigwait(&metrics_sigset, &signo) == 0) {
+		metrics_dump(stdout);
+	}
+
+	return NULL;
+}
+
+/**
+ * Print the metrics to stdout on 'signo', e.g. "kill -USR1 <pid>"
+ *
+ * The signal is blocked in the calling thread and taken by a thread of
+ * its own, so the event loops never see EINTR. Call it from main() before
+ * any other thread is started, they inherit the blocked signal.
+ *
+ * @param[in] signo	signal number
+ *
+ * @return On success, return 0.
+ *		   On error, return -1
+ */
+int metrics_signal_init(int signo)
+{
+	sigemptyset(&metrics_sigset);
+	sigaddset(&metrics_sigset, signo);
+	if (pthread_sigmask(SIG_BLOCK, &metrics_sigset, NULL) != 0) {
+		return -1;
+	}
+	if (pthread_create(&metrics_tid, NULL, metrics_run, NULL) != 0) {
+		pthread_sigmask(SIG_UNBLOCK, &metrics_sigset, NULL);
+		return -1;
+	}
+	pthread_detach(metrics_tid);
+
+	return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Server counters and latency histograms.
+ *
+ * Every set has a single writer, the event loop that owns it, which bumps
+ * the counters with plain relaxed stores; metrics_dump() reads them from
+ * any thread without stopping the loop. Histograms are log-linear (HDR
+ * style): each power of 2 is split in METRICS_HIST_SUB buckets, so a
+ * reported quantile is within 1/METRICS_HIST_SUB of the real value.
+ */
+#define METRICS_NAME_LEN			32
+#define METRICS_MAX_SETS			64
+#define METRICS_HIST_SUB_BITS		3
+#define METRICS_HIST_SUB			(1 << METRICS_HIST_SUB_BITS)
+#define METRICS_HIST_BUCKETS		(64 * METRICS_HIST_SUB)
+
+struct metrics_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[METRICS_HIST_BUCKETS];
+};
+
+struct metrics {
+	char name[METRICS_NAME_LEN];
+	uint64_t accepts;
+	uint64_t closes;
+	uint64_t idle_closes;	/* connections reaped by the idle timeout */
+	uint64_t dead_closes;	/* peers that missed their heartbeats */
+	uint64_t pings;			/* heartbeats sent to silent peers */
+	uint64_t handoffs;		/* accepted connections passed to a worker */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t msgs_in;
+	uint64_t msgs_out;
+	uint64_t eagain;		/* reads and writes that would have blocked */
+	uint64_t send_errors;	/* messages dropped on a write error */
+	uint64_t waits;			/* epoll_wait()/poll()/select()/io_uring_enter() calls */
+	uint64_t events;		/* ready descriptors or completions they returned */
+	uint64_t wake_ns;		/* when the last wait returned, 0 once handled */
+	struct metrics_hist handle_ns;	/* time to handle what one wait returned */
+};
+
+/**
+ * Add to a counter of a set owned by the calling thread
+ *
+ * @param[in] c	counter
+ * @param[in] n	increment
+ */
+static inline void metrics_add(uint64_t *c, uint64_t n)
+{
+	__atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Monotonic clock in nanoseconds
+ *
+ * @return the current time
+ */
+static inline uint64_t metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_init(struct metrics *m, const char *name);
+void metrics_exit(struct metrics *m);
+uint32_t metrics_hist_index(uint64_t v);
+uint64_t metrics_hist_value(uint32_t idx);
+void metrics_hist_add(struct metrics_hist *h, uint64_t v);
+uint64_t metrics_hist_quantile(struct metrics_hist *h, double q);
+void metrics_wakeup(struct metrics *m, int nevents);
+void metrics_handled(struct metrics *m);
+void metrics_dump(FILE *fp);
+int metrics_signal_init(int signo);
+
+#endif	/* #ifndef __METRICS_H__ */
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE			/* sendmmsg() */
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "frame.h"
+#include "mode.h"
+
+static const char *mode_names[] = { "console", "echo", "sink", "source" };
+
+/**
+ * Look up a mode by name
+ *
+ * @param[in] name	"console", "echo", "sink" or "source"
+ *
+ * @return On success, return the SERVER_MODE_* value.
+ *		   On error (unknown name), return -1
+ */
+int mode_parse(const char *name)
+{
+	int i;
+
+	for (i=0; i<sizeof(mode_names)/sizeof(mode_names[0]); i++) {
+		if (strcmp(name, mode_names[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Get the name of a mode
+ *
+ * @param[in] mode	SERVER_MODE_*
+ *
+ * @return the name
+ */
+const char *mode_name(int mode)
+{
+	if ((mode < 0) || (mode >= sizeof(mode_names)/sizeof(mode_names[0]))) {
+		return "unknown";
+	}
+
+	return mode_names[mode];
+}
+
+/**
+ * Queue a received frame to be sent back
+ *
+ * @param[in] q		connection output queue
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return On success, return 0.
+ *		   On error, return -1
+ */
+int mode_echo(struct outq *q, const uint8_t *data, uint32_t len)
+{
+	struct outq_buf *b;
+
+	b = outq_frame_new(q, len);
+	if (!b) {
+		return -1;
+	}
+	memcpy(&b->data[FRAME_HDR_LEN], data, len);
+	outq_push(q, b);
+
+	return 0;
+}
+
+/**
+ * Build the frame a source server streams, every connection queues
+ * references to it
+ *
+ * @param[in] pool	pool of the queues that will reference it
+ * @param[in] len	payload length
+ *
+ * @return On success, return the frame, give it back with outq_buf_put().
+ *		   On error, NULL
+ */
+struct outq_buf *mode_source_frame(struct buff_pool *pool, uint32_t len)
+{
+	struct outq_buf *frame;
+	uint32_t i;
+
+	frame = outq_buf_new(pool, len);
+	if (!frame) {
+		return NULL;
+	}
+	for (i=0; i<len; i++) {
+		frame->data[FRAME_HDR_LEN + i] = 'a' + (i % 26);
+	}
+
+	return frame;
+}
+
+/**
+ * Top up a source connection's queue to at least 'bytes', nothing is
+ * copied
+ *
+ * @param[in] q		connection output queue
+ * @param[in] frame	frame from mode_source_frame()
+ * @param[in] bytes	queued bytes wanted
+ *
+ * @return the number of frames queued, -1 if out of memory
+ */
+int mode_source_fill(struct outq *q, struct outq_buf *frame, uint64_t bytes)
+{
+	int cnt;
+
+	for (cnt=0; q->bytes < bytes; cnt++) {
+		if (outq_push_ref(q, frame, 0) < 0) {
+			return -1;
+		}
+	}
+
+	return cnt;
+}
+
+/**
+ * Write the queue until it is empty or the socket is full
+ *
+ * @param[in] q		connection output queue
+ * @param[in] fd	socket
+ *
+ * @return On success, return the number of bytes written, check
+ *		   outq_empty() to know whether something is left.
+ *		   On error, return -1 with errno set
+ */
+ssize_t mode_flush(struct outq *q, int fd)
+{
+	struct iovec iov[OUTQ_IOV_MAX];
+	struct msghdr msg;
+	ssize_t total;
+	ssize_t ret;
+
+	total = 0;
+	while (!outq_empty(q)) {
+		memset(&msg, 0x00, sizeof(struct msghdr));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = outq_iov(q, iov, OUTQ_IOV_MAX);
+		ret = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				break;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		outq_consume(q, ret, NULL, NULL);
+		total += ret;
+	}
+
+	return total;
+}
+
+/**
+ * Write the queue one message per frame, without the frame headers, for
+ * sockets that keep message boundaries (SOCK_SEQPACKET)
+ *
+ * Every queued buffer must hold exactly one frame, as mode_echo() and
+ * mode_source_fill() queue them. Up to OUTQ_IOV_MAX messages go out with
+ * one sendmmsg(), each one whole or not at all.
+ *
+ * @param[in] q		connection output queue
+ * @param[in] fd	socket
+ *
+ * @return On success, return the number of payload bytes written, check
+ *		   outq_empty() to know whether something is left.
+ *		   On error, return -1 with errno set
+ */
+ssize_t mode_flush_msgs(struct outq *q, int fd)
+{
+	struct mmsghdr msgs[OUTQ_IOV_MAX];
+	struct iovec iov[OUTQ_IOV_MAX];
+	ssize_t total;
+	size_t len;
+	int i, cnt, ret;
+
+	total = 0;
+	while (!outq_empty(q)) {
+		cnt = outq_iov(q, iov, OUTQ_IOV_MAX);
+		memset(msgs, 0x00, sizeof(struct mmsghdr) * cnt);
+		for (i=0; i<cnt; i++) {
+			iov[i].iov_base = (uint8_t *)iov[i].iov_base + FRAME_HDR_LEN;
+			iov[i].iov_len -= FRAME_HDR_LEN;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		ret = sendmmsg(fd, msgs, cnt, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				break;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		for (i=0,len=0; i<ret; i++) {
+			len += iov[i].iov_len;
+		}
+		outq_consume(q, len + (size_t)ret * FRAME_HDR_LEN, NULL, NULL);
+		total += len;
+		if (ret < cnt) {
+			break;	/* the socket is full */
+		}
+	}
+
+	return total;
+}
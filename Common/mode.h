@@ -0,0 +1,37 @@
+#ifndef __MODE_H__
+#define __MODE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "outq.h"
+
+/*
+ * What a server does with the frames it receives (-m):
+ *	console	log them, send what the operator types (default)
+ *	echo	send every frame back unchanged
+ *	sink	drop them, only the metrics count them
+ *	source	ignore them and stream generated frames as fast as the
+ *			socket takes them
+ * Echo and source write through a per-connection output queue, flushed
+ * when the socket has room, so a full socket never cuts a frame. Only the
+ * console mode takes messages from the console.
+ */
+enum server_mode {
+	SERVER_MODE_CONSOLE,
+	SERVER_MODE_ECHO,
+	SERVER_MODE_SINK,
+	SERVER_MODE_SOURCE,
+};
+
+#define MODE_SOURCE_SIZE			(16 * 1024)	/* source frame payload, default */
+
+int mode_parse(const char *name);
+const char *mode_name(int mode);
+int mode_echo(struct outq *q, const uint8_t *data, uint32_t len);
+struct outq_buf *mode_source_frame(struct buff_pool *pool, uint32_t len);
+int mode_source_fill(struct outq *q, struct outq_buf *frame, uint64_t bytes);
+ssize_t mode_flush(struct outq *q, int fd);
+ssize_t mode_flush_msgs(struct outq *q, int fd);
+
+#endif	/* #ifndef __MODE_H__ */
@@ -0,0 +1,286 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame.h"
+#include "outq.h"
+
+/**
+ * Get a buffer holding a frame of 'payload_len' bytes with one reference,
+ * the header is already filled in and the payload goes to
+ * data + FRAME_HDR_LEN
+ *
+ * @param[in] pool			pool to draw from
+ * @param[in] payload_len	payload length
+ *
+ * @return On success, return the buffer.
+ *		   On error, NULL
+ */
+struct outq_buf *outq_buf_new(struct buff_pool *pool, uint32_t payload_len)
+{
+	struct outq_buf *b;
+	uint32_t size;
+
+	b = (struct outq_buf *)buff_pool_get(pool, sizeof(struct outq_buf) + FRAME_HDR_LEN + payload_len, &size);
+	if (!b) {
+		return NULL;
+	}
+	b->next = NULL;
+	b->ref = NULL;
+	b->size = size;
+	b->refs = 1;
+	b->len = frame_encode(b->data, payload_len);
+
+	return b;
+}
+
+/**
+ * Drop a reference, the buffer (and its own reference to a shared frame)
+ * goes back to the pool with the last one
+ *
+ * @param[in] pool	pool the buffer came from
+ * @param[in] b		buffer
+ */
+void outq_buf_put(struct buff_pool *pool, struct outq_buf *b)
+{
+	if (--b->refs > 0) {
+		return;
+	}
+	if (b->ref) {
+		outq_buf_put(pool, b->ref);
+	}
+	buff_pool_put(pool, b, b->size);
+}
+
+/**
+ * Initialize an empty output queue
+ *
+ * @param[in] q		queue
+ * @param[in] pool	pool the buffers come from
+ */
+void outq_init(struct outq *q, struct buff_pool *pool)
+{
+	memset(q, 0x00, sizeof(struct outq));
+	q->pool = pool;
+}
+
+/**
+ * Drop every queued buffer
+ *
+ * @param[in] q	queue
+ */
+void outq_exit(struct outq *q)
+{
+	struct outq_buf *b;
+
+	while (q->head) {
+		b = q->head;
+		q->head = b->next;
+		outq_buf_put(q->pool, b);
+	}
+	q->tail = NULL;
+	q->off = 0;
+	q->bytes = 0;
+}
+
+/**
+ * Get a buffer holding a frame of 'payload_len' bytes, the header is
+ * already filled in and the payload goes to data + FRAME_HDR_LEN
+ *
+ * @param[in] q				queue
+ * @param[in] payload_len	payload length
+ *
+ * @return On success, return the buffer, not queued yet.
+ *		   On error, NULL
+ */
+struct outq_buf *outq_frame_new(struct outq *q, uint32_t payload_len)
+{
+	return outq_buf_new(q->pool, payload_len);
+}
+
+/**
+ * Append a buffer to the queue
+ *
+ * @param[in] q	queue
+ * @param[in] b	buffer from outq_frame_new()
+ */
+void outq_push(struct outq *q, struct outq_buf *b)
+{
+	b->next = NULL;
+	if (q->tail) {
+		q->tail->next = b;
+	} else {
+		q->head = b;
+	}
+	q->tail = b;
+	q->bytes += b->len;
+}
+
+/**
+ * Append a copy of raw bytes, e.g. the unsent tail of a direct write
+ *
+ * @param[in] q		queue
+ * @param[in] data	bytes
+ * @param[in] len	number of bytes
+ *
+ * @return On success, return 0.
+ *		   On error, return -1
+ */
+int outq_push_bytes(struct outq *q, const void *data, uint32_t len)
+{
+	struct outq_buf *b;
+	uint32_t size;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	b = (struct outq_buf *)buff_pool_get(q->pool, sizeof(struct outq_buf) + len, &size);
+	if (!b) {
+		return -1;
+	}
+	b->ref = NULL;
+	b->size = size;
+	b->refs = 1;
+	b->len = len;
+	memcpy(b->data, data, len);
+	outq_push(q, b);
+
+	return 0;
+}
+
+/**
+ * Append the part of a frame frame_writev() did not get on the wire
+ *
+ * @param[in] q			queue
+ * @param[in] payload	frame payload
+ * @param[in] len		payload length
+ * @param[in] sent		leading frame bytes already written
+ *
+ * @return On success, return 0.
+ *		   On error, return -1
+ */
+int outq_push_frame(struct outq *q, const void *payload, uint32_t len, uint32_t sent)
+{
+	uint8_t hdr[FRAME_HDR_LEN];
+	struct outq_buf *b;
+	uint32_t size;
+
+	if (sent >= FRAME_HDR_LEN + len) {
+		return 0;
+	}
+
+	b = (struct outq_buf *)buff_pool_get(q->pool, sizeof(struct outq_buf) + FRAME_HDR_LEN + len - sent, &size);
+	if (!b) {
+		return -1;
+	}
+	b->ref = NULL;
+	b->size = size;
+	b->refs = 1;
+	b->len = 0;
+	if (sent < FRAME_HDR_LEN) {
+		frame_encode(hdr, len);
+		b->len = FRAME_HDR_LEN - sent;
+		memcpy(b->data, &hdr[sent], b->len);
+		sent = FRAME_HDR_LEN;
+	}
+	memcpy(&b->data[b->len], (const uint8_t *)payload + (sent - FRAME_HDR_LEN), FRAME_HDR_LEN + len - sent);
+	b->len += FRAME_HDR_LEN + len - sent;
+	outq_push(q, b);
+
+	return 0;
+}
+
+/**
+ * Append a reference to a shared frame, nothing is copied
+ *
+ * @param[in] q			queue
+ * @param[in] shared	frame from outq_buf_new()
+ * @param[in] sent		leading bytes of it already written directly
+ *
+ * @return On success, return 0.
+ *		   On error, return -1
+ */
+int outq_push_ref(struct outq *q, struct outq_buf *shared, uint32_t sent)
+{
+	struct outq_buf *b;
+	uint32_t size;
+
+	if (sent >= shared->len) {
+		return 0;
+	}
+
+	b = (struct outq_buf *)buff_pool_get(q->pool, sizeof(struct outq_buf), &size);
+	if (!b) {
+		return -1;
+	}
+	b->ref = shared;
+	b->size = size;
+	b->refs = 1;
+	b->len = shared->len - sent;
+	shared->refs++;
+	outq_push(q, b);
+
+	return 0;
+}
+
+/**
+ * Describe the queued bytes for one gathering write
+ *
+ * @param[in]  q	queue
+ * @param[out] iov	vector to fill in
+ * @param[in]  max	vector capacity
+ *
+ * @return the number of vector entries filled in
+ */
+int outq_iov(struct outq *q, struct iovec *iov, int max)
+{
+	struct outq_buf *b;
+	uint32_t off;
+	int cnt;
+
+	off = q->off;
+	for (b=q->head,cnt=0; b && (cnt < max); b=b->next,cnt++) {
+		iov[cnt].iov_base = outq_buf_data(b) + off;
+		iov[cnt].iov_len = b->len - off;
+		off = 0;
+	}
+
+	return cnt;
+}
+
+/**
+ * Account for 'len' bytes written from the head of the queue
+ *
+ * @param[in] q			queue
+ * @param[in] len		bytes written
+ * @param[in] release	called for every fully sent buffer, NULL to drop
+ *						the queue's reference right away
+ * @param[in] arg		callback user pointer
+ */
+void outq_consume(struct outq *q, size_t len, outq_release_t release, void *arg)
+{
+	struct outq_buf *b;
+	uint32_t left;
+
+	q->bytes -= len;
+	while (q->head && (len > 0)) {
+		b = q->head;
+		left = b->len - q->off;
+		if (len < left) {
+			q->off += len;
+			break;
+		}
+		len -= left;
+		q->off = 0;
+		q->head = b->next;
+		if (!q->head) {
+			q->tail = NULL;
+		}
+
+		if (release) {
+			release(arg, b);
+		} else {
+			outq_buf_put(q->pool, b);
+		}
+	}
+}
@@ -0,0 +1,69 @@
+#ifndef __OUTQ_H__
+#define __OUTQ_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "pool.h"
+
+/*
+ * Per-connection output queue: bytes that could not be written yet, kept
+ * in pooled buffers in send order. The owner writes outq_iov() with one
+ * writev()/sendmsg() and reports the result with outq_consume().
+ *
+ * A frame meant for many connections is encoded once into a reference
+ * counted buffer, every queue then only holds a small entry pointing at it
+ * (outq_push_ref()), and the last outq_buf_put() gives it back.
+ */
+#define OUTQ_IOV_MAX				64		/* buffers gathered per write */
+
+struct outq_buf {
+	struct outq_buf *next;
+	struct outq_buf *ref;	/* shared frame holding the bytes, NULL: data[] */
+	uint32_t size;			/* buff_pool real size, this header included */
+	uint32_t len;			/* bytes to send, the tail of ref's when shared */
+	uint32_t refs;			/* references, freed when it drops to 0 */
+	uint8_t data[0];
+};
+
+struct outq {
+	struct outq_buf *head;
+	struct outq_buf *tail;
+	uint32_t off;			/* bytes of head already sent */
+	uint64_t bytes;			/* bytes not sent yet */
+	struct buff_pool *pool;
+};
+
+/**
+ * Give back a buffer that has been sent
+ *
+ * @param[in] arg	user pointer passed to outq_consume()
+ * @param[in] b		sent buffer
+ */
+typedef void (*outq_release_t)(void *arg, struct outq_buf *b);
+
+struct outq_buf *outq_buf_new(struct buff_pool *pool, uint32_t payload_len);
+void outq_buf_put(struct buff_pool *pool, struct outq_buf *b);
+
+void outq_init(struct outq *q, struct buff_pool *pool);
+void outq_exit(struct outq *q);
+struct outq_buf *outq_frame_new(struct outq *q, uint32_t payload_len);
+void outq_push(struct outq *q, struct outq_buf *b);
+int outq_push_bytes(struct outq *q, const void *data, uint32_t len);
+int outq_push_frame(struct outq *q, const void *payload, uint32_t len, uint32_t sent);
+int outq_push_ref(struct outq *q, struct outq_buf *shared, uint32_t sent);
+int outq_iov(struct outq *q, struct iovec *iov, int max);
+void outq_consume(struct outq *q, size_t len, outq_release_t release, void *arg);
+
+static inline int outq_empty(const struct outq *q)
+{
+	return q->head == NULL;
+}
+
+static inline uint8_t *outq_buf_data(struct outq_buf *b)
+{
+	return b->ref ? &b->ref->data[b->ref->len - b->len] : b->data;
+}
+
+#endif	/* #ifndef __OUTQ_H__ */
@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+static const uint32_t buff_class_size[BUFF_POOL_CLASSES] = {
+	2 * 1024, 16 * 1024, 64 * 1024,
+};
+
+/**
+ * Initialize a fixed-size object pool, no memory is taken until the
+ * first slab_pool_get()
+ *
+ * @param[in] pool		pool
+ * @param[in] obj_size	object size
+ * @param[in] slab_objs	objects allocated at once when the pool runs dry
+ *
+ * @return On success, return 0.
+ *		   On error, return -1
+ */
+int slab_pool_init(struct slab_pool *pool, uint32_t obj_size, uint32_t slab_objs)
+{
+	memset(pool, 0x00, sizeof(struct slab_pool));
+	if (slab_objs == 0) {
+		return -1;
+	}
+
+	/* every free object holds the free-list link */
+	if (obj_size < sizeof(void *)) {
+		obj_size = sizeof(void *);
+	}
+	/* keep objects pointer aligned */
+	pool->obj_size = (obj_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	pool->slab_objs = slab_objs;
+
+	return 0;
+}
+
+/**
+ * Release every slab, objects still in use become invalid
+ *
+ * @param[in] pool	pool
+ */
+void slab_pool_exit(struct slab_pool *pool)
+{
+	void *slab;
+
+	while (pool->slabs) {
+		slab = pool->slabs;
+		pool->slabs = *(void **)slab;
+		free(slab);
+	}
+	pool->free_list = NULL;
+}
+
+/**
+ * Get one object, the content is undefined
+ *
+ * @param[in] pool	pool
+ *
+ * @return On success, return the object.
+ *		   On error, NULL
+ */
+void *slab_pool_get(struct slab_pool *pool)
+{
+	uint8_t *slab;
+	void *obj;
+	uint32_t i;
+
+	if (pool->free_list) {
+		pool->stats.hits++;
+	} else {
+		/* slab layout: link to the next slab, then the objects */
+		slab = (uint8_t *)malloc(sizeof(void *) + (size_t)pool->obj_size * pool->slab_objs);
+		if (!slab) {
+			return NULL;
+		}
+		*(void **)slab = pool->slabs;
+		pool->slabs = slab;
+
+		slab += sizeof(void *);
+		for (i=0; i<pool->slab_objs; i++) {
+			obj = &slab[(size_t)i * pool->obj_size];
+			*(void **)obj = pool->free_list;
+			pool->free_list = obj;
+		}
+		pool->stats.misses++;
+	}
+
+	obj = pool->free_list;
+	pool->free_list = *(void **)obj;
+	pool->stats.in_use++;
+
+	return obj;
+}
+
+/**
+ * Give an object back to the pool
+ *
+ * @param[in] pool	pool
+ * @param[in] obj	object from slab_pool_get()
+ */
+void slab_pool_put(struct slab_pool *pool, void *obj)
+{
+	*(void **)obj = pool->free_list;
+	pool->free_list = obj;
+	pool->stats.in_use--;
+}
+
+/**
+ * Initialize a tiered buffer pool
+ *
+ * @param[in] pool			pool
+ * @param[in] idle_bytes	idle memory each class may keep
+ */
+void buff_pool_init(struct buff_pool *pool, uint32_t idle_bytes)
+{
+	int i;
+
+	memset(pool, 0x00, sizeof(struct buff_pool));
+	for (i=0; i<BUFF_POOL_CLASSES; i++) {
+		pool->cls[i].size = buff_class_size[i];
+		pool->cls[i].max_free = idle_bytes / buff_class_size[i];
+	}
+}
+
+/**
+ * Free every idle buffer
+ *
+ * @param[in] pool	pool
+ */
+void buff_pool_exit(struct buff_pool *pool)
+{
+	void *buf;
+	int i;
+
+	for (i=0; i<BUFF_POOL_CLASSES; i++) {
+		while (pool->cls[i].free_list) {
+			buf = pool->cls[i].free_list;
+			pool->cls[i].free_list = *(void **)buf;
+			free(buf);
+		}
+		pool->cls[i].free_cnt = 0;
+	}
+}
+
+/**
+ * Get a buffer of at least 'size' bytes
+ *
+ * @param[in]  pool			pool
+ * @param[in]  size			bytes needed
+ * @param[out] real_size	usable size, must be passed back to buff_pool_put()
+ *
+ * @return On success, return the buffer.
+ *		   On error, NULL
+ */
+void *buff_pool_get(struct buff_pool *pool, uint32_t size, uint32_t *real_size)
+{
+	struct buff_class *cls;
+	void *buf;
+	int i;
+
+	for (i=0; i<BUFF_POOL_CLASSES; i++) {
+		if (size <= pool->cls[i].size) {
+			break;
+		}
+	}
+
+	if (i == BUFF_POOL_CLASSES) {
+		/* oversized, never cached */
+		cls = &pool->cls[BUFF_POOL_CLASSES - 1];
+		buf = malloc(size);
+		if (buf) {
+			cls->stats.misses++;
+			*real_size = size;
+		}
+		return buf;
+	}
+
+	cls = &pool->cls[i];
+	if (cls->free_list) {
+		buf = cls->free_list;
+		cls->free_list = *(void **)buf;
+		cls->free_cnt--;
+		cls->stats.hits++;
+	} else {
+		buf = malloc(cls->size);
+		if (!buf) {
+			return NULL;
+		}
+		cls->stats.misses++;
+	}
+	cls->stats.in_use++;
+	*real_size = cls->size;
+
+	return buf;
+}
+
+/**
+ * Give a buffer back to the pool
+ *
+ * @param[in] pool		pool
+ * @param[in] buf		buffer from buff_pool_get()
+ * @param[in] real_size	size reported by buff_pool_get()
+ */
+void buff_pool_put(struct buff_pool *pool, void *buf, uint32_t real_size)
+{
+	struct buff_class *cls;
+	int i;
+
+	for (i=0; i<BUFF_POOL_CLASSES; i++) {
+		if (real_size == pool->cls[i].size) {
+			break;
+		}
+	}
+
+	if (i == BUFF_POOL_CLASSES) {
+		free(buf);
+		return;
+	}
+
+	cls = &pool->cls[i];
+	cls->stats.in_use--;
+	if (cls->free_cnt >= cls->max_free) {
+		free(buf);
+		return;
+	}
+	*(void **)buf = cls->free_list;
+	cls->free_list = buf;
+	cls->free_cnt++;
+}
@@ -0,0 +1,54 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdint.h>
+
+struct pool_stats {
+	uint64_t hits;			/* served from a free-list */
+	uint64_t misses;		/* had to go to malloc() */
+	uint64_t in_use;		/* handed out and not returned yet */
+};
+
+/*
+ * Fixed-size object pool: objects are carved out of slabs of 'slab_objs'
+ * objects and recycled through a free-list, slabs are only released by
+ * slab_pool_exit().
+ */
+struct slab_pool {
+	uint32_t obj_size;
+	uint32_t slab_objs;
+	void *free_list;
+	void *slabs;			/* singly linked through the first word */
+	struct pool_stats stats;
+};
+
+int slab_pool_init(struct slab_pool *pool, uint32_t obj_size, uint32_t slab_objs);
+void slab_pool_exit(struct slab_pool *pool);
+void *slab_pool_get(struct slab_pool *pool);
+void slab_pool_put(struct slab_pool *pool, void *obj);
+
+/*
+ * Tiered buffer pool: requests are rounded up to the smallest class that
+ * fits, larger requests go straight to malloc() and are counted as misses
+ * of the last class.
+ */
+#define BUFF_POOL_CLASSES			3
+
+struct buff_class {
+	uint32_t size;
+	uint32_t max_free;		/* idle buffers kept before free() */
+	uint32_t free_cnt;
+	void *free_list;
+	struct pool_stats stats;
+};
+
+struct buff_pool {
+	struct buff_class cls[BUFF_POOL_CLASSES];
+};
+
+void buff_pool_init(struct buff_pool *pool, uint32_t idle_bytes);
+void buff_pool_exit(struct buff_pool *pool);
+void *buff_pool_get(struct buff_pool *pool, uint32_t size, uint32_t *real_size);
+void buff_pool_put(struct buff_pool *pool, void *buf, uint32_t real_size);
+
+#endif	/* #ifndef __POOL_H__ */
@@ -0,0 +1,291 @@
+#include <string.h>
+#include <time.h>
+
+#include "wheel.h"
+
+#define WHEEL_TICK_NS				1000000ULL	/* 1 ms */
+
+/**
+ * Read the clock
+ *
+ * @param[in] tw	wheel
+ *
+ * @return the current tick
+ */
+static uint64_t wheel_clock(const struct timer_wheel *tw)
+{
+	struct timespec ts;
+	uint64_t ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	return (ns - tw->start_ns) / WHEEL_TICK_NS;
+}
+
+/**
+ * Link a timer into the slot of its deadline, the level is picked from
+ * how far the deadline is
+ *
+ * @param[in] tw	wheel
+ * @param[in] t		timer, t->expires >= tw->now
+ */
+static void wheel_link(struct timer_wheel *tw, struct wheel_timer *t)
+{
+	uint64_t delta = t->expires - tw->now;
+	struct wheel_timer **head;
+	uint32_t level, idx;
+
+	for (level=0; level<WHEEL_LEVELS-1; level++) {
+		if (delta < (1ULL << (WHEEL_LEVEL_BITS * (level + 1)))) {
+			break;
+		}
+	}
+	idx = (t->expires >> (WHEEL_LEVEL_BITS * level)) & WHEEL_LEVEL_MASK;
+
+	head = &tw->slots[level][idx];
+	t->next = *head;
+	if (t->next) {
+		t->next->pprev = &t->next;
+	}
+	*head = t;
+	t->pprev = head;
+	t->slot = level * WHEEL_LEVEL_SIZE + idx;
+	tw->busy[level] |= 1ULL << idx;
+}
+
+/**
+ * Take a timer out of its list, the slot bitmap is left alone
+ *
+ * @param[in] t	pending timer
+ */
+static void wheel_unlink(struct wheel_timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next) {
+		t->next->pprev = t->pprev;
+	}
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/**
+ * Spread the timers of a slot over the levels below
+ *
+ * @param[in] tw	wheel
+ * @param[in] level	level of the slot, at least 1
+ * @param[in] idx	slot index
+ */
+static void wheel_cascade(struct timer_wheel *tw, uint32_t level, uint32_t idx)
+{
+	struct wheel_timer *list, *t;
+
+	list = tw->slots[level][idx];
+	tw->slots[level][idx] = NULL;
+	tw->busy[level] &= ~(1ULL << idx);
+
+	while (list) {
+		t = list;
+		list = t->next;
+		wheel_link(tw, t);
+	}
+}
+
+/**
+ * Run the timers of a level 0 slot
+ *
+ * The list is detached first: a callback may add timers (they land in
+ * other slots) or delete any timer, including one of this list.
+ *
+ * @param[in] tw	wheel
+ * @param[in] idx	slot index
+ *
+ * @return the number of timers run
+ */
+static int wheel_expire(struct timer_wheel *tw, uint32_t idx)
+{
+	struct wheel_timer *list, *t;
+	int cnt;
+
+	list = tw->slots[0][idx];
+	tw->slots[0][idx] = NULL;
+	tw->busy[0] &= ~(1ULL << idx);
+	list->pprev = &list;
+
+	for (cnt=0; list; cnt++) {
+		t = list;
+		wheel_unlink(t);
+		tw->count--;
+		t->cb(t->arg);
+	}
+
+	return cnt;
+}
+
+/**
+ * Initialize an empty wheel, its tick 0 is now
+ *
+ * @param[in] tw	wheel
+ */
+void wheel_init(struct timer_wheel *tw)
+{
+	struct timespec ts;
+
+	memset(tw, 0x00, sizeof(struct timer_wheel));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tw->start_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Initialize a timer, not pending
+ *
+ * @param[in] t		timer
+ * @param[in] cb	called when it expires
+ * @param[in] arg	passed to cb
+ */
+void wheel_timer_init(struct wheel_timer *t, wheel_cb_t cb, void *arg)
+{
+	memset(t, 0x00, sizeof(struct wheel_timer));
+	t->cb = cb;
+	t->arg = arg;
+}
+
+/**
+ * Arm a timer, or move it if it is pending
+ *
+ * @param[in] tw		wheel
+ * @param[in] t			timer
+ * @param[in] expires	deadline tick, e.g. wheel_now() + ms; a passed one
+ *						expires on the next tick
+ */
+void wheel_add(struct timer_wheel *tw, struct wheel_timer *t, uint64_t expires)
+{
+	wheel_del(tw, t);
+
+	if (expires <= tw->now) {
+		expires = tw->now + 1;
+	} else if (expires - tw->now > WHEEL_MAX_TICKS) {
+		expires = tw->now + WHEEL_MAX_TICKS;
+	}
+	t->expires = expires;
+	wheel_link(tw, t);
+	tw->count++;
+}
+
+/**
+ * Disarm a timer, nothing happens if it is not pending
+ *
+ * @param[in] tw	wheel
+ * @param[in] t		timer
+ */
+void wheel_del(struct timer_wheel *tw, struct wheel_timer *t)
+{
+	uint32_t level, idx;
+
+	if (!wheel_pending(t)) {
+		return;
+	}
+
+	wheel_unlink(t);
+	level = t->slot / WHEEL_LEVEL_SIZE;
+	idx = t->slot % WHEEL_LEVEL_SIZE;
+	if (!tw->slots[level][idx]) {
+		tw->busy[level] &= ~(1ULL << idx);
+	}
+	tw->count--;
+}
+
+/**
+ * Advance the wheel to the clock and run the timers that expired, call it
+ * once per loop, right before wheel_timeout() and the wait
+ *
+ * Only the ticks with a busy slot or a cascade are visited.
+ *
+ * @param[in] tw	wheel
+ *
+ * @return the number of timers run
+ */
+int wheel_run(struct timer_wheel *tw)
+{
+	uint64_t target, tick, bits;
+	uint32_t level, idx;
+	int cnt;
+
+	target = wheel_clock(tw);
+	cnt = 0;
+	tick = tw->now + 1;
+	while ((tick <= target) && (tw->count > 0)) {
+		tw->now = tick;
+		idx = tick & WHEEL_LEVEL_MASK;
+		if (idx == 0) {
+			/* level 0 wrapped, refill it from the levels above */
+			for (level=1; level<WHEEL_LEVELS; level++) {
+				idx = (tick >> (WHEEL_LEVEL_BITS * level)) & WHEEL_LEVEL_MASK;
+				wheel_cascade(tw, level, idx);
+				if (idx != 0) {
+					break;
+				}
+			}
+			idx = 0;
+		}
+		if (tw->slots[0][idx]) {
+			cnt += wheel_expire(tw, idx);
+		}
+
+		/* next busy slot of this round, or the next wrap */
+		bits = (idx == WHEEL_LEVEL_MASK) ? 0 : (tw->busy[0] >> (idx + 1));
+		tick = bits ? (tick + 1 + __builtin_ctzll(bits)) : ((tick | WHEEL_LEVEL_MASK) + 1);
+	}
+	if (target > tw->now) {
+		tw->now = target;
+	}
+
+	return cnt;
+}
+
+/**
+ * Get the time until wheel_run() has work, to wait that long at most
+ *
+ * A timer on a higher level counts from when its slot cascades, which is
+ * never later than its deadline.
+ *
+ * @param[in] tw		wheel
+ * @param[in] max_ms	timeout when nothing is pending
+ *
+ * @return the timeout in ms, 0 if a timer is already due
+ */
+int wheel_timeout(struct timer_wheel *tw, int max_ms)
+{
+	uint64_t next, tick, bits, base, now;
+	uint32_t level, shift, s;
+
+	if (tw->count == 0) {
+		return max_ms;
+	}
+
+	next = UINT64_MAX;
+	for (level=0; level<WHEEL_LEVELS; level++) {
+		bits = tw->busy[level];
+		if (!bits) {
+			continue;
+		}
+		/* slots are visited in order starting with the next one */
+		shift = WHEEL_LEVEL_BITS * level;
+		base = (tw->now >> shift) + 1;
+		s = base & WHEEL_LEVEL_MASK;
+		if (s) {
+			bits = (bits >> s) | (bits << (WHEEL_LEVEL_SIZE - s));
+		}
+		tick = (base + __builtin_ctzll(bits)) << shift;
+		if (tick < next) {
+			next = tick;
+		}
+	}
+
+	now = wheel_clock(tw);
+	if (next <= now) {
+		return 0;
+	}
+
+	return ((next - now) < (uint64_t)max_ms) ? (int)(next - now) : max_ms;
+}
@@ -0,0 +1,84 @@
+#ifndef __WHEEL_H__
+#define __WHEEL_H__
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel, one per event loop, not thread safe.
+ *
+ * Time is counted in 1 ms ticks. Level 0 has a slot per tick for the next
+ * 64 ticks, each further level a slot per 64 ticks of the level below, so
+ * four levels cover about 4.6 hours (longer timeouts are clamped). Adding
+ * and deleting a timer are O(1): it is linked into the slot of its
+ * deadline. When level 0 wraps, the due slot of the next level is spread
+ * back over the level below (cascade). A bitmap per level finds the next
+ * busy slot without walking them, so wheel_timeout() gives the loop its
+ * poll()/epoll_wait() timeout from the nearest deadline, and wheel_run()
+ * skips the empty ticks.
+ *
+ * The timer lives in the object it belongs to; it must not move while it
+ * is pending.
+ */
+#define WHEEL_LEVEL_BITS			6
+#define WHEEL_LEVEL_SIZE			(1 << WHEEL_LEVEL_BITS)
+#define WHEEL_LEVEL_MASK			(WHEEL_LEVEL_SIZE - 1)
+#define WHEEL_LEVELS				4
+#define WHEEL_MAX_TICKS				((1ULL << (WHEEL_LEVEL_BITS * WHEEL_LEVELS)) - 1)
+
+/**
+ * Called from wheel_run() once the deadline has passed, the timer is no
+ * longer pending and may be added again
+ *
+ * @param[in] arg	user pointer given to wheel_timer_init()
+ */
+typedef void (*wheel_cb_t)(void *arg);
+
+struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer **pprev;	/* NULL when not pending */
+	uint64_t expires;			/* tick */
+	uint32_t slot;				/* level * WHEEL_LEVEL_SIZE + index */
+	wheel_cb_t cb;
+	void *arg;
+};
+
+struct timer_wheel {
+	uint64_t now;				/* last tick run */
+	uint64_t start_ns;			/* CLOCK_MONOTONIC of tick 0 */
+	uint32_t count;				/* pending timers */
+	uint64_t busy[WHEEL_LEVELS];	/* bit set: slot not empty */
+	struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_LEVEL_SIZE];
+};
+
+void wheel_init(struct timer_wheel *tw);
+void wheel_timer_init(struct wheel_timer *t, wheel_cb_t cb, void *arg);
+void wheel_add(struct timer_wheel *tw, struct wheel_timer *t, uint64_t expires);
+void wheel_del(struct timer_wheel *tw, struct wheel_timer *t);
+int wheel_run(struct timer_wheel *tw);
+int wheel_timeout(struct timer_wheel *tw, int max_ms);
+
+/**
+ * Get the wheel's current tick, deadlines are given against it
+ *
+ * @param[in] tw	wheel
+ *
+ * @return the last tick wheel_run() reached, in ms since wheel_init()
+ */
+static inline uint64_t wheel_now(const struct timer_wheel *tw)
+{
+	return tw->now;
+}
+
+/**
+ * Check whether a timer is waiting for its deadline
+ *
+ * @param[in] t	timer
+ *
+ * @return 1 if pending, 0 otherwise
+ */
+static inline int wheel_pending(const struct wheel_timer *t)
+{
+	return t->pprev != NULL;
+}
+
+#endif	/* #ifndef __WHEEL_H__ */
@@ -0,0 +1,293 @@
+#define _GNU_SOURCE			/* splice() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "xfer.h"
+
+/**
+ * Queue the status frame that starts every answer
+ *
+ * @param[in] x		transfer
+ * @param[in] fmt	status text format
+ */
+static void xfer_status(struct xfer *x, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void xfer_status(struct xfer *x, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf((char *)&x->pend[FRAME_HDR_LEN], XFER_PEND_LEN - FRAME_HDR_LEN, fmt, ap);
+	va_end(ap);
+	if (len >= (XFER_PEND_LEN - FRAME_HDR_LEN)) {
+		len = XFER_PEND_LEN - FRAME_HDR_LEN - 1;
+	}
+
+	x->pend_len = frame_encode(x->pend, len);
+	x->pend_off = 0;
+}
+
+/**
+ * Initialize an idle transfer
+ *
+ * @param[in] x	transfer
+ */
+void xfer_init(struct xfer *x)
+{
+	memset(x, 0x00, sizeof(struct xfer));
+	x->fd = x->pipefd[0] = x->pipefd[1] = -1;
+}
+
+/**
+ * Open the directory files are served from
+ *
+ * @param[in] path	root directory
+ *
+ * @return On success, return the directory fd.
+ *		   On error, return -1 and set errno
+ */
+int xfer_root_open(const char *path)
+{
+	return open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * Check that a requested path stays below the root
+ *
+ * @param[in] path	requested path
+ *
+ * @return 1 if it is relative and has no ".." component, 0 otherwise
+ */
+static int xfer_path_check(const char *path)
+{
+	const char *p;
+	size_t len;
+
+	if (path[0] == '/') {
+		return 0;
+	}
+	for (p=path; *p; p+=len) {
+		len = strcspn(p, "/");
+		if ((len == 2) && (p[0] == '.') && (p[1] == '.')) {
+			return 0;
+		}
+		if (p[len] == '/') {
+			len++;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Open a source below the root
+ *
+ * openat2() keeps the whole resolution, symbolic links included, below the
+ * root. Kernels without it only get single component paths, which openat()
+ * with O_NOFOLLOW cannot resolve outside the root either.
+ *
+ * @param[in] rootfd	root directory
+ * @param[in] path		checked relative path
+ *
+ * @return On success, return the fd.
+ *		   On error, return -1 and set errno
+ */
+static int xfer_source_open(int rootfd, const char *path)
+{
+	struct open_how how;
+	int fd;
+
+	/* O_NONBLOCK keeps open() of a FIFO without writer from hanging */
+	memset(&how, 0x00, sizeof(struct open_how));
+	how.flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOFOLLOW | O_NOCTTY;
+	how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+	fd = syscall(SYS_openat2, rootfd, path, &how, sizeof(struct open_how));
+	if ((fd >= 0) || (errno != ENOSYS)) {
+		return fd;
+	}
+
+	if (strchr(path, '/')) {
+		errno = EXDEV;
+		return -1;
+	}
+
+	return openat(rootfd, path, how.flags);
+}
+
+/**
+ * Start answering a "get <path> [offset [length]]" request
+ *
+ * Failures are answered with an "error" status frame, so the transfer
+ * always has something to send afterwards.
+ *
+ * @param[in] x			transfer
+ * @param[in] rootfd	directory from xfer_root_open(), -1 if serving is off
+ * @param[in] req		request text following XFER_CMD, NUL terminated
+ * @param[in] chunk_max	largest data frame the peer accepts
+ */
+void xfer_open(struct xfer *x, int rootfd, const char *req, uint32_t chunk_max)
+{
+	char path[256];
+	unsigned long long offset, length;
+	struct stat st;
+	int n;
+
+	xfer_init(x);
+	x->chunk_max = chunk_max;
+
+	offset = length = 0;
+	n = sscanf(req, "%255s %llu %llu", path, &offset, &length);
+	if (n < 1) {
+		xfer_status(x, "error usage: get <path> [offset [length]]");
+		return;
+	}
+
+	if (rootfd < 0) {
+		xfer_status(x, "error file serving is off");
+		return;
+	} else if (!xfer_path_check(path)) {
+		xfer_status(x, "error %s: outside the served directory", path);
+		return;
+	}
+
+	/* the source stays non-blocking, xfer_send() waits for it instead */
+	x->fd = xfer_source_open(rootfd, path);
+	if ((x->fd < 0) || (fstat(x->fd, &st) < 0)) {
+		xfer_status(x, "error %s: %s", path, strerror(errno));
+		xfer_close(x);
+		return;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		if (offset > (unsigned long long)st.st_size) {
+			offset = st.st_size;
+		}
+		if ((n < 3) || (length > (unsigned long long)st.st_size - offset)) {
+			length = st.st_size - offset;
+		}
+		x->offset = offset;
+	} else {
+		/* pipes and devices have no size, splice() reads them in order */
+		if ((n < 3) || (offset != 0)) {
+			xfer_status(x, "error %s: not a regular file, give offset 0 and a length", path);
+			xfer_close(x);
+			return;
+		}
+		if (pipe2(x->pipefd, O_CLOEXEC | O_NONBLOCK) < 0) {
+			xfer_status(x, "error pipe: %s", strerror(errno));
+			xfer_close(x);
+			return;
+		}
+	}
+
+	x->remain = length;
+	xfer_status(x, "ok %llu", length);
+}
+
+/**
+ * Send as much of the transfer as the socket takes
+ *
+ * @param[in] x			transfer
+ * @param[in] sockfd	non-blocking stream socket
+ *
+ * @return 1 once everything is sent, 0 when the socket is full (wait for
+ *		   EPOLLOUT), XFER_SOURCE_WAIT when the source has nothing to read
+ *		   (wait until x->fd is readable), -1 on error
+ */
+int xfer_send(struct xfer *x, int sockfd)
+{
+	uint32_t chunk;
+	ssize_t ret;
+
+	while (1) {
+		if (x->pend_off < x->pend_len) {
+			ret = send(sockfd, &x->pend[x->pend_off], x->pend_len - x->pend_off,
+					   MSG_NOSIGNAL | (x->chunk_left ? MSG_MORE : 0));
+		} else if (x->chunk_left == 0) {
+			if (x->remain == 0) {
+				xfer_close(x);
+				return 1;
+			}
+			chunk = (x->remain < x->chunk_max) ? (uint32_t)x->remain : x->chunk_max;
+			frame_encode(x->pend, chunk);	/* header only, the payload follows from the file */
+			x->pend_len = FRAME_HDR_LEN;
+			x->pend_off = 0;
+			x->chunk_left = chunk;
+			continue;
+		} else if (x->pipefd[0] < 0) {
+			ret = sendfile(sockfd, x->fd, &x->offset, x->chunk_left);
+			if (ret == 0) {
+				errno = ENODATA;	/* the file shrank */
+				return -1;
+			}
+		} else {
+			if (x->piped == 0) {
+				ret = splice(x->fd, NULL, x->pipefd[1], NULL, x->chunk_left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (ret < 0) {
+					if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+						return XFER_SOURCE_WAIT;
+					} else if (errno == EINTR) {
+						continue;
+					}
+					return -1;
+				} else if (ret == 0) {
+					errno = ENODATA;	/* the writer went away early */
+					return -1;
+				}
+				x->piped = ret;
+			}
+			ret = splice(x->pipefd[0], NULL, sockfd, NULL, x->piped,
+						 SPLICE_F_MOVE | SPLICE_F_NONBLOCK | ((x->chunk_left > x->piped) ? SPLICE_F_MORE : 0));
+			if (ret > 0) {
+				x->piped -= ret;
+			}
+		}
+
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				return 0;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		if (x->pend_off < x->pend_len) {
+			x->pend_off += ret;
+		} else {
+			x->chunk_left -= ret;
+			x->remain -= ret;
+		}
+	}
+}
+
+/**
+ * Release the source and pipe, any unsent bytes are dropped
+ *
+ * @param[in] x	transfer
+ */
+void xfer_close(struct xfer *x)
+{
+	if (x->fd >= 0) {
+		close(x->fd);
+		x->fd = -1;
+	}
+	if (x->pipefd[0] >= 0) {
+		close(x->pipefd[0]);
+		close(x->pipefd[1]);
+		x->pipefd[0] = x->pipefd[1] = -1;
+	}
+	x->remain = 0;
+	x->chunk_left = 0;
+	x->piped = 0;
+}
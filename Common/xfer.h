@@ -0,0 +1,57 @@
+#ifndef __XFER_H__
+#define __XFER_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "frame.h"
+
+/*
+ * Bulk file transfer over the frame protocol.
+ *
+ * A client sends the text frame "get <path> [offset [length]]", the server
+ * answers with the text frame "ok <length>" (or "error <reason>") followed
+ * by <length> payload bytes cut into frames of at most 'chunk_max' bytes.
+ * The payload goes from the file to the socket with sendfile(), or with
+ * splice() through a pipe when the source is not a regular file, so it is
+ * never copied into user space.
+ *
+ * Paths are relative to the served root directory, absolute paths, ".."
+ * components and symbolic links leaving the root are refused.
+ */
+#define XFER_CMD					"get "
+#define XFER_PEND_LEN				128		/* status frame or frame header */
+#define XFER_SOURCE_WAIT			2		/* xfer_send(): the source has no data yet */
+
+struct xfer {
+	int fd;					/* source, -1 once closed */
+	int pipefd[2];			/* splice() pipe, -1 when sendfile() is used */
+	uint32_t piped;			/* bytes sitting in the pipe */
+	off_t offset;			/* next source byte (sendfile only) */
+	uint64_t remain;		/* payload bytes not sent yet */
+	uint32_t chunk_max;		/* largest data frame */
+	uint32_t chunk_left;	/* payload bytes left in the current frame */
+	uint8_t pend[XFER_PEND_LEN];	/* small bytes to send before the payload */
+	uint32_t pend_len;
+	uint32_t pend_off;
+};
+
+void xfer_init(struct xfer *x);
+int xfer_root_open(const char *path);
+void xfer_open(struct xfer *x, int rootfd, const char *req, uint32_t chunk_max);
+int xfer_send(struct xfer *x, int sockfd);
+void xfer_close(struct xfer *x);
+
+/**
+ * Check whether a transfer is in progress
+ *
+ * @param[in] x	transfer
+ *
+ * @return 1 while bytes are left to send, 0 otherwise
+ */
+static inline int xfer_active(struct xfer *x)
+{
+	return (x->pend_off < x->pend_len) || (x->remain > 0);
+}
+
+#endif	/* #ifndef __XFER_H__ */
@@ -0,0 +1,229 @@
+#define _GNU_SOURCE			/* SOL_IP, SOL_IPV6 */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "zcopy.h"
+
+/**
+ * Give a held buffer back
+ *
+ * @param[in] zc	tracker
+ * @param[in] buf	buffer
+ * @param[in] size	buffer real size
+ */
+static void zc_put(struct zc_tracker *zc, void *buf, uint32_t size)
+{
+	if (zc->release) {
+		zc->release(zc->pool, buf, size);
+	} else {
+		buff_pool_put(zc->pool, buf, size);
+	}
+}
+
+/**
+ * Enable MSG_ZEROCOPY on a socket
+ *
+ * @param[in] zc	tracker
+ * @param[in] fd	connected stream socket
+ * @param[in] pool	pool the held buffers go back to
+ *
+ * @return On success, return 0.
+ *		   On error (SO_ZEROCOPY unsupported), return -1, sends then copy
+ */
+int zc_init(struct zc_tracker *zc, int fd, struct buff_pool *pool)
+{
+	int on = 1;
+
+	memset(zc, 0x00, sizeof(struct zc_tracker));
+	zc->pool = pool;
+	if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(int)) < 0) {
+		return -1;
+	}
+	zc->enabled = 1;
+
+	return 0;
+}
+
+/**
+ * Give back every held buffer, only call it once the socket is closed
+ *
+ * @param[in] zc	tracker
+ */
+void zc_exit(struct zc_tracker *zc)
+{
+	struct zc_buf *zb;
+
+	while (zc->head) {
+		zb = zc->head;
+		zc->head = zb->next;
+		zc_put(zc, zb->buf, zb->size);
+		free(zb);
+	}
+	zc->tail = NULL;
+}
+
+/**
+ * sendmsg() that uses MSG_ZEROCOPY when enabled and the data is worth it
+ *
+ * The bytes must stay untouched until zc_hold() gives their buffers back.
+ *
+ * @param[in] zc		tracker
+ * @param[in] fd		socket
+ * @param[in] iov		data
+ * @param[in] iovcnt	number of vector entries
+ * @param[in] flags		other sendmsg() flags
+ *
+ * @return what sendmsg() returns
+ */
+ssize_t zc_sendmsg(struct zc_tracker *zc, int fd, struct iovec *iov, int iovcnt, int flags)
+{
+	struct msghdr msg;
+	size_t len;
+	ssize_t ret;
+	int i;
+
+	memset(&msg, 0x00, sizeof(struct msghdr));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	for (i=0,len=0; i<iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	if (!zc->enabled || (len < ZC_MIN_LEN)) {
+		return sendmsg(fd, &msg, flags);
+	}
+
+	ret = sendmsg(fd, &msg, flags | MSG_ZEROCOPY);
+	if (ret < 0) {
+		/* ENOBUFS: out of optmem for notifications, copy this one */
+		if (errno != ENOBUFS) {
+			return ret;
+		}
+		return sendmsg(fd, &msg, flags);
+	}
+	zc->next_seq++;
+	zc->stats.sends++;
+
+	return ret;
+}
+
+/**
+ * Release the buffers whose sends are all done
+ *
+ * @param[in] zc	tracker
+ */
+static void zc_release(struct zc_tracker *zc)
+{
+	struct zc_buf *zb;
+
+	/* wrap-safe 'seq_end <= done_seq' */
+	while (zc->head && ((int32_t)(zc->done_seq - zc->head->seq_end) >= 0)) {
+		zb = zc->head;
+		zc->head = zb->next;
+		zc_put(zc, zb->buf, zb->size);
+		free(zb);
+	}
+	if (!zc->head) {
+		zc->tail = NULL;
+	}
+}
+
+/**
+ * Hold a buffer until the kernel is done with every send issued so far
+ *
+ * @param[in] zc	tracker
+ * @param[in] buf	buffer from zc->pool
+ * @param[in] size	buffer real size
+ *
+ * @return On success, return 0.
+ *		   On error, return -1 (the buffer is released right away, which is
+ *		   only safe if it was not sent with MSG_ZEROCOPY)
+ */
+int zc_hold(struct zc_tracker *zc, void *buf, uint32_t size)
+{
+	struct zc_buf *zb;
+
+	if (zc->done_seq == zc->next_seq) {
+		zc_put(zc, buf, size);
+		return 0;
+	}
+
+	zb = (struct zc_buf *)malloc(sizeof(struct zc_buf));
+	if (!zb) {
+		zc_put(zc, buf, size);
+		return -1;
+	}
+	zb->buf = buf;
+	zb->size = size;
+	zb->seq_end = zc->next_seq;
+	zb->next = NULL;
+	if (zc->tail) {
+		zc->tail->next = zb;
+	} else {
+		zc->head = zb;
+	}
+	zc->tail = zb;
+
+	return 0;
+}
+
+/**
+ * Read the completion notifications from the socket error queue and
+ * release the buffers they cover
+ *
+ * @param[in] zc	tracker
+ * @param[in] fd	socket
+ *
+ * @return On success, return the number of notifications read.
+ *		   On error (a real socket error is queued), return -1 with errno set
+ */
+int zc_reap(struct zc_tracker *zc, int fd)
+{
+	union {
+		struct cmsghdr hdr;
+		uint8_t buf[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+	} ctrl;
+	struct sock_extended_err *serr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	int cnt;
+
+	cnt = 0;
+	while (1) {
+		memset(&msg, 0x00, sizeof(struct msghdr));
+		msg.msg_control = ctrl.buf;
+		msg.msg_controllen = sizeof(ctrl.buf);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				break;
+			}
+			return -1;
+		}
+
+		for (cmsg=CMSG_FIRSTHDR(&msg); cmsg; cmsg=CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_RECVERR)) ||
+				  ((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR)))) {
+				continue;
+			}
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				errno = serr->ee_errno;
+				return -1;
+			}
+			/* sends ee_info..ee_data (inclusive) are done, TCP reports them in order */
+			zc->stats.completed += serr->ee_data - serr->ee_info + 1;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				zc->stats.copied += serr->ee_data - serr->ee_info + 1;
+			}
+			zc->done_seq = serr->ee_data + 1;
+			cnt++;
+		}
+	}
+	zc_release(zc);
+
+	return cnt;
+}
@@ -0,0 +1,59 @@
+#ifndef __ZCOPY_H__
+#define __ZCOPY_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "pool.h"
+
+/*
+ * MSG_ZEROCOPY transmit tracking for one socket.
+ *
+ * The kernel numbers every successful MSG_ZEROCOPY send() on a socket and
+ * reports finished ranges of those numbers on the socket error queue
+ * (EPOLLERR). A buffer handed to zc_hold() is only given back to its pool
+ * once every send issued before it has been reported.
+ */
+#define ZC_MIN_LEN					(16 * 1024)	/* smaller sends are cheaper to copy */
+
+struct zc_buf {
+	void *buf;
+	uint32_t size;			/* buff_pool real size */
+	uint32_t seq_end;		/* released once sends < seq_end are done */
+	struct zc_buf *next;
+};
+
+struct zc_stats {
+	uint64_t sends;			/* MSG_ZEROCOPY send() calls */
+	uint64_t completed;		/* sends reported done */
+	uint64_t copied;		/* sends the kernel copied anyway (e.g. loopback) */
+};
+
+/**
+ * Give back a held buffer, defaults to buff_pool_put()
+ *
+ * @param[in] pool	tracker pool
+ * @param[in] buf	buffer
+ * @param[in] size	buffer real size
+ */
+typedef void (*zc_release_t)(struct buff_pool *pool, void *buf, uint32_t size);
+
+struct zc_tracker {
+	int enabled;
+	uint32_t next_seq;		/* number of the next zerocopy send */
+	uint32_t done_seq;		/* every send below this is done */
+	struct zc_buf *head;	/* held buffers, in send order */
+	struct zc_buf *tail;
+	struct buff_pool *pool;
+	zc_release_t release;	/* NULL: buff_pool_put() */
+	struct zc_stats stats;
+};
+
+int zc_init(struct zc_tracker *zc, int fd, struct buff_pool *pool);
+void zc_exit(struct zc_tracker *zc);
+ssize_t zc_sendmsg(struct zc_tracker *zc, int fd, struct iovec *iov, int iovcnt, int flags);
+int zc_hold(struct zc_tracker *zc, void *buf, uint32_t size);
+int zc_reap(struct zc_tracker *zc, int fd);
+
+#endif	/* #ifndef __ZCOPY_H__ */
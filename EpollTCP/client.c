@@ -10,11 +10,45 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <sys/epoll.h>
+#include <time.h>
 
 #include "common.h"
+#include "frame.h"
+#include "xfer.h"
+#include "log.h"
+#include "pool.h"
+#include "outq.h"
+#include "mode.h"
+#include "wheel.h"
+#include "heartbeat.h"
 
 #define CLIENT_ERRNO				__LINE__
-#define CLIENT_PRINT(_fmt, ...)		printf("[%04d] "_fmt"\n", __LINE__, ##__VA_ARGS__);
+#define CLIENT_PRINT(_fmt, ...)		LOG_INFO("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
+#define CLIENT_WAIT_MS				(10 * 1000)	/* longest wait without a timer due */
+#define CLIENT_POOL_IDLE			(64 * 1024)	/* idle output queue memory kept */
+
+/* file requested with "get", saved as <basename>.recv */
+struct client_download {
+	int fd;					/* output file, -1 while no data is expected */
+	int waiting;			/* request sent, status frame expected */
+	char name[256];
+	uint64_t total;
+	uint64_t remain;
+	struct timespec start;
+};
+
+/* the connection as seen by the frame handler */
+struct client_conn {
+	int fd;
+	struct client_download dl;
+	struct hb_config hb;
+	struct timer_wheel timers;
+	struct wheel_timer hb_timer;	/* -P heartbeat */
+	uint64_t heard;					/* tick of the last bytes in */
+	struct buff_pool pool;			/* output queue buffers */
+	struct outq outq;				/* frames the socket did not take yet */
+	int want_out;					/* registered for EPOLLOUT */
+};
 
 /**
  * Connect to the server
@@ -133,16 +167,19 @@ label_client_connect_server:
 /**
  * Send a message to the server
  *
- * @param[in] sockfd	socket file descriptor
+ * It goes behind whatever is queued, and what the socket does not take
+ * is queued, so heartbeats and messages never cut into each other.
+ *
+ * @param[in] c			connection
  * @param[in] sbuf		send buff pointer
- * @param[in] buff_len	send buff size
+ * @param[in] buff_len	send buff payload size
  *
- * @return On success, return the length of the sent.
+ * @return On success, return the length of the frame.
  */
-static int client_send_message(int sockfd, struct common_buff *sbuf, uint16_t buff_len)
+static int client_send_message(struct client_conn *c, struct common_buff *sbuf, uint16_t buff_len)
 {
 	uint32_t slen;
-	int ret;
+	ssize_t ret;
 
 	/* clear send buff */
 	memset(sbuf->data, 0x00, buff_len);
@@ -158,39 +195,211 @@ static int client_send_message(int sockfd, struct common_buff *sbuf, uint16_t bu
 	sbuf->data[slen] = '\0'; /* delete \n */
 
 	/* send to server */
-	ret = write(sockfd, sbuf->data, slen);
-	if (ret < 0) {
-		/* we failed */
-		CLIENT_PRINT("write failed, %s", strerror(errno));
+	ret = 0;
+	if (outq_empty(&c->outq)) {
+		ret = frame_writev(c->fd, sbuf->data, slen, 0);
+		if (ret < 0) {
+			/* we failed */
+			CLIENT_PRINT("write failed, %s", strerror(errno));
+			return -CLIENT_ERRNO;
+		}
+	}
+	if (outq_push_frame(&c->outq, sbuf->data, slen, ret) < 0) {
+		CLIENT_PRINT("get output queue memory failed");
 		return -CLIENT_ERRNO;
 	}
-	CLIENT_PRINT("TX[%04d]> %s", ret, sbuf->data);
+	CLIENT_PRINT("TX[%04d]> %s", (int)(FRAME_HDR_LEN + slen), sbuf->data); /* the length includes the frame header */
 	/* CLIENT_PRINT("send %d bytes data", ret); */
 
-	return ret;
+	return FRAME_HDR_LEN + slen;
 }
 
 /**
- * Receive a message from the server
+ * Watch the socket for room only while output is queued
  *
- * @param[in] sockfd	socket file descriptor
- * @param[in] rbuf		recv buff pointer
- * @param[in] buff_len	recv buff size
+ * @param[in] c		connection
+ * @param[in] epfd	epoll file descriptor
+ */
+static void client_watch(struct client_conn *c, int epfd)
+{
+	struct epoll_event epev;
+	int want;
+
+	want = !outq_empty(&c->outq);
+	if (want == c->want_out) {
+		return;
+	}
+
+	memset(&epev, 0x00, sizeof(struct epoll_event));
+	epev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+	epev.data.fd = c->fd;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &epev);
+	c->want_out = want;
+}
+
+/**
+ * Expect the answer to a "get" request
+ *
+ * @param[in] dl	download state
+ * @param[in] req	request text following XFER_CMD
+ */
+static void client_download_start(struct client_download *dl, const char *req)
+{
+	const char *base;
+	char path[240];
+
+	if (sscanf(req, "%239s", path) != 1) {
+		return;
+	}
+	base = strrchr(path, '/');
+	base = base ? (base + 1) : path;
+	snprintf(dl->name, sizeof(dl->name), "%s.recv", base);
+	dl->waiting = 1;
+	clock_gettime(CLOCK_MONOTONIC, &dl->start);
+}
+
+/**
+ * Close the output file and report the throughput
  *
- * @return On success, return the length of the sent.
+ * @param[in] dl	download state
  */
-static int client_recv_message(int sockfd, struct common_buff *rbuf, uint16_t buff_len)
+static void client_download_done(struct client_download *dl)
+{
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - dl->start.tv_sec) + (now.tv_nsec - dl->start.tv_nsec) / 1e9;
+	CLIENT_PRINT("saved %llu bytes to %s, %.3f s, %.1f MB/s", (unsigned long long)dl->total, dl->name,
+				 secs, (secs > 0) ? (dl->total / secs / 1e6) : 0);
+
+	if (dl->fd >= 0) {
+		close(dl->fd);
+		dl->fd = -1;
+	}
+}
+
+/**
+ * Heartbeat timer: ping a server that has been silent for -P seconds, shut
+ * the connection down once it stayed silent for -M of them
+ *
+ * @param[in] arg	connection
+ */
+static void client_heartbeat(void *arg)
+{
+	struct client_conn *c = (struct client_conn *)arg;
+	uint64_t next;
+
+	switch (hb_check(&c->hb, wheel_now(&c->timers), c->heard, &next)) {
+	case HB_DEAD:
+		CLIENT_PRINT("server silent for %u heartbeats, closing", c->hb.misses);
+		shutdown(c->fd, SHUT_RDWR);
+		return;
+	case HB_PING:
+		if (hb_send(c->fd, HB_FRAME_PING, &c->outq) < 0) {
+			CLIENT_PRINT("ping failed, %s", strerror(errno));
+			shutdown(c->fd, SHUT_RDWR);
+			return;
+		}
+		break;
+	}
+	wheel_add(&c->timers, &c->hb_timer, next);
+}
+
+/**
+ * Handle a control frame received from the server: answer pings, drop
+ * pongs, any bytes in already count as heard from it
+ *
+ * @param[in] arg	connection
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return On success, return 0.
+ *		   On error, negative number of the error line number
+ */
+static int client_recv_ctrl(void *arg, uint8_t *data, uint32_t len)
+{
+	struct client_conn *c = (struct client_conn *)arg;
+
+	if ((hb_frame_type(data, len) == HB_FRAME_PING) && (hb_send(c->fd, HB_FRAME_PONG, &c->outq) < 0)) {
+		CLIENT_PRINT("pong failed, %s", strerror(errno));
+		return -CLIENT_ERRNO;
+	}
+
+	return 0;
+}
+
+/**
+ * Print a complete frame received from the server, or store it while a
+ * download is running
+ *
+ * @param[in] arg	connection
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return On success, return 0.
+ *		   On error, negative number of the error line number
+ */
+static int client_recv_frame(void *arg, uint8_t *data, uint32_t len)
+{
+	struct client_conn *c = (struct client_conn *)arg;
+	struct client_download *dl = &c->dl;
+	unsigned long long total;
+
+	if (dl->fd >= 0) {
+		if (write(dl->fd, data, len) != (ssize_t)len) {
+			CLIENT_PRINT("write %s failed, %s", dl->name, strerror(errno));
+			return -CLIENT_ERRNO;
+		}
+		dl->remain -= (len < dl->remain) ? len : dl->remain;
+		if (dl->remain == 0) {
+			client_download_done(dl);
+		}
+		return 0;
+	}
+
+	CLIENT_PRINT("RX[%04d]> %.*s", len, (int)len, data);
+
+	if (dl->waiting) {
+		dl->waiting = 0;
+		if ((len < 3) || (memcmp(data, "ok ", 3) != 0) || (sscanf((char *)&data[3], "%llu", &total) != 1)) {
+			return 0;	/* error status, already printed */
+		}
+		dl->fd = open(dl->name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (dl->fd < 0) {
+			CLIENT_PRINT("open %s failed, %s", dl->name, strerror(errno));
+			return -CLIENT_ERRNO;
+		}
+		dl->total = dl->remain = total;
+		if (total == 0) {
+			client_download_done(dl);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Receive messages from the server
+ *
+ * @param[in] c		connection
+ * @param[in] dec	frame decoder of the connection
+ *
+ * @return On success, return the number of bytes read.
+ */
+static int client_recv_message(struct client_conn *c, struct frame_decoder *dec)
 {
-	char *ptr;
 	uint32_t rlen;
 	int ret;
 
-	ptr = (char *)rbuf;
 	rlen = 0;
 	do {
-		ret = read(sockfd, &ptr[rlen], buff_len - rlen);
+		ret = frame_decoder_readv(dec, c->fd, client_recv_frame, c);
 		if (ret < 0) {
-			if (errno != EAGAIN) {
+			if (errno == EBADMSG) {
+				CLIENT_PRINT("data error!!!");
+				return -CLIENT_ERRNO;
+			} else if (errno != EAGAIN) {
 				CLIENT_PRINT("read failed, %s", strerror(errno));
 				return -CLIENT_ERRNO;
 			}
@@ -199,10 +408,9 @@ static int client_recv_message(int sockfd, struct common_buff *rbuf, uint16_t bu
 			CLIENT_PRINT("server closed connection");
 			return 0;
 		}
+		c->heard = wheel_now(&c->timers);
 		rlen += ret;
-	} while ((ret > 0) && (rlen < buff_len));
-
-	CLIENT_PRINT("RX[%04d]> %s", rlen, rbuf->data);
+	} while (ret > 0);
 
 	return rlen;
 }
@@ -210,37 +418,76 @@ static int client_recv_message(int sockfd, struct common_buff *rbuf, uint16_t bu
 int main(int argc, char *argv[])
 {
 	struct common_buff *buff;
+	struct frame_decoder dec;
+	struct client_conn c;
 	struct epoll_event epev;
 	struct epoll_event events[2];
 	const char *ip_str;
 	const char *port_str;
-	uint32_t timeout;
 	uint16_t blen;
 	int sockfd, epfd;
-	int i, ret;
-
-	if (argc < 3) {
-		CLIENT_PRINT("usage: ./client ip port");
+	int i, ret, opt;
+
+	log_init();
+
+	memset(&c, 0x00, sizeof(struct client_conn));
+	c.dl.fd = -1;
+	buff_pool_init(&c.pool, CLIENT_POOL_IDLE);
+	outq_init(&c.outq, &c.pool);
+	c.hb.misses = HB_MISSES;
+	while ((opt = getopt(argc, argv, "P:M:K:U:")) != -1) {
+		switch (opt) {
+		case 'P':
+			c.hb.interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			c.hb.misses = strtoul(optarg, NULL, 0);
+			break;
+		case 'K':
+			c.hb.keepalive = strtoul(optarg, NULL, 0);
+			break;
+		case 'U':
+			c.hb.user_timeout = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			optind = argc;	/* usage */
+			break;
+		}
+	}
+	if ((argc - optind < 2) || (c.hb.misses == 0)) {
+		CLIENT_PRINT("usage: ./client [-P ping_seconds] [-M misses] [-K keepalive_seconds] [-U user_timeout_ms] ip port");
 		return -CLIENT_ERRNO;
 	}
 
-	blen = sizeof(struct common_buff);
+	blen = sizeof(struct common_buff) + DATA_MAX_LEN;
 	buff = (struct common_buff *)malloc(blen);
 	if (!buff) {
 		CLIENT_PRINT("get %d bytes buff memory failed", blen);
 		return -CLIENT_ERRNO;
 	}
 
-	ip_str   = argv[1];
-	port_str = argv[2];
+	if (frame_decoder_init(&dec, RECV_BUFF_LEN, RECV_HIGH_WATER, NULL) < 0) {
+		CLIENT_PRINT("get decoder memory failed");
+		free(buff);
+		return -CLIENT_ERRNO;
+	}
+	frame_decoder_ctrl(&dec, client_recv_ctrl);
+
+	ip_str   = argv[optind];
+	port_str = argv[optind + 1];
 	CLIENT_PRINT("addr: %s:%s", ip_str, port_str);
 
 	sockfd = client_connect_server(ip_str, port_str);
 	if (sockfd < 0) {
 		CLIENT_PRINT("connect server failed, %d", sockfd);
+		frame_decoder_exit(&dec);
 		free(buff);
 		return -CLIENT_ERRNO;
 	}
+	c.fd = sockfd;
+	if (hb_tcp_tune(sockfd, &c.hb) < 0) {
+		CLIENT_PRINT("set keepalive options failed, %s", strerror(errno));
+	}
 
 	epfd = epoll_create(2);
 	if (epfd < 0) {
@@ -248,7 +495,11 @@ int main(int argc, char *argv[])
 		goto label_main_exit;
 	}
 
-	timeout = 10*1000;
+	wheel_init(&c.timers);
+	wheel_timer_init(&c.hb_timer, client_heartbeat, &c);
+	if (c.hb.interval) {
+		wheel_add(&c.timers, &c.hb_timer, c.hb.interval * 1000ULL);
+	}
 	memset(&epev, 0x00, sizeof(struct epoll_event));
 	epev.events = EPOLLIN;
 	epev.data.fd = fileno(stdin);	/* stdin can also be monitored using epoll */
@@ -260,8 +511,12 @@ int main(int argc, char *argv[])
 
 	memset(events, 0x00, sizeof(struct epoll_event) * 2);
 	while (1) {
-		ret = epoll_wait(epfd, events, 2, timeout);
-		if (ret < 0) {
+		wheel_run(&c.timers);
+		client_watch(&c, epfd);
+		ret = epoll_wait(epfd, events, 2, wheel_timeout(&c.timers, CLIENT_WAIT_MS));
+		if ((ret < 0) && (errno == EINTR)) {
+			continue;	/* a signal, e.g. SIGCONT after a stop */
+		} else if (ret < 0) {
 			CLIENT_PRINT("epoll failed, %s", strerror(errno));
 			ret = -CLIENT_ERRNO;
 			break;
@@ -270,11 +525,18 @@ int main(int argc, char *argv[])
 			continue;
 		} else {
 			for (i=0; i<ret; i++) {
+				if ((events[i].events & EPOLLOUT) && (mode_flush(&c.outq, sockfd) < 0)) {
+					CLIENT_PRINT("write failed, %s", strerror(errno));
+					goto label_main_exit;
+				}
 				if (events[i].events & EPOLLIN) {
 					if (events[i].data.fd == fileno(stdin)) {
-						if (client_send_message(sockfd, buff, blen) < 0) {
+						if (client_send_message(&c, buff, DATA_MAX_LEN) < 0) {
 							goto label_main_exit;
 						}
+						if (strncmp((const char *)buff->data, XFER_CMD, strlen(XFER_CMD)) == 0) {
+							client_download_start(&c.dl, (const char *)buff->data + strlen(XFER_CMD));
+						}
 						if (strcmp((const char *)buff->data, "quit") == 0) {
 							CLIENT_PRINT("ready to quit...");
 							epoll_ctl(epfd, EPOLL_CTL_DEL, fileno(stdin), NULL);
@@ -285,7 +547,7 @@ int main(int argc, char *argv[])
 							goto label_main_exit;
 						}
 					} else if (events[i].data.fd == sockfd) {
-						if (client_recv_message(sockfd, buff, blen) <= 0) {
+						if (client_recv_message(&c, &dec) <= 0) {
 							goto label_main_exit;
 						}
 					}
@@ -303,6 +565,12 @@ label_main_exit:
 		close(sockfd);
 		sockfd = -1;
 	}
+	frame_decoder_exit(&dec);
+	outq_exit(&c.outq);
+	buff_pool_exit(&c.pool);
+	if (c.dl.fd >= 0) {
+		close(c.dl.fd);
+	}
 	if (buff) {
 		free(buff);
 		buff = NULL;
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE			/* pthread_setaffinity_np() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
@@ -10,29 +11,103 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "common.h"
+#include "frame.h"
+#include "pool.h"
+#include "conn_table.h"
+#include "config.h"
+#include "xfer.h"
+#include "zcopy.h"
+#include "outq.h"
+#include "fanout.h"
+#include "ctrl.h"
+#include "log.h"
+#include "metrics.h"
+#include "mode.h"
+#include "wheel.h"
+#include "heartbeat.h"
 
-#define LISTENQ						20
-#define MAX_CLIENTS					20
+#define CONN_TABLE_INIT				64		/* initial connection table slots */
+#define POOL_SLAB_OBJS				64					/* connections allocated at once */
+#define POOL_IDLE_BYTES				(4 * 1024 * 1024)	/* idle memory kept per buffer class */
+#define SERVER_WAIT_MS				(10 * 1000)			/* longest wait without a timer due */
+#define SERVER_SOURCE_BATCH			16					/* readable transfer sources taken at once */
 
+#define SERVER_OPTIONS				"c:b:e:Et:ZH:L:m:S:I:P:M:K:U:F:"	/* see config.h */
 #define SERVER_ERRNO				__LINE__
-#define SERVER_PRINT(_fmt, ...)		printf("[%04d] "_fmt"\n", __LINE__, ##__VA_ARGS__);
+#define SERVER_PRINT(_fmt, ...)		LOG_INFO("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
+#define SERVER_DEBUG(_fmt, ...)		LOG_DEBUG("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
+
+struct server_worker;
 
 struct client_connect_info {
 	int fd;
+	struct server_worker *w;			/* owning worker */
+	struct frame_decoder dec;	/* receive buffer */
+	struct common_buff *sbuf;	/* send buffer */
+	uint32_t sbuf_size;
 	struct sockaddr_in clientaddr;
+	uint32_t slot;						/* index in the connection table */
+	struct xfer xfer;					/* file being sent */
+	struct zc_tracker zc;				/* MSG_ZEROCOPY buffers in flight */
+	struct outq outq;					/* frames the socket did not take yet */
+	int want_out;						/* registered for EPOLLOUT */
+	int rd_paused;						/* output above the high watermark */
+	int subscribed;						/* ever subscribed to a topic */
+	int rd_closed;						/* peer shut its side, finishing the transfer */
+	struct wheel_timer idle;			/* -I timeout */
+	uint64_t active;					/* tick of the last frame in or bytes out */
+	struct wheel_timer hb;				/* -P heartbeat */
+	uint64_t hb_rx;						/* tick of the last ping or pong in */
+	struct client_connect_info *next;	/* closing list link */
+};
+
+/*
+ * One reactor: an epoll instance with its own listener, connections and
+ * pools. Workers share nothing, with several of them the kernel spreads
+ * new connections over their SO_REUSEPORT listeners.
+ */
+struct server_worker {
+	int id;
+	int cpu;							/* pinned CPU, -1 if not pinned */
+	int sockfd;							/* listening socket */
+	int epfd;
+	int ctrlfd;							/* -1 unless this worker takes console commands */
+	int srcfd;							/* epoll set of transfer sources waiting for data */
+	const struct server_config *cfg;
+	struct conn_table clients;
+	struct epoll_event *events;
+	struct slab_pool client_pool;		/* struct client_connect_info */
+	struct buff_pool buff_pool;			/* receive and send buffers */
+	struct client_connect_info *closing_list;	/* closed, not recycled yet */
+	struct fanout fanout;				/* topic subscriptions */
+	struct zc_stats zc_closed;			/* zerocopy counters of closed connections */
+	struct metrics metrics;				/* "epoll_w<id>" */
+	struct outq_buf *source;			/* frame streamed in source mode */
+	struct timer_wheel timers;			/* idle timeouts and heartbeats */
+	pthread_t tid;
 };
 
+static int stop_fd = -1;	/* eventfd, becomes readable when the server stops */
+static struct ctrl_chan ctrl = { .efd = -1 };	/* console, read by the control thread */
+static int file_root = -1;	/* -F directory, -1 when files are not served */
+
 /**
  * Listen socket connection
  *
  * @param[in] port_str	port string
+ * @param[in] backlog	listen() backlog
+ * @param[in] reuseport	share the port with the other workers' listeners
  *
  * @return On success, return the client connection fd.
  *		   On error, negative number of the error line number
  */
-static int server_listen_connection(const char *port_str)
+static int server_listen_connection(const char *port_str, int backlog, int reuseport)
 {
 	struct sockaddr_in servaddr;
 	uint16_t port;
@@ -60,6 +135,11 @@ static int server_listen_connection(const char *port_str)
 	servaddr.sin_port = htons(port);
 
 	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(int));
+	if (reuseport && (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(int)) < 0)) {
+		SERVER_PRINT("set SO_REUSEPORT failed, %s", strerror(errno));
+		ret = -SERVER_ERRNO;
+		goto label_server_listen_connection;
+	}
 
 	ret = bind(sockfd, (struct sockaddr *)&servaddr, sizeof(struct sockaddr_in));
 	if (ret < 0) {
@@ -68,7 +148,7 @@ static int server_listen_connection(const char *port_str)
 		goto label_server_listen_connection;
 	}
 
-	ret = listen(sockfd, LISTENQ);
+	ret = listen(sockfd, backlog);
 	if (ret < 0) {
 		SERVER_PRINT("listen failed, %s", strerror(errno));
 		ret = -SERVER_ERRNO;
@@ -85,101 +165,991 @@ label_server_listen_connection:
 }
 
 /**
- * Receive a message from the client
+ * Give back a buffer released by the zerocopy tracker
  *
- * @param[in] clientfd	client connection file descriptor
- * @param[in] rbuf		recv buff pointer
- * @param[in] buff_len	recv buff size
+ * @param[in] pool	worker buffer pool
+ * @param[in] buf	output queue buffer
+ * @param[in] size	unused, the buffer knows its size
+ */
+static void server_zc_release(struct buff_pool *pool, void *buf, uint32_t size)
+{
+	outq_buf_put(pool, (struct outq_buf *)buf);
+}
+
+/**
+ * Idle timer of a connection: shut it down once nothing happened for -I
+ * seconds, otherwise wait for the rest of the period
  *
- * @return On success, return the length of the sent.
+ * The data path only moves 'active' forward and never touches the timer.
+ * A frame trickled in byte by byte is no activity until it is complete.
+ * The shutdown wakes the connection up and the event loop closes it.
+ *
+ * @param[in] arg	client connection info
+ */
+static void server_client_idle(void *arg)
+{
+	struct client_connect_info *info = (struct client_connect_info *)arg;
+	struct server_worker *w = info->w;
+	uint64_t deadline = info->active + w->cfg->idle_timeout * 1000ULL;
+
+	if (deadline > wheel_now(&w->timers)) {
+		wheel_add(&w->timers, &info->idle, deadline);
+		return;
+	}
+
+	SERVER_PRINT("connect %s:%d idle for %u s, closing", inet_ntoa(info->clientaddr.sin_addr),
+				 info->clientaddr.sin_port, w->cfg->idle_timeout);
+	metrics_add(&w->metrics.idle_closes, 1);
+	shutdown(info->fd, SHUT_RDWR);
+}
+
+/**
+ * Handle a control frame received from the client: answer pings, note
+ * pongs
+ *
+ * @param[in] arg	client connection info
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return On success, return 0.
+ *		   On error (no memory to queue the pong), return -1
+ */
+static int server_recv_ctrl(void *arg, uint8_t *data, uint32_t len)
+{
+	struct client_connect_info *info = (struct client_connect_info *)arg;
+
+	switch (hb_frame_type(data, len)) {
+	case HB_FRAME_PING:
+		info->hb_rx = wheel_now(&info->w->timers);
+		if (xfer_active(&info->xfer)) {
+			return 0;	/* the transfer's frames answer it, a pong must not cut into them */
+		}
+		return (hb_send(info->fd, HB_FRAME_PONG, &info->outq) < 0) ? -1 : 0;
+	case HB_FRAME_PONG:
+		info->hb_rx = wheel_now(&info->w->timers);
+		return 0;
+	}
+
+	return 0;	/* unknown control frame */
+}
+
+/**
+ * Get a connection object and its buffers from the pools, and start its
+ * idle timer
+ *
+ * @param[in] w			worker
+ * @param[in] connfd		client connection file descriptor
+ * @param[in] clientaddr	client address
+ *
+ * @return On success, return the connection info.
+ *		   On error, NULL
+ */
+static struct client_connect_info *server_client_new(struct server_worker *w, int connfd,
+													 struct sockaddr_in *clientaddr)
+{
+	struct client_connect_info *info;
+
+	info = (struct client_connect_info *)slab_pool_get(&w->client_pool);
+	if (!info) {
+		return NULL;
+	}
+	memset(info, 0x00, sizeof(struct client_connect_info));
+
+	if (frame_decoder_init(&info->dec, RECV_BUFF_LEN, RECV_HIGH_WATER, &w->buff_pool) < 0) {
+		slab_pool_put(&w->client_pool, info);
+		return NULL;
+	}
+	frame_decoder_ctrl(&info->dec, server_recv_ctrl);
+
+	info->sbuf = (struct common_buff *)buff_pool_get(&w->buff_pool, sizeof(struct common_buff) + DATA_MAX_LEN,
+													 &info->sbuf_size);
+	if (!info->sbuf) {
+		frame_decoder_exit(&info->dec);
+		slab_pool_put(&w->client_pool, info);
+		return NULL;
+	}
+
+	info->fd = connfd;
+	info->w = w;
+	info->clientaddr = *clientaddr;
+	xfer_init(&info->xfer);
+	outq_init(&info->outq, &w->buff_pool);
+	if (w->cfg->zerocopy && (zc_init(&info->zc, connfd, &w->buff_pool) < 0)) {
+		SERVER_PRINT("SO_ZEROCOPY unsupported, %s", strerror(errno));
+	}
+	info->zc.pool = &w->buff_pool;
+	info->zc.release = server_zc_release;	/* queue buffers may be shared */
+
+	wheel_timer_init(&info->idle, server_client_idle, info);
+	info->active = wheel_now(&w->timers);
+	if (w->cfg->idle_timeout) {
+		wheel_add(&w->timers, &info->idle, info->active + w->cfg->idle_timeout * 1000ULL);
+	}
+
+	return info;
+}
+
+/**
+ * Close the connection and free its table slot
+ *
+ * The object may still be referenced by a pending event of the current
+ * epoll_wait() batch, so it is only recycled by server_client_reap().
+ *
+ * @param[in] w		worker
+ * @param[in] info	client connection info
+ */
+static void server_client_close(struct server_worker *w, struct client_connect_info *info)
+{
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, info->fd, NULL);
+	close(info->fd);
+	metrics_add(&w->metrics.closes, 1);
+	wheel_del(&w->timers, &info->idle);
+	wheel_del(&w->timers, &info->hb);
+	info->fd = -1;
+
+	conn_table_remove(&w->clients, info->slot);
+	if (info->subscribed) {
+		fanout_unsubscribe_all(&w->fanout, info);
+	}
+	xfer_close(&info->xfer);
+	outq_exit(&info->outq);
+	w->zc_closed.sends += info->zc.stats.sends;
+	w->zc_closed.completed += info->zc.stats.completed;
+	w->zc_closed.copied += info->zc.stats.copied;
+	zc_exit(&info->zc);
+	info->next = w->closing_list;
+	w->closing_list = info;
+}
+
+/**
+ * Recycle the buffers and connection objects closed during the last batch
+ *
+ * @param[in] w	worker
  */
-static int server_recv_message(int clientfd, struct common_buff *rbuf, uint16_t buff_len)
+static void server_client_reap(struct server_worker *w)
+{
+	struct client_connect_info *info;
+
+	while (w->closing_list) {
+		info = w->closing_list;
+		w->closing_list = info->next;
+
+		frame_decoder_exit(&info->dec);
+		buff_pool_put(&w->buff_pool, info->sbuf, info->sbuf_size);
+		slab_pool_put(&w->client_pool, info);
+	}
+}
+
+/**
+ * Print the worker's pool hit/miss counters
+ *
+ * @param[in] w	worker
+ */
+static void server_pool_stats(struct server_worker *w)
+{
+	struct slab_pool *client_pool = &w->client_pool;
+	struct client_connect_info *info;
+	struct buff_class *cls;
+	struct zc_stats zc;
+	int i;
+
+	SERVER_PRINT("worker %d client pool: hits %llu, misses %llu, in use %llu",
+				 w->id, (unsigned long long)client_pool->stats.hits,
+				 (unsigned long long)client_pool->stats.misses,
+				 (unsigned long long)client_pool->stats.in_use);
+	for (i=0; i<BUFF_POOL_CLASSES; i++) {
+		cls = &w->buff_pool.cls[i];
+		SERVER_PRINT("buff pool %6u: hits %llu, misses %llu, in use %llu, idle %u", cls->size,
+					 (unsigned long long)cls->stats.hits,
+					 (unsigned long long)cls->stats.misses,
+					 (unsigned long long)cls->stats.in_use, cls->free_cnt);
+	}
+
+	if (w->cfg->zerocopy) {
+		zc = w->zc_closed;
+		for (i=0; i<w->clients.size; i++) {
+			info = conn_table_get(&w->clients, i);
+			if (info) {
+				zc.sends += info->zc.stats.sends;
+				zc.completed += info->zc.stats.completed;
+				zc.copied += info->zc.stats.copied;
+			}
+		}
+		SERVER_PRINT("zerocopy: sends %llu, completed %llu, copied by the kernel %llu",
+					 (unsigned long long)zc.sends, (unsigned long long)zc.completed,
+					 (unsigned long long)zc.copied);
+	}
+
+	SERVER_PRINT("fan-out: %u topics, published %llu, delivered %llu, dropped %llu", w->fanout.count,
+				 (unsigned long long)w->fanout.stats.published,
+				 (unsigned long long)w->fanout.stats.delivered,
+				 (unsigned long long)w->fanout.stats.dropped);
+}
+
+/**
+ * Handle a complete frame received from the client
+ *
+ * In echo mode the frame is queued back and the whole read is flushed at
+ * once, in sink and source mode it is dropped. In console mode it is
+ * printed; "sub <topic>" and "unsub <topic>" update the client's
+ * subscriptions and "get <path>" starts a file transfer from the -F
+ * directory. Heartbeats never get here, see server_recv_ctrl().
+ *
+ * @param[in] arg	client connection info
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return On success, return 0.
+ *		   On error (no memory to echo), return -1
+ */
+static int server_recv_frame(void *arg, uint8_t *data, uint32_t len)
+{
+	struct client_connect_info *info = (struct client_connect_info *)arg;
+	char req[XFER_PEND_LEN * 2];
+	int ret;
+
+	metrics_add(&info->w->metrics.msgs_in, 1);
+	info->active = wheel_now(&info->w->timers);
+	if (info->w->cfg->mode == SERVER_MODE_ECHO) {
+		if (mode_echo(&info->outq, data, len) < 0) {
+			SERVER_PRINT("get output queue memory failed");
+			return -1;
+		}
+		metrics_add(&info->w->metrics.msgs_out, 1);
+		return 0;
+	} else if (info->w->cfg->mode != SERVER_MODE_CONSOLE) {
+		return 0;
+	}
+
+	SERVER_PRINT("RX[%04d]> %.*s", len, (int)len, data);
+
+	ret = fanout_command(&info->w->fanout, data, len, info);
+	if (ret != 0) {
+		if (ret > 0) {
+			info->subscribed = 1;
+		}
+		SERVER_PRINT("subscription %s", (ret > 0) ? "updated" : "failed");
+		return 0;
+	}
+
+	if ((len > strlen(XFER_CMD)) && (memcmp(data, XFER_CMD, strlen(XFER_CMD)) == 0)) {
+		if (xfer_active(&info->xfer)) {
+			SERVER_PRINT("transfer in progress, request dropped");
+			return 0;
+		}
+		len -= strlen(XFER_CMD);
+		if (len >= sizeof(req)) {
+			len = sizeof(req) - 1;
+		}
+		memcpy(req, &data[strlen(XFER_CMD)], len);
+		req[len] = '\0';
+		/* the data frames must fit the client's decoder */
+		xfer_open(&info->xfer, file_root, req, RECV_HIGH_WATER);
+	}
+
+	return 0;
+}
+
+/**
+ * Receive messages from the client
+ *
+ * Reads land directly in the connection's frame decoder, which may hold
+ * several pipelined frames or only part of one; what does not fit is
+ * picked up by the same readv() in a spill buffer.
+ *
+ * @param[in] info	client connection info
+ *
+ * @return On success, return the number of bytes read.
+ */
+static int server_recv_message(struct client_connect_info *info)
 {
-	char *rptr;
 	uint32_t rlen;
 	int ret;
 
-	rptr = (char *)rbuf;
 	rlen = 0;
 	do {
-		ret = read(clientfd, &rptr[rlen], buff_len - rlen);
+		ret = frame_decoder_readv(&info->dec, info->fd, server_recv_frame, info);
 		if (ret < 0) {
-			if (errno != EAGAIN) {
+			if (errno == EBADMSG) {
+				SERVER_PRINT("data error!!!");
+				return -SERVER_ERRNO;
+			} else if (errno != EAGAIN) {
 				SERVER_PRINT("read failed, %d, %s", errno, strerror(errno));
 				return -SERVER_ERRNO;
 			}
+			metrics_add(&info->w->metrics.eagain, 1);
 			break;
 		} else if (ret == 0) {
 			SERVER_PRINT("client closed connection");
 			return 0;
 		}
+		metrics_add(&info->w->metrics.bytes_in, ret);
 		rlen += ret;
 	} while (ret > 0);
 
-	SERVER_PRINT("RX[%04d]> %s", rlen, rbuf->data);
-
 	return rlen;
 }
 
 /**
- * Send a message to the client
+ * Register the epoll events the connection currently needs
+ *
+ * @param[in] w		worker
+ * @param[in] info	client connection info
+ * @param[in] op	EPOLL_CTL_ADD or EPOLL_CTL_MOD
+ */
+static void server_client_events(struct server_worker *w, struct client_connect_info *info, int op)
+{
+	struct epoll_event epev;
+
+	memset(&epev, 0x00, sizeof(struct epoll_event));
+	if (!info->rd_closed && !info->rd_paused) {
+		epev.events |= EPOLLIN | EPOLLRDHUP;
+	}
+	if (info->want_out) {
+		epev.events |= EPOLLOUT;
+	}
+	if (w->cfg->edge_triggered) {
+		epev.events |= EPOLLET;
+	}
+	epev.data.ptr = info;
+	epoll_ctl(w->epfd, op, info->fd, &epev);
+}
+
+/**
+ * Check whether anything is still queued for the client
+ *
+ * @param[in] info	client connection info
+ *
+ * @return 1 if queued frames or a file transfer are pending, 0 otherwise
+ */
+static int server_client_pending(struct client_connect_info *info)
+{
+	return !outq_empty(&info->outq) || xfer_active(&info->xfer);
+}
+
+/**
+ * Give back a sent queue buffer
+ *
+ * With MSG_ZEROCOPY the kernel may still read it after sendmsg() returned,
+ * so it goes through the tracker, which releases it right away otherwise.
+ *
+ * @param[in] arg	client connection info
+ * @param[in] b		sent buffer
+ */
+static void server_outq_release(void *arg, struct outq_buf *b)
+{
+	struct client_connect_info *info = (struct client_connect_info *)arg;
+
+	zc_hold(&info->zc, b, b->size);
+}
+
+/**
+ * Write the output queue, many buffers per sendmsg()
+ *
+ * @param[in] info	client connection info
+ *
+ * @return 1 once the queue is empty, 0 when the socket is full, -1 on error
+ */
+static int server_client_send_queue(struct client_connect_info *info)
+{
+	struct iovec iov[OUTQ_IOV_MAX];
+	ssize_t ret;
+	int cnt;
+
+	while (!outq_empty(&info->outq)) {
+		cnt = outq_iov(&info->outq, iov, OUTQ_IOV_MAX);
+		ret = zc_sendmsg(&info->zc, info->fd, iov, cnt, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				metrics_add(&info->w->metrics.eagain, 1);
+				return 0;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		metrics_add(&info->w->metrics.bytes_out, ret);
+		info->active = wheel_now(&info->w->timers);
+		outq_consume(&info->outq, ret, server_outq_release, info);
+	}
+
+	return 1;
+}
+
+/**
+ * Update the epoll interest after the output changed
+ *
+ * EPOLLOUT is only watched while the socket is full. Reading from the
+ * client stops while its queue is above the high watermark and resumes
+ * once it drained below the low one, so a slow reader cannot make it grow
+ * without bound.
+ *
+ * @param[in] w			worker
+ * @param[in] info		client connection info
+ * @param[in] blocked	the socket did not take everything
+ */
+static void server_client_watch(struct server_worker *w, struct client_connect_info *info, int blocked)
+{
+	int paused;
+
+	paused = info->rd_paused;
+	if (info->outq.bytes >= w->cfg->send_high) {
+		paused = 1;
+	} else if (info->outq.bytes <= w->cfg->send_low) {
+		paused = 0;
+	}
+	if (paused != info->rd_paused) {
+		SERVER_PRINT("%s reading %s:%d, %llu bytes queued", paused ? "pause" : "resume",
+					 inet_ntoa(info->clientaddr.sin_addr), info->clientaddr.sin_port,
+					 (unsigned long long)info->outq.bytes);
+	}
+
+	if ((info->want_out != blocked) || (info->rd_paused != paused)) {
+		info->want_out = blocked;
+		info->rd_paused = paused;
+		server_client_events(w, info, EPOLL_CTL_MOD);
+	}
+}
+
+/**
+ * Wait for a transfer source that has no data yet
+ *
+ * The source sits in the worker's source set until it is readable once,
+ * the connection's socket keeps its own interest meanwhile.
+ *
+ * @param[in] w		worker
+ * @param[in] info	client connection info
+ *
+ * @return On success, return 0.
+ *		   On error, return -1
+ */
+static int server_client_source_watch(struct server_worker *w, struct client_connect_info *info)
+{
+	struct epoll_event epev;
+
+	memset(&epev, 0x00, sizeof(struct epoll_event));
+	epev.events = EPOLLIN | EPOLLONESHOT;
+	epev.data.ptr = info;
+	if (epoll_ctl(w->srcfd, EPOLL_CTL_MOD, info->xfer.fd, &epev) == 0) {
+		return 0;
+	} else if (errno != ENOENT) {
+		return -1;
+	}
+
+	/* closing a source drops it from the set, a new one is added */
+	return epoll_ctl(w->srcfd, EPOLL_CTL_ADD, info->xfer.fd, &epev);
+}
+
+/**
+ * Push the output queue and the file transfer until they are done or the
+ * socket is full
+ *
+ * File payload goes from the file to the socket inside the kernel, a
+ * source without data is waited for in the worker's source set. In source
+ * mode the queue is topped up to the low watermark until the socket is
+ * full.
+ *
+ * @param[in] w		worker
+ * @param[in] info	client connection info
+ *
+ * @return On success, return 1 once everything is sent, 0 if it waits.
+ *		   On error, negative number of the error line number
+ */
+static int server_client_flush(struct server_worker *w, struct client_connect_info *info)
+{
+	uint64_t remain;
+	int ret;
+
+	do {
+		if (w->source) {
+			/* queue references to the shared frame, nothing is copied */
+			ret = mode_source_fill(&info->outq, w->source, w->cfg->send_low);
+			if (ret < 0) {
+				SERVER_PRINT("get output queue memory failed");
+				return -SERVER_ERRNO;
+			}
+			metrics_add(&w->metrics.msgs_out, ret);
+		}
+		ret = server_client_send_queue(info);
+		/* a source fills the socket, edge-triggered EPOLLOUT needs EAGAIN */
+	} while (w->source && (ret == 1));
+	if ((ret == 1) && xfer_active(&info->xfer)) {
+		remain = info->xfer.remain;
+		ret = xfer_send(&info->xfer, info->fd);
+		metrics_add(&w->metrics.bytes_out, remain - info->xfer.remain);	/* file payload */
+		if (info->xfer.remain != remain) {
+			info->active = wheel_now(&w->timers);
+		}
+		if (ret == 1) {
+			SERVER_PRINT("transfer to %s:%d done", inet_ntoa(info->clientaddr.sin_addr),
+						 info->clientaddr.sin_port);
+		} else if (ret == XFER_SOURCE_WAIT) {
+			if (server_client_source_watch(w, info) < 0) {
+				SERVER_PRINT("watch transfer source failed, %s", strerror(errno));
+				return -SERVER_ERRNO;
+			}
+			/* the socket has room, EPOLLOUT would only spin */
+			server_client_watch(w, info, 0);
+			return 0;
+		}
+	}
+	if (ret < 0) {
+		SERVER_PRINT("send failed, %s", strerror(errno));
+		return -SERVER_ERRNO;
+	}
+
+	/* a source always waits for room to stream more */
+	server_client_watch(w, info, (ret == 0) || w->source);
+
+	return ret;
+}
+
+/**
+ * Send a frame, the part the socket does not take right away is queued
+ *
+ * Nothing is copied when the queue is empty and the socket has room, the
+ * header and the payload are gathered by one sendmsg().
+ *
+ * @param[in] w			worker
+ * @param[in] info		client connection info
+ * @param[in] payload	frame payload
+ * @param[in] len		payload length
+ *
+ * @return On success, return the length of the frame.
+ *		   On error, negative number of the error line number
+ */
+static int server_client_send(struct server_worker *w, struct client_connect_info *info,
+							  const void *payload, uint32_t len)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	uint32_t hdr;
+	ssize_t ret;
+
+	hdr = htonl(len);
+	ret = 0;
+	if (!server_client_pending(info)) {
+		iov[0].iov_base = &hdr;
+		iov[0].iov_len = FRAME_HDR_LEN;
+		iov[1].iov_base = (void *)payload;
+		iov[1].iov_len = len;
+		memset(&msg, 0x00, sizeof(struct msghdr));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		ret = sendmsg(info->fd, &msg, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+				SERVER_PRINT("send failed, %s", strerror(errno));
+				return -SERVER_ERRNO;
+			}
+			metrics_add(&w->metrics.eagain, 1);
+			ret = 0;
+		}
+		metrics_add(&w->metrics.bytes_out, ret);
+		if (ret > 0) {
+			info->active = wheel_now(&w->timers);
+		}
+	}
+
+	if (ret < FRAME_HDR_LEN) {
+		if (outq_push_bytes(&info->outq, (uint8_t *)&hdr + ret, FRAME_HDR_LEN - ret) < 0) {
+			SERVER_PRINT("get output queue memory failed");
+			return -SERVER_ERRNO;
+		}
+		ret = FRAME_HDR_LEN;
+	}
+	if (outq_push_bytes(&info->outq, (uint8_t *)payload + (ret - FRAME_HDR_LEN),
+						len - (ret - FRAME_HDR_LEN)) < 0) {
+		SERVER_PRINT("get output queue memory failed");
+		return -SERVER_ERRNO;
+	}
+
+	if (info->want_out) {
+		/* EPOLLOUT flushes it, only the watermark may have changed */
+		server_client_watch(w, info, 1);
+	} else if (!outq_empty(&info->outq) && (server_client_flush(w, info) < 0)) {
+		return -SERVER_ERRNO;
+	}
+	metrics_add(&w->metrics.msgs_out, 1);
+
+	return FRAME_HDR_LEN + len;
+}
+
+/**
+ * Queue a bulk frame of 'len' generated payload bytes
+ *
+ * @param[in] w		worker
+ * @param[in] info	client connection info
+ * @param[in] len	payload length, capped at what the client accepts
+ *
+ * @return On success, return the length of the frame.
+ *		   On error, negative number of the error line number
+ */
+static int server_send_bulk(struct server_worker *w, struct client_connect_info *info, uint32_t len)
+{
+	struct outq_buf *b;
+	uint32_t i;
+
+	if (len > RECV_HIGH_WATER) {
+		len = RECV_HIGH_WATER;
+	}
+
+	b = outq_frame_new(&info->outq, len);
+	if (!b) {
+		SERVER_PRINT("get %u bytes bulk buff memory failed", len);
+		return -SERVER_ERRNO;
+	}
+	for (i=0; i<len; i++) {
+		b->data[FRAME_HDR_LEN + i] = 'a' + (i % 26);
+	}
+	outq_push(&info->outq, b);
+	metrics_add(&w->metrics.msgs_out, 1);
+	SERVER_PRINT("TX> %u bytes bulk frame", len);
+
+	if (info->want_out) {
+		server_client_watch(w, info, 1);
+	} else if (server_client_flush(w, info) < 0) {
+		return -SERVER_ERRNO;
+	}
+
+	return FRAME_HDR_LEN + len;
+}
+
+/**
+ * Send a message to the client, "@<bytes>" sends a generated bulk frame
+ * of that size instead
  *
- * @param[in] clientfd	client connection file descriptor
- * @param[in] sbuf		send buff pointer
- * @param[in] buff_len	send buff size
+ * @param[in] w			worker
+ * @param[in] info		client connection info
+ * @param[in] msg		message typed on the console
+ * @param[in] buff_len	send buff payload size
  *
  * @return On success, return the length of the sent.
  */
-static int server_send_message(int clientfd, struct common_buff *sbuf, uint16_t buff_len)
+static int server_send_message(struct server_worker *w, struct client_connect_info *info, const char *msg,
+							   uint16_t buff_len)
 {
+	struct common_buff *sbuf = info->sbuf;
 	uint32_t slen;
 	int ret;
 
-	/* clear send buff */
-	memset(sbuf->data, 0x00, buff_len);
-
-	/* get input from stdin  */
-	fgets((char *)sbuf->data, buff_len, stdin);
-	slen = strlen((char *)sbuf->data);
+	/* the console line (< CTRL_MSG_LEN) is cut to what the buffer holds */
+	slen = strnlen(msg, buff_len - 1);
+	memcpy(sbuf->data, msg, slen);
+	sbuf->data[slen] = '\0';
 	if (slen == 0) {
 		SERVER_PRINT("Input is empty");
 		return 0;
 	}
-	slen -= 1;
-	sbuf->data[slen] = '\0'; /* delete \n */
 
-	/* send to server */
-	ret = write(clientfd, sbuf, slen);
+	if ((sbuf->data[0] == '@') && (atoi((char *)&sbuf->data[1]) > 0)) {
+		return server_send_bulk(w, info, atoi((char *)&sbuf->data[1]));
+	}
+
+	/* send to client */
+	ret = server_client_send(w, info, sbuf->data, slen);
 	if (ret < 0) {
 		/* we failed */
-		SERVER_PRINT("write failed, %s", strerror(errno));
 		return -SERVER_ERRNO;
 	}
-	SERVER_PRINT("TX[%04d]> %s", ret, sbuf->data);
+	SERVER_PRINT("TX[%04d]> %s", ret, sbuf->data); /* 'ret' includes the frame header */
 
 	return ret;
 }
 
 /**
- * Select the client number to send the message to
+ * Fan-out delivery: send a shared frame to one client, queueing a
+ * reference to whatever the socket does not take
+ *
+ * A client in the middle of a file transfer, or whose queue is above the
+ * high watermark, misses the message instead of holding the others up.
+ * A failing client is only shut down here, the event loop closes it.
+ *
+ * @param[in] arg	worker
+ * @param[in] sub	client connection info
+ * @param[in] frame	shared frame
+ *
+ * @return 0 if the frame was sent or queued, -1 if the client missed it
+ */
+static int server_client_deliver(void *arg, void *sub, struct outq_buf *frame)
+{
+	struct server_worker *w = (struct server_worker *)arg;
+	struct client_connect_info *info = (struct client_connect_info *)sub;
+	ssize_t ret;
+
+	if ((info->fd < 0) || xfer_active(&info->xfer) || (info->outq.bytes >= w->cfg->send_high)) {
+		return -1;
+	}
+
+	ret = 0;
+	if (outq_empty(&info->outq)) {
+		ret = send(info->fd, frame->data, frame->len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+				shutdown(info->fd, SHUT_RDWR);
+				return -1;
+			}
+			metrics_add(&w->metrics.eagain, 1);
+			ret = 0;
+		}
+		metrics_add(&w->metrics.bytes_out, ret);
+		if (ret > 0) {
+			info->active = wheel_now(&w->timers);
+		}
+	}
+	if (outq_push_ref(&info->outq, frame, ret) < 0) {
+		if (ret > 0) {
+			/* part of the frame is out, the stream is broken */
+			shutdown(info->fd, SHUT_RDWR);
+		}
+		return -1;
+	}
+	metrics_add(&w->metrics.msgs_out, 1);
+
+	if (info->want_out) {
+		server_client_watch(w, info, 1);
+	} else if (!outq_empty(&info->outq) && (server_client_flush(w, info) < 0)) {
+		shutdown(info->fd, SHUT_RDWR);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Send one message to every client of the worker, it is encoded once
  *
- * @param[in] client_info	Client Connection Info
+ * @param[in] w			worker
+ * @param[in] payload	message
+ * @param[in] len		message length
+ *
+ * @return On success, return the number of clients reached.
+ *		   On error, negative number of the error line number
+ */
+static int server_broadcast(struct server_worker *w, const void *payload, uint32_t len)
+{
+	struct client_connect_info *info;
+	struct outq_buf *frame;
+	int i, cnt;
+
+	frame = fanout_encode(&w->fanout, payload, len);
+	if (!frame) {
+		SERVER_PRINT("get %u bytes broadcast buff memory failed", len);
+		return -SERVER_ERRNO;
+	}
+
+	for (i=0,cnt=0; i<w->clients.size; i++) {
+		info = conn_table_get(&w->clients, i);
+		if (info && (fanout_deliver(&w->fanout, info, frame, server_client_deliver, w) == 0)) {
+			cnt++;
+		}
+	}
+	outq_buf_put(&w->buff_pool, frame);
+
+	return cnt;
+}
+
+/**
+ * Send a console message to every client, or with 'topic' set take it as
+ * "<topic> <message>" and send it to the topic's subscribers
+ *
+ * @param[in] w		worker taking console commands
+ * @param[in] topic	publish to a topic instead of broadcasting
+ * @param[in] input	message line
+ */
+static void server_console_publish(struct server_worker *w, int topic, const char *input)
+{
+	char line[DATA_MAX_LEN];
+	char *msg;
+	int len, cnt;
+
+	snprintf(line, sizeof(line), "%s", input);
+	len = strlen(line);
+
+	if (!topic) {
+		cnt = server_broadcast(w, line, len);
+		SERVER_PRINT("TX[all]> %s, %d clients", line, cnt);
+		return;
+	}
+
+	msg = strchr(line, ' ');
+	if (!msg) {
+		SERVER_PRINT("usage: <topic> <message>");
+		return;
+	}
+	*msg++ = '\0';
+	cnt = fanout_publish(&w->fanout, line, msg, strlen(msg), server_client_deliver, w);
+	SERVER_PRINT("TX[%s]> %s, %d subscribers", line, msg, cnt);
+}
+
+/**
+ * Heartbeat timer of a connection: ping a client that has been silent for
+ * -P seconds, shut it down once it stayed silent for -M of them
+ *
+ * Output the client reads counts as hearing from it, so a streaming
+ * connection needs no pings; one with output or a transfer waiting skips
+ * its ping.
+ *
+ * @param[in] arg	client connection info
+ */
+static void server_client_heartbeat(void *arg)
+{
+	struct client_connect_info *info = (struct client_connect_info *)arg;
+	struct server_worker *w = info->w;
+	uint64_t heard = (info->hb_rx > info->active) ? info->hb_rx : info->active;
+	uint64_t next;
+	int ret;
+
+	switch (hb_check(&w->cfg->hb, wheel_now(&w->timers), heard, &next)) {
+	case HB_DEAD:
+		SERVER_PRINT("connect %s:%d silent for %u heartbeats, closing", inet_ntoa(info->clientaddr.sin_addr),
+					 info->clientaddr.sin_port, w->cfg->hb.misses);
+		metrics_add(&w->metrics.dead_closes, 1);
+		shutdown(info->fd, SHUT_RDWR);
+		return;
+	case HB_PING:
+		if (!server_client_pending(info)) {
+			ret = hb_send(info->fd, HB_FRAME_PING, &info->outq);
+			if (ret >= 0) {
+				metrics_add(&w->metrics.pings, 1);
+			}
+			if (ret == 0) {
+				server_client_watch(w, info, 1);
+			}
+		}
+		break;
+	}
+	wheel_add(&w->timers, &info->hb, next);
+}
+
+/**
+ * Accept pending connections and register them with epoll
+ *
+ * In edge-triggered mode the accept queue is drained until EAGAIN, the
+ * listener is not reported again for connections that are already queued.
+ *
+ * @param[in] w	worker
+ *
+ * @return On success, return the number of accepted clients.
+ *		   On error, negative number of the error line number
+ */
+static int server_accept_clients(struct server_worker *w)
+{
+	struct conn_table *clients = &w->clients;
+	int edge_triggered = w->cfg->edge_triggered;
+	struct client_connect_info *info;
+	struct sockaddr_in clientaddr;
+	socklen_t client_len;
+	int connfd, flags, slot, cnt;
+
+	cnt = 0;
+	do {
+		client_len = sizeof(struct sockaddr_in);
+		connfd = accept(w->sockfd, (struct sockaddr *)&clientaddr, &client_len);
+		if (connfd < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				break;
+			} else if ((errno == EINTR) || (errno == ECONNABORTED)) {
+				continue;
+			}
+			SERVER_PRINT("accept failed, %s", strerror(errno));
+			return -SERVER_ERRNO;
+		}
+		metrics_add(&w->metrics.accepts, 1);
+
+		if (clients->count >= clients->max_size) {
+			SERVER_PRINT("too many connections");
+			close(connfd);
+			continue;
+		}
+
+		SERVER_PRINT("worker %d accpet a new client: %s:%d", w->id, inet_ntoa(clientaddr.sin_addr), clientaddr.sin_port);
+		info = server_client_new(w, connfd, &clientaddr);
+		if (!info) {
+			SERVER_PRINT("get client buff memory failed");
+			close(connfd);
+			continue;
+		}
+		slot = conn_table_insert(clients, info);
+		if (slot < 0) {
+			SERVER_PRINT("get connection table memory failed");
+			info->slot = (uint32_t)-1;	/* not in the table */
+			server_client_close(w, info);
+			continue;
+		}
+		info->slot = slot;
+
+		flags = fcntl(connfd, F_GETFL, 0);
+		/* set non-blocking mode */
+		fcntl(connfd, F_SETFL, flags|O_NONBLOCK);
+		if (hb_tcp_tune(connfd, &w->cfg->hb) < 0) {
+			SERVER_PRINT("set keepalive options failed, %s", strerror(errno));
+		}
+		wheel_timer_init(&info->hb, server_client_heartbeat, info);
+		if (w->cfg->hb.interval) {
+			wheel_add(&w->timers, &info->hb, info->active + w->cfg->hb.interval * 1000ULL);
+		}
+
+		/* a source starts streaming as soon as the socket is writable */
+		info->want_out = (w->source != NULL);
+		server_client_events(w, info, EPOLL_CTL_ADD);
+		cnt++;
+	} while (edge_triggered);
+
+	return cnt;
+}
+
+/**
+ * Print the connections the console can send to
+ *
+ * @param[in] w	worker taking console commands
+ */
+static void server_list_clients(struct server_worker *w)
+{
+	struct client_connect_info *info;
+	uint32_t i, check_cnt;
+
+	for (i=0,check_cnt=0; (i<w->clients.size) && (check_cnt < w->clients.count); i++) {
+		info = conn_table_get(&w->clients, i);
+		if (info) {
+			SERVER_PRINT("Client %u: %s:%d", i, inet_ntoa(info->clientaddr.sin_addr), info->clientaddr.sin_port);
+			check_cnt++;
+		}
+	}
+	SERVER_PRINT("%u client(s)", check_cnt);
+}
+
+/**
+ * Select the client number to send the message to, "s" prints the pool
+ * counters and "l" the clients instead, "a" broadcasts the next line and "t" publishes it to
+ * a topic
+ *
+ * @param[in] w	worker taking console commands
+ * @param[in] cmd	console command
  *
  * @return On success, return the index of the client
  */
-static int server_select_client(struct client_connect_info *client_info)
+static int server_select_client(struct server_worker *w, const struct ctrl_cmd *cmd)
 {
-	char index[5+1] = {0};
-	int i, len;
+	const char *index = cmd->sel;
+	int i;
 
-	fgets(index, sizeof(char)*5, stdin);
-	len = strlen(index);
-	if (len > 0) {
-		index[len - 1] = '\0';	/* delete \n */
+	if (strcmp(index, "s") == 0) {
+		server_pool_stats(w);
+		return -SERVER_ERRNO;
+	} else if (strcmp(index, "l") == 0) {
+		server_list_clients(w);
+		return -SERVER_ERRNO;
+	} else if (w->cfg->mode != SERVER_MODE_CONSOLE) {
+		SERVER_PRINT("console sends are off in %s mode", mode_name(w->cfg->mode));
+		return -SERVER_ERRNO;
+	} else if ((strcmp(index, "a") == 0) || (strcmp(index, "t") == 0)) {
+		server_console_publish(w, index[0] == 't', cmd->msg);
+		return -SERVER_ERRNO;
 	}
 
 	i = atoi(index);
-	if ((i >= MAX_CLIENTS) || (client_info[i].fd <= 0)) {
+	if ((i < 0) || (!conn_table_get(&w->clients, i))) {
 		SERVER_PRINT("input error.");
 		return -SERVER_ERRNO;
 	}
@@ -187,166 +1157,440 @@ static int server_select_client(struct client_connect_info *client_info)
 	return i;
 }
 
-int main(int argc, char *argv[])
+/**
+ * Run the console commands the control thread has queued
+ *
+ * @param[in] w	worker taking console commands
+ */
+static void server_control(struct server_worker *w)
 {
-	struct client_connect_info client_info[MAX_CLIENTS];
-	struct sockaddr_in clientaddr;
-	struct common_buff *buff;
+	struct client_connect_info *info;
+	struct ctrl_cmd cmd;
+	int t;
+
+	while (ctrl_next(&ctrl, &cmd)) {
+		t = server_select_client(w, &cmd);
+		if (t < 0) {
+			continue;
+		}
+
+		info = conn_table_get(&w->clients, t);
+		if (xfer_active(&info->xfer)) {
+			/* a message now would land in the middle of a data frame */
+			SERVER_PRINT("transfer in progress, try again later");
+		} else if (info->outq.bytes >= w->cfg->send_high) {
+			SERVER_PRINT("client is slow, %llu bytes queued, try again later",
+						 (unsigned long long)info->outq.bytes);
+		} else if (server_send_message(w, info, cmd.msg, DATA_MAX_LEN) < 0) {
+			server_client_close(w, info);
+		}
+	}
+}
+
+/**
+ * Resume the transfers whose source became readable
+ *
+ * @param[in] w	worker
+ */
+static void server_sources(struct server_worker *w)
+{
+	struct epoll_event events[SERVER_SOURCE_BATCH];
+	struct client_connect_info *info;
+	int i, n;
+
+	do {
+		n = epoll_wait(w->srcfd, events, SERVER_SOURCE_BATCH, 0);
+		for (i=0; i<n; i++) {
+			info = (struct client_connect_info *)events[i].data.ptr;
+			if ((info->fd < 0) || !xfer_active(&info->xfer)) {
+				continue;	/* closed earlier in this batch */
+			}
+			if (server_client_flush(w, info) < 0) {
+				server_client_close(w, info);
+			} else if (info->rd_closed && !server_client_pending(info)) {
+				server_client_close(w, info);
+			}
+		}
+	} while (n == SERVER_SOURCE_BATCH);
+}
+
+/**
+ * Wake every worker up and make them leave their event loop
+ */
+static void server_stop(void)
+{
+	uint64_t val = 1;
+
+	if (write(stop_fd, &val, sizeof(uint64_t)) < 0) {
+		SERVER_PRINT("stop workers failed, %s", strerror(errno));
+	}
+}
+
+/**
+ * Create a worker's listener, epoll instance and pools
+ *
+ * @param[in] w			worker, zeroed
+ * @param[in] id		worker index, worker 0 also takes console commands
+ * @param[in] cfg		server configuration
+ * @param[in] port_str	port string
+ *
+ * @return On success, return 0.
+ *		   On error, negative number of the error line number
+ */
+static int server_worker_init(struct server_worker *w, int id, const struct server_config *cfg,
+							  const char *port_str)
+{
+	char name[METRICS_NAME_LEN];
 	struct epoll_event epev;
-	struct epoll_event events[MAX_CLIENTS];
-	socklen_t client_len;
-	const char *port_str;
-	uint32_t timeout;
-	uint16_t blen;
-	int sockfd, epfd, connfd;
-	int i, t, connect_cnt, check_cnt, ret;
+	uint32_t max_clients;
+	long online;
 
-	if (argc < 2) {
-		SERVER_PRINT("usage: ./server port");
-		return -SERVER_ERRNO;
+	snprintf(name, sizeof(name), "epoll_w%d", id);
+	metrics_init(&w->metrics, name);
+
+	w->id = id;
+	w->cfg = cfg;
+	w->sockfd = -1;
+	w->epfd = -1;
+	w->srcfd = -1;
+	w->ctrlfd = (id == 0) ? ctrl.efd : -1;
+	w->cpu = -1;
+	if (cfg->threads > 1) {
+		online = sysconf(_SC_NPROCESSORS_ONLN);
+		w->cpu = (online > 0) ? (id % online) : -1;
+	}
+
+	/* the connection limit is split evenly between the workers */
+	max_clients = cfg->max_clients / cfg->threads;
+	if (max_clients == 0) {
+		max_clients = 1;
 	}
 
-	blen = sizeof(struct common_buff);
-	buff = (struct common_buff *)malloc(blen);
-	if (!buff) {
-		SERVER_PRINT("get %d bytes buff memory failed", blen);
+	wheel_init(&w->timers);
+	slab_pool_init(&w->client_pool, sizeof(struct client_connect_info), POOL_SLAB_OBJS);
+	buff_pool_init(&w->buff_pool, POOL_IDLE_BYTES);
+	fanout_init(&w->fanout, &w->buff_pool);
+	if (cfg->mode == SERVER_MODE_SOURCE) {
+		w->source = mode_source_frame(&w->buff_pool, cfg->source_size);
+		if (!w->source) {
+			SERVER_PRINT("get %u bytes source buff memory failed", cfg->source_size);
+			return -SERVER_ERRNO;
+		}
+	}
+	if (conn_table_init(&w->clients, CONN_TABLE_INIT, max_clients) < 0) {
+		SERVER_PRINT("get connection table memory failed");
 		return -SERVER_ERRNO;
 	}
 
-	port_str = argv[1];
-	SERVER_PRINT("port: %s", port_str);
+	w->events = (struct epoll_event *)calloc(cfg->max_events, sizeof(struct epoll_event));
+	if (!w->events) {
+		SERVER_PRINT("get %u epoll events memory failed", cfg->max_events);
+		return -SERVER_ERRNO;
+	}
 
-	sockfd = server_listen_connection(port_str);
-	if (sockfd < 0) {
+	w->sockfd = server_listen_connection(port_str, cfg->backlog, cfg->threads > 1);
+	if (w->sockfd < 0) {
 		SERVER_PRINT("accept client connection failed");
-		free(buff);
 		return -SERVER_ERRNO;
 	}
 
-	client_len = sizeof(struct sockaddr_in);
-
-	connect_cnt = 0;
-	memset(client_info, 0x00, sizeof(struct client_connect_info) * MAX_CLIENTS);
-
-	epfd = epoll_create(2);
-	if (epfd < 0) {
+	w->epfd = epoll_create(2);
+	if (w->epfd < 0) {
 		SERVER_PRINT("epoll failed, %s", strerror(errno));
-		goto label_main_exit;
+		return -SERVER_ERRNO;
 	}
 
-	timeout = 10 * 1000;
+	/*
+	 * Client events carry their connection info in data.ptr, the console,
+	 * the listener, the source set and the stop eventfd carry a pointer to
+	 * their fd variable instead. The stop eventfd is never read, so it wakes every worker.
+	 */
 	memset(&epev, 0x00, sizeof(struct epoll_event));
 	epev.events = EPOLLIN;
-	epev.data.fd = fileno(stdin);	/* stdin can also be monitored using poll */
-	epoll_ctl(epfd, EPOLL_CTL_ADD, fileno(stdin), &epev);
+	epev.data.ptr = &stop_fd;
+	epoll_ctl(w->epfd, EPOLL_CTL_ADD, stop_fd, &epev);
+
+	if (w->ctrlfd >= 0) {
+		/* level-triggered, ctrl_next() resets the eventfd once drained */
+		epev.events = EPOLLIN;
+		epev.data.ptr = &w->ctrlfd;
+		epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->ctrlfd, &epev);
+	}
 
+	/* every worker has its own SO_REUSEPORT listener, no epoll set shares it */
 	epev.events = EPOLLIN;
-	epev.data.fd = sockfd;
-	epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &epev);
+	if (cfg->edge_triggered) {
+		epev.events |= EPOLLET;
+	}
+	epev.data.ptr = &w->sockfd;
+	epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->sockfd, &epev);
 
-	memset(events, 0x00, (sizeof(struct epoll_event) * MAX_CLIENTS));
-	while (1) {
-		SERVER_PRINT("Select a client to send a message:");
-		for (i=0,check_cnt=0; (i<MAX_CLIENTS) && (check_cnt < connect_cnt); i++) {
-			if (client_info[i].fd > 0) {
-				SERVER_PRINT("Client %d: %s:%d", i, inet_ntoa(client_info[i].clientaddr.sin_addr),
-							 client_info[i].clientaddr.sin_port);
-				check_cnt++;
-			}
+	if (file_root >= 0) {
+		/* readable as long as one of its sources is */
+		w->srcfd = epoll_create1(EPOLL_CLOEXEC);
+		if (w->srcfd < 0) {
+			SERVER_PRINT("epoll failed, %s", strerror(errno));
+			return -SERVER_ERRNO;
 		}
-		SERVER_PRINT("---------------------------------\n");
+		epev.events = EPOLLIN;
+		epev.data.ptr = &w->srcfd;
+		epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->srcfd, &epev);
+	}
 
-		ret = epoll_wait(epfd, events, MAX_CLIENTS, timeout);
-		if (ret < 0) {
+	return 0;
+}
+
+/**
+ * Close a worker's connections and release what server_worker_init() got
+ *
+ * @param[in] w	worker
+ */
+static void server_worker_exit(struct server_worker *w)
+{
+	struct client_connect_info *info;
+	int i;
+
+	metrics_exit(&w->metrics);
+	for (i=0; i<w->clients.size; i++) {
+		info = conn_table_get(&w->clients, i);
+		if (info) {
+			server_client_close(w, info);
+		}
+	}
+	server_client_reap(w);
+	conn_table_exit(&w->clients);
+	fanout_exit(&w->fanout);
+	free(w->events);
+	if (w->epfd > 0) {
+		close(w->epfd);
+	}
+	if (w->srcfd >= 0) {
+		close(w->srcfd);
+	}
+	if (w->sockfd > 0) {
+		close(w->sockfd);
+		w->sockfd = -1;
+	}
+
+	if (w->source) {
+		outq_buf_put(&w->buff_pool, w->source);
+		w->source = NULL;
+	}
+	server_pool_stats(w);
+	buff_pool_exit(&w->buff_pool);
+	slab_pool_exit(&w->client_pool);
+}
+
+/**
+ * Worker event loop, runs until epoll fails or the server is stopped
+ *
+ * @param[in] arg	worker
+ *
+ * @return NULL
+ */
+static void *server_worker_run(void *arg)
+{
+	struct server_worker *w = (struct server_worker *)arg;
+	struct client_connect_info *info;
+	struct epoll_event *events = w->events;
+	cpu_set_t cpus;
+	int i, t, nevents, ret;
+
+	if (w->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(w->cpu, &cpus);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+		if (ret != 0) {
+			SERVER_PRINT("worker %d pin to cpu %d failed, %s", w->id, w->cpu, strerror(ret));
+		}
+	}
+
+	if (w->ctrlfd >= 0) {
+		SERVER_PRINT("Select a client to send a message, \"l\" lists the clients:");
+	}
+
+	while (1) {
+		wheel_run(&w->timers);
+		nevents = epoll_wait(w->epfd, events, w->cfg->max_events, wheel_timeout(&w->timers, SERVER_WAIT_MS));
+		metrics_wakeup(&w->metrics, nevents);
+		if ((nevents < 0) && (errno == EINTR)) {
+			continue;	/* a signal, e.g. SIGCONT after a stop */
+		} else if (nevents < 0) {
 			SERVER_PRINT("epoll failed, %s", strerror(errno));
-			ret = -SERVER_ERRNO;
 			break;
-		} else if (ret == 0) {
+		} else if (nevents == 0) {
 			/* SERVER_PRINT("epoll timeout..."); */
 			continue;
-		} else {
-			for (i=0; i<ret; i++) {
-				if (events[i].events & EPOLLIN) {
-					if (events[i].data.fd == fileno(stdin)) { /* stdin */
-						t = server_select_client(client_info);
-						if (t >= 0) {
-							if (server_send_message(client_info[t].fd, buff, blen) < 0) {
-								epoll_ctl(epfd, EPOLL_CTL_DEL, client_info[t].fd, NULL);
-								close(client_info[t].fd);
-								client_info[t].fd = -1;
-								connect_cnt --;
-							}
-						}
-					} else if (events[i].data.fd == sockfd) {
-						connfd = accept(sockfd, (struct sockaddr *)&clientaddr, &client_len);
-						if (connfd < 0) {
-							SERVER_PRINT("accept failed, %s", strerror(errno));
-							ret = -SERVER_ERRNO;
-							break;
-						}
-
-						if (connect_cnt >= MAX_CLIENTS) {
-							SERVER_PRINT("too many connections");
-							close(connfd);
-							connfd = -1;
-						} else {
-							SERVER_PRINT("accpet a new client: %s:%d", inet_ntoa(clientaddr.sin_addr), clientaddr.sin_port);
-							for (t=0; t<MAX_CLIENTS; t++) {
-								if (client_info[t].fd <= 0) {
-									int flags = fcntl(connfd, F_GETFL, 0);
-									/* set non-blocking mode */
-									fcntl(connfd, F_SETFL, flags|O_NONBLOCK);
-
-									epev.events = EPOLLIN;
-									epev.data.fd = connfd;
-									epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &epev);
-
-									client_info[t].fd = connfd;
-									client_info[t].clientaddr = clientaddr;
-									connect_cnt ++;
-									break;
-								}
-							}
-						}
-					} else {
-						for (t=0; t<MAX_CLIENTS; t++) { /* This loop is just to print out the log */
-							if ((events[i].data.fd > 0) && (events[i].data.fd == client_info[t].fd)) {
-								SERVER_PRINT("From client %s:%d.", inet_ntoa(client_info[t].clientaddr.sin_addr),
-											 client_info[t].clientaddr.sin_port);
-								if (server_recv_message(events[i].data.fd, buff, blen) <= 0) {
-									epoll_ctl(epfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
-									close(events[i].data.fd);
-									client_info[t].fd = -1;
-									connect_cnt --;
-									SERVER_PRINT("connect %s:%d closed.", inet_ntoa(client_info[t].clientaddr.sin_addr),
-												 client_info[t].clientaddr.sin_port);
-								}
-								break;
-							}
-						}
+		}
+
+		for (i=0; i<nevents; i++) {
+			if (!(events[i].events & (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+				continue;
+			}
+
+			if (events[i].data.ptr == &stop_fd) {
+				goto label_worker_exit;
+			} else if (events[i].data.ptr == &w->ctrlfd) { /* console */
+				server_control(w);
+			} else if (events[i].data.ptr == &w->sockfd) {
+				server_accept_clients(w);
+			} else if (events[i].data.ptr == &w->srcfd) {
+				server_sources(w);
+			} else {
+				info = (struct client_connect_info *)events[i].data.ptr;
+				if (info->fd < 0) {
+					/* closed earlier in this batch */
+					continue;
+				}
+
+				if (info->zc.enabled && (events[i].events & EPOLLERR)) {
+					/* zerocopy completions arrive on the error queue */
+					if (zc_reap(&info->zc, info->fd) < 0) {
+						SERVER_PRINT("socket error, %s", strerror(errno));
+						server_client_close(w, info);
+						continue;
 					}
+					events[i].events &= ~EPOLLERR;
+				}
+
+				if (events[i].events & EPOLLOUT) {
+					if (server_client_flush(w, info) < 0) {
+						server_client_close(w, info);
+						continue;
+					}
+				}
+				if (info->rd_closed) {
+					if (!server_client_pending(info)) {
+						server_client_close(w, info);
+					}
+					continue;
+				}
+				if (!(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+					continue;
+				}
+
+				SERVER_DEBUG("From client %s:%d.", inet_ntoa(info->clientaddr.sin_addr),
+							 info->clientaddr.sin_port);
+				if (events[i].events & EPOLLRDHUP) {
+					/* drain what is left, the read returning 0 closes it */
+					SERVER_PRINT("client half-closed the connection");
+				}
+				ret = server_recv_message(info);
+				if ((ret == 0) && server_client_pending(info)) {
+					/* the request came with the FIN, finish answering it */
+					info->rd_closed = 1;
+					server_client_events(w, info, EPOLL_CTL_MOD);
+					ret = 1;
+				}
+				if ((ret > 0) && server_client_pending(info) && !info->want_out) {
+					t = server_client_flush(w, info);
+					if ((t < 0) || ((t > 0) && info->rd_closed)) {
+						ret = 0;
+					}
+				}
+				if (ret <= 0) {
+					SERVER_PRINT("connect %s:%d closed.", inet_ntoa(info->clientaddr.sin_addr),
+								 info->clientaddr.sin_port);
+					server_client_close(w, info);
 				}
 			}
 		}
+		server_client_reap(w);
+		metrics_handled(&w->metrics);
 	}
 
-label_main_exit:
-	for (i=0; i<MAX_CLIENTS; i++) {
-		if (client_info[i].fd > 0) {
-			close(client_info[i].fd);
-			client_info[i].fd = -1;
+label_worker_exit:
+	/* one worker leaving takes the whole server down */
+	server_stop();
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct server_worker *workers;
+	struct server_config cfg;
+	const char *port_str;
+	uint32_t i, started;
+	int ret;
+
+	log_init();
+
+	ret = server_config_parse(&cfg, SERVER_OPTIONS, argc, argv);
+	if ((ret < 0) || (ret >= argc)) {
+		SERVER_PRINT("usage: ./server [-c max_clients] [-b backlog] [-e max_events] [-E] [-t threads] [-Z] [-H high] [-L low] [-m console|echo|sink|source] [-S size] [-I idle_seconds] [-P ping_seconds] [-M misses] [-K keepalive_seconds] [-U user_timeout_ms] [-F file_root] port");
+		return -SERVER_ERRNO;
+	}
+
+	port_str = argv[ret];
+	SERVER_PRINT("port: %s, max clients: %u, backlog: %d, %s-triggered, %u worker(s), %s mode", port_str,
+				 cfg.max_clients, cfg.backlog, cfg.edge_triggered ? "edge" : "level", cfg.threads,
+				 mode_name(cfg.mode));
+
+	if (cfg.file_root) {
+		file_root = xfer_root_open(cfg.file_root);
+		if (file_root < 0) {
+			SERVER_PRINT("open file root %s failed, %s", cfg.file_root, strerror(errno));
+			return -SERVER_ERRNO;
 		}
+		SERVER_PRINT("serving files below %s", cfg.file_root);
 	}
-	if (epfd > 0) {
-		close(epfd);
+
+	workers = (struct server_worker *)calloc(cfg.threads, sizeof(struct server_worker));
+	if (!workers) {
+		SERVER_PRINT("get %u workers memory failed", cfg.threads);
+		return -SERVER_ERRNO;
 	}
-	if (sockfd > 0) {
-		close(sockfd);
-		sockfd = -1;
+
+	stop_fd = eventfd(0, EFD_NONBLOCK);
+	if (stop_fd < 0) {
+		SERVER_PRINT("eventfd failed, %s", strerror(errno));
+		free(workers);
+		return -SERVER_ERRNO;
+	}
+
+	/* before any thread is started, they all leave SIGUSR1 to the dump thread */
+	metrics_signal_init(SIGUSR1);
+
+	/* the console is read on a thread of its own, worker 0 takes its commands */
+	if (ctrl_start(&ctrl, stdin, "sl") < 0) {
+		SERVER_PRINT("start control thread failed, %s", strerror(errno));
+		close(stop_fd);
+		free(workers);
+		return -SERVER_ERRNO;
+	}
+
+	started = 0;
+	for (i=0; i<cfg.threads; i++) {
+		if (server_worker_init(&workers[i], i, &cfg, port_str) < 0) {
+			cfg.threads = i + 1;	/* release the partially set up one too */
+			goto label_main_exit;
+		}
+	}
+
+	/* worker 0 runs on the main thread and takes the console commands */
+	for (started=1; started<cfg.threads; started++) {
+		ret = pthread_create(&workers[started].tid, NULL, server_worker_run, &workers[started]);
+		if (ret != 0) {
+			SERVER_PRINT("create worker %u failed, %s", started, strerror(ret));
+			server_stop();
+			break;
+		}
+	}
+	server_worker_run(&workers[0]);
+
+label_main_exit:
+	for (i=1; i<started; i++) {
+		pthread_join(workers[i].tid, NULL);
+	}
+	ctrl_stop(&ctrl);
+	for (i=0; i<cfg.threads; i++) {
+		server_worker_exit(&workers[i]);
 	}
-	if (buff) {
-		free(buff);
-		buff = NULL;
+	free(workers);
+	close(stop_fd);
+	if (file_root >= 0) {
+		close(file_root);
 	}
 
 	SERVER_PRINT("server exit ...");
@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <poll.h>
+
+#include "common.h"
+#include "frame.h"
+#include "uring.h"
+#include "log.h"
+
+#define URING_ENTRIES				8		/* stdin poll, receive and send */
+#define URING_RECV_BUFS				64		/* provided receive buffers, a power of 2 */
+#define URING_RECV_BUF_LEN			4096
+#define URING_RECV_BGID				0		/* receive buffer group */
+
+#define CLIENT_ERRNO				__LINE__
+#define CLIENT_PRINT(_fmt, ...)		LOG_INFO("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
+
+enum {
+	CLIENT_OP_STDIN,
+	CLIENT_OP_RECV,
+	CLIENT_OP_SEND,
+};
+
+/**
+ * Connect to the server
+ *
+ * @param[in] ip_str	ip address string
+ * @param[in] port_str	port string
+ *
+ * @return On success, a file descriptor for the new socket is returned.
+ *		   On error, negative number of the error line number
+ */
+static int client_connect_server(const char *ip_str, const char *port_str)
+{
+	struct sockaddr_in servaddr;
+	uint16_t port;
+	int sockfd;
+	int ret;
+
+	/* Creating a socket descriptor  */
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd < 0) {
+		CLIENT_PRINT("create socket failed, %s", strerror(errno));
+		return -CLIENT_ERRNO;
+	}
+	CLIENT_PRINT("create ok");
+
+	port = atoi(port_str);
+	bzero(&servaddr, sizeof(struct sockaddr_in));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_port = htons(port);
+	if (inet_pton(AF_INET, ip_str, &servaddr.sin_addr) <= 0) {
+		CLIENT_PRINT("IP %s conversion failed, %s", ip_str, strerror(errno));
+		ret = -CLIENT_ERRNO;
+		goto label_client_connect_server;
+	}
+
+	/* Connect to the server, three handshakes right here */
+	ret = connect(sockfd, (struct sockaddr *)&servaddr, sizeof(struct sockaddr_in));
+	if (ret < 0) {
+		CLIENT_PRINT("Connect failed, %s", strerror(errno));
+		ret = -CLIENT_ERRNO;
+		goto label_client_connect_server;
+	}
+	CLIENT_PRINT("connect ok");
+
+	return sockfd;
+label_client_connect_server:
+	if (sockfd > 0) {
+		close(sockfd);
+		sockfd = -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Queue a request, the SQE is submitted with the next wait
+ *
+ * @param[in] ring	ring
+ * @param[in] op	CLIENT_OP_*
+ * @param[in] fd	file descriptor
+ * @param[in] buf	data to send, CLIENT_OP_SEND only
+ * @param[in] len	bytes to send, CLIENT_OP_SEND only
+ *
+ * @return On success, return 0.
+ *		   On error, negative number of the error line number
+ */
+static int client_queue_request(struct uring *ring, int op, int fd, const void *buf, uint32_t len)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+	if (!sqe) {
+		CLIENT_PRINT("submission queue full, %s", strerror(errno));
+		return -CLIENT_ERRNO;
+	}
+
+	switch (op) {
+	case CLIENT_OP_STDIN:
+		uring_prep_poll(sqe, fd, POLLIN, op);
+		break;
+	case CLIENT_OP_RECV:
+		uring_prep_recv_multishot(sqe, fd, URING_RECV_BGID, op);
+		break;
+	case CLIENT_OP_SEND:
+		uring_prep_send(sqe, fd, buf, len, op);
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * Send a message to the server
+ *
+ * The send is only queued, the buffer must not be reused before its
+ * completion.
+ *
+ * @param[in] ring		ring
+ * @param[in] sockfd	socket file descriptor
+ * @param[in] sbuf		send buff pointer
+ * @param[in] buff_len	send buff payload size
+ *
+ * @return On success, return the payload length queued.
+ */
+static int client_send_message(struct uring *ring, int sockfd, struct common_buff *sbuf, uint16_t buff_len)
+{
+	uint32_t slen;
+
+	/* clear send buff */
+	memset(sbuf->data, 0x00, buff_len);
+
+	/* get input from stdin  */
+	fgets((char *)sbuf->data, buff_len, stdin);
+	slen = strlen((char *)sbuf->data);
+	if (slen == 0) {
+		CLIENT_PRINT("Input is empty");
+		return 0;
+	}
+	slen -= 1;
+	sbuf->data[slen] = '\0'; /* delete \n */
+
+	if (client_queue_request(ring, CLIENT_OP_SEND, sockfd, sbuf, frame_encode(sbuf, slen)) < 0) {
+		return -CLIENT_ERRNO;
+	}
+
+	return slen;
+}
+
+/**
+ * Print a complete frame received from the server
+ *
+ * @param[in] arg	unused
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return always 0
+ */
+static int client_recv_frame(void *arg, uint8_t *data, uint32_t len)
+{
+	CLIENT_PRINT("RX[%04d]> %.*s", len, (int)len, data);
+
+	return 0;
+}
+
+/**
+ * Handle a multishot receive completion
+ *
+ * @param[in] ring		ring
+ * @param[in] bring		provided receive buffers
+ * @param[in] sockfd	socket file descriptor
+ * @param[in] dec		frame decoder of the connection
+ * @param[in] cqe		receive completion
+ *
+ * @return On success, return the number of bytes read (1 when the receive
+ *		   only had to be re-armed), 0 if the server closed.
+ */
+static int client_recv_message(struct uring *ring, struct uring_buf_ring *bring, int sockfd,
+							   struct frame_decoder *dec, struct io_uring_cqe *cqe)
+{
+	uint16_t bid;
+	int ret;
+
+	if (cqe->res < 0) {
+		if (cqe->res == -ENOBUFS) {
+			/* out of provided buffers, re-arm, this batch recycles some */
+			if (client_queue_request(ring, CLIENT_OP_RECV, sockfd, NULL, 0) < 0) {
+				return -CLIENT_ERRNO;
+			}
+			return 1;
+		}
+		CLIENT_PRINT("read failed, %s", strerror(-cqe->res));
+		return -CLIENT_ERRNO;
+	} else if (cqe->res == 0) {
+		CLIENT_PRINT("server closed connection");
+		return 0;
+	}
+
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	ret = frame_decoder_feed(dec, uring_buf_ring_addr(bring, bid), cqe->res, client_recv_frame, NULL);
+	uring_buf_ring_recycle(bring, bid);
+	if (ret < 0) {
+		CLIENT_PRINT("data error!!!");
+		return -CLIENT_ERRNO;
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_MORE) && (client_queue_request(ring, CLIENT_OP_RECV, sockfd, NULL, 0) < 0)) {
+		return -CLIENT_ERRNO;
+	}
+
+	return cqe->res;
+}
+
+int main(int argc, char *argv[])
+{
+	struct uring_buf_ring bring;
+	struct io_uring_cqe *cqe;
+	struct common_buff *buff;
+	struct frame_decoder dec;
+	struct uring ring;
+	const char *ip_str;
+	const char *port_str;
+	uint16_t blen;
+	int sockfd, stdinfd;
+	int sending, quit;
+	int ret;
+
+	log_init();
+
+	if (argc < 3) {
+		CLIENT_PRINT("usage: ./client ip port");
+		return -CLIENT_ERRNO;
+	}
+
+	blen = sizeof(struct common_buff) + DATA_MAX_LEN;
+	buff = (struct common_buff *)malloc(blen);
+	if (!buff) {
+		CLIENT_PRINT("get %d bytes buff memory failed", blen);
+		return -CLIENT_ERRNO;
+	}
+
+	if (frame_decoder_init(&dec, RECV_BUFF_LEN, RECV_HIGH_WATER, NULL) < 0) {
+		CLIENT_PRINT("get decoder memory failed");
+		free(buff);
+		return -CLIENT_ERRNO;
+	}
+
+	ip_str   = argv[1];
+	port_str = argv[2];
+	CLIENT_PRINT("addr: %s:%s", ip_str, port_str);
+
+	sockfd = client_connect_server(ip_str, port_str);
+	if (sockfd < 0) {
+		CLIENT_PRINT("connect server failed, %d", sockfd);
+		frame_decoder_exit(&dec);
+		free(buff);
+		return -CLIENT_ERRNO;
+	}
+
+	memset(&bring, 0x00, sizeof(struct uring_buf_ring));
+	if (uring_init(&ring, URING_ENTRIES) < 0) {
+		CLIENT_PRINT("io_uring setup failed, %s", strerror(errno));
+		goto label_main_exit;
+	}
+	if (uring_buf_ring_init(&ring, &bring, URING_RECV_BGID, URING_RECV_BUFS, URING_RECV_BUF_LEN) < 0) {
+		CLIENT_PRINT("register receive buffers failed, %s", strerror(errno));
+		goto label_main_exit;
+	}
+
+	stdinfd = fileno(stdin);
+	if ((client_queue_request(&ring, CLIENT_OP_STDIN, stdinfd, NULL, 0) < 0) ||
+		(client_queue_request(&ring, CLIENT_OP_RECV, sockfd, NULL, 0) < 0)) {
+		goto label_main_exit;
+	}
+
+	sending = quit = 0;
+	while (1) {
+		ret = uring_submit(&ring, 1);
+		if ((ret < 0) && (errno != EINTR)) {
+			CLIENT_PRINT("io_uring enter failed, %s", strerror(errno));
+			break;
+		}
+
+		while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+			switch (cqe->user_data) {
+			case CLIENT_OP_STDIN:
+				if (sending) {
+					/* the buffer is still owned by the kernel, poll again later */
+					break;
+				}
+				ret = client_send_message(&ring, sockfd, buff, DATA_MAX_LEN);
+				if (ret < 0) {
+					goto label_main_exit;
+				} else if (ret > 0) {
+					sending = 1;
+				} else if (client_queue_request(&ring, CLIENT_OP_STDIN, stdinfd, NULL, 0) < 0) {
+					goto label_main_exit;
+				}
+				break;
+			case CLIENT_OP_RECV:
+				if (client_recv_message(&ring, &bring, sockfd, &dec, cqe) <= 0) {
+					goto label_main_exit;
+				}
+				break;
+			case CLIENT_OP_SEND:
+				sending = 0;
+				if (cqe->res < 0) {
+					CLIENT_PRINT("write failed, %s", strerror(-cqe->res));
+					goto label_main_exit;
+				}
+				CLIENT_PRINT("TX[%04d]> %s", cqe->res, buff->data); /* 'res' includes the frame header */
+				if (strcmp((const char *)buff->data, "quit") == 0) {
+					CLIENT_PRINT("ready to quit...");
+					if (shutdown(sockfd, 1)) {
+						CLIENT_PRINT("shutdown failed, %s", strerror(errno));
+					}
+					quit = 1;
+					break;
+				}
+				if (client_queue_request(&ring, CLIENT_OP_STDIN, stdinfd, NULL, 0) < 0) {
+					goto label_main_exit;
+				}
+				break;
+			}
+			uring_cqe_seen(&ring);
+			if (quit) {
+				goto label_main_exit;
+			}
+		}
+	}
+
+label_main_exit:
+	uring_buf_ring_exit(&ring, &bring);
+	uring_exit(&ring);
+	if (sockfd > 0) {
+		close(sockfd);
+		sockfd = -1;
+	}
+	frame_decoder_exit(&dec);
+	if (buff) {
+		free(buff);
+		buff = NULL;
+	}
+
+	CLIENT_PRINT("client exit...");
+
+	return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef __COMMON_H__
+#define __COMMON_H__
+
+#include <stdint.h>
+
+#define DATA_MAX_LEN	1024			/* largest payload typed on stdin */
+#define RECV_BUFF_LEN	(16 * 1024)		/* per-connection receive buffer */
+#define RECV_HIGH_WATER	(256 * 1024)	/* largest payload accepted from the peer */
+struct common_buff {
+	uint32_t len;
+	uint8_t data[0];
+};
+
+#endif	/* #ifndef __COMMON_H__ */
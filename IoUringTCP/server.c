@@ -0,0 +1,630 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "common.h"
+#include "frame.h"
+#include "pool.h"
+#include "conn_table.h"
+#include "config.h"
+#include "uring.h"
+#include "ctrl.h"
+#include "log.h"
+#include "metrics.h"
+
+#define CONN_TABLE_INIT				64		/* initial connection table slots */
+#define POOL_SLAB_OBJS				64					/* connections allocated at once */
+#define POOL_IDLE_BYTES				(4 * 1024 * 1024)	/* idle memory kept per buffer class */
+#define URING_ENTRIES				256		/* submission queue size */
+#define URING_RECV_BUFS				512		/* provided receive buffers, a power of 2 */
+#define URING_RECV_BUF_LEN			4096
+#define URING_RECV_BGID				0		/* receive buffer group */
+
+#define SERVER_OPTIONS				"c:b:"	/* see config.h */
+#define SERVER_ERRNO				__LINE__
+#define SERVER_PRINT(_fmt, ...)		LOG_INFO("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
+#define SERVER_DEBUG(_fmt, ...)		LOG_DEBUG("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
+
+/*
+ * Every SQE carries the request type in the low bits of user_data, and the
+ * connection info (8-byte aligned) in the others.
+ */
+enum {
+	SERVER_OP_ACCEPT,
+	SERVER_OP_CTRL,
+	SERVER_OP_RECV,
+	SERVER_OP_SEND,
+};
+#define SERVER_OP_MASK				0x7
+#define SERVER_USER_DATA(_ptr, _op)	((uint64_t)(uintptr_t)(_ptr) | (_op))
+
+struct client_connect_info {
+	int fd;
+	struct frame_decoder dec;	/* receive buffer */
+	struct common_buff *sbuf;	/* send buffer */
+	uint32_t sbuf_size;
+	struct sockaddr_in clientaddr;
+	uint32_t slot;				/* index in the connection table */
+	uint32_t inflight;			/* requests whose last completion is still pending */
+	int sending;				/* sbuf is owned by the kernel */
+	int closing;
+};
+
+static struct slab_pool client_pool;	/* struct client_connect_info */
+static struct buff_pool buff_pool;		/* receive and send buffers */
+static struct conn_table clients;
+static struct uring ring;
+static struct uring_buf_ring recv_bufs;	/* shared by all multishot receives */
+static struct ctrl_chan ctrl = { .efd = -1 };	/* console, read by the control thread */
+static struct metrics metrics;
+
+/**
+ * Listen socket connection
+ *
+ * The socket stays blocking, io_uring waits for connections itself.
+ *
+ * @param[in] port_str	port string
+ * @param[in] backlog	listen() backlog
+ *
+ * @return On success, return the client connection fd.
+ *		   On error, negative number of the error line number
+ */
+static int server_listen_connection(const char *port_str, int backlog)
+{
+	struct sockaddr_in servaddr;
+	uint16_t port;
+	int sockfd;
+	int ret;
+	int on = 1;
+
+	/* Creating a socket descriptor  */
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd < 0) {
+		SERVER_PRINT("create socket failed, %s", strerror(errno));
+		return -SERVER_ERRNO;
+	}
+	SERVER_PRINT("create ok");
+
+	port = atoi(port_str);
+	bzero(&servaddr, sizeof(struct sockaddr_in));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	servaddr.sin_port = htons(port);
+
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(int));
+
+	ret = bind(sockfd, (struct sockaddr *)&servaddr, sizeof(struct sockaddr_in));
+	if (ret < 0) {
+		SERVER_PRINT("bind port failed, %s", strerror(errno));
+		ret = -SERVER_ERRNO;
+		goto label_server_listen_connection;
+	}
+
+	ret = listen(sockfd, backlog);
+	if (ret < 0) {
+		SERVER_PRINT("listen failed, %s", strerror(errno));
+		ret = -SERVER_ERRNO;
+		goto label_server_listen_connection;
+	}
+
+	return sockfd;
+label_server_listen_connection:
+	if (sockfd > 0) {
+		close(sockfd);
+		sockfd = -1;
+	}
+	return ret;
+}
+
+/**
+ * Queue a request, the SQE is submitted with the rest of the batch
+ *
+ * @param[in] op	SERVER_OP_*
+ * @param[in] fd	file descriptor
+ * @param[in] info	client connection info, NULL for the listener and the console
+ * @param[in] len	bytes of info->sbuf to send, SERVER_OP_SEND only
+ *
+ * @return On success, return 0.
+ *		   On error, negative number of the error line number
+ */
+static int server_queue_request(int op, int fd, struct client_connect_info *info, uint32_t len)
+{
+	struct io_uring_sqe *sqe;
+	uint64_t user_data;
+
+	sqe = uring_get_sqe(&ring);
+	if (!sqe) {
+		SERVER_PRINT("submission queue full, %s", strerror(errno));
+		return -SERVER_ERRNO;
+	}
+
+	user_data = SERVER_USER_DATA(info, op);
+	switch (op) {
+	case SERVER_OP_ACCEPT:
+		uring_prep_accept_multishot(sqe, fd, user_data);
+		break;
+	case SERVER_OP_CTRL:
+		uring_prep_poll(sqe, fd, POLLIN, user_data);
+		break;
+	case SERVER_OP_RECV:
+		uring_prep_recv_multishot(sqe, fd, URING_RECV_BGID, user_data);
+		break;
+	case SERVER_OP_SEND:
+		uring_prep_send(sqe, fd, info->sbuf, len, user_data);
+		break;
+	}
+	if (info) {
+		info->inflight++;
+	}
+
+	return 0;
+}
+
+/**
+ * Get a connection object and its buffers from the pools
+ *
+ * @param[in] connfd	client connection file descriptor
+ *
+ * @return On success, return the connection info.
+ *		   On error, NULL
+ */
+static struct client_connect_info *server_client_new(int connfd)
+{
+	struct client_connect_info *info;
+	socklen_t len;
+
+	info = (struct client_connect_info *)slab_pool_get(&client_pool);
+	if (!info) {
+		return NULL;
+	}
+	memset(info, 0x00, sizeof(struct client_connect_info));
+
+	if (frame_decoder_init(&info->dec, RECV_BUFF_LEN, RECV_HIGH_WATER, &buff_pool) < 0) {
+		slab_pool_put(&client_pool, info);
+		return NULL;
+	}
+
+	info->sbuf = (struct common_buff *)buff_pool_get(&buff_pool, sizeof(struct common_buff) + DATA_MAX_LEN,
+													 &info->sbuf_size);
+	if (!info->sbuf) {
+		frame_decoder_exit(&info->dec);
+		slab_pool_put(&client_pool, info);
+		return NULL;
+	}
+
+	/* multishot accept has no per-connection address buffer */
+	len = sizeof(struct sockaddr_in);
+	getpeername(connfd, (struct sockaddr *)&info->clientaddr, &len);
+	info->fd = connfd;
+
+	return info;
+}
+
+/**
+ * Start closing the connection
+ *
+ * shutdown() ends the pending multishot receive, the object is recycled by
+ * server_client_release() once its last completion has arrived.
+ *
+ * @param[in] info	client connection info
+ */
+static void server_client_close(struct client_connect_info *info)
+{
+	if (info->closing) {
+		return;
+	}
+	info->closing = 1;
+
+	conn_table_remove(&clients, info->slot);
+	shutdown(info->fd, SHUT_RDWR);
+}
+
+/**
+ * Close the socket and recycle the connection once nothing refers to it
+ *
+ * @param[in] info	client connection info
+ */
+static void server_client_release(struct client_connect_info *info)
+{
+	if (!info->closing || (info->inflight > 0)) {
+		return;
+	}
+
+	close(info->fd);
+	metrics_add(&metrics.closes, 1);
+	frame_decoder_exit(&info->dec);
+	buff_pool_put(&buff_pool, info->sbuf, info->sbuf_size);
+	slab_pool_put(&client_pool, info);
+}
+
+/**
+ * Print the pool and ring counters
+ */
+static void server_pool_stats(void)
+{
+	struct buff_class *cls;
+	int i;
+
+	SERVER_PRINT("client pool: hits %llu, misses %llu, in use %llu",
+				 (unsigned long long)client_pool.stats.hits,
+				 (unsigned long long)client_pool.stats.misses,
+				 (unsigned long long)client_pool.stats.in_use);
+	for (i=0; i<BUFF_POOL_CLASSES; i++) {
+		cls = &buff_pool.cls[i];
+		SERVER_PRINT("buff pool %6u: hits %llu, misses %llu, in use %llu, idle %u", cls->size,
+					 (unsigned long long)cls->stats.hits,
+					 (unsigned long long)cls->stats.misses,
+					 (unsigned long long)cls->stats.in_use, cls->free_cnt);
+	}
+	SERVER_PRINT("ring: io_uring_enter %llu, sqes submitted %llu",
+				 (unsigned long long)ring.enters, (unsigned long long)ring.submitted);
+}
+
+/**
+ * Print a complete frame received from the client
+ *
+ * @param[in] arg	client connection info
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return always 0
+ */
+static int server_recv_frame(void *arg, uint8_t *data, uint32_t len)
+{
+	metrics_add(&metrics.msgs_in, 1);
+	SERVER_PRINT("RX[%04d]> %.*s", len, (int)len, data);
+
+	return 0;
+}
+
+/**
+ * Handle a multishot receive completion
+ *
+ * The data sits in a provided buffer, it is decoded in place and the
+ * buffer goes straight back to the ring.
+ *
+ * @param[in] info	client connection info
+ * @param[in] cqe	receive completion
+ *
+ * @return On success, return the number of bytes read (1 when the receive
+ *		   only had to be re-armed), 0 if the peer closed.
+ */
+static int server_recv_message(struct client_connect_info *info, struct io_uring_cqe *cqe)
+{
+	uint16_t bid;
+	int ret;
+
+	if (cqe->res < 0) {
+		if (cqe->res == -ENOBUFS) {
+			/* out of provided buffers, re-arm, this batch recycles some */
+			if (server_queue_request(SERVER_OP_RECV, info->fd, info, 0) < 0) {
+				return -SERVER_ERRNO;
+			}
+			return 1;
+		}
+		SERVER_PRINT("read failed, %d, %s", -cqe->res, strerror(-cqe->res));
+		return -SERVER_ERRNO;
+	} else if (cqe->res == 0) {
+		SERVER_PRINT("client closed connection");
+		return 0;
+	}
+
+	metrics_add(&metrics.bytes_in, cqe->res);
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	ret = frame_decoder_feed(&info->dec, uring_buf_ring_addr(&recv_bufs, bid), cqe->res,
+							 server_recv_frame, info);
+	uring_buf_ring_recycle(&recv_bufs, bid);
+	if (ret < 0) {
+		SERVER_PRINT("data error!!!");
+		return -SERVER_ERRNO;
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_MORE) && (server_queue_request(SERVER_OP_RECV, info->fd, info, 0) < 0)) {
+		return -SERVER_ERRNO;
+	}
+
+	return cqe->res;
+}
+
+/**
+ * Send a message to the client
+ *
+ * The send is only queued, its completion is reported by the ring.
+ *
+ * @param[in] info		client connection info
+ * @param[in] msg		message typed on the console
+ * @param[in] buff_len	send buff payload size
+ *
+ * @return On success, return the payload length queued.
+ */
+static int server_send_message(struct client_connect_info *info, const char *msg, uint16_t buff_len)
+{
+	struct common_buff *sbuf = info->sbuf;
+	uint32_t slen;
+	char line[DATA_MAX_LEN];
+
+	snprintf(line, (buff_len < sizeof(line)) ? buff_len : sizeof(line), "%s", msg);
+	slen = strlen(line);
+	if (slen == 0) {
+		SERVER_PRINT("Input is empty");
+		return 0;
+	}
+	if (info->sending) {
+		SERVER_PRINT("previous message still sending");
+		return 0;
+	}
+	memcpy(sbuf->data, line, slen + 1);
+	if (server_queue_request(SERVER_OP_SEND, info->fd, info, frame_encode(sbuf, slen)) < 0) {
+		return -SERVER_ERRNO;
+	}
+	info->sending = 1;
+
+	return slen;
+}
+
+/**
+ * Print the connections the console can send to
+ */
+static void server_list_clients(void)
+{
+	struct client_connect_info *info;
+	uint32_t i, check_cnt;
+
+	for (i=0,check_cnt=0; (i<clients.size) && (check_cnt < clients.count); i++) {
+		info = conn_table_get(&clients, i);
+		if (info) {
+			SERVER_PRINT("Client %u: %s:%d", i, inet_ntoa(info->clientaddr.sin_addr), info->clientaddr.sin_port);
+			check_cnt++;
+		}
+	}
+	SERVER_PRINT("%u client(s)", check_cnt);
+}
+
+/**
+ * Select the client number to send the message to, "s" prints the pool
+ * and ring counters and "l" the clients instead
+ *
+ * @param[in] index	selector line of a console command
+ *
+ * @return On success, return the index of the client
+ */
+static int server_select_client(const char *index)
+{
+	int i;
+
+	if (strcmp(index, "s") == 0) {
+		server_pool_stats();
+		return -SERVER_ERRNO;
+	} else if (strcmp(index, "l") == 0) {
+		server_list_clients();
+		return -SERVER_ERRNO;
+	}
+
+	i = atoi(index);
+	if ((i < 0) || (!conn_table_get(&clients, i))) {
+		SERVER_PRINT("input error.");
+		return -SERVER_ERRNO;
+	}
+
+	return i;
+}
+
+/**
+ * Handle a multishot accept completion
+ *
+ * @param[in] sockfd	listening socket
+ * @param[in] cqe		accept completion
+ *
+ * @return On success, return 0.
+ *		   On error, negative number of the error line number
+ */
+static int server_accept_client(int sockfd, struct io_uring_cqe *cqe)
+{
+	struct client_connect_info *info;
+	int connfd = cqe->res;
+	int slot;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE) && (server_queue_request(SERVER_OP_ACCEPT, sockfd, NULL, 0) < 0)) {
+		return -SERVER_ERRNO;
+	}
+
+	if (connfd < 0) {
+		SERVER_PRINT("accept failed, %s", strerror(-connfd));
+		return 0;
+	}
+	metrics_add(&metrics.accepts, 1);
+
+	if (clients.count >= clients.max_size) {
+		SERVER_PRINT("too many connections");
+		close(connfd);
+		return 0;
+	}
+
+	info = server_client_new(connfd);
+	if (!info) {
+		SERVER_PRINT("get client buff memory failed");
+		close(connfd);
+		return 0;
+	}
+	SERVER_PRINT("accpet a new client: %s:%d", inet_ntoa(info->clientaddr.sin_addr), info->clientaddr.sin_port);
+
+	slot = conn_table_insert(&clients, info);
+	if (slot < 0) {
+		SERVER_PRINT("get connection table memory failed");
+		info->slot = (uint32_t)-1;	/* not in the table */
+		server_client_close(info);
+		server_client_release(info);
+		return 0;
+	}
+	info->slot = slot;
+
+	if (server_queue_request(SERVER_OP_RECV, connfd, info, 0) < 0) {
+		server_client_close(info);
+		server_client_release(info);
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct client_connect_info *info;
+	struct io_uring_cqe *cqe;
+	struct server_config cfg;
+	struct ctrl_cmd cmd;
+	const char *port_str;
+	int sockfd;
+	int i, t, ret;
+
+	log_init();
+	metrics_init(&metrics, "iouring");
+	metrics_signal_init(SIGUSR1);
+
+	sockfd = -1;
+	ret = server_config_parse(&cfg, SERVER_OPTIONS, argc, argv);
+	if ((ret < 0) || (ret >= argc)) {
+		SERVER_PRINT("usage: ./server [-c max_clients] [-b backlog] port");
+		return -SERVER_ERRNO;
+	}
+
+	port_str = argv[ret];
+	SERVER_PRINT("port: %s, max clients: %u, backlog: %d", port_str, cfg.max_clients, cfg.backlog);
+
+	if (uring_init(&ring, URING_ENTRIES) < 0) {
+		SERVER_PRINT("io_uring setup failed, %s", strerror(errno));
+		return -SERVER_ERRNO;
+	}
+	if (uring_buf_ring_init(&ring, &recv_bufs, URING_RECV_BGID, URING_RECV_BUFS, URING_RECV_BUF_LEN) < 0) {
+		SERVER_PRINT("register receive buffers failed, %s", strerror(errno));
+		uring_exit(&ring);
+		return -SERVER_ERRNO;
+	}
+
+	slab_pool_init(&client_pool, sizeof(struct client_connect_info), POOL_SLAB_OBJS);
+	buff_pool_init(&buff_pool, POOL_IDLE_BYTES);
+	if (conn_table_init(&clients, CONN_TABLE_INIT, cfg.max_clients) < 0) {
+		SERVER_PRINT("get connection table memory failed");
+		ret = -SERVER_ERRNO;
+		goto label_main_exit;
+	}
+
+	sockfd = server_listen_connection(port_str, cfg.backlog);
+	if (sockfd < 0) {
+		SERVER_PRINT("accept client connection failed");
+		ret = -SERVER_ERRNO;
+		goto label_main_exit;
+	}
+
+	/* the console is read on a thread of its own, the ring polls its eventfd */
+	if (ctrl_start(&ctrl, stdin, "sl") < 0) {
+		SERVER_PRINT("start control thread failed, %s", strerror(errno));
+		ret = -SERVER_ERRNO;
+		goto label_main_exit;
+	}
+
+	if ((server_queue_request(SERVER_OP_ACCEPT, sockfd, NULL, 0) < 0) ||
+		(server_queue_request(SERVER_OP_CTRL, ctrl.efd, NULL, 0) < 0)) {
+		ret = -SERVER_ERRNO;
+		goto label_main_exit;
+	}
+
+	SERVER_PRINT("Select a client to send a message, \"l\" lists the clients:");
+	while (1) {
+		/* everything queued by the last batch goes out with the wait */
+		metrics_handled(&metrics);	/* the previous wakeup */
+		ret = uring_submit(&ring, 1);
+		if ((ret < 0) && (errno != EINTR)) {
+			SERVER_PRINT("io_uring enter failed, %s", strerror(errno));
+			ret = -SERVER_ERRNO;
+			break;
+		}
+		metrics_wakeup(&metrics, uring_cq_ready(&ring));
+
+		while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+			info = (struct client_connect_info *)(uintptr_t)(cqe->user_data & ~(uint64_t)SERVER_OP_MASK);
+			switch (cqe->user_data & SERVER_OP_MASK) {
+			case SERVER_OP_ACCEPT:
+				server_accept_client(sockfd, cqe);
+				break;
+			case SERVER_OP_CTRL:
+				while (ctrl_next(&ctrl, &cmd)) {
+					t = server_select_client(cmd.sel);
+					if ((t >= 0) && (server_send_message(conn_table_get(&clients, t), cmd.msg, DATA_MAX_LEN) < 0)) {
+						server_client_close(conn_table_get(&clients, t));
+					}
+				}
+				server_queue_request(SERVER_OP_CTRL, ctrl.efd, NULL, 0);
+				break;
+			case SERVER_OP_RECV:
+				if (!(cqe->flags & IORING_CQE_F_MORE)) {
+					info->inflight--;
+				}
+				if (info->closing) {
+					/* drain what is left, the buffer still goes back */
+					if (cqe->flags & IORING_CQE_F_BUFFER) {
+						uring_buf_ring_recycle(&recv_bufs, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+					}
+				} else {
+					SERVER_DEBUG("From client %s:%d.", inet_ntoa(info->clientaddr.sin_addr),
+								 info->clientaddr.sin_port);
+					if (server_recv_message(info, cqe) <= 0) {
+						SERVER_PRINT("connect %s:%d closed.", inet_ntoa(info->clientaddr.sin_addr),
+									 info->clientaddr.sin_port);
+						server_client_close(info);
+					}
+				}
+				server_client_release(info);
+				break;
+			case SERVER_OP_SEND:
+				info->inflight--;
+				info->sending = 0;
+				if (cqe->res < 0) {
+					SERVER_PRINT("write failed, %s", strerror(-cqe->res));
+					server_client_close(info);
+				} else {
+					metrics_add(&metrics.msgs_out, 1);
+					metrics_add(&metrics.bytes_out, cqe->res);
+					SERVER_PRINT("TX[%04d]> %s", cqe->res, info->sbuf->data); /* includes the frame header */
+				}
+				server_client_release(info);
+				break;
+			}
+			uring_cqe_seen(&ring);
+		}
+	}
+
+label_main_exit:
+	ctrl_stop(&ctrl);
+	/* closing the ring cancels every pending request */
+	uring_buf_ring_exit(&ring, &recv_bufs);
+	uring_exit(&ring);
+	for (i=0; i<clients.size; i++) {
+		info = conn_table_get(&clients, i);
+		if (info) {
+			server_client_close(info);
+			info->inflight = 0;
+			server_client_release(info);
+		}
+	}
+	conn_table_exit(&clients);
+	if (sockfd > 0) {
+		close(sockfd);
+		sockfd = -1;
+	}
+
+	server_pool_stats();
+	buff_pool_exit(&buff_pool);
+	slab_pool_exit(&client_pool);
+
+	SERVER_PRINT("server exit ...");
+
+	return ret;
+}
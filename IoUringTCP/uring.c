@@ -0,0 +1,379 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#define URING_CQ_FACTOR				4	/* multishot requests post many CQEs per SQE */
+
+static int uring_setup(uint32_t entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, uint32_t opcode, void *arg, uint32_t nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Create a ring and map its queues
+ *
+ * @param[in] ring		ring
+ * @param[in] entries	submission queue size, the completion queue is larger
+ *
+ * @return On success, return 0.
+ *		   On error, return -1 with errno set
+ */
+int uring_init(struct uring *ring, uint32_t entries)
+{
+	struct io_uring_params p;
+	uint8_t *sq_ptr, *cq_ptr;
+	uint32_t i;
+
+	memset(ring, 0x00, sizeof(struct uring));
+	memset(&p, 0x00, sizeof(struct io_uring_params));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = entries * URING_CQ_FACTOR;
+
+	ring->fd = uring_setup(entries, &p);
+	if (ring->fd < 0) {
+		return -1;
+	}
+	ring->features = p.features;
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size) {
+			ring->sq_size = ring->cq_size;
+		}
+		ring->cq_size = 0;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+						ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		goto label_uring_init;
+	}
+	if (ring->cq_size) {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+							ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			goto label_uring_init;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+											 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto label_uring_init;
+	}
+
+	sq_ptr = (uint8_t *)ring->sq_ptr;
+	cq_ptr = ring->cq_ptr ? (uint8_t *)ring->cq_ptr : sq_ptr;
+	ring->sq_head = (uint32_t *)(sq_ptr + p.sq_off.head);
+	ring->sq_tail = (uint32_t *)(sq_ptr + p.sq_off.tail);
+	ring->sq_mask = *(uint32_t *)(sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (uint32_t *)(sq_ptr + p.sq_off.array);
+	ring->cq_head = (uint32_t *)(cq_ptr + p.cq_off.head);
+	ring->cq_tail = (uint32_t *)(cq_ptr + p.cq_off.tail);
+	ring->cq_mask = *(uint32_t *)(cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+	/* SQEs are used in order, the indirection array never changes */
+	for (i=0; i<p.sq_entries; i++) {
+		ring->sq_array[i] = i;
+	}
+	ring->sqe_tail = *ring->sq_tail;
+
+	return 0;
+label_uring_init:
+	uring_exit(ring);
+	return -1;
+}
+
+/**
+ * Unmap the queues and close the ring, pending requests are cancelled
+ *
+ * @param[in] ring	ring
+ */
+void uring_exit(struct uring *ring)
+{
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_size);
+		ring->sqes = NULL;
+	}
+	if (ring->cq_ptr) {
+		munmap(ring->cq_ptr, ring->cq_size);
+		ring->cq_ptr = NULL;
+	}
+	if (ring->sq_ptr) {
+		munmap(ring->sq_ptr, ring->sq_size);
+		ring->sq_ptr = NULL;
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+		ring->fd = -1;
+	}
+}
+
+/**
+ * Get a cleared SQE, submitting the queued ones first if the queue is full
+ *
+ * @param[in] ring	ring
+ *
+ * @return On success, return the SQE.
+ *		   On error (the kernel did not consume the queue), NULL
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t head;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if ((ring->sqe_tail - head) > ring->sq_mask) {
+		if (uring_submit(ring, 0) < 0) {
+			return NULL;
+		}
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if ((ring->sqe_tail - head) > ring->sq_mask) {
+			return NULL;
+		}
+	}
+
+	sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	ring->sqe_tail++;
+	memset(sqe, 0x00, sizeof(struct io_uring_sqe));
+
+	return sqe;
+}
+
+/**
+ * Hand every queued SQE to the kernel and optionally wait for completions,
+ * both in one io_uring_enter()
+ *
+ * @param[in] ring		ring
+ * @param[in] wait_nr	completions to wait for, 0 to return immediately
+ *
+ * @return On success, return the number of SQEs submitted.
+ *		   On error, return -1 with errno set (EINTR while waiting included)
+ */
+int uring_submit(struct uring *ring, uint32_t wait_nr)
+{
+	uint32_t to_submit;
+	int ret;
+
+	to_submit = ring->sqe_tail - *ring->sq_tail;
+	if ((to_submit == 0) && (wait_nr == 0)) {
+		return 0;
+	}
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	ring->enters++;
+	ret = uring_enter(ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	if (ret < 0) {
+		return -1;
+	}
+	ring->submitted += ret;
+
+	return ret;
+}
+
+/**
+ * Get the oldest unhandled completion
+ *
+ * @param[in] ring	ring
+ *
+ * @return the CQE, NULL if the completion queue is empty
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	uint32_t head;
+
+	head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+/**
+ * Give the CQE returned by uring_peek_cqe() back to the kernel
+ *
+ * @param[in] ring	ring
+ */
+void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Allocate 'entries' receive buffers and register them as buffer group
+ * 'bgid', the kernel picks one for every multishot recv completion
+ *
+ * @param[in] ring		ring
+ * @param[in] bring		buffer ring
+ * @param[in] bgid		buffer group id
+ * @param[in] entries	number of buffers, a power of 2
+ * @param[in] buf_size	size of each buffer
+ *
+ * @return On success, return 0.
+ *		   On error, return -1 with errno set
+ */
+int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *bring, uint16_t bgid,
+						uint32_t entries, uint32_t buf_size)
+{
+	struct io_uring_buf_reg reg;
+	size_t size;
+	uint32_t i;
+
+	memset(bring, 0x00, sizeof(struct uring_buf_ring));
+	if ((entries == 0) || (entries & (entries - 1)) || (entries > 32768)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* the ring must be page aligned */
+	size = entries * sizeof(struct io_uring_buf);
+	bring->br = (struct io_uring_buf_ring *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+												 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bring->br == MAP_FAILED) {
+		bring->br = NULL;
+		return -1;
+	}
+	bring->bufs = (uint8_t *)malloc((size_t)entries * buf_size);
+	if (!bring->bufs) {
+		munmap(bring->br, size);
+		bring->br = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+	bring->entries = entries;
+	bring->buf_size = buf_size;
+	bring->bgid = bgid;
+
+	memset(&reg, 0x00, sizeof(struct io_uring_buf_reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)bring->br;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		free(bring->bufs);
+		munmap(bring->br, size);
+		memset(bring, 0x00, sizeof(struct uring_buf_ring));
+		return -1;
+	}
+
+	for (i=0; i<entries; i++) {
+		bring->br->bufs[i].addr = (uint64_t)(uintptr_t)uring_buf_ring_addr(bring, i);
+		bring->br->bufs[i].len = buf_size;
+		bring->br->bufs[i].bid = i;
+	}
+	__atomic_store_n(&bring->br->tail, (uint16_t)entries, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * Unregister and free the buffer ring
+ *
+ * @param[in] ring	ring
+ * @param[in] bring	buffer ring
+ */
+void uring_buf_ring_exit(struct uring *ring, struct uring_buf_ring *bring)
+{
+	struct io_uring_buf_reg reg;
+
+	if (!bring->br) {
+		return;
+	}
+
+	memset(&reg, 0x00, sizeof(struct io_uring_buf_reg));
+	reg.bgid = bring->bgid;
+	uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+	munmap(bring->br, bring->entries * sizeof(struct io_uring_buf));
+	free(bring->bufs);
+	memset(bring, 0x00, sizeof(struct uring_buf_ring));
+}
+
+/**
+ * Give a consumed buffer back to the kernel
+ *
+ * @param[in] bring	buffer ring
+ * @param[in] bid	buffer id from the CQE flags
+ */
+void uring_buf_ring_recycle(struct uring_buf_ring *bring, uint16_t bid)
+{
+	struct io_uring_buf *buf;
+	uint16_t tail;
+
+	tail = bring->br->tail;
+	buf = &bring->br->bufs[tail & (bring->entries - 1)];
+	buf->addr = (uint64_t)(uintptr_t)uring_buf_ring_addr(bring, bid);
+	buf->len = bring->buf_size;
+	buf->bid = bid;
+	__atomic_store_n(&bring->br->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * Accept connections until cancelled, one CQE per connection
+ */
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = user_data;
+}
+
+/**
+ * Receive until the peer closes, every CQE carries a buffer of group 'bgid'
+ */
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, uint16_t bgid, uint64_t user_data)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = bgid;
+	sqe->user_data = user_data;
+}
+
+/**
+ * Send 'len' bytes, 'buf' must stay untouched until the completion
+ */
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, uint32_t len, uint64_t user_data)
+{
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;	/* no short sends on stream sockets */
+	sqe->user_data = user_data;
+}
+
+/**
+ * One-shot poll for 'events' (POLLIN...)
+ */
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, uint32_t events, uint64_t user_data)
+{
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->user_data = user_data;
+}
@@ -0,0 +1,93 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper on top of the raw system calls, no liburing.
+ *
+ * SQEs taken with uring_get_sqe() are only handed to the kernel by the
+ * next uring_submit(), so everything queued while handling a batch of
+ * completions goes out in a single io_uring_enter().
+ */
+struct uring {
+	int fd;
+	uint32_t features;
+
+	/* submission queue */
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t sq_mask;
+	uint32_t *sq_array;
+	struct io_uring_sqe *sqes;
+	uint32_t sqe_tail;		/* SQEs handed out, published by uring_submit() */
+
+	/* completion queue */
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+
+	uint64_t enters;		/* io_uring_enter() calls */
+	uint64_t submitted;		/* SQEs handed to the kernel */
+};
+
+/* provided buffer ring: receive buffers the kernel picks from */
+struct uring_buf_ring {
+	struct io_uring_buf_ring *br;
+	uint8_t *bufs;
+	uint32_t entries;
+	uint32_t buf_size;
+	uint16_t bgid;			/* buffer group id */
+};
+
+int uring_init(struct uring *ring, uint32_t entries);
+void uring_exit(struct uring *ring);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit(struct uring *ring, uint32_t wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *bring, uint16_t bgid,
+						uint32_t entries, uint32_t buf_size);
+void uring_buf_ring_exit(struct uring *ring, struct uring_buf_ring *bring);
+void uring_buf_ring_recycle(struct uring_buf_ring *bring, uint16_t bid);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, uint16_t bgid, uint64_t user_data);
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, uint32_t len, uint64_t user_data);
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, uint32_t events, uint64_t user_data);
+
+/**
+ * Get the address of a provided buffer
+ *
+ * @param[in] bring	buffer ring
+ * @param[in] bid	buffer id from the CQE flags
+ *
+ * @return the buffer address
+ */
+static inline uint8_t *uring_buf_ring_addr(struct uring_buf_ring *bring, uint16_t bid)
+{
+	return bring->bufs + (size_t)bid * bring->buf_size;
+}
+
+/**
+ * Get the number of completions waiting to be peeked
+ *
+ * @param[in] ring	ring
+ *
+ * @return the number of CQEs
+ */
+static inline uint32_t uring_cq_ready(struct uring *ring)
+{
+	return __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head;
+}
+
+#endif	/* #ifndef __URING_H__ */
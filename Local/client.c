@@ -13,13 +13,21 @@
 #include <sys/un.h>
 
 #include "common.h"
+#include "frame.h"
+#include "config.h"
+#include "log.h"
 
 #define CLIENT_ERRNO				__LINE__
-#define CLIENT_PRINT(_fmt, ...)		printf("[%04d] "_fmt"\n", __LINE__, ##__VA_ARGS__);
+#define CLIENT_PRINT(_fmt, ...)		LOG_INFO("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
+
+static int sock_type = SOCK_STREAM;	/* -T */
 
 /**
  * Connect to the server
  *
+ * A datagram socket is bound to an autobound (abstract) address first, so
+ * the server has somewhere to send its replies.
+ *
  * @param[in] local_path	Full path to local socket file
  *
  * @return On success, a file descriptor for the new socket is returned.
@@ -34,13 +42,23 @@ static int client_connect_server(const char *local_path)
 
 	sockfd = -1;
 	/* Creating a socket descriptor  */
-	sockfd = socket(AF_LOCAL, SOCK_STREAM, 0);
+	sockfd = socket(AF_LOCAL, sock_type, 0);
 	if (sockfd < 0) {
 		CLIENT_PRINT("create socket failed, %s", strerror(errno));
 		return -CLIENT_ERRNO;
 	}
 	CLIENT_PRINT("create ok");
 
+	if (sock_type == SOCK_DGRAM) {
+		bzero(&servaddr, sizeof(servaddr));
+		servaddr.sun_family = AF_LOCAL;
+		if (bind(sockfd, (struct sockaddr *)&servaddr, sizeof(sa_family_t)) < 0) {
+			CLIENT_PRINT("bind failed, %s", strerror(errno));
+			close(sockfd);
+			return -CLIENT_ERRNO;
+		}
+	}
+
 	/* set non-blocking mode */
 	flags = fcntl(sockfd, F_GETFL, 0);
 	fcntl(sockfd, F_SETFL, flags|O_NONBLOCK);
@@ -65,7 +83,7 @@ static int client_connect_server(const char *local_path)
  *
  * @param[in] sockfd	socket file descriptor
  * @param[in] sbuf		send buff pointer
- * @param[in] buff_len	send buff size
+ * @param[in] buff_len	send buff payload size
  *
  * @return On success, return the length of the sent.
  */
@@ -87,40 +105,60 @@ static int client_send_message(int sockfd, struct common_buff *sbuf, uint16_t bu
 	slen -= 1;
 	sbuf->data[slen] = '\0'; /* delete \n */
 
-	/* send to server */
-	ret = write(sockfd, sbuf->data, slen);
+	/* send to server, a seqpacket or dgram message needs no header */
+	if (sock_type == SOCK_STREAM) {
+		ret = frame_write_all(sockfd, sbuf->data, slen);
+	} else {
+		ret = send(sockfd, sbuf->data, slen, MSG_NOSIGNAL);
+	}
 	if (ret < 0) {
 		/* we failed */
 		CLIENT_PRINT("write failed, %s", strerror(errno));
 		return -CLIENT_ERRNO;
 	}
-	CLIENT_PRINT("TX[%04d]> %s", ret, sbuf->data);
+	CLIENT_PRINT("TX[%04d]> %s", ret, sbuf->data); /* 'ret' includes the frame header */
 	/* CLIENT_PRINT("send %d bytes data", ret); */
 
 	return ret;
 }
 
 /**
- * Receive a message from the server
+ * Print a complete frame received from the server
+ *
+ * @param[in] arg	unused
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return always 0
+ */
+static int client_recv_frame(void *arg, uint8_t *data, uint32_t len)
+{
+	CLIENT_PRINT("RX[%04d]> %.*s", len, (int)len, data);
+
+	return 0;
+}
+
+/**
+ * Receive messages from the server
  *
  * @param[in] sockfd	socket file descriptor
- * @param[in] rbuf		recv buff pointer
- * @param[in] buff_len	recv buff size
+ * @param[in] dec		frame decoder of the connection
  *
- * @return On success, return the length of the sent.
+ * @return On success, return the number of bytes read.
  */
-static int client_recv_message(int sockfd, struct common_buff *rbuf, uint16_t buff_len)
+static int client_recv_message(int sockfd, struct frame_decoder *dec)
 {
-	char *ptr;
 	uint32_t rlen;
 	int ret;
 
-	ptr = (char *)rbuf;
 	rlen = 0;
 	do {
-		ret = read(sockfd, &ptr[rlen], buff_len - rlen);
+		ret = frame_decoder_readv(dec, sockfd, client_recv_frame, NULL);
 		if (ret < 0) {
-			if (errno != EAGAIN) {
+			if (errno == EBADMSG) {
+				CLIENT_PRINT("data error!!!");
+				return -CLIENT_ERRNO;
+			} else if (errno != EAGAIN) {
 				CLIENT_PRINT("read failed, %s", strerror(errno));
 				return -CLIENT_ERRNO;
 			}
@@ -130,16 +168,56 @@ static int client_recv_message(int sockfd, struct common_buff *rbuf, uint16_t bu
 			return 0;
 		}
 		rlen += ret;
-	} while ((ret > 0) && (rlen < buff_len));
-
-	CLIENT_PRINT("RX[%04d]> %s", rlen, rbuf->data);
+	} while (ret > 0);
 
 	return rlen;
 }
 
+/**
+ * Receive messages from a seqpacket or dgram server, one whole message
+ * per recv()
+ *
+ * @param[in] sockfd	socket file descriptor
+ * @param[in] buf		receive buffer of RECV_HIGH_WATER bytes
+ *
+ * @return On success, return the number of bytes read.
+ */
+static int client_recv_packets(int sockfd, uint8_t *buf)
+{
+	uint32_t rlen;
+	int ret;
+
+	rlen = 0;
+	while (1) {
+		ret = recv(sockfd, buf, RECV_HIGH_WATER, MSG_TRUNC);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				CLIENT_PRINT("read failed, %s", strerror(errno));
+				return -CLIENT_ERRNO;
+			}
+			break;
+		} else if ((ret == 0) && (sock_type == SOCK_SEQPACKET)) {
+			CLIENT_PRINT("server closed connection");
+			return 0;
+		} else if (ret > RECV_HIGH_WATER) {
+			CLIENT_PRINT("message truncated to %u bytes", RECV_HIGH_WATER);
+			ret = RECV_HIGH_WATER;
+		}
+		client_recv_frame(NULL, buf, ret);
+		rlen += ret;
+	}
+
+	/* an empty datagram is a message too */
+	return (sock_type == SOCK_DGRAM) ? 1 : rlen;
+}
+
 int main(int argc, char *argv[])
 {
 	struct common_buff *buff;
+	struct frame_decoder dec;
+	uint8_t *rbuf;
 	struct epoll_event epev;
 	struct epoll_event events[2];
 	char *local_path;
@@ -148,21 +226,44 @@ int main(int argc, char *argv[])
 	int sockfd, epfd;
 	int i, ret;
 
-	if (argc < 2) {
-		CLIENT_PRINT("usage: ./client loacl_path");
+	log_init();
+
+	while ((ret = getopt(argc, argv, "T:")) != -1) {
+		if ((ret != 'T') || ((sock_type = sock_type_parse(optarg)) < 0)) {
+			break;
+		}
+	}
+	if ((ret != -1) || (optind >= argc)) {
+		CLIENT_PRINT("usage: ./client [-T stream|seqpacket|dgram] loacl_path");
 		return -CLIENT_ERRNO;
 	}
 
 	sockfd = epfd = -1;
-	blen = sizeof(struct common_buff);
+	rbuf = NULL;
+	blen = sizeof(struct common_buff) + DATA_MAX_LEN;
 	buff = (struct common_buff *)malloc(blen);
 	if (!buff) {
 		CLIENT_PRINT("get %d bytes buff memory failed", blen);
 		return -CLIENT_ERRNO;
 	}
 
-	local_path = argv[1];
-	CLIENT_PRINT("path: %s", local_path);
+	if (frame_decoder_init(&dec, RECV_BUFF_LEN, RECV_HIGH_WATER, NULL) < 0) {
+		CLIENT_PRINT("get decoder memory failed");
+		free(buff);
+		return -CLIENT_ERRNO;
+	}
+
+	if (sock_type != SOCK_STREAM) {
+		rbuf = (uint8_t *)malloc(RECV_HIGH_WATER);
+		if (!rbuf) {
+			CLIENT_PRINT("get %d bytes buff memory failed", RECV_HIGH_WATER);
+			ret = -CLIENT_ERRNO;
+			goto label_main_exit;
+		}
+	}
+
+	local_path = argv[optind];
+	CLIENT_PRINT("path: %s (%s)", local_path, sock_type_name(sock_type));
 
 	sockfd = client_connect_server(local_path);
 	if (sockfd < 0) {
@@ -202,20 +303,24 @@ int main(int argc, char *argv[])
 			for (i=0; i<ret; i++) {
 				if (events[i].events & EPOLLIN) {
 					if (events[i].data.fd == fileno(stdin)) {
-						if (client_send_message(sockfd, buff, blen) < 0) {
+						if (client_send_message(sockfd, buff, DATA_MAX_LEN) < 0) {
 							goto label_main_exit;
 						}
 						if (strcmp((const char *)buff->data, "quit") == 0) {
 							CLIENT_PRINT("ready to quit...");
 							epoll_ctl(epfd, EPOLL_CTL_DEL, fileno(stdin), NULL);
-							if (shutdown(sockfd, 1)) {
+							if ((sock_type != SOCK_DGRAM) && shutdown(sockfd, 1)) {
 								CLIENT_PRINT("shutdown failed, %s", strerror(errno));
 								ret = -CLIENT_ERRNO;
 							}
 							goto label_main_exit;
 						}
 					} else if (events[i].data.fd == sockfd) {
-						if (client_recv_message(sockfd, buff, blen) <= 0) {
+						if (sock_type != SOCK_STREAM) {
+							if (client_recv_packets(sockfd, rbuf) <= 0) {
+								goto label_main_exit;
+							}
+						} else if (client_recv_message(sockfd, &dec) <= 0) {
 							goto label_main_exit;
 						}
 					}
@@ -233,6 +338,8 @@ label_main_exit:
 		close(sockfd);
 		sockfd = -1;
 	}
+	frame_decoder_exit(&dec);
+	free(rbuf);
 	if (buff) {
 		free(buff);
 		buff = NULL;
@@ -3,9 +3,12 @@
 
 #include <stdint.h>
 
-#define DATA_MAX_LEN	1024
+#define DATA_MAX_LEN	1024			/* largest payload typed on stdin */
+#define RECV_BUFF_LEN	(16 * 1024)		/* per-connection receive buffer */
+#define RECV_HIGH_WATER	(256 * 1024)	/* largest payload accepted from the peer */
 struct common_buff {
-	uint8_t data[DATA_MAX_LEN];
+	uint32_t len;
+	uint8_t data[0];
 };
 
 #endif	/* #ifndef __COMMON_H__ */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE			/* recvmmsg(), sendmmsg() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
@@ -9,30 +10,94 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
 #include <sys/epoll.h>
 #include <sys/un.h>
+#include <stddef.h>
 
 #include "common.h"
+#include "frame.h"
+#include "conn_table.h"
+#include "config.h"
+#include "fanout.h"
+#include "ctrl.h"
+#include "log.h"
+#include "metrics.h"
+#include "mode.h"
+#include "wheel.h"
+#include "heartbeat.h"
+#include "fdpass.h"
 
-#define LISTENQ						20
-#define MAX_CLIENTS					20
+#define CONN_TABLE_INIT				64		/* initial connection table slots */
+#define SERVER_WAIT_MS				(10 * 1000)	/* longest wait without a timer due */
 
+#define SERVER_OPTIONS				"c:b:e:H:L:m:S:I:K:U:A:WT:"	/* see config.h */
 #define SERVER_ERRNO				__LINE__
-#define SERVER_PRINT(_fmt, ...)		printf("[%04d] "_fmt"\n", __LINE__, ##__VA_ARGS__);
+#define SERVER_PRINT(_fmt, ...)		LOG_INFO("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
+#define SERVER_DEBUG(_fmt, ...)		LOG_DEBUG("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
 
 struct client_connect_info {
 	int fd;
+	struct frame_decoder dec;	/* receive buffer */
+	struct common_buff *sbuf;	/* send buffer */
+	uint32_t slot;						/* index in the connection table */
+	struct client_connect_info *next;	/* closing list link */
+	struct outq outq;					/* echo and source output */
+	uint32_t events;					/* epoll events registered */
+	struct wheel_timer idle;			/* -I timeout */
+	uint64_t active;					/* tick of the last frame in or bytes out */
+	int worker;							/* takes -A connections */
 };
 
+/* -W: the connection to the acceptor and the descriptors it passed */
+struct server_acceptor {
+	int fd;								/* -1 once closed */
+	int epfd;
+	struct conn_table *clients;
+	struct frame_decoder dec;
+	struct fdpass_queue fds;
+};
+
+static struct client_connect_info *closing_list;	/* closed, not freed yet */
+#define POOL_IDLE_BYTES				(1024 * 1024)	/* idle broadcast frames kept */
+#define SERVER_MSG_BATCH			16		/* -T seqpacket/dgram messages per recvmmsg() */
+#define SERVER_MSG_LEN				(64 * 1024)	/* largest -T seqpacket/dgram message */
+
+/*
+ * Message vectors for recvmmsg()/sendmmsg(): one buffer and one source
+ * address per message. Shared by every client, one receive at a time.
+ */
+struct msg_batch {
+	struct mmsghdr msgs[SERVER_MSG_BATCH];
+	struct iovec iovs[SERVER_MSG_BATCH];
+	struct sockaddr_un addrs[SERVER_MSG_BATCH];	/* dgram senders */
+	uint8_t bufs[SERVER_MSG_BATCH][SERVER_MSG_LEN];
+};
+
+static struct buff_pool buff_pool;	/* broadcast frames */
+static struct fanout fanout;		/* topic subscriptions, by connection */
+static struct metrics metrics;
+static struct server_config cfg;
+static struct outq_buf *source_frame;	/* streamed in source mode */
+static struct timer_wheel timers;		/* idle timeouts */
+static int tcpfd = -1;					/* -A listener */
+static uint32_t next_worker;			/* -A round robin, a table slot */
+static struct server_acceptor acceptor = { .fd = -1 };
+static struct msg_batch *msg_batch;		/* -T seqpacket/dgram receive vectors */
+static struct sockaddr_un dgram_peer;	/* -T dgram: last client heard from */
+static socklen_t dgram_peer_len;
+static struct ctrl_chan ctrl = { .efd = -1 };	/* console, read by the control thread */
+
 /**
  * Listen socket connection
  *
  * @param[in] local_path
+ * @param[in] backlog		listen() backlog
  *
  * @return On success, return the client connection fd.
  *		   On error, negative number of the error line number
  */
-static int server_listen_connection(const char *local_path)
+static int server_listen_connection(const char *local_path, int backlog)
 {
 #if 1
     struct sockaddr_un servaddr;
@@ -40,7 +105,7 @@ static int server_listen_connection(const char *local_path)
 	int flags;
 	int ret;
 
-	sockfd = socket(AF_LOCAL, SOCK_STREAM, 0);
+	sockfd = socket(AF_LOCAL, cfg.sock_type, 0);
 	if (sockfd < 0) {
 		SERVER_PRINT("create socket failed, %s", strerror(errno));
 		return -SERVER_ERRNO;
@@ -62,8 +127,11 @@ static int server_listen_connection(const char *local_path)
 		ret = -SERVER_ERRNO;
 		goto label_server_listen_connection;
 	}
+	if (cfg.sock_type == SOCK_DGRAM) {
+		return sockfd;	/* nothing to accept, datagrams arrive on it */
+	}
 
-	ret = listen(sockfd, LISTENQ);
+	ret = listen(sockfd, backlog);
 	if (ret < 0) {
 		SERVER_PRINT("listen failed, %s", strerror(errno));
 		ret = -SERVER_ERRNO;
@@ -113,7 +181,7 @@ label_server_listen_connection:
 		goto label_server_listen_connection;
 	}
 
-	ret = listen(sockfd, LISTENQ);
+	ret = listen(sockfd, backlog);
 	if (ret < 0) {
 		SERVER_PRINT("listen failed, %s", strerror(errno));
 		ret = -SERVER_ERRNO;
@@ -131,101 +199,1003 @@ label_server_listen_connection:
 }
 
 /**
- * Receive a message from the client
+ * Listen for TCP connections to hand to the workers
  *
- * @param[in] clientfd	client connection file descriptor
- * @param[in] rbuf		recv buff pointer
- * @param[in] buff_len	recv buff size
+ * @param[in] port		port
+ * @param[in] backlog	listen() backlog
  *
- * @return On success, return the length of the sent.
+ * @return On success, return the listening fd.
+ *		   On error, negative number of the error line number
+ */
+static int server_listen_tcp(uint16_t port, int backlog)
+{
+	struct sockaddr_in servaddr;
+	int sockfd;
+	int flags;
+	int ret;
+	int on = 1;
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd < 0) {
+		SERVER_PRINT("create tcp socket failed, %s", strerror(errno));
+		return -SERVER_ERRNO;
+	}
+
+	flags = fcntl(sockfd, F_GETFL, 0);
+	/* set non-blocking mode */
+	fcntl(sockfd, F_SETFL, flags|O_NONBLOCK);
+
+	bzero(&servaddr, sizeof(struct sockaddr_in));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	servaddr.sin_port = htons(port);
+
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(int));
+
+	ret = bind(sockfd, (struct sockaddr *)&servaddr, sizeof(struct sockaddr_in));
+	if (ret < 0) {
+		SERVER_PRINT("bind port %u failed, %s", port, strerror(errno));
+		ret = -SERVER_ERRNO;
+		goto label_server_listen_tcp;
+	}
+
+	ret = listen(sockfd, backlog);
+	if (ret < 0) {
+		SERVER_PRINT("listen failed, %s", strerror(errno));
+		ret = -SERVER_ERRNO;
+		goto label_server_listen_tcp;
+	}
+
+	return sockfd;
+label_server_listen_tcp:
+	close(sockfd);
+	return ret;
+}
+
+/**
+ * Connect to the acceptor and ask for connections
+ *
+ * @param[in] local_path	acceptor's socket
+ *
+ * @return On success, return the connection fd.
+ *		   On error, negative number of the error line number
+ */
+static int server_connect_acceptor(const char *local_path)
+{
+	struct sockaddr_un servaddr;
+	int sockfd;
+	int flags;
+	int ret;
+
+	sockfd = socket(AF_LOCAL, SOCK_STREAM, 0);
+	if (sockfd < 0) {
+		SERVER_PRINT("create socket failed, %s", strerror(errno));
+		return -SERVER_ERRNO;
+	}
+
+	bzero(&servaddr, sizeof(struct sockaddr_un));
+	servaddr.sun_family = AF_LOCAL;
+	strncpy(servaddr.sun_path, local_path, sizeof(servaddr.sun_path) - 1);
+
+	if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(struct sockaddr_un)) < 0) {
+		SERVER_PRINT("connect %s failed, %s", local_path, strerror(errno));
+		ret = -SERVER_ERRNO;
+		goto label_server_connect_acceptor;
+	}
+	if (frame_write_all(sockfd, FDPASS_WORKER_CMD, strlen(FDPASS_WORKER_CMD)) < 0) {
+		SERVER_PRINT("register with %s failed, %s", local_path, strerror(errno));
+		ret = -SERVER_ERRNO;
+		goto label_server_connect_acceptor;
+	}
+
+	flags = fcntl(sockfd, F_GETFL, 0);
+	/* set non-blocking mode */
+	fcntl(sockfd, F_SETFL, flags|O_NONBLOCK);
+
+	return sockfd;
+label_server_connect_acceptor:
+	close(sockfd);
+	return ret;
+}
+
+/**
+ * Idle timer of a connection: shut it down once nothing happened for -I
+ * seconds, otherwise wait for the rest of the period
+ *
+ * The data path only moves 'active' forward and never touches the timer.
+ * A frame trickled in byte by byte is no activity until it is complete.
+ * The event loop then sees the stream end and closes the connection.
+ *
+ * @param[in] arg	client connection info
+ */
+static void server_client_idle(void *arg)
+{
+	struct client_connect_info *info = (struct client_connect_info *)arg;
+	uint64_t deadline = info->active + cfg.idle_timeout * 1000ULL;
+
+	if (deadline > wheel_now(&timers)) {
+		wheel_add(&timers, &info->idle, deadline);
+		return;
+	}
+
+	SERVER_PRINT("connect %d:%d idle for %u s, closing", info->slot, info->fd, cfg.idle_timeout);
+	metrics_add(&metrics.idle_closes, 1);
+	shutdown(info->fd, SHUT_RDWR);
+}
+
+/**
+ * Allocate a connection object and its receive and send buffers, and start
+ * its idle timer
+ *
+ * @param[in] connfd	client connection file descriptor
+ *
+ * @return On success, return the connection info.
+ *		   On error, NULL
+ */
+static struct client_connect_info *server_client_new(int connfd)
+{
+	struct client_connect_info *info;
+
+	info = (struct client_connect_info *)calloc(1, sizeof(struct client_connect_info));
+	if (!info) {
+		return NULL;
+	}
+
+	if (frame_decoder_init(&info->dec, RECV_BUFF_LEN, RECV_HIGH_WATER, NULL) < 0) {
+		free(info);
+		return NULL;
+	}
+
+	info->sbuf = (struct common_buff *)malloc(sizeof(struct common_buff) + DATA_MAX_LEN);
+	if (!info->sbuf) {
+		frame_decoder_exit(&info->dec);
+		free(info);
+		return NULL;
+	}
+	outq_init(&info->outq, &buff_pool);
+	info->fd = connfd;
+
+	wheel_timer_init(&info->idle, server_client_idle, info);
+	info->active = wheel_now(&timers);
+	if (cfg.idle_timeout) {
+		wheel_add(&timers, &info->idle, info->active + cfg.idle_timeout * 1000ULL);
+	}
+
+	return info;
+}
+
+/**
+ * Close the connection and free its table slot
+ *
+ * The object may still be referenced by a pending event of the current
+ * epoll_wait() batch, so it is only freed by server_client_reap().
+ *
+ * @param[in] epfd		epoll file descriptor
+ * @param[in] clients	connection table
+ * @param[in] info		client connection info
+ */
+static void server_client_close(int epfd, struct conn_table *clients, struct client_connect_info *info)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, info->fd, NULL);
+	wheel_del(&timers, &info->idle);
+	fanout_unsubscribe_all(&fanout, info);
+	close(info->fd);
+	info->fd = -1;
+	metrics_add(&metrics.closes, 1);
+
+	conn_table_remove(clients, info->slot);
+	info->next = closing_list;
+	closing_list = info;
+}
+
+/**
+ * Free the connections closed during the last batch
+ */
+static void server_client_reap(void)
+{
+	struct client_connect_info *info;
+
+	while (closing_list) {
+		info = closing_list;
+		closing_list = info->next;
+
+		frame_decoder_exit(&info->dec);
+		outq_exit(&info->outq);
+		free(info->sbuf);
+		free(info);
+	}
+}
+
+/**
+ * Register the events the connection waits for: input while its output
+ * queue is below the high watermark, output while something is queued or
+ * the server is a source
+ *
+ * @param[in] epfd	epoll file descriptor
+ * @param[in] info	client connection info
+ */
+static void server_client_events(int epfd, struct client_connect_info *info)
+{
+	struct epoll_event epev;
+	uint32_t events;
+
+	events = (info->outq.bytes < cfg.send_high) ? EPOLLIN : 0;
+	if (!outq_empty(&info->outq) || (cfg.mode == SERVER_MODE_SOURCE)) {
+		events |= EPOLLOUT;
+	}
+	if (events == info->events) {
+		return;
+	}
+
+	memset(&epev, 0x00, sizeof(struct epoll_event));
+	epev.events = events;
+	epev.data.ptr = info;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, info->fd, &epev);
+	info->events = events;
+}
+
+/**
+ * Handle a complete frame received from the client: print it, "sub <topic>"
+ * and "unsub <topic>" frames also update its subscriptions; in echo mode
+ * queue it back, in sink and source mode drop it. With -A a "worker" frame
+ * makes the client a worker instead.
+ *
+ * @param[in] arg	client connection info
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return On success, return 0.
+ *		   On error (no memory to echo), return -1
+ */
+static int server_recv_frame(void *arg, uint8_t *data, uint32_t len)
+{
+	struct client_connect_info *info = (struct client_connect_info *)arg;
+	int ret;
+
+	if (cfg.accept_port && (len == strlen(FDPASS_WORKER_CMD)) &&
+		(memcmp(data, FDPASS_WORKER_CMD, len) == 0)) {
+		SERVER_PRINT("client %d:%d is a worker", info->slot, info->fd);
+		info->worker = 1;
+		wheel_del(&timers, &info->idle);	/* it never sends again */
+		return 0;
+	}
+
+	metrics_add(&metrics.msgs_in, 1);
+	info->active = wheel_now(&timers);
+	if (cfg.mode == SERVER_MODE_ECHO) {
+		if (mode_echo(&info->outq, data, len) < 0) {
+			SERVER_PRINT("get %u bytes echo buff memory failed", len);
+			return -1;
+		}
+		metrics_add(&metrics.msgs_out, 1);
+		return 0;
+	} else if (cfg.mode != SERVER_MODE_CONSOLE) {
+		return 0;
+	}
+
+	SERVER_PRINT("RX[%04d]> %.*s", len, (int)len, data);
+
+	ret = fanout_command(&fanout, data, len, info);
+	if (ret != 0) {
+		SERVER_PRINT("subscription %s", (ret > 0) ? "updated" : "failed");
+	}
+
+	return 0;
+}
+
+/**
+ * Receive messages from the client
+ *
+ * Reads land directly in the connection's frame decoder, which may hold
+ * several pipelined frames or only part of one; what does not fit is
+ * picked up by the same readv() in a spill buffer.
+ *
+ * @param[in] info	client connection info
+ *
+ * @return On success, return the number of bytes read.
  */
-static int server_recv_message(int clientfd, struct common_buff *rbuf, uint16_t buff_len)
+static int server_recv_message(struct client_connect_info *info)
 {
-	char *rptr;
 	uint32_t rlen;
 	int ret;
 
-	rptr = (char *)rbuf;
 	rlen = 0;
 	do {
-		ret = read(clientfd, &rptr[rlen], buff_len - rlen);
+		ret = frame_decoder_readv(&info->dec, info->fd, server_recv_frame, info);
 		if (ret < 0) {
-			if (errno != EAGAIN) {
+			if (errno == EBADMSG) {
+				SERVER_PRINT("data error!!!");
+				return -SERVER_ERRNO;
+			} else if (errno != EAGAIN) {
 				SERVER_PRINT("read failed, %d, %s", errno, strerror(errno));
 				return -SERVER_ERRNO;
 			}
+			metrics_add(&metrics.eagain, 1);
 			break;
 		} else if (ret == 0) {
 			SERVER_PRINT("client closed connection");
 			return 0;
 		}
+		metrics_add(&metrics.bytes_in, ret);
 		rlen += ret;
 	} while (ret > 0);
 
-	SERVER_PRINT("RX[%04d]> %s", rlen, rbuf->data);
+	return rlen;
+}
+
+/**
+ * Point the message vectors at their buffers for the next recvmmsg()
+ *
+ * @param[in] batch	message vectors
+ */
+static void server_batch_reset(struct msg_batch *batch)
+{
+	int i;
+
+	memset(batch->msgs, 0x00, sizeof(batch->msgs));
+	for (i=0; i<SERVER_MSG_BATCH; i++) {
+		batch->iovs[i].iov_base = batch->bufs[i];
+		batch->iovs[i].iov_len = SERVER_MSG_LEN;
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+		batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+	}
+}
+
+/**
+ * Receive messages from a -T seqpacket client
+ *
+ * Every message arrives whole, there is nothing to decode. Up to
+ * SERVER_MSG_BATCH of them are read per recvmmsg(), a short batch means the
+ * socket is drained. An empty message cannot be told from the end of
+ * the connection, clients do not send them.
+ *
+ * @param[in] info	client connection info
+ *
+ * @return On success, return the number of bytes read.
+ */
+static int server_recv_packets(struct client_connect_info *info)
+{
+	struct mmsghdr *msg;
+	uint32_t rlen;
+	int ret;
+	int i;
+
+	rlen = 0;
+	do {
+		server_batch_reset(msg_batch);
+		ret = recvmmsg(info->fd, msg_batch->msgs, SERVER_MSG_BATCH, MSG_DONTWAIT, NULL);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				SERVER_PRINT("read failed, %d, %s", errno, strerror(errno));
+				return -SERVER_ERRNO;
+			}
+			metrics_add(&metrics.eagain, 1);
+			break;
+		}
+
+		for (i=0; i<ret; i++) {
+			msg = &msg_batch->msgs[i];
+			if (msg->msg_len == 0) {
+				SERVER_PRINT("client closed connection");
+				return 0;
+			} else if (msg->msg_hdr.msg_flags & MSG_TRUNC) {
+				SERVER_PRINT("data error!!! message over %u bytes", SERVER_MSG_LEN);
+				return -SERVER_ERRNO;
+			}
+			metrics_add(&metrics.bytes_in, msg->msg_len);
+			if (server_recv_frame(info, msg_batch->bufs[i], msg->msg_len) < 0) {
+				return -SERVER_ERRNO;
+			}
+			rlen += msg->msg_len;
+		}
+	} while ((ret < 0) || (ret == SERVER_MSG_BATCH));
 
 	return rlen;
 }
 
 /**
- * Send a message to the client
+ * Print the address of a -T dgram client
  *
- * @param[in] clientfd	client connection file descriptor
- * @param[in] sbuf		send buff pointer
- * @param[in] buff_len	send buff size
+ * @param[in] addr		client address
+ * @param[in] addr_len	its length
  *
- * @return On success, return the length of the sent.
+ * @return the path, an autobound (abstract) one starts with '@'
  */
-static int server_send_message(int clientfd, struct common_buff *sbuf, uint16_t buff_len)
+static const char *server_dgram_peer(const struct sockaddr_un *addr, socklen_t addr_len)
 {
-	uint32_t slen;
+	static char name[sizeof(addr->sun_path) + 1];
+	int len = addr_len - offsetof(struct sockaddr_un, sun_path);
+
+	if (len <= 0) {
+		return "(unbound)";
+	}
+	if (addr->sun_path[0] == '\0') {
+		snprintf(name, sizeof(name), "@%.*s", len - 1, &addr->sun_path[1]);
+	} else {
+		snprintf(name, sizeof(name), "%.*s", len, addr->sun_path);
+	}
+
+	return name;
+}
+
+/**
+ * Send a batch of received datagrams back to their senders
+ *
+ * What the senders' queues do not take is dropped, like any datagram.
+ * Senders without an address are skipped, there is nowhere to send to.
+ *
+ * @param[in] sockfd	bound datagram socket
+ * @param[in] batch		message vectors of the last receive
+ * @param[in] cnt		number of datagrams received
+ *
+ * @return the number of datagrams sent
+ */
+static int server_echo_batch(int sockfd, struct msg_batch *batch, int cnt)
+{
+	struct mmsghdr *msg;
+	int i, n, done, sent, ret;
+
+	/* only the addressed ones are kept, in order */
+	for (i=0,n=0; i<cnt; i++) {
+		msg = &batch->msgs[i];
+		if (msg->msg_hdr.msg_namelen <= offsetof(struct sockaddr_un, sun_path)) {
+			continue;
+		}
+		batch->iovs[i].iov_len = msg->msg_len;
+		msg->msg_hdr.msg_flags = 0;
+		batch->msgs[n++] = *msg;
+	}
+
+	for (sent=0,done=0; sent<n; sent+=ret) {
+		ret = sendmmsg(sockfd, &batch->msgs[sent], n - sent, MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			/* full, or the sender is gone: skip that one */
+			metrics_add(&metrics.eagain, 1);
+			ret = 1;
+			continue;
+		}
+		for (i=sent; i<sent+ret; i++) {
+			metrics_add(&metrics.msgs_out, 1);
+			metrics_add(&metrics.bytes_out, batch->msgs[i].msg_len);
+		}
+		done += ret;
+	}
+
+	return done;
+}
+
+/**
+ * Receive the datagrams of -T dgram clients
+ *
+ * There are no connections: each datagram is a whole message from the
+ * address it came from, and a client has to be bound to an address to get
+ * anything back. Up to SERVER_MSG_BATCH datagrams are read per recvmmsg(), in
+ * echo mode each batch goes back with one sendmmsg(). The console talks
+ * to the last client heard from.
+ *
+ * @param[in] sockfd	bound datagram socket
+ *
+ * @return On success, return the number of messages received.
+ *		   On error, negative number of the error line number
+ */
+static int server_recv_dgrams(int sockfd)
+{
+	struct mmsghdr *msg;
+	int cnt;
 	int ret;
+	int i;
 
-	/* clear send buff */
-	memset(sbuf->data, 0x00, buff_len);
+	cnt = 0;
+	do {
+		server_batch_reset(msg_batch);
+		ret = recvmmsg(sockfd, msg_batch->msgs, SERVER_MSG_BATCH, MSG_DONTWAIT, NULL);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				SERVER_PRINT("read failed, %d, %s", errno, strerror(errno));
+				return -SERVER_ERRNO;
+			}
+			metrics_add(&metrics.eagain, 1);
+			break;
+		}
 
-	/* get input from stdin  */
-	fgets((char *)sbuf->data, buff_len, stdin);
-	slen = strlen((char *)sbuf->data);
+		for (i=0; i<ret; i++) {
+			msg = &msg_batch->msgs[i];
+			if (msg->msg_hdr.msg_flags & MSG_TRUNC) {
+				SERVER_PRINT("datagram truncated to %u bytes", SERVER_MSG_LEN);
+			}
+			metrics_add(&metrics.bytes_in, msg->msg_len);
+			if (msg->msg_hdr.msg_namelen > offsetof(struct sockaddr_un, sun_path)) {
+				dgram_peer = msg_batch->addrs[i];
+				dgram_peer_len = msg->msg_hdr.msg_namelen;
+			}
+			if (cfg.mode == SERVER_MODE_CONSOLE) {
+				SERVER_PRINT("RX[%04d]> %.*s", msg->msg_len, (int)msg->msg_len, msg_batch->bufs[i]);
+				SERVER_PRINT("receive from client: %s",
+							 server_dgram_peer(&msg_batch->addrs[i], msg->msg_hdr.msg_namelen));
+			}
+		}
+		metrics_add(&metrics.msgs_in, ret);
+		cnt += ret;
+		if (cfg.mode == SERVER_MODE_ECHO) {
+			server_echo_batch(sockfd, msg_batch, ret);
+		}
+	} while ((ret < 0) || (ret == SERVER_MSG_BATCH));	/* a short batch means the queue is empty */
+
+	return cnt;
+}
+
+/**
+ * Write the connection's queued output, a source connection gets its queue
+ * topped up first
+ *
+ * @param[in] info	client connection info
+ *
+ * @return On success, return 0.
+ *		   On error, negative number of the error line number
+ */
+static int server_client_output(struct client_connect_info *info)
+{
+	ssize_t ret;
+
+	if (cfg.mode == SERVER_MODE_SOURCE) {
+		ret = mode_source_fill(&info->outq, source_frame, cfg.send_low);
+		if (ret < 0) {
+			SERVER_PRINT("get source buff memory failed");
+			return -SERVER_ERRNO;
+		}
+		metrics_add(&metrics.msgs_out, ret);
+	}
+
+	if (cfg.sock_type == SOCK_SEQPACKET) {
+		ret = mode_flush_msgs(&info->outq, info->fd);
+	} else {
+		ret = mode_flush(&info->outq, info->fd);
+	}
+	if (ret < 0) {
+		SERVER_PRINT("write failed, %s", strerror(errno));
+		return -SERVER_ERRNO;
+	}
+	metrics_add(&metrics.bytes_out, ret);
+	if (ret > 0) {
+		info->active = wheel_now(&timers);
+	}
+	if (!outq_empty(&info->outq)) {
+		metrics_add(&metrics.eagain, 1);
+	}
+
+	return 0;
+}
+
+/**
+ * Serve a connection in this process: it gets its buffers, a table slot
+ * and its epoll registration
+ *
+ * @param[in] epfd		epoll file descriptor
+ * @param[in] clients	connection table
+ * @param[in] connfd	connected socket, closed on error
+ *
+ * @return On success, return 0.
+ *		   On error, negative number of the error line number
+ */
+static int server_client_add(int epfd, struct conn_table *clients, int connfd)
+{
+	struct client_connect_info *info;
+	struct epoll_event epev;
+	int flags;
+	int t;
+
+	if (clients->count >= clients->max_size) {
+		SERVER_PRINT("too many connections");
+		close(connfd);
+		return -SERVER_ERRNO;
+	}
+
+	info = server_client_new(connfd);
+	if (!info) {
+		SERVER_PRINT("get client buff memory failed");
+		close(connfd);
+		return -SERVER_ERRNO;
+	}
+	t = conn_table_insert(clients, info);
+	if (t < 0) {
+		SERVER_PRINT("get connection table memory failed");
+		info->slot = (uint32_t)-1;	/* not in the table */
+		server_client_close(epfd, clients, info);
+		return -SERVER_ERRNO;
+	}
+	info->slot = t;
+
+	flags = fcntl(connfd, F_GETFL, 0);
+	/* set non-blocking mode */
+	fcntl(connfd, F_SETFL, flags|O_NONBLOCK);
+
+	memset(&epev, 0x00, sizeof(struct epoll_event));
+	epev.events = EPOLLIN;
+	epev.data.ptr = info;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &epev);
+	info->events = EPOLLIN;
+	server_client_events(epfd, info);
+
+	return 0;
+}
+
+/**
+ * Pass an accepted TCP connection to the next worker that can take it
+ *
+ * Workers are picked round robin. One with output queued is skipped, the
+ * descriptor has to ride on the first byte of its frame.
+ *
+ * @param[in] epfd		epoll file descriptor
+ * @param[in] clients	connection table
+ * @param[in] connfd	accepted socket, closed once passed
+ * @param[in] addr		its peer
+ *
+ * @return 1 if a worker took it, 0 if none could
+ */
+static int server_handoff(int epfd, struct conn_table *clients, int connfd, struct sockaddr_in *addr)
+{
+	struct client_connect_info *info;
+	uint8_t frame[FRAME_HDR_LEN + 64];
+	uint32_t i, slot, len;
+	ssize_t ret;
+
+	len = snprintf((char *)&frame[FRAME_HDR_LEN], sizeof(frame) - FRAME_HDR_LEN, FDPASS_CONN_CMD "%s:%d",
+				   inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+	len = frame_encode(frame, len);
+
+	for (i=0; i<clients->size; i++) {
+		slot = (next_worker + i) % clients->size;
+		info = conn_table_get(clients, slot);
+		if (!info || !info->worker || !outq_empty(&info->outq)) {
+			continue;
+		}
+		ret = fdpass_send(info->fd, frame, len, connfd);
+		if (ret <= 0) {
+			continue;	/* full or going away, the next one may take it */
+		}
+		if (ret < len) {
+			if (outq_push_bytes(&info->outq, &frame[ret], len - ret) < 0) {
+				shutdown(info->fd, SHUT_RDWR);	/* its stream is cut mid frame */
+			}
+			server_client_events(epfd, info);
+		}
+		SERVER_PRINT("passed %s to worker %d:%d", &frame[FRAME_HDR_LEN + strlen(FDPASS_CONN_CMD)],
+					 info->slot, info->fd);
+		metrics_add(&metrics.handoffs, 1);
+		close(connfd);
+		next_worker = slot + 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Handle a frame from the acceptor, a "conn" frame announces the next
+ * descriptor that came with the stream
+ *
+ * @param[in] arg	acceptor connection
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return 0, a missing descriptor is only reported
+ */
+static int server_acceptor_frame(void *arg, uint8_t *data, uint32_t len)
+{
+	struct server_acceptor *a = (struct server_acceptor *)arg;
+	int connfd;
+
+	if ((len < strlen(FDPASS_CONN_CMD)) || (memcmp(data, FDPASS_CONN_CMD, strlen(FDPASS_CONN_CMD)) != 0)) {
+		SERVER_PRINT("acceptor> %.*s", (int)len, data);
+		return 0;
+	}
+
+	connfd = fdpass_pop(&a->fds);
+	if (connfd < 0) {
+		SERVER_PRINT("no descriptor came with \"%.*s\"", (int)len, data);
+		return 0;
+	}
+	SERVER_PRINT("took %.*s, fd: %d", (int)(len - strlen(FDPASS_CONN_CMD)), &data[strlen(FDPASS_CONN_CMD)], connfd);
+	metrics_add(&metrics.accepts, 1);
+	server_client_add(a->epfd, a->clients, connfd);
+
+	return 0;
+}
+
+/**
+ * Read what the acceptor sent, with the descriptors attached to it
+ *
+ * @param[in] a	acceptor connection
+ *
+ * @return On success, return the number of bytes read, 0 once the
+ *		   acceptor is gone.
+ *		   On error, negative number of the error line number
+ */
+static int server_acceptor_recv(struct server_acceptor *a)
+{
+	uint32_t rlen, space;
+	uint8_t *buf;
+	ssize_t ret;
+
+	rlen = 0;
+	do {
+		buf = frame_decoder_space(&a->dec, &space);
+		if (!buf) {
+			SERVER_PRINT("get acceptor buff memory failed");
+			return -SERVER_ERRNO;
+		}
+		ret = fdpass_recv(a->fd, buf, space, &a->fds);
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				break;
+			}
+			SERVER_PRINT("read acceptor failed, %s", strerror(errno));
+			return -SERVER_ERRNO;
+		} else if (ret == 0) {
+			return 0;
+		}
+		if (frame_decoder_commit(&a->dec, ret, server_acceptor_frame, a) < 0) {
+			SERVER_PRINT("acceptor data error!!!");
+			return -SERVER_ERRNO;
+		}
+		rlen += ret;
+	} while (ret > 0);
+
+	return rlen;
+}
+
+/**
+ * Send a message to the client
+ *
+ * What the socket does not take is queued behind the frame's sent part,
+ * so the stream never carries half a frame followed by another one. A
+ * seqpacket message is queued whole while output is waiting or the socket
+ * is full, so it cannot overtake the echoes and broadcasts before it.
+ *
+ * @param[in] info		client connection info
+ * @param[in] msg		message typed on the console
+ * @param[in] buff_len	send buff payload size
+ *
+ * @return On success, return the length of the frame, of the message
+ *		   for seqpacket.
+ */
+static int server_send_message(struct client_connect_info *info, const char *msg, uint16_t buff_len)
+{
+	struct common_buff *sbuf = info->sbuf;
+	uint32_t slen;
+	ssize_t ret;
+
+	/* the console line (< CTRL_MSG_LEN) is cut to what the buffer holds */
+	slen = strnlen(msg, buff_len - 1);
+	memcpy(sbuf->data, msg, slen);
+	sbuf->data[slen] = '\0';
 	if (slen == 0) {
 		SERVER_PRINT("Input is empty");
 		return 0;
 	}
-	slen -= 1;
-	sbuf->data[slen] = '\0'; /* delete \n */
 
-	/* send to server */
-	ret = write(clientfd, sbuf, slen);
+	/* send to client, behind what is already queued */
+	if (cfg.sock_type == SOCK_SEQPACKET) {
+		ret = 0;
+		if (outq_empty(&info->outq)) {
+			ret = send(info->fd, sbuf->data, slen, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if ((ret < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				SERVER_PRINT("write failed, %s", strerror(errno));
+				return -SERVER_ERRNO;
+			}
+		}
+		/* a queued frame goes out as one bare message, see mode_flush_msgs() */
+		if ((ret <= 0) && (outq_push_frame(&info->outq, sbuf->data, slen, 0) < 0)) {
+			SERVER_PRINT("get output queue memory failed");
+			return -SERVER_ERRNO;
+		}
+		metrics_add(&metrics.msgs_out, 1);
+		metrics_add(&metrics.bytes_out, (ret > 0) ? ret : 0);
+		SERVER_PRINT("TX[%04d]> %s", (int)slen, sbuf->data);
+		return slen;
+	}
+
+	ret = 0;
+	if (outq_empty(&info->outq)) {
+		ret = frame_writev(info->fd, sbuf->data, slen, 0);
+		if (ret < 0) {
+			/* we failed */
+			SERVER_PRINT("write failed, %s", strerror(errno));
+			return -SERVER_ERRNO;
+		}
+	}
+	if (outq_push_frame(&info->outq, sbuf->data, slen, ret) < 0) {
+		SERVER_PRINT("get output queue memory failed");
+		return -SERVER_ERRNO;
+	}
+	metrics_add(&metrics.msgs_out, 1);
+	metrics_add(&metrics.bytes_out, ret);
+	SERVER_PRINT("TX[%04d]> %s", (int)(FRAME_HDR_LEN + slen), sbuf->data); /* the length includes the frame header */
+
+	return FRAME_HDR_LEN + slen;
+}
+
+/**
+ * Send a console message to the last -T dgram client heard from
+ *
+ * @param[in] sockfd	bound datagram socket
+ * @param[in] msg		message typed on the console
+ *
+ * @return On success, return the length of the sent.
+ */
+static int server_dgram_send(int sockfd, const char *msg)
+{
+	ssize_t ret;
+
+	if (*msg == '\0') {
+		SERVER_PRINT("Input is empty");
+		return 0;
+	} else if (dgram_peer_len == 0) {
+		SERVER_PRINT("no client to send to");
+		return 0;
+	}
+
+	ret = sendto(sockfd, msg, strlen(msg), MSG_DONTWAIT, (struct sockaddr *)&dgram_peer, dgram_peer_len);
 	if (ret < 0) {
-		/* we failed */
-		SERVER_PRINT("write failed, %s", strerror(errno));
+		SERVER_PRINT("write to %s failed, %s", server_dgram_peer(&dgram_peer, dgram_peer_len), strerror(errno));
 		return -SERVER_ERRNO;
 	}
-	SERVER_PRINT("TX[%04d]> %s", ret, sbuf->data);
+	metrics_add(&metrics.msgs_out, 1);
+	metrics_add(&metrics.bytes_out, ret);
+	SERVER_PRINT("TX[%04zd]> %s", ret, msg);
+	SERVER_PRINT("send to client: %s", server_dgram_peer(&dgram_peer, dgram_peer_len));
 
 	return ret;
 }
 
 /**
- * Select the client number to send the message to
+ * Fan-out delivery: send a shared frame to one client behind its queued
+ * output, seqpacket clients get the bare payload; what the socket does
+ * not take is queued as a reference and waits for EPOLLOUT
+ *
+ * @param[in] arg	epoll file descriptor
+ * @param[in] sub	client connection info
+ * @param[in] frame	shared frame
+ *
+ * @return 0 if the frame was sent or queued, -1 if the client missed it
+ */
+static int server_client_deliver(void *arg, void *sub, struct outq_buf *frame)
+{
+	struct client_connect_info *info = (struct client_connect_info *)sub;
+	int epfd = *(int *)arg;
+	ssize_t ret;
+
+	if (cfg.sock_type == SOCK_SEQPACKET) {
+		ret = fanout_send_msg(info->fd, &info->outq, frame, cfg.send_high);
+	} else {
+		ret = fanout_send(info->fd, &info->outq, frame, cfg.send_high);
+	}
+	if (ret < 0) {
+		return -1;
+	}
+	metrics_add(&metrics.bytes_out, ret);
+	if (ret > 0) {
+		info->active = wheel_now(&timers);
+	}
+	server_client_events(epfd, info);
+
+	return 0;
+}
+
+/**
+ * Send a console message to every client, or with 'topic' set take it as
+ * "<topic> <message>" and send it to the topic's subscribers
+ *
+ * @param[in] epfd			epoll file descriptor
+ * @param[in] clients		connection table
+ * @param[in] topic			publish to a topic instead of broadcasting
+ * @param[in] input			message line
+ */
+static void server_console_publish(int epfd, struct conn_table *clients, int topic, const char *input)
+{
+	struct client_connect_info *info;
+	struct outq_buf *frame;
+	char line[DATA_MAX_LEN];
+	char *msg;
+	int i, len, cnt;
+
+	snprintf(line, sizeof(line), "%s", input);
+	len = strlen(line);
+
+	if (topic) {
+		msg = strchr(line, ' ');
+		if (!msg) {
+			SERVER_PRINT("usage: <topic> <message>");
+			return;
+		}
+		*msg++ = '\0';
+		cnt = fanout_publish(&fanout, line, msg, strlen(msg), server_client_deliver, &epfd);
+		if (cnt > 0) {
+			metrics_add(&metrics.msgs_out, cnt);
+		}
+		SERVER_PRINT("TX[%s]> %s, %d subscribers", line, msg, cnt);
+		return;
+	}
+
+	/* encoded once, every client gets the same bytes */
+	frame = fanout_encode(&fanout, line, len);
+	if (!frame) {
+		SERVER_PRINT("get %d bytes broadcast buff memory failed", len);
+		return;
+	}
+	for (i=0,cnt=0; i<clients->size; i++) {
+		info = conn_table_get(clients, i);
+		if (info && (fanout_deliver(&fanout, info, frame, server_client_deliver, &epfd) == 0)) {
+			cnt++;
+		}
+	}
+	metrics_add(&metrics.msgs_out, cnt);
+	outq_buf_put(&buff_pool, frame);
+	SERVER_PRINT("TX[all]> %s, %d clients", line, cnt);
+}
+
+/**
+ * Print the connections the console can send to
+ *
+ * @param[in] clients	connection table
+ */
+static void server_list_clients(struct conn_table *clients)
+{
+	struct client_connect_info *info;
+	uint32_t i, check_cnt;
+
+	for (i=0,check_cnt=0; (i<clients->size) && (check_cnt < clients->count); i++) {
+		info = conn_table_get(clients, i);
+		if (info) {
+			SERVER_PRINT("Client %u: %d", i, info->fd);
+			check_cnt++;
+		}
+	}
+	SERVER_PRINT("%u client(s)", check_cnt);
+}
+
+/**
+ * Select the client number to send the message to, "l" lists the clients,
+ * "a" broadcasts the next line and "t" publishes it to a topic instead.
+ * A -T dgram server has no clients to pick, any selection means the last
+ * client heard from.
  *
- * @param[in] client_info	Client Connection Info
+ * @param[in] epfd		epoll file descriptor
+ * @param[in] clients	connection table
+ * @param[in] cmd		console command
  *
  * @return On success, return the index of the client
  */
-static int server_select_client(struct client_connect_info *client_info)
+static int server_select_client(int epfd, struct conn_table *clients, const struct ctrl_cmd *cmd)
 {
-	char index[5+1] = {0};
-	int i, len;
+	const char *index = cmd->sel;
+	int i;
 
-	fgets(index, sizeof(char)*5, stdin);
-	len = strlen(index);
-	if (len > 0) {
-		index[len - 1] = '\0';	/* delete \n */
+	if (strcmp(index, "l") == 0) {
+		server_list_clients(clients);
+		return -SERVER_ERRNO;
+	} else if (cfg.mode != SERVER_MODE_CONSOLE) {
+		SERVER_PRINT("console sends are off in %s mode", mode_name(cfg.mode));
+		return -SERVER_ERRNO;
+	} else if (cfg.sock_type == SOCK_DGRAM) {
+		return 0;
+	} else if ((strcmp(index, "a") == 0) || (strcmp(index, "t") == 0)) {
+		server_console_publish(epfd, clients, index[0] == 't', cmd->msg);
+		return -SERVER_ERRNO;
 	}
 
 	i = atoi(index);
-	if ((i >= MAX_CLIENTS) || (client_info[i].fd <= 0)) {
+	if ((i < 0) || (!conn_table_get(clients, i))) {
 		SERVER_PRINT("input error.");
 		return -SERVER_ERRNO;
 	}
@@ -235,73 +1205,150 @@ static int server_select_client(struct client_connect_info *client_info)
 
 int main(int argc, char *argv[])
 {
-	struct client_connect_info client_info[MAX_CLIENTS];
+	struct client_connect_info *info;
+	struct conn_table clients;
 	struct sockaddr_un clientaddr;
-	struct common_buff *buff;
+	struct sockaddr_in tcpaddr;
 	struct epoll_event epev;
-	struct epoll_event events[MAX_CLIENTS];
-	socklen_t client_len;
-	uint32_t timeout;
-	uint16_t blen;
+	struct epoll_event *events;
+	struct ctrl_cmd cmd;
+	socklen_t client_len, tcp_len;
 	char *local_path;
 	int sockfd, connfd, epfd;
-	int i, t, connect_cnt, check_cnt, ret;
+	int i, t, ret, ret2;
 
-	if (argc < 2) {
-		SERVER_PRINT("usage: ./server local_path");
+	log_init();
+	metrics_init(&metrics, "local");
+	metrics_signal_init(SIGUSR1);
+
+	ret = server_config_parse(&cfg, SERVER_OPTIONS, argc, argv);
+	if ((ret < 0) || (ret >= argc)) {
+		SERVER_PRINT("usage: ./server [-c max_clients] [-b backlog] [-e max_events] [-H high] [-L low] [-m console|echo|sink|source] [-S size] [-I idle_seconds] [-K keepalive_seconds] [-U user_timeout_ms] [-A port | -W] [-T stream|seqpacket|dgram] local_path");
 		return -SERVER_ERRNO;
 	}
 
-	local_path = argv[1];
-	SERVER_PRINT("local path: %s", local_path);
+	local_path = argv[ret];
+	SERVER_PRINT("local path: %s (%s), max clients: %u, backlog: %d, %s mode%s", local_path,
+				 sock_type_name(cfg.sock_type), cfg.max_clients, cfg.backlog, mode_name(cfg.mode),
+				 cfg.worker ? ", worker" : "");
+	if ((cfg.sock_type == SOCK_DGRAM) && (cfg.mode == SERVER_MODE_SOURCE)) {
+		SERVER_PRINT("source mode needs connections, not dgram");
+		return -SERVER_ERRNO;
+	}
 
-	blen = sizeof(struct common_buff);
-	buff = (struct common_buff *)malloc(blen);
-	if (!buff) {
-		SERVER_PRINT("get %d bytes buff memory failed", blen);
+	buff_pool_init(&buff_pool, POOL_IDLE_BYTES);
+	fanout_init(&fanout, &buff_pool);
+	if (cfg.mode == SERVER_MODE_SOURCE) {
+		source_frame = mode_source_frame(&buff_pool, cfg.source_size);
+		if (!source_frame) {
+			SERVER_PRINT("get %u bytes source buff memory failed", cfg.source_size);
+			return -SERVER_ERRNO;
+		}
+	}
+	if (conn_table_init(&clients, CONN_TABLE_INIT, cfg.max_clients) < 0) {
+		SERVER_PRINT("get connection table memory failed");
 		return -SERVER_ERRNO;
 	}
 
-	sockfd = server_listen_connection(local_path);
-	if (sockfd < 0) {
-		SERVER_PRINT("accept client connection failed");
-		ret = -SERVER_ERRNO;
-		goto label_main_exit;
+	events = (struct epoll_event *)calloc(cfg.max_events, sizeof(struct epoll_event));
+	if (!events) {
+		SERVER_PRINT("get %u epoll events memory failed", cfg.max_events);
+		conn_table_exit(&clients);
+		return -SERVER_ERRNO;
+	}
+	if (cfg.sock_type != SOCK_STREAM) {
+		msg_batch = (struct msg_batch *)malloc(sizeof(struct msg_batch));
+		if (!msg_batch) {
+			SERVER_PRINT("get message buff memory failed");
+			free(events);
+			conn_table_exit(&clients);
+			return -SERVER_ERRNO;
+		}
+	}
+
+	epfd = -1;
+	sockfd = -1;
+	fdpass_queue_init(&acceptor.fds);
+	if (cfg.worker) {
+		/* the acceptor's socket is dialed instead of listened on */
+		if (frame_decoder_init(&acceptor.dec, RECV_BUFF_LEN, RECV_HIGH_WATER, NULL) < 0) {
+			SERVER_PRINT("get acceptor buff memory failed");
+			ret = -SERVER_ERRNO;
+			goto label_main_exit;
+		}
+		acceptor.fd = server_connect_acceptor(local_path);
+		if (acceptor.fd < 0) {
+			ret = -SERVER_ERRNO;
+			goto label_main_exit;
+		}
+		acceptor.clients = &clients;
+	} else {
+		sockfd = server_listen_connection(local_path, cfg.backlog);
+		if (sockfd < 0) {
+			SERVER_PRINT("accept client connection failed");
+			ret = -SERVER_ERRNO;
+			goto label_main_exit;
+		}
+	}
+	if (cfg.accept_port) {
+		tcpfd = server_listen_tcp(cfg.accept_port, cfg.backlog);
+		if (tcpfd < 0) {
+			ret = -SERVER_ERRNO;
+			goto label_main_exit;
+		}
+		SERVER_PRINT("accepting tcp port %u for the workers", cfg.accept_port);
 	}
 
-	client_len = sizeof(struct sockaddr_in);
-	connect_cnt = 0;
-	memset(client_info, 0x00, sizeof(struct client_connect_info) * MAX_CLIENTS);
+	client_len = sizeof(struct sockaddr_un);
 
 	epfd = epoll_create(2);
 	if (epfd < 0) {
 		SERVER_PRINT("epoll failed, %s", strerror(errno));
 		goto label_main_exit;
 	}
+	acceptor.epfd = epfd;
 
-	timeout = 10 * 1000;
+	/* the console is read on a thread of its own, epoll only sees its eventfd */
+	if (ctrl_start(&ctrl, stdin, "l") < 0) {
+		SERVER_PRINT("start control thread failed, %s", strerror(errno));
+		goto label_main_exit;
+	}
+
+	/*
+	 * Client events carry their connection info in data.ptr, the console,
+	 * the listeners and the acceptor connection carry a pointer to their fd
+	 * variable instead.
+	 */
+	wheel_init(&timers);
 	memset(&epev, 0x00, sizeof(struct epoll_event));
 	epev.events = EPOLLIN;
-	epev.data.fd = fileno(stdin);	/* stdin can also be monitored using poll */
-	epoll_ctl(epfd, EPOLL_CTL_ADD, fileno(stdin), &epev);
+	epev.data.ptr = &ctrl.efd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, ctrl.efd, &epev);
 
-	epev.events = EPOLLIN;
-	epev.data.fd = sockfd;
-	epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &epev);
+	if (sockfd >= 0) {
+		epev.events = EPOLLIN;
+		epev.data.ptr = &sockfd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &epev);
+	}
+	if (tcpfd >= 0) {
+		epev.events = EPOLLIN;
+		epev.data.ptr = &tcpfd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, tcpfd, &epev);
+	}
+	if (acceptor.fd >= 0) {
+		epev.events = EPOLLIN;
+		epev.data.ptr = &acceptor.fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, acceptor.fd, &epev);
+	}
 
-	memset(events, 0x00, (sizeof(struct epoll_event) * MAX_CLIENTS));
+	SERVER_PRINT("Select a client to send a message, \"l\" lists the clients:");
 	while (1) {
-		SERVER_PRINT("Select a client to send a message:");
-		for (i=0,check_cnt=0; (i<MAX_CLIENTS) && (check_cnt < connect_cnt); i++) {
-			if (client_info[i].fd > 0) {
-				SERVER_PRINT("Client %d: %d", i, client_info[i].fd);
-				check_cnt++;
-			}
-		}
-		SERVER_PRINT("---------------------------------\n");
-
-		ret = epoll_wait(epfd, events, MAX_CLIENTS, timeout);
-		if (ret < 0) {
+		wheel_run(&timers);
+		ret = epoll_wait(epfd, events, cfg.max_events, wheel_timeout(&timers, SERVER_WAIT_MS));
+		metrics_wakeup(&metrics, ret);
+		if ((ret < 0) && (errno == EINTR)) {
+			continue;	/* a signal, e.g. SIGCONT after a stop */
+		} else if (ret < 0) {
 			SERVER_PRINT("epoll failed, %s", strerror(errno));
 			ret = -SERVER_ERRNO;
 			break;
@@ -310,74 +1357,109 @@ int main(int argc, char *argv[])
 			continue;
 		} else {
 			for (i=0; i<ret; i++) {
-				if (events[i].events & EPOLLIN) {
-					if (events[i].data.fd == fileno(stdin)) { /* stdin */
-						t = server_select_client(client_info);
-						if (t >= 0) {
-							if (server_send_message(client_info[t].fd, buff, blen) < 0) {
-								epoll_ctl(epfd, EPOLL_CTL_DEL, client_info[t].fd, NULL);
-								close(client_info[t].fd);
-								client_info[t].fd = -1;
-								connect_cnt --;
-							}
+				if (events[i].data.ptr == &ctrl.efd) { /* console */
+					while (ctrl_next(&ctrl, &cmd)) {
+						t = server_select_client(epfd, &clients, &cmd);
+						if (t < 0) {
+							continue;
+						} else if (cfg.sock_type == SOCK_DGRAM) {
+							server_dgram_send(sockfd, cmd.msg);
+							continue;
 						}
-					} else if (events[i].data.fd == sockfd) {
-						connfd = accept(sockfd, (struct sockaddr *)&clientaddr, &client_len);
-						if (connfd < 0) {
-							SERVER_PRINT("accept failed, %s", strerror(errno));
-							ret = -SERVER_ERRNO;
-							break;
+						info = conn_table_get(&clients, t);
+						if (server_send_message(info, cmd.msg, DATA_MAX_LEN) < 0) {
+							server_client_close(epfd, &clients, info);
+						} else {
+							/* a queued tail goes out on EPOLLOUT */
+							server_client_events(epfd, info);
 						}
+					}
+				} else if ((events[i].data.ptr == &sockfd) && (cfg.sock_type == SOCK_DGRAM)) {
+					if (server_recv_dgrams(sockfd) < 0) {
+						ret = -SERVER_ERRNO;
+						break;
+					}
+				} else if (events[i].data.ptr == &sockfd) {
+					connfd = accept(sockfd, (struct sockaddr *)&clientaddr, &client_len);
+					if (connfd < 0) {
+						SERVER_PRINT("accept failed, %s", strerror(errno));
+						ret = -SERVER_ERRNO;
+						break;
+					}
+					metrics_add(&metrics.accepts, 1);
 
-						if (connect_cnt >= MAX_CLIENTS) {
-							SERVER_PRINT("too many connections");
-							close(connfd);
-							connfd = -1;
+					SERVER_PRINT("accpet a new client, fd: %d", connfd);
+					server_client_add(epfd, &clients, connfd);
+				} else if (events[i].data.ptr == &tcpfd) {
+					tcp_len = sizeof(struct sockaddr_in);
+					connfd = accept(tcpfd, (struct sockaddr *)&tcpaddr, &tcp_len);
+					if (connfd < 0) {
+						if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != ECONNABORTED)) {
+							SERVER_PRINT("accept tcp failed, %s", strerror(errno));
+						}
+						continue;
+					}
+					metrics_add(&metrics.accepts, 1);
+					if (hb_tcp_tune(connfd, &cfg.hb) < 0) {
+						SERVER_PRINT("set keepalive options failed, %s", strerror(errno));
+					}
+
+					/* without a worker to take it, it is served here */
+					if (!server_handoff(epfd, &clients, connfd, &tcpaddr)) {
+						SERVER_PRINT("accpet a new tcp client: %s:%d", inet_ntoa(tcpaddr.sin_addr), ntohs(tcpaddr.sin_port));
+						server_client_add(epfd, &clients, connfd);
+					}
+				} else if (events[i].data.ptr == &acceptor.fd) {
+					if (server_acceptor_recv(&acceptor) <= 0) {
+						SERVER_PRINT("acceptor closed, serving the connections left");
+						epoll_ctl(epfd, EPOLL_CTL_DEL, acceptor.fd, NULL);
+						close(acceptor.fd);
+						acceptor.fd = -1;
+					}
+				} else {
+					info = (struct client_connect_info *)events[i].data.ptr;
+					if (info->fd < 0) {
+						/* closed earlier in this batch */
+						continue;
+					}
+
+					ret2 = 0;
+					if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+						SERVER_DEBUG("From client %d: %d.", info->slot, info->fd);
+						if (cfg.sock_type == SOCK_SEQPACKET) {
+							ret2 = (server_recv_packets(info) <= 0) ? -1 : 0;
 						} else {
-							SERVER_PRINT("accpet a new client, fd: %d", connfd);
-							for (t=0; t<MAX_CLIENTS; t++) {
-								if (client_info[t].fd <= 0) {
-									int flags = fcntl(connfd, F_GETFL, 0);
-									/* set non-blocking mode */
-									fcntl(connfd, F_SETFL, flags|O_NONBLOCK);
-
-									epev.events = EPOLLIN;
-									epev.data.fd = connfd;
-									epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &epev);
-
-									client_info[t].fd = connfd;
-									connect_cnt ++;
-									break;
-								}
-							}
+							ret2 = (server_recv_message(info) <= 0) ? -1 : 0;
 						}
+					}
+					/* echoes go out right away, the socket usually has room */
+					if ((ret2 == 0) && ((events[i].events & EPOLLOUT) || !outq_empty(&info->outq))) {
+						ret2 = server_client_output(info);
+					}
+					if (ret2 < 0) {
+						SERVER_PRINT("connect %d:%d closed.", info->slot, info->fd);
+						server_client_close(epfd, &clients, info);
 					} else {
-						for (t=0; t<MAX_CLIENTS; t++) { /* This loop is just to print out the log */
-							if ((events[i].data.fd > 0) && (events[i].data.fd == client_info[t].fd)) {
-								SERVER_PRINT("From client %d: %d.", t, client_info[t].fd);
-								if (server_recv_message(events[i].data.fd, buff, blen) <= 0) {
-									epoll_ctl(epfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
-									SERVER_PRINT("connect %d:%d closed.", t, client_info[t].fd);
-									close(events[i].data.fd);
-									client_info[t].fd = -1;
-									connect_cnt --;
-								}
-								break;
-							}
-						}
+						server_client_events(epfd, info);
 					}
 				}
 			}
+			server_client_reap();
+			metrics_handled(&metrics);
 		}
 	}
 
 label_main_exit:
-	for (i=0; i<MAX_CLIENTS; i++) {
-		if (client_info[i].fd > 0) {
-			close(client_info[i].fd);
-			client_info[i].fd = -1;
+	for (i=0; i<clients.size; i++) {
+		info = conn_table_get(&clients, i);
+		if (info) {
+			server_client_close(epfd, &clients, info);
 		}
 	}
+	server_client_reap();
+	conn_table_exit(&clients);
+	free(events);
+	free(msg_batch);
 	if (epfd > 0) {
 		close(epfd);
 	}
@@ -385,10 +1467,23 @@ label_main_exit:
 		close(sockfd);
 		sockfd = -1;
 	}
-	if (buff) {
-		free(buff);
-		buff = NULL;
+	if (tcpfd >= 0) {
+		close(tcpfd);
+		tcpfd = -1;
+	}
+	if (acceptor.fd >= 0) {
+		close(acceptor.fd);
+		acceptor.fd = -1;
+	}
+	frame_decoder_exit(&acceptor.dec);
+	fdpass_queue_exit(&acceptor.fds);
+
+	ctrl_stop(&ctrl);
+	fanout_exit(&fanout);
+	if (source_frame) {
+		outq_buf_put(&buff_pool, source_frame);
 	}
+	buff_pool_exit(&buff_pool);
 
 	SERVER_PRINT("server exit ...");
 
@@ -11,9 +11,11 @@
 #include <poll.h>
 
 #include "common.h"
+#include "frame.h"
+#include "log.h"
 
 #define CLIENT_ERRNO				__LINE__
-#define CLIENT_PRINT(_fmt, ...)		printf("[%04d] "_fmt"\n", __LINE__, ##__VA_ARGS__);
+#define CLIENT_PRINT(_fmt, ...)		LOG_INFO("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
 
 /**
  * Connect to the server
@@ -113,7 +115,7 @@ label_client_connect_server:
  *
  * @param[in] sockfd	socket file descriptor
  * @param[in] sbuf		send buff pointer
- * @param[in] buff_len	send buff size
+ * @param[in] buff_len	send buff payload size
  *
  * @return On success, return the length of the sent.
  */
@@ -136,39 +138,55 @@ static int client_send_message(int sockfd, struct common_buff *sbuf, uint16_t bu
 	sbuf->data[slen] = '\0'; /* delete \n */
 
 	/* send to server */
-	ret = write(sockfd, sbuf->data, slen);
+	ret = frame_write_all(sockfd, sbuf->data, slen);
 	if (ret < 0) {
 		/* we failed */
 		CLIENT_PRINT("write failed, %s", strerror(errno));
 		return -CLIENT_ERRNO;
 	}
-	CLIENT_PRINT("TX[%04d]> %s", ret, sbuf->data);
+	CLIENT_PRINT("TX[%04d]> %s", ret, sbuf->data); /* 'ret' includes the frame header */
 	/* CLIENT_PRINT("send %d bytes data", ret); */
 
 	return ret;
 }
 
 /**
- * Receive a message from the server
+ * Print a complete frame received from the server
+ *
+ * @param[in] arg	unused
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return always 0
+ */
+static int client_recv_frame(void *arg, uint8_t *data, uint32_t len)
+{
+	CLIENT_PRINT("RX[%04d]> %.*s", len, (int)len, data);
+
+	return 0;
+}
+
+/**
+ * Receive messages from the server
  *
  * @param[in] sockfd	socket file descriptor
- * @param[in] rbuf		recv buff pointer
- * @param[in] buff_len	recv buff size
+ * @param[in] dec		frame decoder of the connection
  *
- * @return On success, return the length of the sent.
+ * @return On success, return the number of bytes read.
  */
-static int client_recv_message(int sockfd, struct common_buff *rbuf, uint16_t buff_len)
+static int client_recv_message(int sockfd, struct frame_decoder *dec)
 {
-	char *ptr;
 	uint32_t rlen;
 	int ret;
 
-	ptr = (char *)rbuf;
 	rlen = 0;
 	do {
-		ret = read(sockfd, &ptr[rlen], buff_len - rlen);
+		ret = frame_decoder_readv(dec, sockfd, client_recv_frame, NULL);
 		if (ret < 0) {
-			if (errno != EAGAIN) {
+			if (errno == EBADMSG) {
+				CLIENT_PRINT("data error!!!");
+				return -CLIENT_ERRNO;
+			} else if (errno != EAGAIN) {
 				CLIENT_PRINT("read failed, %s", strerror(errno));
 				return -CLIENT_ERRNO;
 			}
@@ -178,9 +196,7 @@ static int client_recv_message(int sockfd, struct common_buff *rbuf, uint16_t bu
 			return 0;
 		}
 		rlen += ret;
-	} while ((ret > 0) && (rlen < buff_len));
-
-	CLIENT_PRINT("RX[%04d]> %s", rlen, rbuf->data);
+	} while (ret > 0);
 
 	return rlen;
 }
@@ -188,6 +204,7 @@ static int client_recv_message(int sockfd, struct common_buff *rbuf, uint16_t bu
 int main(int argc, char *argv[])
 {
 	struct common_buff *buff;
+	struct frame_decoder dec;
 	struct pollfd pfds[2];		/* stdin + sockfd */
 	const char *ip_str;
 	const char *port_str;
@@ -196,18 +213,26 @@ int main(int argc, char *argv[])
 	int sockfd;
 	int ret;
 
+	log_init();
+
 	if (argc < 3) {
 		CLIENT_PRINT("usage: ./client ip port");
 		return -CLIENT_ERRNO;
 	}
 
-	blen = sizeof(struct common_buff);
+	blen = sizeof(struct common_buff) + DATA_MAX_LEN;
 	buff = (struct common_buff *)malloc(blen);
 	if (!buff) {
 		CLIENT_PRINT("get %d bytes buff memory failed", blen);
 		return -CLIENT_ERRNO;
 	}
 
+	if (frame_decoder_init(&dec, RECV_BUFF_LEN, RECV_HIGH_WATER, NULL) < 0) {
+		CLIENT_PRINT("get decoder memory failed");
+		free(buff);
+		return -CLIENT_ERRNO;
+	}
+
 	ip_str   = argv[1];
 	port_str = argv[2];
 	CLIENT_PRINT("addr: %s:%s", ip_str, port_str);
@@ -215,6 +240,7 @@ int main(int argc, char *argv[])
 	sockfd = client_connect_server(ip_str, port_str);
 	if (sockfd < 0) {
 		CLIENT_PRINT("connect server failed, %d", sockfd);
+		frame_decoder_exit(&dec);
 		free(buff);
 		return -CLIENT_ERRNO;
 	}
@@ -237,7 +263,7 @@ int main(int argc, char *argv[])
 			continue;
 		} else {
 			if (pfds[0].revents & POLLIN) {
-				if (client_send_message(sockfd, buff, blen) < 0) {
+				if (client_send_message(sockfd, buff, DATA_MAX_LEN) < 0) {
 					break;
 				}
 
@@ -254,7 +280,7 @@ int main(int argc, char *argv[])
 			}
 
 			if (pfds[1].revents & POLLIN) {
-				if (client_recv_message(sockfd, buff, blen) <= 0) {
+				if (client_recv_message(sockfd, &dec) <= 0) {
 					break;
 				}
 			}
@@ -265,6 +291,7 @@ int main(int argc, char *argv[])
 		close(sockfd);
 		sockfd = -1;
 	}
+	frame_decoder_exit(&dec);
 	if (buff) {
 		free(buff);
 		buff = NULL;
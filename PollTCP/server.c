@@ -9,29 +9,60 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
 
 #include "common.h"
+#include "frame.h"
+#include "config.h"
+#include "fanout.h"
+#include "ctrl.h"
+#include "log.h"
+#include "metrics.h"
+#include "mode.h"
+#include "wheel.h"
+#include "heartbeat.h"
 
-#define LISTENQ						20
-#define MAX_CLIENTS					20
+#define CLIENT_SLOTS_INIT			64		/* initial client slots */
 
+#define SERVER_WAIT_MS				(10 * 1000)	/* longest wait without a timer due */
+
+#define SERVER_OPTIONS				"c:b:H:L:m:S:I:P:M:K:U:"	/* see config.h */
 #define SERVER_ERRNO				__LINE__
-#define SERVER_PRINT(_fmt, ...)		printf("[%04d] "_fmt"\n", __LINE__, ##__VA_ARGS__);
+#define SERVER_PRINT(_fmt, ...)		LOG_INFO("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
+#define SERVER_DEBUG(_fmt, ...)		LOG_DEBUG("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
 
 struct client_connect_info {
 	int fd;
+	struct frame_decoder dec;	/* receive buffer */
+	struct common_buff *sbuf;	/* send buffer */
 	struct sockaddr_in clientaddr;
+	struct outq outq;			/* echo and source output */
+	struct wheel_timer idle;	/* -I timeout */
+	uint64_t active;			/* tick of the last frame in or bytes out */
+	struct wheel_timer hb;		/* -P heartbeat */
+	uint64_t hb_rx;				/* tick of the last ping or pong in */
 };
 
+#define POOL_IDLE_BYTES				(1024 * 1024)	/* idle broadcast frames kept */
+
+static struct buff_pool buff_pool;	/* broadcast frames */
+static struct fanout fanout;		/* topic subscriptions, by connection */
+static struct metrics metrics;
+static struct server_config cfg;
+static struct outq_buf *source_frame;	/* streamed in source mode */
+static struct timer_wheel timers;		/* idle timeouts and heartbeats */
+static struct ctrl_chan ctrl = { .efd = -1 };	/* console, read by the control thread */
+
 /**
  * Listen socket connection
  *
  * @param[in] port_str	port string
+ * @param[in] backlog	listen() backlog
  *
  * @return On success, return the client connection fd.
  *		   On error, negative number of the error line number
  */
-static int server_listen_connection(const char *port_str)
+static int server_listen_connection(const char *port_str, int backlog)
 {
 	struct sockaddr_in servaddr;
 	uint16_t port;
@@ -67,7 +98,7 @@ static int server_listen_connection(const char *port_str)
 		goto label_server_listen_connection;
 	}
 
-	ret = listen(sockfd, LISTENQ);
+	ret = listen(sockfd, backlog);
 	if (ret < 0) {
 		SERVER_PRINT("listen failed, %s", strerror(errno));
 		ret = -SERVER_ERRNO;
@@ -84,101 +115,545 @@ label_server_listen_connection:
 }
 
 /**
- * Receive a message from the client
+ * Idle timer of a connection: shut it down once nothing happened for -I
+ * seconds, otherwise wait for the rest of the period
+ *
+ * The data path only moves 'active' forward and never touches the timer.
+ * Bytes that do not complete a frame are no activity, so a client that
+ * trickles a frame in (slowloris) is reaped too. The event loop then sees
+ * the stream end and closes the connection as usual.
+ *
+ * @param[in] arg	client connection info
+ */
+static void server_client_idle(void *arg)
+{
+	struct client_connect_info *info = (struct client_connect_info *)arg;
+	uint64_t deadline = info->active + cfg.idle_timeout * 1000ULL;
+
+	if (deadline > wheel_now(&timers)) {
+		wheel_add(&timers, &info->idle, deadline);
+		return;
+	}
+
+	SERVER_PRINT("connect %s:%d idle for %u s, closing", inet_ntoa(info->clientaddr.sin_addr),
+				 info->clientaddr.sin_port, cfg.idle_timeout);
+	metrics_add(&metrics.idle_closes, 1);
+	shutdown(info->fd, SHUT_RDWR);
+}
+
+/**
+ * Heartbeat timer of a connection: ping a client that has been silent for
+ * -P seconds, shut it down once it stayed silent for -M of them
+ *
+ * Output the client reads counts as hearing from it, so a streaming
+ * connection needs no pings; one with output waiting skips its ping.
+ *
+ * @param[in] arg	client connection info
+ */
+static void server_client_heartbeat(void *arg)
+{
+	struct client_connect_info *info = (struct client_connect_info *)arg;
+	uint64_t heard = (info->hb_rx > info->active) ? info->hb_rx : info->active;
+	uint64_t next;
+
+	switch (hb_check(&cfg.hb, wheel_now(&timers), heard, &next)) {
+	case HB_DEAD:
+		SERVER_PRINT("connect %s:%d silent for %u heartbeats, closing", inet_ntoa(info->clientaddr.sin_addr),
+					 info->clientaddr.sin_port, cfg.hb.misses);
+		metrics_add(&metrics.dead_closes, 1);
+		shutdown(info->fd, SHUT_RDWR);
+		return;
+	case HB_PING:
+		if (outq_empty(&info->outq) && (hb_send(info->fd, HB_FRAME_PING, &info->outq) >= 0)) {
+			metrics_add(&metrics.pings, 1);
+		}
+		break;
+	}
+	wheel_add(&timers, &info->hb, next);
+}
+
+/**
+ * Handle a control frame received from the client: answer pings, note
+ * pongs
+ *
+ * @param[in] arg	client connection info
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return On success, return 0.
+ *		   On error (no memory to queue the pong), return -1
+ */
+static int server_recv_ctrl(void *arg, uint8_t *data, uint32_t len)
+{
+	struct client_connect_info *info = (struct client_connect_info *)arg;
+
+	switch (hb_frame_type(data, len)) {
+	case HB_FRAME_PING:
+		info->hb_rx = wheel_now(&timers);
+		return (hb_send(info->fd, HB_FRAME_PONG, &info->outq) < 0) ? -1 : 0;
+	case HB_FRAME_PONG:
+		info->hb_rx = wheel_now(&timers);
+		return 0;
+	}
+
+	return 0;	/* unknown control frame */
+}
+
+/**
+ * Allocate the per-connection receive and send buffers and start its idle
+ * and heartbeat timers
+ *
+ * @param[in] info	client connection info
+ *
+ * @return On success, return 0.
+ *		   On error, negative number of the error line number
+ */
+static int server_client_alloc(struct client_connect_info *info)
+{
+	if (frame_decoder_init(&info->dec, RECV_BUFF_LEN, RECV_HIGH_WATER, NULL) < 0) {
+		return -SERVER_ERRNO;
+	}
+	frame_decoder_ctrl(&info->dec, server_recv_ctrl);
+
+	info->sbuf = (struct common_buff *)malloc(sizeof(struct common_buff) + DATA_MAX_LEN);
+	if (!info->sbuf) {
+		frame_decoder_exit(&info->dec);
+		return -SERVER_ERRNO;
+	}
+	outq_init(&info->outq, &buff_pool);
+
+	wheel_timer_init(&info->idle, server_client_idle, info);
+	info->active = wheel_now(&timers);
+	if (cfg.idle_timeout) {
+		wheel_add(&timers, &info->idle, info->active + cfg.idle_timeout * 1000ULL);
+	}
+	wheel_timer_init(&info->hb, server_client_heartbeat, info);
+	info->hb_rx = 0;
+	if (cfg.hb.interval) {
+		wheel_add(&timers, &info->hb, info->active + cfg.hb.interval * 1000ULL);
+	}
+
+	return 0;
+}
+
+/**
+ * Release the per-connection buffers
+ *
+ * @param[in] info	client connection info
+ */
+static void server_client_free(struct client_connect_info *info)
+{
+	frame_decoder_exit(&info->dec);
+	outq_exit(&info->outq);
+	wheel_del(&timers, &info->idle);
+	wheel_del(&timers, &info->hb);
+	if (info->sbuf) {
+		free(info->sbuf);
+		info->sbuf = NULL;
+	}
+}
+
+/**
+ * Close the connection and free its slot
+ *
+ * @param[in] info	client connection info
+ * @param[in] pfd	its poll descriptor
+ */
+static void server_client_close(struct client_connect_info *info, struct pollfd *pfd)
+{
+	fanout_unsubscribe_all(&fanout, info);
+	close(info->fd);
+	metrics_add(&metrics.closes, 1);
+	server_client_free(info);
+	info->fd = -1;
+	pfd->fd = -1;
+}
+
+/**
+ * Unlink a timer before its connection slot moves, 'expires' is kept only
+ * if it was pending
+ *
+ * @param[in] t	timer
+ */
+static void server_timer_park(struct wheel_timer *t)
+{
+	if (!wheel_pending(t)) {
+		t->expires = 0;
+	}
+	wheel_del(&timers, t);
+}
+
+/**
+ * Link a parked timer again at its new address
+ *
+ * @param[in] t		timer
+ * @param[in] arg	its connection at the new address
+ */
+static void server_timer_unpark(struct wheel_timer *t, void *arg)
+{
+	t->arg = arg;
+	if (t->expires) {
+		wheel_add(&timers, t, t->expires);
+	}
+}
+
+/**
+ * Double the client slots, up to 'max_clients'
+ *
+ * pfds[0] is the console eventfd, pfds[1] the listener and pfds[i+2]
+ * belongs to client_info[i], so both arrays grow together.
+ *
+ * @param[in,out] client_info	client slots
+ * @param[in,out] pfds			poll descriptors
+ * @param[in,out] nslots		number of client slots
+ * @param[in]	  max_clients	upper bound
+ *
+ * @return On success, return 0.
+ *		   On error, negative number of the error line number
+ */
+static int server_client_grow(struct client_connect_info **client_info, struct pollfd **pfds,
+							  uint32_t *nslots, uint32_t max_clients)
+{
+	struct client_connect_info *info;
+	struct pollfd *pfd;
+	uint32_t size, i;
+
+	if (*nslots >= max_clients) {
+		return -SERVER_ERRNO;
+	}
+	size = (*nslots == 0) ? CLIENT_SLOTS_INIT : (*nslots * 2);
+	if (size > max_clients) {
+		size = max_clients;
+	}
+
+	/* the timers are linked by address, unlink them while the slots may move */
+	for (i=0; i<*nslots; i++) {
+		server_timer_park(&(*client_info)[i].idle);
+		server_timer_park(&(*client_info)[i].hb);
+	}
+	info = (struct client_connect_info *)realloc(*client_info, size * sizeof(struct client_connect_info));
+	if (info) {
+		*client_info = info;
+	}
+	for (i=0; i<*nslots; i++) {
+		server_timer_unpark(&(*client_info)[i].idle, &(*client_info)[i]);
+		server_timer_unpark(&(*client_info)[i].hb, &(*client_info)[i]);
+	}
+	if (!info) {
+		return -SERVER_ERRNO;
+	}
+
+	pfd = (struct pollfd *)realloc(*pfds, (size + 2) * sizeof(struct pollfd));
+	if (!pfd) {
+		return -SERVER_ERRNO;
+	}
+	*pfds = pfd;
+
+	memset(&info[*nslots], 0x00, (size - *nslots) * sizeof(struct client_connect_info));
+	for (i=*nslots; i<size; i++) {
+		pfd[i+2].fd = -1;
+		pfd[i+2].events = 0;
+		pfd[i+2].revents = 0;
+	}
+	*nslots = size;
+
+	return 0;
+}
+
+/**
+ * Handle a complete frame received from the client: print it, "sub <topic>"
+ * and "unsub <topic>" frames also update its subscriptions; in echo mode
+ * queue it back, in sink and source mode drop it
+ *
+ * @param[in] arg	client connection info
+ * @param[in] data	frame payload
+ * @param[in] len	frame payload length
+ *
+ * @return On success, return 0.
+ *		   On error (no memory to echo), return -1
+ */
+static int server_recv_frame(void *arg, uint8_t *data, uint32_t len)
+{
+	struct client_connect_info *info = (struct client_connect_info *)arg;
+	int ret;
+
+	metrics_add(&metrics.msgs_in, 1);
+	info->active = wheel_now(&timers);
+	if (cfg.mode == SERVER_MODE_ECHO) {
+		if (mode_echo(&info->outq, data, len) < 0) {
+			SERVER_PRINT("get %u bytes echo buff memory failed", len);
+			return -1;
+		}
+		metrics_add(&metrics.msgs_out, 1);
+		return 0;
+	} else if (cfg.mode != SERVER_MODE_CONSOLE) {
+		return 0;
+	}
+
+	SERVER_PRINT("RX[%04d]> %.*s", len, (int)len, data);
+
+	ret = fanout_command(&fanout, data, len, info);
+	if (ret != 0) {
+		SERVER_PRINT("subscription %s", (ret > 0) ? "updated" : "failed");
+	}
+
+	return 0;
+}
+
+/**
+ * Receive messages from the client
+ *
+ * Reads land directly in the connection's frame decoder, which may hold
+ * several pipelined frames or only part of one; what does not fit is
+ * picked up by the same readv() in a spill buffer.
  *
- * @param[in] clientfd	client connection file descriptor
- * @param[in] rbuf		recv buff pointer
- * @param[in] buff_len	recv buff size
+ * @param[in] info	client connection info
  *
- * @return On success, return the length of the sent.
+ * @return On success, return the number of bytes read.
  */
-static int server_recv_message(int clientfd, struct common_buff *rbuf, uint16_t buff_len)
+static int server_recv_message(struct client_connect_info *info)
 {
-	char *rptr;
 	uint32_t rlen;
 	int ret;
 
-	rptr = (char *)rbuf;
 	rlen = 0;
 	do {
-		ret = read(clientfd, &rptr[rlen], buff_len - rlen);
+		ret = frame_decoder_readv(&info->dec, info->fd, server_recv_frame, info);
 		if (ret < 0) {
-			if (errno != EAGAIN) {
+			if (errno == EBADMSG) {
+				SERVER_PRINT("data error!!!");
+				return -SERVER_ERRNO;
+			} else if (errno != EAGAIN) {
 				SERVER_PRINT("read failed, %d, %s", errno, strerror(errno));
 				return -SERVER_ERRNO;
 			}
+			metrics_add(&metrics.eagain, 1);
 			break;
 		} else if (ret == 0) {
 			SERVER_PRINT("client closed connection");
 			return 0;
 		}
+		metrics_add(&metrics.bytes_in, ret);
 		rlen += ret;
 	} while (ret > 0);
 
-	SERVER_PRINT("RX[%04d]> %s", rlen, rbuf->data);
-
 	return rlen;
 }
 
+/**
+ * Write the connection's queued output, a source connection gets its queue
+ * topped up first
+ *
+ * @param[in] info	client connection info
+ *
+ * @return On success, return 0.
+ *		   On error, negative number of the error line number
+ */
+static int server_client_output(struct client_connect_info *info)
+{
+	ssize_t ret;
+
+	if (cfg.mode == SERVER_MODE_SOURCE) {
+		ret = mode_source_fill(&info->outq, source_frame, cfg.send_low);
+		if (ret < 0) {
+			SERVER_PRINT("get source buff memory failed");
+			return -SERVER_ERRNO;
+		}
+		metrics_add(&metrics.msgs_out, ret);
+	}
+
+	ret = mode_flush(&info->outq, info->fd);
+	if (ret < 0) {
+		SERVER_PRINT("write failed, %s", strerror(errno));
+		return -SERVER_ERRNO;
+	}
+	metrics_add(&metrics.bytes_out, ret);
+	if (ret > 0) {
+		info->active = wheel_now(&timers);
+	}
+	if (!outq_empty(&info->outq)) {
+		metrics_add(&metrics.eagain, 1);
+	}
+
+	return 0;
+}
+
 /**
  * Send a message to the client
  *
- * @param[in] clientfd	client connection file descriptor
- * @param[in] sbuf		send buff pointer
- * @param[in] buff_len	send buff size
+ * What the socket does not take is queued behind the frame's sent part,
+ * so the stream never carries half a frame followed by another one.
+ *
+ * @param[in] info		client connection info
+ * @param[in] msg		message typed on the console
+ * @param[in] buff_len	send buff payload size
  *
- * @return On success, return the length of the sent.
+ * @return On success, return the length of the frame.
  */
-static int server_send_message(int clientfd, struct common_buff *sbuf, uint16_t buff_len)
+static int server_send_message(struct client_connect_info *info, const char *msg, uint16_t buff_len)
 {
+	struct common_buff *sbuf = info->sbuf;
 	uint32_t slen;
-	int ret;
-
-	/* clear send buff */
-	memset(sbuf->data, 0x00, buff_len);
+	ssize_t ret;
 
-	/* get input from stdin  */
-	fgets((char *)sbuf->data, buff_len, stdin);
-	slen = strlen((char *)sbuf->data);
+	/* the console line (< CTRL_MSG_LEN) is cut to what the buffer holds */
+	slen = strnlen(msg, buff_len - 1);
+	memcpy(sbuf->data, msg, slen);
+	sbuf->data[slen] = '\0';
 	if (slen == 0) {
 		SERVER_PRINT("Input is empty");
 		return 0;
 	}
-	slen -= 1;
-	sbuf->data[slen] = '\0'; /* delete \n */
 
-	/* send to server */
-	ret = write(clientfd, sbuf, slen);
-	if (ret < 0) {
-		/* we failed */
-		SERVER_PRINT("write failed, %s", strerror(errno));
+	/* send to client, behind what is already queued */
+	ret = 0;
+	if (outq_empty(&info->outq)) {
+		ret = frame_writev(info->fd, sbuf->data, slen, 0);
+		if (ret < 0) {
+			/* we failed */
+			SERVER_PRINT("write failed, %s", strerror(errno));
+			return -SERVER_ERRNO;
+		}
+	}
+	if (outq_push_frame(&info->outq, sbuf->data, slen, ret) < 0) {
+		SERVER_PRINT("get output queue memory failed");
 		return -SERVER_ERRNO;
 	}
-	SERVER_PRINT("TX[%04d]> %s", ret, sbuf->data);
+	metrics_add(&metrics.msgs_out, 1);
+	metrics_add(&metrics.bytes_out, ret);
+	SERVER_PRINT("TX[%04d]> %s", (int)(FRAME_HDR_LEN + slen), sbuf->data); /* the length includes the frame header */
 
-	return ret;
+	return FRAME_HDR_LEN + slen;
+}
+
+/**
+ * Fan-out delivery: send a shared frame to one client behind its queued
+ * output, the rest of it is queued as a reference
+ *
+ * @param[in] arg	unused
+ * @param[in] sub	client connection info
+ * @param[in] frame	shared frame
+ *
+ * @return 0 if the frame was sent or queued, -1 if the client missed it
+ */
+static int server_client_deliver(void *arg, void *sub, struct outq_buf *frame)
+{
+	struct client_connect_info *info = (struct client_connect_info *)sub;
+	ssize_t ret;
+
+	ret = fanout_send(info->fd, &info->outq, frame, cfg.send_high);
+	if (ret < 0) {
+		return -1;
+	}
+	metrics_add(&metrics.bytes_out, ret);
+	if (ret > 0) {
+		info->active = wheel_now(&timers);
+	}
+
+	return 0;
+}
+
+/**
+ * Send a console message to every client, or with 'topic' set take it as
+ * "<topic> <message>" and send it to the topic's subscribers
+ *
+ * @param[in] client_info	Client Connection Info
+ * @param[in] nslots		number of client slots
+ * @param[in] topic			publish to a topic instead of broadcasting
+ * @param[in] input			message line
+ */
+static void server_console_publish(struct client_connect_info *client_info, uint32_t nslots, int topic,
+								 const char *input)
+{
+	struct outq_buf *frame;
+	char line[DATA_MAX_LEN];
+	char *msg;
+	int i, len, cnt;
+
+	snprintf(line, sizeof(line), "%s", input);
+	len = strlen(line);
+
+	if (topic) {
+		msg = strchr(line, ' ');
+		if (!msg) {
+			SERVER_PRINT("usage: <topic> <message>");
+			return;
+		}
+		*msg++ = '\0';
+		cnt = fanout_publish(&fanout, line, msg, strlen(msg), server_client_deliver, NULL);
+		if (cnt > 0) {
+			metrics_add(&metrics.msgs_out, cnt);
+		}
+		SERVER_PRINT("TX[%s]> %s, %d subscribers", line, msg, cnt);
+		return;
+	}
+
+	/* encoded once, every client gets the same bytes */
+	frame = fanout_encode(&fanout, line, len);
+	if (!frame) {
+		SERVER_PRINT("get %d bytes broadcast buff memory failed", len);
+		return;
+	}
+	for (i=0,cnt=0; i<nslots; i++) {
+		if ((client_info[i].fd > 0) &&
+			(fanout_deliver(&fanout, &client_info[i], frame, server_client_deliver, NULL) == 0)) {
+			cnt++;
+		}
+	}
+	metrics_add(&metrics.msgs_out, cnt);
+	outq_buf_put(&buff_pool, frame);
+	SERVER_PRINT("TX[all]> %s, %d clients", line, cnt);
+}
+
+/**
+ * Print the connections the console can send to
+ *
+ * @param[in] client_info	Client Connection Info
+ * @param[in] nslots		number of client slots
+ */
+static void server_list_clients(struct client_connect_info *client_info, uint32_t nslots)
+{
+	uint32_t i, cnt;
+
+	for (i=0,cnt=0; i<nslots; i++) {
+		if (client_info[i].fd > 0) {
+			SERVER_PRINT("Client %u: %s:%d", i, inet_ntoa(client_info[i].clientaddr.sin_addr),
+						 client_info[i].clientaddr.sin_port);
+			cnt++;
+		}
+	}
+	SERVER_PRINT("%u client(s)", cnt);
 }
 
 /**
- * Select the client number to send the message to
+ * Select the client number to send the message to, "l" lists the clients,
+ * "a" broadcasts the next line and "t" publishes it to a topic instead
  *
  * @param[in] client_info	Client Connection Info
+ * @param[in] nslots		number of client slots
+ * @param[in] cmd			console command
  *
  * @return On success, return the index of the client
  */
-static int server_select_client(struct client_connect_info *client_info)
+static int server_select_client(struct client_connect_info *client_info, uint32_t nslots,
+								const struct ctrl_cmd *cmd)
 {
-	char index[5+1] = {0};
-	int i, len;
+	const char *index = cmd->sel;
+	int i;
 
-	fgets(index, sizeof(char)*5, stdin);
-	len = strlen(index);
-	if (len > 0) {
-		index[len - 1] = '\0';	/* delete \n */
+	if (strcmp(index, "l") == 0) {
+		server_list_clients(client_info, nslots);
+		return -SERVER_ERRNO;
+	} else if (cfg.mode != SERVER_MODE_CONSOLE) {
+		SERVER_PRINT("console sends are off in %s mode", mode_name(cfg.mode));
+		return -SERVER_ERRNO;
+	} else if ((strcmp(index, "a") == 0) || (strcmp(index, "t") == 0)) {
+		server_console_publish(client_info, nslots, index[0] == 't', cmd->msg);
+		return -SERVER_ERRNO;
 	}
 
 	i = atoi(index);
-	if ((i >= MAX_CLIENTS) || (client_info[i].fd <= 0)) {
+	if ((i < 0) || (i >= nslots) || (client_info[i].fd <= 0)) {
 		SERVER_PRINT("input error.");
 		return -SERVER_ERRNO;
 	}
@@ -188,68 +663,100 @@ static int server_select_client(struct client_connect_info *client_info)
 
 int main(int argc, char *argv[])
 {
-	struct common_buff *buff;
-	struct pollfd pfds[MAX_CLIENTS + 2];
-	struct client_connect_info client_info[MAX_CLIENTS];
+	struct pollfd *pfds;
+	struct client_connect_info *client_info;
+	struct ctrl_cmd cmd;
 	struct sockaddr_in clientaddr;
 	socklen_t client_len;
 	const char *port_str;
-	uint32_t timeout;
-	uint16_t blen;
+	uint32_t nslots;
 	int sockfd;
-	int i, connect_cnt, check_cnt, close_cnt, ret;
+	int i, connect_cnt, check_cnt, close_cnt, ret, ret2;
+
+	log_init();
+	metrics_init(&metrics, "poll");
+	metrics_signal_init(SIGUSR1);
 
-	if (argc < 2) {
-		SERVER_PRINT("usage: ./server port");
+	ret = server_config_parse(&cfg, SERVER_OPTIONS, argc, argv);
+	if ((ret < 0) || (ret >= argc)) {
+		SERVER_PRINT("usage: ./server [-c max_clients] [-b backlog] [-H high] [-L low] [-m console|echo|sink|source] [-S size] [-I idle_seconds] [-P ping_seconds] [-M misses] [-K keepalive_seconds] [-U user_timeout_ms] port");
 		return -SERVER_ERRNO;
 	}
 
-	blen = sizeof(struct common_buff);
-	buff = (struct common_buff *)malloc(blen);
-	if (!buff) {
-		SERVER_PRINT("get %d bytes buff memory failed", blen);
+	port_str = argv[ret];
+	SERVER_PRINT("port: %s, max clients: %u, backlog: %d, %s mode", port_str, cfg.max_clients, cfg.backlog,
+				 mode_name(cfg.mode));
+
+	client_info = NULL;
+	pfds = NULL;
+	nslots = 0;
+	if (server_client_grow(&client_info, &pfds, &nslots, cfg.max_clients) < 0) {
+		SERVER_PRINT("get client slots memory failed");
+		free(client_info);
 		return -SERVER_ERRNO;
 	}
 
-	port_str = argv[1];
-	SERVER_PRINT("port: %s", port_str);
-
-	sockfd = server_listen_connection(port_str);
+	sockfd = server_listen_connection(port_str, cfg.backlog);
 	if (sockfd < 0) {
 		SERVER_PRINT("accept client connection failed");
-		free(buff);
+		free(client_info);
+		free(pfds);
+		return -SERVER_ERRNO;
+	}
+
+	/* the console is read on a thread of its own, poll() only sees its eventfd */
+	if (ctrl_start(&ctrl, stdin, "l") < 0) {
+		SERVER_PRINT("start control thread failed, %s", strerror(errno));
+		close(sockfd);
+		free(client_info);
+		free(pfds);
 		return -SERVER_ERRNO;
 	}
 
 	client_len = sizeof(struct sockaddr_in);
+	buff_pool_init(&buff_pool, POOL_IDLE_BYTES);
+	fanout_init(&fanout, &buff_pool);
+	if (cfg.mode == SERVER_MODE_SOURCE) {
+		source_frame = mode_source_frame(&buff_pool, cfg.source_size);
+		if (!source_frame) {
+			SERVER_PRINT("get %u bytes source buff memory failed", cfg.source_size);
+			ctrl_stop(&ctrl);
+			close(sockfd);
+			free(client_info);
+			free(pfds);
+			return -SERVER_ERRNO;
+		}
+	}
 
 	connect_cnt = 0;
-	memset(client_info, 0x00, sizeof(struct client_connect_info) * MAX_CLIENTS);
-
-	timeout = 10 * 1000;
-	for (i=0; i<MAX_CLIENTS+2; i++) {
-		pfds[i].fd = -1;
-	}
+	wheel_init(&timers);
 
-	pfds[0].fd = fileno(stdin);	/* stdin can also be monitored using poll */
+	pfds[0].fd = ctrl.efd;
 	pfds[0].events = POLLIN;
 
 	pfds[1].fd = sockfd;
 	pfds[1].events = POLLRDNORM;
 
+	SERVER_PRINT("Select a client to send a message, \"l\" lists the clients:");
 	while (1) {
-		SERVER_PRINT("Select a client to send a message:");
-		for (i=0,check_cnt=0; (i<MAX_CLIENTS) && (check_cnt < connect_cnt); i++) {
+		for (i=0, check_cnt=0; (i<nslots) && (check_cnt < connect_cnt); i++) {
 			if (client_info[i].fd > 0) {
-				SERVER_PRINT("Client %d: %s:%d", i, inet_ntoa(client_info[i].clientaddr.sin_addr),
-							 client_info[i].clientaddr.sin_port);
 				check_cnt++;
+				/* a client whose output piles up is not read until it drains */
+				pfds[i+2].events = (client_info[i].outq.bytes < cfg.send_high) ? POLLIN : 0;
+				if (!outq_empty(&client_info[i].outq) || (cfg.mode == SERVER_MODE_SOURCE)) {
+					pfds[i+2].events |= POLLOUT;
+				}
 			}
 		}
-		SERVER_PRINT("---------------------------------\n");
 
-		ret = poll(pfds, MAX_CLIENTS+2, timeout);
-		if (ret < 0) {
+		wheel_run(&timers);
+		metrics_handled(&metrics);	/* the previous wakeup */
+		ret = poll(pfds, nslots+2, wheel_timeout(&timers, SERVER_WAIT_MS));
+		metrics_wakeup(&metrics, ret);
+		if ((ret < 0) && (errno == EINTR)) {
+			continue;	/* a signal, e.g. SIGCONT after a stop */
+		} else if (ret < 0) {
 			SERVER_PRINT("poll failed, %s", strerror(errno));
 			ret = -SERVER_ERRNO;
 			break;
@@ -257,13 +764,12 @@ int main(int argc, char *argv[])
 			/* SERVER_PRINT("poll timeout..."); */
 			continue;
 		} else {
-			if (pfds[0].revents & POLLIN) { /* stdin */
-				i = server_select_client(client_info);
-				if (i >= 0) {
-					if (server_send_message(client_info[i].fd, buff, blen) < 0) {
-						close(client_info[i].fd);
-						client_info[i].fd = -1;
-						pfds[i+2].fd = -1;
+			if (pfds[0].revents & POLLIN) { /* console */
+				while (ctrl_next(&ctrl, &cmd)) {
+					i = server_select_client(client_info, nslots, &cmd);
+					if ((i >= 0) &&
+						(server_send_message(&client_info[i], cmd.msg, DATA_MAX_LEN) < 0)) {
+						server_client_close(&client_info[i], &pfds[i+2]);
 						connect_cnt --;
 					}
 				}
@@ -279,18 +785,31 @@ int main(int argc, char *argv[])
 					ret = -SERVER_ERRNO;
 					break;
 				}
+				metrics_add(&metrics.accepts, 1);
 
-				if (connect_cnt >= MAX_CLIENTS) {
+				if ((connect_cnt >= nslots) &&
+					(server_client_grow(&client_info, &pfds, &nslots, cfg.max_clients) < 0)) {
 					SERVER_PRINT("too many connections");
 					close(connfd);
 					connfd = -1;
 				} else {
 					SERVER_PRINT("accpet a new client: %s:%d", inet_ntoa(clientaddr.sin_addr), clientaddr.sin_port);
-					for (i=0; i<MAX_CLIENTS; i++) {
+					for (i=0; i<nslots; i++) {
 						if (client_info[i].fd <= 0) {
-							int flags = fcntl(connfd, F_GETFL, 0);
+							int flags;
+
+							if (server_client_alloc(&client_info[i]) < 0) {
+								SERVER_PRINT("get client buff memory failed");
+								close(connfd);
+								break;
+							}
+
+							flags = fcntl(connfd, F_GETFL, 0);
 							/* set non-blocking mode */
 							fcntl(connfd, F_SETFL, flags|O_NONBLOCK);
+							if (hb_tcp_tune(connfd, &cfg.hb) < 0) {
+								SERVER_PRINT("set keepalive options failed, %s", strerror(errno));
+							}
 
 							pfds[i+2].fd = connfd;
 							pfds[i+2].events = POLLIN;
@@ -307,18 +826,24 @@ int main(int argc, char *argv[])
 				}
 			}
 
-			for (i=0, check_cnt=0, close_cnt=0; (i<MAX_CLIENTS) && (check_cnt < connect_cnt); i++) {
-				if ((client_info[i].fd > 0) && (pfds[i+2].revents & POLLIN)) {
+			for (i=0, check_cnt=0, close_cnt=0; (i<nslots) && (check_cnt < connect_cnt); i++) {
+				if ((client_info[i].fd > 0) && pfds[i+2].revents) {
 					check_cnt++;
-					SERVER_PRINT("From client %d: %s:%d.", i, inet_ntoa(client_info[i].clientaddr.sin_addr),
-								 client_info[i].clientaddr.sin_port);
-					if (server_recv_message(client_info[i].fd, buff, blen) <= 0) {
-						close(client_info[i].fd);
-						client_info[i].fd = -1;
-						pfds[i+2].fd = -1;
-						close_cnt++;
+					ret2 = 0;
+					if (pfds[i+2].revents & (POLLIN | POLLHUP | POLLERR)) {
+						SERVER_DEBUG("From client %d: %s:%d.", i, inet_ntoa(client_info[i].clientaddr.sin_addr),
+									 client_info[i].clientaddr.sin_port);
+						ret2 = (server_recv_message(&client_info[i]) <= 0) ? -1 : 0;
+					}
+					/* echoes go out right away, the socket usually has room */
+					if ((ret2 == 0) && ((pfds[i+2].revents & POLLOUT) || !outq_empty(&client_info[i].outq))) {
+						ret2 = server_client_output(&client_info[i]);
+					}
+					if (ret2 < 0) {
 						SERVER_PRINT("connect %d: %s:%d closed.", i, inet_ntoa(client_info[i].clientaddr.sin_addr),
 									 client_info[i].clientaddr.sin_port);
+						server_client_close(&client_info[i], &pfds[i+2]);
+						close_cnt++;
 					}
 
 					if ((--ret) <= 0) {
@@ -330,21 +855,25 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	for (i=0; i<MAX_CLIENTS; i++) {
+	for (i=0; i<nslots; i++) {
 		if (client_info[i].fd > 0) {
-			close(client_info[i].fd);
-			client_info[i].fd = -1;
+			server_client_close(&client_info[i], &pfds[i+2]);
 		}
 	}
+	free(client_info);
+	free(pfds);
 
 	if (sockfd > 0) {
 		close(sockfd);
 		sockfd = -1;
 	}
-	if (buff) {
-		free(buff);
-		buff = NULL;
+
+	ctrl_stop(&ctrl);
+	fanout_exit(&fanout);
+	if (source_frame) {
+		outq_buf_put(&buff_pool, source_frame);
 	}
+	buff_pool_exit(&buff_pool);
 
 	SERVER_PRINT("server exit ...");
 
@@ -0,0 +1,59 @@
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdio.h>
+
+/*
+ * Minimal unit test harness: a test is a function returning 0 on success
+ * or the negative line number of the first failed check, the same error
+ * convention as the servers. Every test program runs its table and exits
+ * non-zero if any test failed, which is all ctest looks at.
+ */
+#define TEST_CHECK(_cond)											\
+	do {															\
+		if (!(_cond)) {												\
+			fprintf(stderr, "[%04d] check failed: %s\n", __LINE__, #_cond);	\
+			return -__LINE__;										\
+		}															\
+	} while (0)
+
+struct test_case {
+	const char *name;
+	int (*run)(void);
+};
+
+#define TEST_CASE(_fn)				{ #_fn, _fn }
+
+/**
+ * Run a table of tests
+ *
+ * @param[in] tests	test table
+ * @param[in] count	number of tests
+ *
+ * @return the number of failed tests
+ */
+static inline int test_run(const struct test_case *tests, int count)
+{
+	int failed;
+	int ret;
+	int i;
+
+	failed = 0;
+	for (i=0; i<count; i++) {
+		ret = tests[i].run();
+		printf("%-40s %s\n", tests[i].name, (ret == 0) ? "ok" : "FAILED");
+		if (ret != 0) {
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
+#define TEST_MAIN(_tests)											\
+	int main(void)													\
+	{																\
+		return test_run(_tests, sizeof(_tests) / sizeof(_tests[0])) ? 1 : 0;	\
+	}
+
+#endif	/* #ifndef __TEST_H__ */
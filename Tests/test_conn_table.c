@@ -0,0 +1,85 @@
+#include <stdint.h>
+
+#include "conn_table.h"
+#include "test.h"
+
+#define TEST_CONNS					100
+
+/* fake connections, only their addresses are stored */
+static int conns[TEST_CONNS];
+
+/* the table doubles up to max_size, keeping every slot it handed out */
+static int test_growth(void)
+{
+	struct conn_table tbl;
+	uint32_t i;
+	int slot;
+
+	TEST_CHECK(conn_table_init(&tbl, 4, TEST_CONNS) == 0);
+	TEST_CHECK((tbl.size == 4) && (tbl.count == 0));
+
+	for (i=0; i<TEST_CONNS; i++) {
+		slot = conn_table_insert(&tbl, &conns[i]);
+		/* the lowest free index first, so slots follow insertion order */
+		TEST_CHECK(slot == (int)i);
+		TEST_CHECK(tbl.count == (i + 1));
+		TEST_CHECK(tbl.size <= TEST_CONNS);
+	}
+	TEST_CHECK(tbl.size == TEST_CONNS);
+	TEST_CHECK(conn_table_insert(&tbl, &conns[0]) == -1);
+	TEST_CHECK(tbl.count == TEST_CONNS);
+
+	/* everything survived the reallocations */
+	for (i=0; i<TEST_CONNS; i++) {
+		TEST_CHECK(conn_table_get(&tbl, i) == &conns[i]);
+	}
+	TEST_CHECK(conn_table_get(&tbl, TEST_CONNS) == NULL);
+	TEST_CHECK(conn_table_get(&tbl, UINT32_MAX) == NULL);
+	conn_table_exit(&tbl);
+
+	return 0;
+}
+
+/* freed slots are reused before the table grows */
+static int test_reuse(void)
+{
+	struct conn_table tbl;
+	uint32_t i;
+
+	TEST_CHECK(conn_table_init(&tbl, 2, 64) == 0);
+	for (i=0; i<8; i++) {
+		TEST_CHECK(conn_table_insert(&tbl, &conns[i]) == (int)i);
+	}
+	TEST_CHECK(tbl.size == 8);
+
+	conn_table_remove(&tbl, 3);
+	conn_table_remove(&tbl, 5);
+	/* removing twice or out of range changes nothing */
+	conn_table_remove(&tbl, 5);
+	conn_table_remove(&tbl, 1000);
+	TEST_CHECK(tbl.count == 6);
+	TEST_CHECK(conn_table_get(&tbl, 3) == NULL);
+
+	TEST_CHECK(conn_table_insert(&tbl, &conns[50]) == 5);
+	TEST_CHECK(conn_table_insert(&tbl, &conns[51]) == 3);
+	TEST_CHECK(tbl.size == 8);
+	TEST_CHECK(conn_table_insert(&tbl, &conns[52]) == 8);
+	TEST_CHECK(tbl.size == 16);
+	TEST_CHECK(tbl.count == 9);
+	conn_table_exit(&tbl);
+
+	/* a start size above the limit is clamped, 0 is refused */
+	TEST_CHECK(conn_table_init(&tbl, 32, 3) == 0);
+	TEST_CHECK(tbl.size == 3);
+	conn_table_exit(&tbl);
+	TEST_CHECK(conn_table_init(&tbl, 0, 3) == -1);
+
+	return 0;
+}
+
+static const struct test_case tests[] = {
+	TEST_CASE(test_growth),
+	TEST_CASE(test_reuse),
+};
+
+TEST_MAIN(tests)
@@ -0,0 +1,233 @@
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "frame.h"
+#include "fanout.h"
+#include "mode.h"
+#include "test.h"
+
+#define TEST_CONSOLE_LEN			(32*1024)	/* more than the socket takes */
+#define TEST_FRAMES_MAX				8
+#define TEST_DRAIN_ROUNDS			1000	/* flush and read turns before giving up */
+
+static uint8_t console[TEST_CONSOLE_LEN];
+
+/* a subscriber as the servers keep it */
+struct test_conn {
+	int fd;
+	struct outq outq;
+};
+
+/* what the peer decoded */
+struct frame_log {
+	uint32_t count;
+	uint32_t lens[TEST_FRAMES_MAX];
+	uint8_t firsts[TEST_FRAMES_MAX];	/* first payload byte */
+	uint32_t intact;					/* frames whose bytes are all the first one */
+};
+
+static int frame_log_add(void *arg, uint8_t *data, uint32_t len)
+{
+	struct frame_log *log = (struct frame_log *)arg;
+	uint32_t i;
+
+	if (log->count == TEST_FRAMES_MAX) {
+		return -1;
+	}
+	for (i=1; (i<len) && (data[i] == data[0]); i++) {
+	}
+	log->intact += (i >= len);
+	log->lens[log->count] = len;
+	log->firsts[log->count] = len ? data[0] : 0;
+	log->count++;
+
+	return 0;
+}
+
+static int test_deliver(void *arg, void *sub, struct outq_buf *frame)
+{
+	struct test_conn *c = (struct test_conn *)sub;
+
+	return (fanout_send(c->fd, &c->outq, frame, *(uint64_t *)arg) < 0) ? -1 : 0;
+}
+
+/**
+ * Send a console frame the way the servers do: directly while nothing is
+ * queued, the rest behind the queue
+ *
+ * @param[in] c		connection
+ * @param[in] len	payload length
+ * @param[in] fill	payload byte
+ *
+ * @return the number of bytes written directly, -1 on error
+ */
+static ssize_t console_send(struct test_conn *c, uint32_t len, uint8_t fill)
+{
+	ssize_t ret;
+
+	memset(console, fill, len);
+	ret = 0;
+	if (outq_empty(&c->outq)) {
+		ret = frame_writev(c->fd, console, len, 0);
+		if (ret < 0) {
+			return -1;
+		}
+	}
+
+	return (outq_push_frame(&c->outq, console, len, ret) < 0) ? -1 : ret;
+}
+
+/*
+ * The socket fills in the middle of a console frame, a broadcast and a
+ * topic frame follow it: the peer gets every frame whole and in order
+ */
+static int test_stream_order(void)
+{
+	static struct frame_log log;
+	struct frame_decoder dec;
+	struct buff_pool pool;
+	struct test_conn c;
+	struct fanout fo;
+	struct outq_buf *frame;
+	uint64_t high = 1024 * 1024;
+	int sndbuf = 4096;
+	ssize_t ret;
+	int sv[2];
+	int i;
+
+	memset(&log, 0x00, sizeof(log));
+	buff_pool_init(&pool, 64 * 1024);
+	fanout_init(&fo, &pool);
+	TEST_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	TEST_CHECK(setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == 0);
+	TEST_CHECK(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0);
+	TEST_CHECK(fcntl(sv[1], F_SETFL, O_NONBLOCK) == 0);
+	c.fd = sv[0];
+	outq_init(&c.outq, &pool);
+	TEST_CHECK(fanout_subscribe(&fo, "news", &c) == 0);
+
+	/* half a console frame is out, the rest is queued */
+	ret = console_send(&c, TEST_CONSOLE_LEN, 'c');
+	TEST_CHECK((ret > 0) && (ret < (ssize_t)(FRAME_HDR_LEN + TEST_CONSOLE_LEN)));
+	TEST_CHECK(!outq_empty(&c.outq));
+
+	/* the peer reads meanwhile, the socket has room again */
+	TEST_CHECK(frame_decoder_init(&dec, 4096, TEST_CONSOLE_LEN, NULL) == 0);
+	TEST_CHECK(frame_decoder_readv(&dec, sv[1], frame_log_add, &log) > 0);
+	TEST_CHECK(log.count == 0);
+
+	/* fan-out still goes behind the queue, nothing is written directly */
+	frame = fanout_encode(&fo, "bbbb", 4);
+	TEST_CHECK(frame);
+	TEST_CHECK(fanout_deliver(&fo, &c, frame, test_deliver, &high) == 0);
+	outq_buf_put(&pool, frame);
+	TEST_CHECK(fanout_publish(&fo, "news", "tttttt", 6, test_deliver, &high) == 1);
+	TEST_CHECK(console_send(&c, 100, 'd') == 0);
+	TEST_CHECK(fo.stats.delivered == 2);
+
+	/* the peer reads while the queue drains */
+	for (i=0; !outq_empty(&c.outq) || (log.count < 4); i++) {
+		TEST_CHECK(i < TEST_DRAIN_ROUNDS);
+		TEST_CHECK(mode_flush(&c.outq, c.fd) >= 0);
+		ret = frame_decoder_readv(&dec, sv[1], frame_log_add, &log);
+		TEST_CHECK((ret > 0) || ((ret < 0) && (errno == EAGAIN)));
+	}
+	TEST_CHECK(log.count == 4);
+	TEST_CHECK(log.intact == 4);
+	TEST_CHECK((log.lens[0] == TEST_CONSOLE_LEN) && (log.firsts[0] == 'c'));
+	TEST_CHECK((log.lens[1] == 4) && (log.firsts[1] == 'b'));
+	TEST_CHECK((log.lens[2] == 6) && (log.firsts[2] == 't'));
+	TEST_CHECK((log.lens[3] == 100) && (log.firsts[3] == 'd'));
+
+	frame_decoder_exit(&dec);
+	fanout_exit(&fo);
+	outq_exit(&c.outq);
+	buff_pool_exit(&pool);
+	close(sv[0]);
+	close(sv[1]);
+
+	return 0;
+}
+
+/* a subscriber at the high watermark misses the message, its queue is kept */
+static int test_high_water(void)
+{
+	struct buff_pool pool;
+	struct test_conn c;
+	struct fanout fo;
+	uint64_t high;
+	int sv[2];
+
+	buff_pool_init(&pool, 64 * 1024);
+	fanout_init(&fo, &pool);
+	TEST_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	c.fd = sv[0];
+	outq_init(&c.outq, &pool);
+	TEST_CHECK(fanout_subscribe(&fo, "news", &c) == 0);
+
+	TEST_CHECK(outq_push_frame(&c.outq, "queued", 6, 0) == 0);
+	high = c.outq.bytes;
+	TEST_CHECK(fanout_publish(&fo, "news", "missed", 6, test_deliver, &high) == 0);
+	TEST_CHECK(fo.stats.dropped == 1);
+	TEST_CHECK(c.outq.bytes == high);
+
+	fanout_exit(&fo);
+	outq_exit(&c.outq);
+	buff_pool_exit(&pool);
+	close(sv[0]);
+	close(sv[1]);
+
+	return 0;
+}
+
+/* seqpacket: bare payloads, queued whole behind waiting output */
+static int test_msg_order(void)
+{
+	struct buff_pool pool;
+	struct outq_buf *frame;
+	struct outq q;
+	char buf[64];
+	int sv[2];
+
+	buff_pool_init(&pool, 64 * 1024);
+	outq_init(&q, &pool);
+	TEST_CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+
+	frame = outq_buf_new(&pool, 3);
+	TEST_CHECK(frame);
+	memcpy(&frame->data[FRAME_HDR_LEN], "pub", 3);
+
+	/* nothing waiting: straight out */
+	TEST_CHECK(fanout_send_msg(sv[0], &q, frame, 1024) == 3);
+	TEST_CHECK(recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT) == 3);
+	TEST_CHECK(memcmp(buf, "pub", 3) == 0);
+
+	/* an earlier message waits: behind it */
+	TEST_CHECK(outq_push_frame(&q, "first", 5, 0) == 0);
+	TEST_CHECK(fanout_send_msg(sv[0], &q, frame, 1024) == 0);
+	outq_buf_put(&pool, frame);
+	TEST_CHECK(mode_flush_msgs(&q, sv[0]) == 8);
+	TEST_CHECK(outq_empty(&q));
+	TEST_CHECK(recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT) == 5);
+	TEST_CHECK(memcmp(buf, "first", 5) == 0);
+	TEST_CHECK(recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT) == 3);
+	TEST_CHECK(memcmp(buf, "pub", 3) == 0);
+
+	outq_exit(&q);
+	buff_pool_exit(&pool);
+	close(sv[0]);
+	close(sv[1]);
+
+	return 0;
+}
+
+static const struct test_case tests[] = {
+	TEST_CASE(test_stream_order),
+	TEST_CASE(test_high_water),
+	TEST_CASE(test_msg_order),
+};
+
+TEST_MAIN(tests)
@@ -0,0 +1,123 @@
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "fdpass.h"
+#include "test.h"
+
+#define TEST_PASSES					3
+
+/**
+ * Check that two descriptors refer to the same open file
+ *
+ * @param[in] a	descriptor
+ * @param[in] b	descriptor
+ *
+ * @return 1 if they do, 0 otherwise
+ */
+static int same_file(int a, int b)
+{
+	struct stat sa, sb;
+
+	if ((fstat(a, &sa) < 0) || (fstat(b, &sb) < 0)) {
+		return 0;
+	}
+
+	return (sa.st_dev == sb.st_dev) && (sa.st_ino == sb.st_ino);
+}
+
+/* descriptors arrive in send order, usable, close-on-exec, one per send */
+static int test_round_trip(void)
+{
+	int pipes[TEST_PASSES][2];
+	struct fdpass_queue q;
+	char buf[64], c;
+	uint32_t got, want;
+	ssize_t ret;
+	int sv[2];
+	int i, fd;
+
+	TEST_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	fdpass_queue_init(&q);
+	TEST_CHECK(fdpass_pop(&q) == -1);
+
+	want = 0;
+	for (i=0; i<TEST_PASSES; i++) {
+		TEST_CHECK(pipe(pipes[i]) == 0);
+		TEST_CHECK(fdpass_send(sv[0], FDPASS_CONN_CMD "x", 6, pipes[i][1]) == 6);
+		want += 6;
+	}
+	/* nothing was taken from the sender */
+	TEST_CHECK(fcntl(pipes[0][1], F_GETFD) >= 0);
+
+	for (got=0; got<want; got+=ret) {
+		ret = fdpass_recv(sv[1], buf + got, sizeof(buf) - got, &q);
+		TEST_CHECK(ret > 0);
+	}
+	TEST_CHECK(q.count == TEST_PASSES);
+	errno = 0;
+	TEST_CHECK(fdpass_recv(sv[1], buf, sizeof(buf), &q) == -1);
+	TEST_CHECK(errno == EAGAIN);
+
+	for (i=0; i<TEST_PASSES; i++) {
+		fd = fdpass_pop(&q);
+		TEST_CHECK(fd >= 0);
+		TEST_CHECK(fd != pipes[i][1]);
+		TEST_CHECK(same_file(fd, pipes[i][1]));
+		TEST_CHECK(fcntl(fd, F_GETFD) & FD_CLOEXEC);
+
+		c = 'a' + i;
+		TEST_CHECK(write(fd, &c, 1) == 1);
+		TEST_CHECK(read(pipes[i][0], &c, 1) == 1);
+		TEST_CHECK(c == ('a' + i));
+		close(fd);
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+	TEST_CHECK(fdpass_pop(&q) == -1);
+
+	/* the peer going away reads as end of stream */
+	close(sv[0]);
+	TEST_CHECK(fdpass_recv(sv[1], buf, sizeof(buf), &q) == 0);
+	close(sv[1]);
+
+	return 0;
+}
+
+/* descriptors left in the queue are closed with it */
+static int test_queue_exit(void)
+{
+	struct fdpass_queue q;
+	int sv[2], p[2];
+	char buf[8];
+	int fd;
+
+	TEST_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	TEST_CHECK(pipe(p) == 0);
+	fdpass_queue_init(&q);
+	TEST_CHECK(fdpass_send(sv[0], "w", 1, p[1]) == 1);
+	TEST_CHECK(fdpass_recv(sv[1], buf, sizeof(buf), &q) == 1);
+	TEST_CHECK(q.count == 1);
+	fd = q.fds[q.head];
+
+	fdpass_queue_exit(&q);
+	TEST_CHECK(q.count == 0);
+	TEST_CHECK((fcntl(fd, F_GETFD) < 0) && (errno == EBADF));
+
+	close(p[0]);
+	close(p[1]);
+	close(sv[0]);
+	close(sv[1]);
+
+	return 0;
+}
+
+static const struct test_case tests[] = {
+	TEST_CASE(test_round_trip),
+	TEST_CASE(test_queue_exit),
+};
+
+TEST_MAIN(tests)
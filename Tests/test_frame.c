@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "frame.h"
+#include "test.h"
+
+#define TEST_FRAMES_MAX				16
+#define TEST_BUFF_LEN				(8*1024)
+#define TEST_STREAM_LEN				(16*1024)	/* holds a frame above the decoders' max_len */
+
+/* what the frame handlers were given */
+struct frame_log {
+	uint32_t count;
+	uint32_t ctrl_count;
+	uint32_t lens[TEST_FRAMES_MAX];
+	uint8_t data[TEST_BUFF_LEN];	/* payloads back to back */
+	uint32_t used;
+};
+
+static int frame_log_add(void *arg, uint8_t *data, uint32_t len)
+{
+	struct frame_log *log = (struct frame_log *)arg;
+
+	if ((log->count == TEST_FRAMES_MAX) || (len > (TEST_BUFF_LEN - log->used))) {
+		return -1;
+	}
+	log->lens[log->count++] = len;
+	memcpy(&log->data[log->used], data, len);
+	log->used += len;
+
+	return 0;
+}
+
+static int frame_log_ctrl(void *arg, uint8_t *data, uint32_t len)
+{
+	struct frame_log *log = (struct frame_log *)arg;
+
+	if ((len != 4) || (memcmp(data, "ping", 4) != 0)) {
+		return -1;
+	}
+	log->ctrl_count++;
+
+	return 0;
+}
+
+/**
+ * Append a frame with a payload of 'len' bytes of 'fill' to a stream
+ *
+ * @param[in] buf	stream
+ * @param[in] off	stream length so far
+ * @param[in] len	payload length
+ * @param[in] fill	payload byte
+ *
+ * @return the new stream length
+ */
+static uint32_t stream_add(uint8_t *buf, uint32_t off, uint32_t len, uint8_t fill)
+{
+	memset(&buf[off + FRAME_HDR_LEN], fill, len);
+
+	return off + frame_encode(&buf[off], len);
+}
+
+/* headers and payloads cut at every byte boundary, through both entry points */
+static int test_split_headers(void)
+{
+	static struct frame_log log;
+	struct frame_decoder dec;
+	uint8_t stream[256];
+	uint32_t len, space, i;
+	uint8_t *ptr;
+	int ret;
+
+	len = stream_add(stream, 0, 3, 'a');
+	len = stream_add(stream, len, 0, 0);
+	len = stream_add(stream, len, 100, 'b');
+
+	memset(&log, 0x00, sizeof(log));
+	TEST_CHECK(frame_decoder_init(&dec, 16, 128, NULL) == 0);
+	for (i=0; i<len; i++) {
+		ret = frame_decoder_feed(&dec, &stream[i], 1, frame_log_add, &log);
+		TEST_CHECK(ret >= 0);
+	}
+	TEST_CHECK(log.count == 3);
+	TEST_CHECK((log.lens[0] == 3) && (log.lens[1] == 0) && (log.lens[2] == 100));
+	TEST_CHECK(memcmp(log.data, "aaa", 3) == 0);
+	TEST_CHECK((log.data[3] == 'b') && (log.data[102] == 'b'));
+	TEST_CHECK(dec.head == dec.tail);
+	TEST_CHECK(dec.size == dec.init_size);
+
+	memset(&log, 0x00, sizeof(log));
+	for (i=0; i<len; i++) {
+		ptr = frame_decoder_space(&dec, &space);
+		TEST_CHECK(ptr && (space > 0));
+		*ptr = stream[i];
+		TEST_CHECK(frame_decoder_commit(&dec, 1, frame_log_add, &log) >= 0);
+	}
+	TEST_CHECK(log.count == 3);
+	TEST_CHECK(log.lens[2] == 100);
+	frame_decoder_exit(&dec);
+
+	return 0;
+}
+
+/* a length above max_len is refused as soon as its header is complete */
+static int test_max_len(void)
+{
+	static struct frame_log log;
+	struct frame_decoder dec;
+	uint8_t stream[128];
+	uint32_t len;
+
+	memset(&log, 0x00, sizeof(log));
+	TEST_CHECK(frame_decoder_init(&dec, 16, 32, NULL) == 0);
+	len = stream_add(stream, 0, 32, 'x');
+	TEST_CHECK(frame_decoder_feed(&dec, stream, len, frame_log_add, &log) == 1);
+
+	len = stream_add(stream, 0, 33, 'y');
+	TEST_CHECK(frame_decoder_feed(&dec, stream, 2, frame_log_add, &log) == 0);
+	TEST_CHECK(frame_decoder_feed(&dec, &stream[2], 2, frame_log_add, &log) == -1);
+	TEST_CHECK(log.count == 1);
+	frame_decoder_exit(&dec);
+
+	/* the control flag does not count as length, but the rest does */
+	TEST_CHECK(frame_decoder_init(&dec, 16, 32, NULL) == 0);
+	frame_encode_ctrl(stream, 33);
+	TEST_CHECK(frame_decoder_feed(&dec, stream, FRAME_HDR_LEN, frame_log_add, &log) == -1);
+	frame_decoder_exit(&dec);
+
+	return 0;
+}
+
+/* a frame larger than the decoder plus the ones behind it, in one readv() */
+static int test_readv_spill(void)
+{
+	static struct frame_log log;
+	static uint8_t stream[TEST_STREAM_LEN];
+	struct frame_decoder dec;
+	uint32_t len;
+	int sv[2];
+
+	memset(&log, 0x00, sizeof(log));
+	len = stream_add(stream, 0, 4000, 'a');
+	len = stream_add(stream, len, 10, 'b');
+	len = stream_add(stream, len, 20, 'c');
+
+	TEST_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	TEST_CHECK(write(sv[0], stream, len) == len);
+	TEST_CHECK(frame_decoder_init(&dec, 64, 8192, NULL) == 0);
+	TEST_CHECK(frame_decoder_readv(&dec, sv[1], frame_log_add, &log) == len);
+	TEST_CHECK(log.count == 3);
+	TEST_CHECK((log.lens[0] == 4000) && (log.lens[1] == 10) && (log.lens[2] == 20));
+	TEST_CHECK((log.data[3999] == 'a') && (log.data[4000] == 'b') && (log.data[4029] == 'c'));
+	TEST_CHECK(dec.size == dec.init_size);
+
+	/* an oversized frame behind the spill is still refused */
+	len = stream_add(stream, 0, 100, 'd');
+	len = stream_add(stream, len, 9000, 'e');
+	TEST_CHECK(write(sv[0], stream, len) == len);
+	errno = 0;
+	TEST_CHECK(frame_decoder_readv(&dec, sv[1], frame_log_add, &log) == -1);
+	TEST_CHECK(errno == EBADMSG);
+	TEST_CHECK(log.count == 4);
+
+	frame_decoder_exit(&dec);
+	close(sv[0]);
+	close(sv[1]);
+
+	return 0;
+}
+
+/* control frames go to their own handler, or nowhere */
+static int test_ctrl_frames(void)
+{
+	static struct frame_log log;
+	struct frame_decoder dec;
+	uint8_t stream[64];
+	uint32_t len;
+
+	memset(&log, 0x00, sizeof(log));
+	memcpy(&stream[FRAME_HDR_LEN], "ping", 4);
+	len = frame_encode_ctrl(stream, 4);
+	len = stream_add(stream, len, 4, 'p');
+
+	TEST_CHECK(frame_decoder_init(&dec, 16, 32, NULL) == 0);
+	TEST_CHECK(frame_decoder_feed(&dec, stream, len, frame_log_add, &log) == 2);
+	TEST_CHECK((log.count == 1) && (log.ctrl_count == 0));
+
+	frame_decoder_ctrl(&dec, frame_log_ctrl);
+	TEST_CHECK(frame_decoder_feed(&dec, stream, len, frame_log_add, &log) == 2);
+	TEST_CHECK((log.count == 2) && (log.ctrl_count == 1));
+	frame_decoder_exit(&dec);
+
+	return 0;
+}
+
+/* frame_writev() picks a frame up where an earlier call left it */
+static int test_writev_resume(void)
+{
+	const char payload[] = "resumed";
+	uint8_t expect[64], got[64];
+	uint32_t len, sent;
+	int sv[2];
+
+	memcpy(&expect[FRAME_HDR_LEN], payload, sizeof(payload));
+	len = frame_encode(expect, sizeof(payload));
+
+	TEST_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	for (sent=0; sent<len; sent++) {
+		TEST_CHECK(frame_writev(sv[0], payload, sizeof(payload), sent) == len);
+		TEST_CHECK(read(sv[1], got, sizeof(got)) == (len - sent));
+		TEST_CHECK(memcmp(got, &expect[sent], len - sent) == 0);
+	}
+	close(sv[0]);
+	close(sv[1]);
+
+	return 0;
+}
+
+static const struct test_case tests[] = {
+	TEST_CASE(test_split_headers),
+	TEST_CASE(test_max_len),
+	TEST_CASE(test_readv_spill),
+	TEST_CASE(test_ctrl_frames),
+	TEST_CASE(test_writev_resume),
+};
+
+TEST_MAIN(tests)
@@ -0,0 +1,109 @@
+#include <string.h>
+
+#include "metrics.h"
+#include "test.h"
+
+/**
+ * Check the bucket of one value: in range, holding the value, and no
+ * wider than 1/METRICS_HIST_SUB of it
+ *
+ * @param[in] v	value
+ *
+ * @return On success, 0.
+ *		   On error, negative number of the failed check's line number
+ */
+static int hist_check_value(uint64_t v)
+{
+	uint32_t idx;
+	uint64_t high;
+
+	idx = metrics_hist_index(v);
+	TEST_CHECK(idx < METRICS_HIST_BUCKETS);
+	high = metrics_hist_value(idx);
+	TEST_CHECK(high >= v);
+	TEST_CHECK((idx == 0) || (metrics_hist_value(idx - 1) < v));
+	TEST_CHECK((high - v) <= (v >> METRICS_HIST_SUB_BITS));
+
+	return 0;
+}
+
+/* small values get a bucket each */
+static int test_hist_exact(void)
+{
+	uint64_t v;
+
+	for (v=0; v<METRICS_HIST_SUB; v++) {
+		TEST_CHECK(metrics_hist_index(v) == v);
+		TEST_CHECK(metrics_hist_value(v) == v);
+	}
+	TEST_CHECK(metrics_hist_index(METRICS_HIST_SUB) == METRICS_HIST_SUB);
+
+	return 0;
+}
+
+/* every bucket holds the values between its neighbours' highest ones */
+static int test_hist_bounds(void)
+{
+	uint64_t v, p;
+	uint32_t idx, prev;
+	int shift;
+	int ret;
+
+	prev = 0;
+	for (v=0; v<(1 << 16); v++) {
+		ret = hist_check_value(v);
+		if (ret < 0) {
+			return ret;
+		}
+		idx = metrics_hist_index(v);
+		TEST_CHECK((idx == prev) || (idx == (prev + 1)));
+		prev = idx;
+	}
+
+	for (shift=16; shift<64; shift++) {
+		p = 1ULL << shift;
+		if ((hist_check_value(p - 1) < 0) || (hist_check_value(p) < 0) ||
+			(hist_check_value(p + 1) < 0) || (hist_check_value(p + (p >> 1)) < 0)) {
+			return -__LINE__;
+		}
+		TEST_CHECK(metrics_hist_index(p) == (metrics_hist_index(p - 1) + 1));
+	}
+
+	TEST_CHECK(hist_check_value(UINT64_MAX) == 0);
+	TEST_CHECK(metrics_hist_index(UINT64_MAX) == (METRICS_HIST_BUCKETS - (METRICS_HIST_SUB * 2) - 1));
+	TEST_CHECK(metrics_hist_value(metrics_hist_index(UINT64_MAX)) == UINT64_MAX);
+
+	return 0;
+}
+
+/* quantiles come back within a bucket of the recorded values */
+static int test_hist_quantile(void)
+{
+	static struct metrics_hist h;
+	uint64_t v;
+
+	memset(&h, 0x00, sizeof(h));
+	TEST_CHECK(metrics_hist_quantile(&h, 0.5) == 0);
+
+	for (v=1; v<=1000; v++) {
+		metrics_hist_add(&h, v * 1000);
+	}
+	TEST_CHECK(h.count == 1000);
+	TEST_CHECK(h.max == 1000000);
+
+	v = metrics_hist_quantile(&h, 0.5);
+	TEST_CHECK((v >= 501000) && (v <= 501000 + (501000 >> METRICS_HIST_SUB_BITS)));
+	v = metrics_hist_quantile(&h, 0.99);
+	TEST_CHECK((v >= 990000) && (v <= 1000000));
+	TEST_CHECK(metrics_hist_quantile(&h, 1.0) == 1000000);
+
+	return 0;
+}
+
+static const struct test_case tests[] = {
+	TEST_CASE(test_hist_exact),
+	TEST_CASE(test_hist_bounds),
+	TEST_CASE(test_hist_quantile),
+};
+
+TEST_MAIN(tests)
@@ -0,0 +1,182 @@
+#include <string.h>
+#include <time.h>
+
+#include "wheel.h"
+#include "test.h"
+
+struct test_timer {
+	struct wheel_timer timer;
+	struct timer_wheel *tw;
+	struct test_timer *victim;	/* deleted by the callback */
+	uint64_t fired_at;			/* tick the callback ran on, 0: not yet */
+	uint32_t fired;
+};
+
+static void test_timer_cb(void *arg)
+{
+	struct test_timer *tt = (struct test_timer *)arg;
+
+	tt->fired++;
+	tt->fired_at = wheel_now(tt->tw);
+	if (tt->victim) {
+		wheel_del(tt->tw, &tt->victim->timer);
+	}
+}
+
+static void test_timer_init(struct test_timer *tt, struct timer_wheel *tw)
+{
+	memset(tt, 0x00, sizeof(struct test_timer));
+	tt->tw = tw;
+	wheel_timer_init(&tt->timer, test_timer_cb, tt);
+}
+
+/**
+ * Move the wheel's clock, it reads 'tick' until the next millisecond
+ * passes for real
+ *
+ * @param[in] tw	wheel
+ * @param[in] tick	tick the clock is set to
+ */
+static void wheel_clock_set(struct timer_wheel *tw, uint64_t tick)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tw->start_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec - tick * 1000000ULL;
+}
+
+/* deadlines on every level fire on their own tick, not before */
+static int test_cascade(void)
+{
+	static const uint64_t deadlines[] = {
+		1, 63, 64, 65, 130, 4095, 4096, 4097, 5000, 262143, 262144, 300000,
+	};
+	static struct test_timer timers[sizeof(deadlines) / sizeof(deadlines[0])];
+	static struct timer_wheel tw;
+	uint32_t i, n;
+
+	n = sizeof(deadlines) / sizeof(deadlines[0]);
+	wheel_init(&tw);
+	wheel_clock_set(&tw, 0);
+	for (i=0; i<n; i++) {
+		test_timer_init(&timers[i], &tw);
+		wheel_add(&tw, &timers[i].timer, deadlines[i]);
+	}
+	TEST_CHECK(tw.count == n);
+	TEST_CHECK(tw.busy[0] && tw.busy[1] && tw.busy[2] && tw.busy[3]);
+
+	for (i=0; i<n; i++) {
+		/* short of the deadline nothing of it runs */
+		wheel_clock_set(&tw, deadlines[i] - 1);
+		wheel_run(&tw);
+		TEST_CHECK(timers[i].fired == 0);
+		TEST_CHECK(wheel_pending(&timers[i].timer));
+
+		wheel_clock_set(&tw, deadlines[i]);
+		TEST_CHECK(wheel_run(&tw) == 1);
+		TEST_CHECK(timers[i].fired == 1);
+		TEST_CHECK(timers[i].fired_at == deadlines[i]);
+		TEST_CHECK(!wheel_pending(&timers[i].timer));
+		TEST_CHECK(tw.count == (n - i - 1));
+	}
+	TEST_CHECK(!tw.busy[0] && !tw.busy[1] && !tw.busy[2] && !tw.busy[3]);
+
+	return 0;
+}
+
+/* a callback deletes timers of its own slot, of another slot, and re-adds */
+static int test_del_in_expiry(void)
+{
+	static struct test_timer a, b, c, d;
+	static struct timer_wheel tw;
+
+	wheel_init(&tw);
+	wheel_clock_set(&tw, 0);
+	test_timer_init(&a, &tw);
+	test_timer_init(&b, &tw);
+	test_timer_init(&c, &tw);
+	test_timer_init(&d, &tw);
+
+	/* a and b share a slot and delete each other: exactly one runs */
+	a.victim = &b;
+	b.victim = &a;
+	wheel_add(&tw, &a.timer, 10);
+	wheel_add(&tw, &b.timer, 10);
+	/* c, due at the same time, deletes d far away */
+	c.victim = &d;
+	wheel_add(&tw, &c.timer, 10);
+	wheel_add(&tw, &d.timer, 5000);
+	TEST_CHECK(tw.count == 4);
+
+	wheel_clock_set(&tw, 10);
+	TEST_CHECK(wheel_run(&tw) == 2);
+	TEST_CHECK((a.fired + b.fired) == 1);
+	TEST_CHECK(c.fired == 1);
+	TEST_CHECK(!wheel_pending(&a.timer) && !wheel_pending(&b.timer));
+	TEST_CHECK(!wheel_pending(&d.timer));
+	TEST_CHECK(tw.count == 0);
+	TEST_CHECK(!tw.busy[0] && !tw.busy[1]);
+
+	wheel_clock_set(&tw, 6000);
+	TEST_CHECK(wheel_run(&tw) == 0);
+	TEST_CHECK(d.fired == 0);
+
+	/* deleting a timer that already ran is a no-op */
+	wheel_del(&tw, &c.timer);
+	TEST_CHECK(tw.count == 0);
+
+	/* a passed deadline expires on the next tick */
+	wheel_add(&tw, &c.timer, 100);
+	TEST_CHECK(c.timer.expires == (wheel_now(&tw) + 1));
+
+	return 0;
+}
+
+/* the wait never ends later than the nearest deadline */
+static int test_timeout(void)
+{
+	static struct test_timer a, b;
+	static struct timer_wheel tw;
+
+	wheel_init(&tw);
+	wheel_clock_set(&tw, 0);
+	test_timer_init(&a, &tw);
+	test_timer_init(&b, &tw);
+	TEST_CHECK(wheel_timeout(&tw, 1000) == 1000);
+
+	wheel_add(&tw, &a.timer, 10);
+	TEST_CHECK(wheel_timeout(&tw, 1000) == 10);
+	TEST_CHECK(wheel_timeout(&tw, 5) == 5);
+
+	/* level 1: woken when its slot cascades, at tick 192 */
+	wheel_del(&tw, &a.timer);
+	wheel_add(&tw, &a.timer, 200);
+	TEST_CHECK(wheel_timeout(&tw, 1000) == 192);
+	wheel_clock_set(&tw, 192);
+	TEST_CHECK(wheel_run(&tw) == 0);
+	TEST_CHECK(wheel_timeout(&tw, 1000) == 8);
+
+	/* a deadline past the wrap of level 0 */
+	wheel_clock_set(&tw, 200);
+	TEST_CHECK(wheel_run(&tw) == 1);
+	wheel_clock_set(&tw, 250);
+	wheel_run(&tw);
+	wheel_add(&tw, &b.timer, 260);
+	TEST_CHECK(wheel_timeout(&tw, 1000) == 10);
+
+	/* already due */
+	wheel_clock_set(&tw, 270);
+	TEST_CHECK(wheel_timeout(&tw, 1000) == 0);
+	TEST_CHECK(wheel_run(&tw) == 1);
+	TEST_CHECK(wheel_timeout(&tw, 1000) == 1000);
+
+	return 0;
+}
+
+static const struct test_case tests[] = {
+	TEST_CASE(test_cascade),
+	TEST_CASE(test_del_in_expiry),
+	TEST_CASE(test_timeout),
+};
+
+TEST_MAIN(tests)
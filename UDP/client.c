@@ -10,11 +10,13 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <sys/epoll.h>
+#include <netinet/udp.h>
 
 #include "common.h"
+#include "log.h"
 
 #define CLIENT_ERRNO				__LINE__
-#define CLIENT_PRINT(_fmt, ...)		printf("[%04d] "_fmt"\n", __LINE__, ##__VA_ARGS__);
+#define CLIENT_PRINT(_fmt, ...)		LOG_INFO("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
 
 /**
  * Send a message to the server
@@ -58,6 +60,69 @@ static int client_send_message(int sockfd, struct common_buff *sbuf, uint16_t bu
 	return ret;
 }
 
+/**
+ * Send 'count' copies of the last message as one UDP_SEGMENT buffer
+ *
+ * Each copy fills one 'seg_size' segment (zero padded), the kernel cuts
+ * the buffer into wire datagrams so the whole burst costs one syscall.
+ *
+ * @param[in] sockfd	file descriptor
+ * @param[in] sbuf		message sent by client_send_message()
+ * @param[in] slen		message length
+ * @param[in] gbuf		segment buffer, GSO_MAX_SEGS * seg_size bytes
+ * @param[in] seg_size	segment size
+ * @param[in] count		number of segments, at most GSO_MAX_SEGS
+ * @param[in] servaddr	server addr info
+ *
+ * @return On success, return the number of bytes sent.
+ */
+static int client_send_segments(int sockfd, struct common_buff *sbuf, uint32_t slen, uint8_t *gbuf,
+								uint16_t seg_size, uint16_t count, struct sockaddr_in *servaddr)
+{
+	union {
+		struct cmsghdr hdr;
+		uint8_t buf[CMSG_SPACE(sizeof(uint16_t))];
+	} ctrl;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	uint16_t i;
+	int ret;
+
+	if (slen > seg_size) {
+		slen = seg_size;
+	}
+	memset(gbuf, 0x00, (size_t)count * seg_size);
+	for (i=0; i<count; i++) {
+		memcpy(&gbuf[i * seg_size], sbuf->data, slen);
+	}
+
+	iov.iov_base = gbuf;
+	iov.iov_len = (size_t)count * seg_size;
+	memset(&msg, 0x00, sizeof(struct msghdr));
+	msg.msg_name = servaddr;
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buf;
+	msg.msg_controllen = sizeof(ctrl.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	memcpy(CMSG_DATA(cmsg), &seg_size, sizeof(uint16_t));
+
+	ret = sendmsg(sockfd, &msg, 0);
+	if (ret < 0) {
+		CLIENT_PRINT("segmented write failed, %s", strerror(errno));
+		return -CLIENT_ERRNO;
+	}
+	CLIENT_PRINT("TX[%04d]> %u x %u bytes segments", ret, count, seg_size);
+
+	return ret;
+}
+
 /**
  * Receive a message from the server
  *
@@ -106,22 +171,54 @@ int main(int argc, char *argv[])
 	struct sockaddr_in servaddr;
 	const char *ip_str;
 	const char *port_str;
+	uint8_t *gbuf;
 	uint32_t timeout;
+	uint16_t seg_size, seg_cnt;
 	uint16_t port;
 	uint16_t blen;
 	int sockfd, epfd;
 	int flags;
 	int i, ret;
 
-	if (argc < 3) {
-		CLIENT_PRINT("usage: ./client ip port");
+	log_init();
+
+	/* -g: after each line, send seg_cnt copies as one UDP_SEGMENT burst */
+	seg_size = 0;
+	seg_cnt = GSO_MAX_SEGS;
+	while ((ret = getopt(argc, argv, "g:n:")) != -1) {
+		switch (ret) {
+		case 'g':
+			seg_size = atoi(optarg);
+			break;
+		case 'n':
+			seg_cnt = atoi(optarg);
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+	if (((argc - optind) < 2) || (seg_cnt == 0) || (seg_cnt > GSO_MAX_SEGS) ||
+		((uint32_t)seg_size * seg_cnt > GRO_BUFF_LEN - 64)) {
+		CLIENT_PRINT("usage: ./client [-g segment_size [-n segments]] ip port");
 		return -CLIENT_ERRNO;
 	}
+	argv += optind - 1;
+
+	gbuf = NULL;
+	if (seg_size) {
+		gbuf = (uint8_t *)malloc((size_t)seg_size * seg_cnt);
+		if (!gbuf) {
+			CLIENT_PRINT("get segment buff memory failed");
+			return -CLIENT_ERRNO;
+		}
+	}
 
 	blen = sizeof(struct common_buff) + DATA_MAX_LEN;
 	buff = (struct common_buff *)malloc(blen);
 	if (!buff) {
 		CLIENT_PRINT("get %d bytes buff memory failed", blen);
+		free(gbuf);
 		return -CLIENT_ERRNO;
 	}
 
@@ -182,7 +279,12 @@ int main(int argc, char *argv[])
 			for (i=0; i<ret; i++) {
 				if (events[i].events & EPOLLIN) {
 					if (events[i].data.fd == fileno(stdin)) {
-						if (client_send_message(sockfd, buff, blen, &servaddr) < 0) {
+						ret = client_send_message(sockfd, buff, blen, &servaddr);
+						if (ret < 0) {
+							goto label_main_exit;
+						}
+						if (gbuf && (ret > 0) && strcmp((const char *)buff->data, "quit") &&
+							(client_send_segments(sockfd, buff, ret, gbuf, seg_size, seg_cnt, &servaddr) < 0)) {
 							goto label_main_exit;
 						}
 
@@ -207,6 +309,7 @@ label_main_exit:
 		free(buff);
 		buff = NULL;
 	}
+	free(gbuf);
 	if (sockfd > 0) {
 		close(sockfd);
 		sockfd = -1;
@@ -4,6 +4,8 @@
 #include <stdint.h>
 
 #define DATA_MAX_LEN	1024
+#define GSO_MAX_SEGS	64				/* segments per UDP_SEGMENT send (UDP_MAX_SEGMENTS) */
+#define GRO_BUFF_LEN	(64 * 1024)		/* largest coalesced UDP_GRO datagram */
 struct common_buff {
 	uint8_t data[DATA_MAX_LEN];
 };
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE			/* recvmmsg(), sendmmsg() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
@@ -9,114 +10,436 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
 #include <sys/epoll.h>
+#include <netinet/udp.h>
 
 #include "common.h"
+#include "config.h"
+#include "ctrl.h"
+#include "log.h"
+#include "metrics.h"
+#include "mode.h"
 
+#define DGRAM_BATCH					64		/* datagrams per recvmmsg()/sendmmsg() */
+#define SOURCE_BURST				16		/* sendmmsg() per EPOLLOUT in source mode */
+#define SOURCE_DGRAM_MAX			65507	/* UDP payload over IPv4 */
+
+#define SERVER_OPTIONS				"EGm:S:"	/* see config.h */
 #define SERVER_ERRNO				__LINE__
-#define SERVER_PRINT(_fmt, ...)		printf("[%04d] "_fmt"\n", __LINE__, ##__VA_ARGS__);
+#define SERVER_PRINT(_fmt, ...)		LOG_INFO("[%04d] "_fmt, __LINE__, ##__VA_ARGS__);
+
+/* room for the UDP_GRO segment size of one datagram */
+union dgram_ctrl {
+	struct cmsghdr hdr;
+	uint8_t buf[CMSG_SPACE(sizeof(int))];
+};
+
+/*
+ * Datagram vectors for recvmmsg()/sendmmsg(): one buffer and one source
+ * address per datagram, so a batch keeps every sender apart.
+ */
+struct dgram_batch {
+	struct mmsghdr msgs[DGRAM_BATCH];
+	struct iovec iovs[DGRAM_BATCH];
+	struct sockaddr_in addrs[DGRAM_BATCH];
+	union dgram_ctrl ctrls[DGRAM_BATCH];
+	uint8_t *bufs;
+	uint32_t buf_size;		/* per datagram, GRO_BUFF_LEN with UDP_GRO */
+
+	/* distinct senders of the last receive, the console message goes to them;
+	 * in source mode every sender so far, they get the stream */
+	struct mmsghdr smsgs[DGRAM_BATCH];
+	struct iovec siov;
+	struct sockaddr_in peers[DGRAM_BATCH];
+	uint32_t npeers;
+};
+
+static struct ctrl_chan ctrl = { .efd = -1 };	/* console, read by the control thread */
+static struct metrics metrics;				/* no connections, accepts and closes stay 0 */
+static struct server_config cfg;
+
+/**
+ * Allocate the datagram vectors
+ *
+ * @param[in] buf_size	receive buffer size of each datagram
+ *
+ * @return On success, return the batch.
+ *		   On error, NULL
+ */
+static struct dgram_batch *server_batch_new(uint32_t buf_size)
+{
+	struct dgram_batch *batch;
+	int i;
+
+	batch = (struct dgram_batch *)calloc(1, sizeof(struct dgram_batch));
+	if (!batch) {
+		return NULL;
+	}
+	batch->bufs = (uint8_t *)malloc((size_t)DGRAM_BATCH * buf_size);
+	if (!batch->bufs) {
+		free(batch);
+		return NULL;
+	}
+	batch->buf_size = buf_size;
+
+	for (i=0; i<DGRAM_BATCH; i++) {
+		batch->iovs[i].iov_base = &batch->bufs[i * buf_size];
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+
+		batch->smsgs[i].msg_hdr.msg_iov = &batch->siov;
+		batch->smsgs[i].msg_hdr.msg_iovlen = 1;
+		batch->smsgs[i].msg_hdr.msg_name = &batch->peers[i];
+		batch->smsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+
+	return batch;
+}
+
+/**
+ * Free the datagram vectors
+ *
+ * @param[in] batch	datagram vectors
+ */
+static void server_batch_free(struct dgram_batch *batch)
+{
+	if (batch) {
+		free(batch->bufs);
+		free(batch);
+	}
+}
+
+/**
+ * Get the UDP_GRO segment size of a received datagram
+ *
+ * @param[in] hdr	received message header
+ *
+ * @return the segment size, 0 if the datagram was not coalesced
+ */
+static int server_gro_size(struct msghdr *hdr)
+{
+	struct cmsghdr *cmsg;
+	int gso_size;
+
+	for (cmsg=CMSG_FIRSTHDR(hdr); cmsg; cmsg=CMSG_NXTHDR(hdr, cmsg)) {
+		if ((cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO)) {
+			memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(int));
+			return gso_size;
+		}
+	}
+
+	return 0;
+}
 
 /**
- * Receive a message from the client
+ * Remember the sender of a datagram, once
  *
- * @param[in] sockfd	client connection file descriptor
- * @param[in] rbuf		recv buff pointer
- * @param[in] buff_len	recv buff size
- * @param[in] cliaddr	client addr info
+ * @param[in] batch	datagram vectors
+ * @param[in] addr	sender address
+ */
+static void server_batch_add_peer(struct dgram_batch *batch, struct sockaddr_in *addr)
+{
+	uint32_t i;
+
+	for (i=0; i<batch->npeers; i++) {
+		if ((batch->peers[i].sin_addr.s_addr == addr->sin_addr.s_addr) &&
+			(batch->peers[i].sin_port == addr->sin_port)) {
+			return;
+		}
+	}
+	if (batch->npeers < DGRAM_BATCH) {
+		batch->peers[batch->npeers++] = *addr;
+	}
+}
+
+/**
+ * Send the datagrams of the last recvmmsg() back to their senders, a
+ * coalesced one goes back as UDP_SEGMENT segments of the received size
  *
- * @return On success, return the length of the sent.
+ * A datagram the socket has no room for is dropped, as the network would,
+ * and so is one the send fails for (e.g. EIO from a device without
+ * UDP_SEGMENT, EINVAL or EMSGSIZE for more segments than it allows): it
+ * is counted and the rest of the batch still goes out.
+ *
+ * @param[in] sockfd	socket file descriptor
+ * @param[in] batch		datagram vectors
+ * @param[in] cnt		datagrams received
  */
-static int server_recv_message(int sockfd, struct common_buff *rbuf, uint16_t buff_len,
-							   struct sockaddr_in *cliaddr)
+static void server_echo_batch(int sockfd, struct dgram_batch *batch, int cnt)
 {
-	socklen_t len;
-	char *rptr;
-	uint32_t rlen;
+	uint32_t segs[DGRAM_BATCH];	/* messages in each datagram */
+	struct mmsghdr *msg;
+	struct cmsghdr *cmsg;
+	uint16_t seg_size;
+	int gso_size;
+	int sent;
 	int ret;
+	int i;
 
-	rptr = (char *)rbuf;
-	rlen = 0;
+	for (i=0; i<cnt; i++) {
+		msg = &batch->msgs[i];
+		gso_size = server_gro_size(&msg->msg_hdr);
+		batch->iovs[i].iov_len = msg->msg_len;
+		msg->msg_hdr.msg_flags = 0;
+		segs[i] = 1;
+		if ((gso_size > 0) && (gso_size < msg->msg_len)) {
+			segs[i] = (msg->msg_len + gso_size - 1) / gso_size;
+			/* the control buffer held the UDP_GRO size, reuse it */
+			msg->msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+			cmsg = CMSG_FIRSTHDR(&msg->msg_hdr);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			seg_size = gso_size;
+			memcpy(CMSG_DATA(cmsg), &seg_size, sizeof(uint16_t));
+		} else {
+			msg->msg_hdr.msg_control = NULL;
+			msg->msg_hdr.msg_controllen = 0;
+		}
+	}
+
+	for (sent=0; sent<cnt; sent+=ret) {
+		ret = sendmmsg(sockfd, &batch->msgs[sent], cnt - sent, MSG_DONTWAIT);
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS)) {
+				metrics_add(&metrics.eagain, 1);
+				break;
+			} else if (errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			/* the first datagram left is the one that failed, skip it */
+			if (metrics.send_errors == 0) {
+				SERVER_PRINT("write failed, %s, dropping such datagrams", strerror(errno));
+			}
+			metrics_add(&metrics.send_errors, 1);
+			segs[sent] = 0;
+			batch->msgs[sent].msg_len = 0;
+			ret = 1;
+		}
+	}
+	/* the cmsg now holds UDP_SEGMENT, the segment counts were taken before */
+	for (i=0; i<sent; i++) {
+		metrics_add(&metrics.msgs_out, segs[i]);
+		metrics_add(&metrics.bytes_out, batch->msgs[i].msg_len);
+	}
+}
 
-	len = sizeof(struct sockaddr_in);
+/**
+ * Stream generated datagrams to every client that has sent one, a bounded
+ * burst per call so the console and the receive side still get their turn
+ *
+ * @param[in] sockfd	socket file descriptor
+ * @param[in] batch		datagram vectors, holding the clients
+ * @param[in] payload	datagram payload
+ * @param[in] len		payload length
+ *
+ * @return On success, return the number of datagrams sent.
+ *		   On error, negative number of the error line number
+ */
+static int server_source_send(int sockfd, struct dgram_batch *batch, uint8_t *payload, uint32_t len)
+{
+	int burst;
+	int cnt;
+	int ret;
+
+	batch->siov.iov_base = payload;
+	batch->siov.iov_len = len;
+	for (burst=0,cnt=0; burst<SOURCE_BURST; burst++) {
+		ret = sendmmsg(sockfd, batch->smsgs, batch->npeers, MSG_DONTWAIT);
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS)) {
+				metrics_add(&metrics.eagain, 1);
+				break;
+			}
+			SERVER_PRINT("write failed, %s", strerror(errno));
+			return -SERVER_ERRNO;
+		}
+		cnt += ret;
+	}
+	metrics_add(&metrics.msgs_out, cnt);
+	metrics_add(&metrics.bytes_out, (uint64_t)cnt * len);
+
+	return cnt;
+}
+
+/**
+ * Receive all queued datagrams from the clients
+ *
+ * Up to DGRAM_BATCH datagrams are read per recvmmsg() until the socket is
+ * drained, which is what the edge-triggered mode relies on. With UDP_GRO a
+ * datagram may hold several segments of the same sender, each one is a
+ * message of its own. In echo mode every batch is sent back before the
+ * next one is read.
+ *
+ * @param[in] sockfd	socket file descriptor
+ * @param[in] batch		datagram vectors
+ *
+ * @return On success, return the number of messages received.
+ */
+static int server_recv_message(int sockfd, struct dgram_batch *batch)
+{
+	struct mmsghdr *msg;
+	struct sockaddr_in *addr;
+	uint32_t off, seg_len;
+	uint8_t *data;
+	int gso_size;
+	int cnt;
+	int ret;
+	int i;
+
+	cnt = 0;
 	do {
-		ret = recvfrom(sockfd, &rptr[rlen], buff_len - rlen, 0, (struct sockaddr *)cliaddr, &len);
+		for (i=0; i<DGRAM_BATCH; i++) {
+			batch->iovs[i].iov_len = batch->buf_size;
+			batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			batch->msgs[i].msg_hdr.msg_control = &batch->ctrls[i];
+			batch->msgs[i].msg_hdr.msg_controllen = sizeof(union dgram_ctrl);
+		}
+
+		ret = recvmmsg(sockfd, batch->msgs, DGRAM_BATCH, MSG_DONTWAIT, NULL);
 		if (ret < 0) {
 			if (errno != EAGAIN) {
 				SERVER_PRINT("read failed, %d, %s", errno, strerror(errno));
 				return -SERVER_ERRNO;
 			}
+			metrics_add(&metrics.eagain, 1);
 			break;
-		} else if (ret == 0) {
-			SERVER_PRINT("client closed connection");
-			return 0;
 		}
-		rlen += ret;
-	} while (ret > 0);
+		if ((cnt == 0) && (cfg.mode != SERVER_MODE_SOURCE)) {
+			batch->npeers = 0;
+		}
+
+		for (i=0; i<ret; i++) {
+			msg = &batch->msgs[i];
+			addr = &batch->addrs[i];
+			data = (uint8_t *)batch->iovs[i].iov_base;
+			if (msg->msg_hdr.msg_flags & MSG_TRUNC) {
+				SERVER_PRINT("datagram truncated to %u bytes", batch->buf_size);
+			}
 
-	SERVER_PRINT("RX[%04d]> %s", rlen, rbuf->data);
+			metrics_add(&metrics.bytes_in, msg->msg_len);
+			gso_size = server_gro_size(&msg->msg_hdr);
+			if (gso_size <= 0) {
+				gso_size = msg->msg_len;
+			}
+			for (off=0; off<msg->msg_len; off+=seg_len) {
+				seg_len = msg->msg_len - off;
+				if (seg_len > (uint32_t)gso_size) {
+					seg_len = gso_size;
+				}
+				if (cfg.mode == SERVER_MODE_CONSOLE) {
+					SERVER_PRINT("RX[%04d]> %.*s", seg_len, (int)strnlen((char *)&data[off], seg_len), &data[off]);
+				}
+				cnt++;
+			}
+			if (msg->msg_len == 0) {
+				if (cfg.mode == SERVER_MODE_CONSOLE) {
+					SERVER_PRINT("RX[0000]> ");
+				}
+				cnt++;
+			}
+			if (cfg.mode == SERVER_MODE_CONSOLE) {
+				SERVER_PRINT("receive from client: %s:%d", inet_ntoa(addr->sin_addr), addr->sin_port);
+			}
+			server_batch_add_peer(batch, addr);
+		}
+		if (cfg.mode == SERVER_MODE_ECHO) {
+			server_echo_batch(sockfd, batch, ret);
+		}
+	} while (ret == DGRAM_BATCH);	/* a short batch means the queue is empty */
+	metrics_add(&metrics.msgs_in, cnt);
 
-	return rlen;
+	return cnt;
 }
 
 /**
- * Send a message to the client
+ * Send a message to the clients of the last receive
  *
- * @param[in] sockfd	client connection file descriptor
+ * One sendmmsg() carries the same payload to every distinct sender.
+ *
+ * @param[in] sockfd	socket file descriptor
  * @param[in] sbuf		send buff pointer
+ * @param[in] msg		message typed on the console
  * @param[in] buff_len	send buff size
- * @param[in] cliaddr	client addr info
+ * @param[in] batch		datagram vectors, holding the senders
  *
- * @return On success, return the length of the sent.
+ * @return On success, return the number of datagrams sent.
  */
-static int server_send_message(int sockfd, struct common_buff *sbuf, uint16_t buff_len,
-							   struct sockaddr_in *cliaddr)
+static int server_send_message(int sockfd, struct common_buff *sbuf, const char *msg, uint16_t buff_len,
+							   struct dgram_batch *batch)
 {
 	uint32_t slen;
+	uint32_t sent;
 	int ret;
 
-	/* clear send buff */
-	memset(sbuf->data, 0x00, buff_len);
-
-	/* get input from stdin  */
-	fgets((char *)sbuf->data, buff_len, stdin);
-	slen = strlen((char *)sbuf->data);
+	/* the console line (< CTRL_MSG_LEN) is cut to what the buffer holds */
+	slen = strnlen(msg, buff_len - 1);
+	memcpy(sbuf->data, msg, slen);
+	sbuf->data[slen] = '\0';
 	if (slen == 0) {
 		SERVER_PRINT("Input is empty");
 		return 0;
 	}
-	slen -= 1;
-	sbuf->data[slen] = '\0'; /* delete \n */
 
-	/* send to server */
-	ret = sendto(sockfd, sbuf, slen, 0, (const struct sockaddr *)cliaddr, sizeof(struct sockaddr_in));
-	if (ret < 0) {
-		/* we failed */
-		SERVER_PRINT("write failed, %s", strerror(errno));
-		return -SERVER_ERRNO;
+	if (batch->npeers == 0) {
+		SERVER_PRINT("no client to send to");
+		return 0;
+	}
+
+	batch->siov.iov_base = sbuf->data;
+	batch->siov.iov_len = slen;
+	for (sent=0; sent<batch->npeers; sent+=ret) {
+		/* send to clients */
+		ret = sendmmsg(sockfd, &batch->smsgs[sent], batch->npeers - sent, 0);
+		if (ret < 0) {
+			/* we failed */
+			SERVER_PRINT("write failed, %s", strerror(errno));
+			return -SERVER_ERRNO;
+		}
+	}
+	for (sent=0; sent<batch->npeers; sent++) {
+		metrics_add(&metrics.msgs_out, 1);
+		metrics_add(&metrics.bytes_out, batch->smsgs[sent].msg_len);
+		SERVER_PRINT("TX[%04d]> %s", batch->smsgs[sent].msg_len, sbuf->data);
+		SERVER_PRINT("send to client: %s:%d", inet_ntoa(batch->peers[sent].sin_addr),
+					 batch->peers[sent].sin_port);
 	}
-	SERVER_PRINT("TX[%04d]> %s", ret, sbuf->data);
 
-	return ret;
+	return sent;
 }
 
 int main(int argc, char *argv[])
 {
 	struct sockaddr_in servaddr;
-	struct sockaddr_in cliaddr;
+	struct dgram_batch *batch;
 	struct common_buff *buff;
 	struct epoll_event epev;
 	struct epoll_event events[2];
+	struct ctrl_cmd cmd;
+	uint8_t *source;
 	const char *port_str;
 	uint32_t timeout;
 	uint16_t port;
 	uint16_t blen;
 	int sockfd, epfd;
-	int i, ret, flags, on;
+	int i, ret, flags, on, watch_out;
 
-	if (argc < 2) {
-		SERVER_PRINT("usage: ./server port");
+	log_init();
+	metrics_init(&metrics, "udp");
+	metrics_signal_init(SIGUSR1);
+
+	batch = NULL;
+	source = NULL;
+
+	ret = server_config_parse(&cfg, SERVER_OPTIONS, argc, argv);
+	if ((ret < 0) || (ret >= argc)) {
+		SERVER_PRINT("usage: ./server [-E] [-G] [-m console|echo|sink|source] [-S size] port");
 		return -SERVER_ERRNO;
 	}
+	port_str = argv[ret];
 
 	blen = sizeof(struct common_buff);
 	buff = (struct common_buff *)malloc(blen);
@@ -125,13 +448,33 @@ int main(int argc, char *argv[])
 		return -SERVER_ERRNO;
 	}
 
+	batch = server_batch_new(cfg.udp_gro ? GRO_BUFF_LEN : DATA_MAX_LEN);
+	if (!batch) {
+		SERVER_PRINT("get datagram batch memory failed");
+		free(buff);
+		return -SERVER_ERRNO;
+	}
+
 	sockfd = epfd = -1;
 
-	port_str = argv[1];
-	SERVER_PRINT("port: %s", port_str);
+	if (cfg.mode == SERVER_MODE_SOURCE) {
+		if (cfg.source_size > SOURCE_DGRAM_MAX) {
+			cfg.source_size = SOURCE_DGRAM_MAX;
+		}
+		source = (uint8_t *)malloc(cfg.source_size);
+		if (!source) {
+			SERVER_PRINT("get %u bytes source buff memory failed", cfg.source_size);
+			goto label_main_exit;
+		}
+		for (i=0; i<cfg.source_size; i++) {
+			source[i] = 'a' + (i % 26);
+		}
+	}
+
+	SERVER_PRINT("port: %s, %s-triggered%s, %s mode", port_str, cfg.edge_triggered ? "edge" : "level",
+				 cfg.udp_gro ? ", UDP_GRO" : "", mode_name(cfg.mode));
 
 	port = atoi(port_str);
-	bzero(&cliaddr, sizeof(struct sockaddr_in));
 	bzero(&servaddr, sizeof(struct sockaddr_in));
 	servaddr.sin_family = AF_INET;
 	servaddr.sin_port = htons(port);
@@ -151,6 +494,11 @@ int main(int argc, char *argv[])
 
 	on = 1;
 	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(int));
+	if (cfg.udp_gro && (setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(int)) < 0)) {
+		SERVER_PRINT("enable UDP_GRO failed, %s", strerror(errno));
+		ret = -SERVER_ERRNO;
+		goto label_main_exit;
+	}
 
 	ret = bind(sockfd, (struct sockaddr *)&servaddr, sizeof(struct sockaddr_in));
 	if (ret < 0) {
@@ -165,19 +513,31 @@ int main(int argc, char *argv[])
 		goto label_main_exit;
 	}
 
+	/* the console is read on a thread of its own, every line is a message */
+	if (ctrl_start(&ctrl, stdin, NULL) < 0) {
+		SERVER_PRINT("start control thread failed, %s", strerror(errno));
+		goto label_main_exit;
+	}
+
 	timeout = 10 * 1000;
 	memset(&epev, 0x00, sizeof(struct epoll_event));
 	epev.events = EPOLLIN;
-	epev.data.fd = fileno(stdin);	/* stdin can also be monitored using poll */
-	epoll_ctl(epfd, EPOLL_CTL_ADD, fileno(stdin), &epev);
+	epev.data.fd = ctrl.efd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, ctrl.efd, &epev);
 
+	/* server_recv_message() reads until EAGAIN, so edge-triggered is safe */
 	epev.events = EPOLLIN;
+	if (cfg.edge_triggered) {
+		epev.events |= EPOLLET;
+	}
 	epev.data.fd = sockfd;
 	epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &epev);
 
 	memset(events, 0x00, (sizeof(struct epoll_event) * 2));
+	watch_out = 0;
 	while (1) {
 		ret = epoll_wait(epfd, events, 2, timeout);
+		metrics_wakeup(&metrics, ret);
 		if (ret < 0) {
 			SERVER_PRINT("epoll failed, %s", strerror(errno));
 			ret = -SERVER_ERRNO;
@@ -188,23 +548,47 @@ int main(int argc, char *argv[])
 		} else {
 			for (i=0; i<ret; i++) {
 				if (events[i].events & EPOLLIN) {
-					if (events[i].data.fd == fileno(stdin)) { /* stdin */
-						if (server_send_message(sockfd, buff, blen, &cliaddr) < 0) {
-							goto label_main_exit;
+					if (events[i].data.fd == ctrl.efd) { /* console */
+						while (ctrl_next(&ctrl, &cmd)) {
+							if (cfg.mode != SERVER_MODE_CONSOLE) {
+								SERVER_PRINT("console sends are off in %s mode", mode_name(cfg.mode));
+							} else if (server_send_message(sockfd, buff, cmd.msg, blen, batch) < 0) {
+								goto label_main_exit;
+							}
 						}
-						SERVER_PRINT("send to client: %s:%d", inet_ntoa(cliaddr.sin_addr), cliaddr.sin_port);
 					} else if (events[i].data.fd == sockfd) {
-						if (server_recv_message(sockfd, buff, blen, &cliaddr) <= 0) {
+						if (server_recv_message(sockfd, batch) < 0) {
 							goto label_main_exit;
 						}
-						SERVER_PRINT("receive from client: %s:%d", inet_ntoa(cliaddr.sin_addr), cliaddr.sin_port);
 					}
 				}
+				if ((events[i].events & EPOLLOUT) && (events[i].data.fd == sockfd)) {
+					if (server_source_send(sockfd, batch, source, cfg.source_size) < 0) {
+						goto label_main_exit;
+					}
+				}
+			}
+
+			/*
+			 * A source streams once a client has shown up. Edge-triggered,
+			 * a socket that is still writable is not reported again, the
+			 * modification re-arms it.
+			 */
+			if (source && (batch->npeers > 0) && (!watch_out || cfg.edge_triggered)) {
+				epev.events = EPOLLIN | EPOLLOUT;
+				if (cfg.edge_triggered) {
+					epev.events |= EPOLLET;
+				}
+				epev.data.fd = sockfd;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, sockfd, &epev);
+				watch_out = 1;
 			}
+			metrics_handled(&metrics);
 		}
 	}
 
 label_main_exit:
+	ctrl_stop(&ctrl);
 	if (epfd > 0) {
 		close(epfd);
 	}
@@ -216,6 +600,8 @@ label_main_exit:
 		free(buff);
 		buff = NULL;
 	}
+	server_batch_free(batch);
+	free(source);
 
 	SERVER_PRINT("server exit ...");
 